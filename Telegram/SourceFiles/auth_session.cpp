@@ -458,6 +458,11 @@ bool AuthSession::validateSelf(const MTPUser &user) {
 	return true;
 }
 
+void AuthSession::writeUploadJournals() {
+	_mtp_uploader->writeJournals();
+	_web_uploader->writeJournals();
+}
+
 void AuthSession::moveSettingsFrom(AuthSessionSettings &&other) {
 	_settings.moveFrom(std::move(other));
 	if (_settings.hadLegacyCallsPeerToPeerNobody()) {
@@ -292,6 +292,7 @@ public:
 	Storage::Uploader &mtpUploader() {
 		return *_mtp_uploader;
 	}
+	void writeUploadJournals();
 	Storage::Facade &storage() {
 		return *_storage;
 	}
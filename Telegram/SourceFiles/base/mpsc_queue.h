@@ -0,0 +1,123 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include <atomic>
+#include <optional>
+
+namespace base {
+
+// Lock-free queue for many producer threads and a single consumer thread.
+//
+// push() is wait-free and may be called from any thread. try_pop() and
+// empty() may be called only from the consumer thread. While some push()
+// is in progress try_pop() may return nothing even if there are values
+// pushed after it, so the producer should notify the consumer after its
+// push() returns and the consumer should pop everything when notified.
+template <typename Type>
+class mpsc_queue {
+public:
+	mpsc_queue();
+	mpsc_queue(const mpsc_queue &other) = delete;
+	mpsc_queue &operator=(const mpsc_queue &other) = delete;
+	~mpsc_queue();
+
+	void push(Type &&value);
+	void push(const Type &value);
+
+	std::optional<Type> try_pop();
+	bool empty() const;
+
+private:
+	struct node {
+		node() = default;
+		explicit node(Type &&value) : value(std::move(value)) {
+		}
+
+		std::atomic<node*> next = nullptr;
+		std::optional<Type> value;
+	};
+
+	void push_node(node *value);
+
+	node _stub;
+	std::atomic<node*> _head = nullptr; // last pushed, producers
+	node *_tail = nullptr; // next to pop, consumer
+
+};
+
+template <typename Type>
+inline mpsc_queue<Type>::mpsc_queue()
+: _head(&_stub)
+, _tail(&_stub) {
+}
+
+template <typename Type>
+inline mpsc_queue<Type>::~mpsc_queue() {
+	while (try_pop()) {
+	}
+}
+
+template <typename Type>
+inline void mpsc_queue<Type>::push(Type &&value) {
+	push_node(new node(std::move(value)));
+}
+
+template <typename Type>
+inline void mpsc_queue<Type>::push(const Type &value) {
+	push(Type(value));
+}
+
+template <typename Type>
+inline void mpsc_queue<Type>::push_node(node *value) {
+	value->next.store(nullptr, std::memory_order_relaxed);
+	const auto previous = _head.exchange(value, std::memory_order_acq_rel);
+
+	// Until this store the consumer can't reach the pushed node.
+	previous->next.store(value, std::memory_order_release);
+}
+
+template <typename Type>
+std::optional<Type> mpsc_queue<Type>::try_pop() {
+	auto tail = _tail;
+	auto next = tail->next.load(std::memory_order_acquire);
+	if (tail == &_stub) {
+		if (!next) {
+			return std::nullopt;
+		}
+		_tail = tail = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+	const auto take = [&] {
+		_tail = next;
+		auto result = std::move(tail->value);
+		delete tail;
+		return result;
+	};
+	if (next) {
+		return take();
+	} else if (tail != _head.load(std::memory_order_acquire)) {
+		return std::nullopt; // Some push() is in progress.
+	}
+
+	// Leave the stub in the queue so that the last node can be popped.
+	push_node(&_stub);
+	next = tail->next.load(std::memory_order_acquire);
+	if (next) {
+		return take();
+	}
+	return std::nullopt;
+}
+
+template <typename Type>
+inline bool mpsc_queue<Type>::empty() const {
+	return (_tail == &_stub)
+		&& !_stub.next.load(std::memory_order_acquire);
+}
+
+} // namespace base
@@ -0,0 +1,244 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "catch.hpp"
+
+#include "base/mpsc_queue.h"
+
+#include <QtCore/QMap>
+#include <QtCore/QReadWriteLock>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const auto DisableBenchmarks = true;
+
+using Clock = std::chrono::steady_clock;
+
+int64_t NanosecondsSince(Clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		Clock::now() - start).count();
+}
+
+struct Item {
+	int producer = 0;
+	int index = 0;
+	Clock::time_point pushed;
+};
+
+struct Measured {
+	int64_t contended = 0; // lock acquisitions that had to wait
+	int64_t producerWait = 0; // total nanoseconds spent in locks / push()
+	int64_t averageLatency = 0; // nanoseconds from push to pop
+	int64_t maxLatency = 0;
+};
+
+// Producers wait for each other, so that the burst is really concurrent.
+void WaitForStart(std::atomic<int> &ready, int producers) {
+	++ready;
+	while (ready.load() < producers) {
+		std::this_thread::yield();
+	}
+}
+
+void LockForWrite(QReadWriteLock &lock, std::atomic<int64_t> &contended) {
+	if (!lock.tryLockForWrite()) {
+		++contended;
+		lock.lockForWrite();
+	}
+}
+
+// The hand-off used in SessionData before: a map guarded by a lock,
+// swapped out by the consumer whenever it is not empty.
+Measured MeasureLocked(int producers, int count) {
+	auto lock = QReadWriteLock();
+	auto map = QMap<int, Item>();
+	auto waits = std::vector<int64_t>(producers, 0);
+	auto contended = std::atomic<int64_t>(0);
+	auto ready = std::atomic<int>(0);
+	auto threads = std::vector<std::thread>();
+	for (auto producer = 0; producer != producers; ++producer) {
+		threads.emplace_back([&, producer] {
+			WaitForStart(ready, producers);
+			for (auto index = 0; index != count; ++index) {
+				const auto start = Clock::now();
+				LockForWrite(lock, contended);
+				waits[producer] += NanosecondsSince(start);
+				map.insert(producer * count + index, { producer, index, start });
+				lock.unlock();
+			}
+		});
+	}
+	auto result = Measured();
+	auto received = 0;
+	while (received != producers * count) {
+		auto taken = QMap<int, Item>();
+		LockForWrite(lock, contended);
+		std::swap(taken, map);
+		lock.unlock();
+		for (const auto &item : taken) {
+			const auto latency = NanosecondsSince(item.pushed);
+			result.averageLatency += latency;
+			result.maxLatency = std::max(result.maxLatency, latency);
+		}
+		received += taken.size();
+		if (taken.isEmpty()) {
+			std::this_thread::yield();
+		}
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	for (const auto wait : waits) {
+		result.producerWait += wait;
+	}
+	result.contended = contended;
+	result.averageLatency /= received;
+	return result;
+}
+
+Measured MeasureQueue(int producers, int count) {
+	auto queue = base::mpsc_queue<Item>();
+	auto waits = std::vector<int64_t>(producers, 0);
+	auto ready = std::atomic<int>(0);
+	auto threads = std::vector<std::thread>();
+	for (auto producer = 0; producer != producers; ++producer) {
+		threads.emplace_back([&, producer] {
+			WaitForStart(ready, producers);
+			for (auto index = 0; index != count; ++index) {
+				const auto start = Clock::now();
+				queue.push({ producer, index, start });
+				waits[producer] += NanosecondsSince(start);
+			}
+		});
+	}
+	auto result = Measured();
+	auto received = 0;
+	while (received != producers * count) {
+		auto popped = false;
+		while (const auto item = queue.try_pop()) {
+			const auto latency = NanosecondsSince(item->pushed);
+			result.averageLatency += latency;
+			result.maxLatency = std::max(result.maxLatency, latency);
+			++received;
+			popped = true;
+		}
+		if (!popped) {
+			std::this_thread::yield();
+		}
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	for (const auto wait : waits) {
+		result.producerWait += wait;
+	}
+	result.averageLatency /= received;
+	return result;
+}
+
+} // namespace
+
+TEST_CASE("mpsc_queue hands values between threads", "[mpsc_queue]") {
+	SECTION("values are popped in the push order") {
+		auto queue = base::mpsc_queue<int>();
+		REQUIRE(queue.empty());
+		REQUIRE(!queue.try_pop());
+		for (auto i = 0; i != 5; ++i) {
+			queue.push(i);
+		}
+		REQUIRE(!queue.empty());
+		for (auto i = 0; i != 5; ++i) {
+			const auto value = queue.try_pop();
+			REQUIRE(value.has_value());
+			REQUIRE(*value == i);
+		}
+		REQUIRE(queue.empty());
+		REQUIRE(!queue.try_pop());
+
+		queue.push(5);
+		REQUIRE(*queue.try_pop() == 5);
+		REQUIRE(queue.empty());
+	}
+	SECTION("move only values are supported") {
+		auto queue = base::mpsc_queue<std::unique_ptr<int>>();
+		queue.push(std::make_unique<int>(1));
+		auto value = queue.try_pop();
+		REQUIRE(value.has_value());
+		REQUIRE(**value == 1);
+	}
+	SECTION("values left in the queue are destroyed with it") {
+		auto counter = std::make_shared<int>(0);
+		{
+			auto queue = base::mpsc_queue<std::shared_ptr<int>>();
+			queue.push(counter);
+			queue.push(counter);
+			REQUIRE(counter.use_count() == 3);
+		}
+		REQUIRE(counter.use_count() == 1);
+	}
+	SECTION("all values from many producers are received in order") {
+		const auto kProducers = 4;
+		const auto kCount = 10000;
+		auto queue = base::mpsc_queue<Item>();
+		auto threads = std::vector<std::thread>();
+		for (auto producer = 0; producer != kProducers; ++producer) {
+			threads.emplace_back([&, producer] {
+				for (auto index = 0; index != kCount; ++index) {
+					queue.push({ producer, index });
+				}
+			});
+		}
+		auto next = std::vector<int>(kProducers, 0);
+		auto received = 0;
+		auto ordered = true;
+		while (received != kProducers * kCount) {
+			if (const auto item = queue.try_pop()) {
+				ordered = ordered && (next[item->producer] == item->index);
+				next[item->producer] = item->index + 1;
+				++received;
+			} else {
+				std::this_thread::yield();
+			}
+		}
+		for (auto &thread : threads) {
+			thread.join();
+		}
+		REQUIRE(ordered);
+		REQUIRE(queue.empty());
+	}
+}
+
+TEST_CASE("mpsc_queue hand-off benchmark", "[mpsc_queue]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	const auto kBurst = 5000;
+	const auto cores = std::thread::hardware_concurrency();
+	if (cores < 2) {
+		WARN("Only " << cores << " core, producers won't run concurrently.");
+	}
+	for (const auto producers : { 1, 2, 4, 8 }) {
+		const auto count = kBurst / producers;
+		const auto locked = MeasureLocked(producers, count);
+		const auto queue = MeasureQueue(producers, count);
+		WARN("Burst of " << (count * producers) << " requests from "
+			<< producers << " threads on " << cores << " cores, locked map: "
+			<< locked.contended << " contended locks, "
+			<< (locked.producerWait / 1000) << " us producers wait, "
+			<< (locked.averageLatency / 1000) << " us average latency, "
+			<< (locked.maxLatency / 1000) << " us max latency; queue: "
+			<< (queue.producerWait / 1000) << " us producers wait, "
+			<< (queue.averageLatency / 1000) << " us average latency, "
+			<< (queue.maxLatency / 1000) << " us max latency.");
+	}
+}
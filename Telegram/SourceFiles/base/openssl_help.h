@@ -10,6 +10,7 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "base/bytes.h"
 #include "base/algorithm.h"
 #include "base/basic_types.h"
+#include "base/assertion.h"
 
 extern "C" {
 #include <openssl/bn.h>
@@ -430,6 +431,111 @@ inline bytes::vector Sha512(Args &&...args) {
 		args...);
 }
 
+// AES-256 in IGE mode built over the EVP ECB cipher, so that the
+// hardware AES instructions are used, AES_ige_encrypt doesn't use them.
+// The chaining state is kept between process() calls, so the data can
+// be handled in parts, each size must be a multiple of kAesBlockSize.
+// Source and destination may be the same.
+//
+// Each ECB input depends on the previous IGE output in both directions,
+// so the cipher is called for each block, but the chaining blocks are
+// read in place within a run and stored only at the end of the run.
+class AesIge {
+public:
+	static constexpr auto kAesBlockSize = size_type(AES_BLOCK_SIZE);
+	static constexpr auto kKeySize = size_type(32);
+	static constexpr auto kIvSize = size_type(2 * kAesBlockSize);
+
+	enum class Mode {
+		Encrypt,
+		Decrypt,
+	};
+
+	AesIge(Mode mode, const void *key, const void *iv)
+	: _context(EVP_CIPHER_CTX_new()) {
+		Expects(_context != nullptr);
+
+		const auto bytes = static_cast<const unsigned char*>(iv);
+		const auto encrypt = (mode == Mode::Encrypt);
+		const auto initialized = EVP_CipherInit_ex(
+			_context,
+			EVP_aes_256_ecb(),
+			nullptr,
+			static_cast<const unsigned char*>(key),
+			nullptr,
+			encrypt ? 1 : 0);
+		Assert(initialized == 1);
+		EVP_CIPHER_CTX_set_padding(_context, 0);
+
+		// The first half of the iv is the previous encrypted block,
+		// the second half is the previous plain block.
+		memcpy(_previousOut, bytes + (encrypt ? 0 : kAesBlockSize), kAesBlockSize);
+		memcpy(_previousIn, bytes + (encrypt ? kAesBlockSize : 0), kAesBlockSize);
+	}
+	AesIge(const AesIge &other) = delete;
+	AesIge &operator=(const AesIge &other) = delete;
+	~AesIge() {
+		EVP_CIPHER_CTX_free(_context);
+	}
+
+	void process(const void *src, void *dst, size_type size) {
+		Expects(size % kAesBlockSize == 0);
+
+		auto from = static_cast<const unsigned char*>(src);
+		auto to = static_cast<unsigned char*>(dst);
+		while (size > 0) {
+			const auto run = std::min(size, kRunSize);
+			processRun(from, to, run);
+			from += run;
+			to += run;
+			size -= run;
+		}
+	}
+
+private:
+	static constexpr auto kRunSize = size_type(64 * kAesBlockSize);
+
+	void processRun(
+			const unsigned char *from,
+			unsigned char *to,
+			size_type size) {
+		memcpy(_run, from, size); // From may be to.
+
+		const unsigned char *previousIn = _previousIn;
+		const unsigned char *previousOut = _previousOut;
+		unsigned char input[kAesBlockSize];
+		for (auto offset = size_type(); offset != size; offset += kAesBlockSize) {
+			const auto in = _run + offset;
+			const auto out = to + offset;
+			for (auto i = size_type(); i != kAesBlockSize; ++i) {
+				input[i] = in[i] ^ previousOut[i];
+			}
+			auto outputSize = 0;
+			const auto updated = EVP_CipherUpdate(
+				_context,
+				out,
+				&outputSize,
+				input,
+				kAesBlockSize);
+			Assert(updated == 1);
+			Assert(outputSize == int(kAesBlockSize));
+			for (auto i = size_type(); i != kAesBlockSize; ++i) {
+				out[i] ^= previousIn[i];
+			}
+			previousIn = in;
+			previousOut = out;
+		}
+		memcpy(_previousIn, previousIn, kAesBlockSize);
+		memcpy(_previousOut, previousOut, kAesBlockSize);
+	}
+
+	EVP_CIPHER_CTX *_context = nullptr;
+	unsigned char _previousIn[kAesBlockSize];
+	unsigned char _previousOut[kAesBlockSize];
+	unsigned char _run[kRunSize];
+
+};
+
 inline void AddRandomSeed(bytes::const_span data) {
 	RAND_seed(data.data(), data.size());
 }
@@ -0,0 +1,216 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "catch.hpp"
+
+#include "base/openssl_help.h"
+
+#include <chrono>
+#include <random>
+
+namespace {
+
+const auto DisableBenchmarks = true;
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kKeySize = openssl::AesIge::kKeySize;
+constexpr auto kIvSize = openssl::AesIge::kIvSize;
+
+// Sizes of received encrypted messages with the part of the traffic
+// they usually take: acks, pongs and updates, service messages and
+// history slices, file parts of a large download.
+struct PacketSize {
+	int size = 0;
+	int percent = 0;
+};
+const auto kPacketSizes = {
+	PacketSize{ 64, 30 },
+	PacketSize{ 256, 25 },
+	PacketSize{ 1024, 20 },
+	PacketSize{ 16 * 1024, 15 },
+	PacketSize{ 128 * 1024 + 64, 7 },
+	PacketSize{ 512 * 1024 + 64, 3 },
+};
+
+bytes::vector RandomBytes(int size) {
+	auto result = bytes::vector(size);
+	bytes::set_random(result);
+	return result;
+}
+
+// The implementation used before, AES_ige_encrypt with AES_KEY.
+bytes::vector ReferenceIge(
+		bytes::const_span data,
+		bytes::const_span key,
+		bytes::const_span iv,
+		bool encrypt) {
+	auto result = bytes::vector(data.size());
+	auto ivCopy = bytes::make_vector(iv);
+	AES_KEY aes;
+	if (encrypt) {
+		AES_set_encrypt_key(
+			reinterpret_cast<const unsigned char*>(key.data()),
+			256,
+			&aes);
+	} else {
+		AES_set_decrypt_key(
+			reinterpret_cast<const unsigned char*>(key.data()),
+			256,
+			&aes);
+	}
+	AES_ige_encrypt(
+		reinterpret_cast<const unsigned char*>(data.data()),
+		reinterpret_cast<unsigned char*>(result.data()),
+		data.size(),
+		&aes,
+		reinterpret_cast<unsigned char*>(ivCopy.data()),
+		encrypt ? AES_ENCRYPT : AES_DECRYPT);
+	return result;
+}
+
+bytes::vector Ige(
+		bytes::const_span data,
+		bytes::const_span key,
+		bytes::const_span iv,
+		openssl::AesIge::Mode mode) {
+	auto result = bytes::vector(data.size());
+	openssl::AesIge(mode, key.data(), iv.data()).process(
+		data.data(),
+		result.data(),
+		data.size());
+	return result;
+}
+
+std::vector<int> PacketSizesSequence(int count) {
+	auto generator = std::mt19937(42);
+	auto percent = std::uniform_int_distribution<int>(0, 99);
+	auto result = std::vector<int>();
+	result.reserve(count);
+	while (int(result.size()) != count) {
+		auto left = percent(generator);
+		for (const auto &packet : kPacketSizes) {
+			if (left < packet.percent) {
+				result.push_back(packet.size);
+				break;
+			}
+			left -= packet.percent;
+		}
+	}
+	return result;
+}
+
+template <typename Method>
+int64_t MeasureMegabytesPerSecond(const std::vector<int> &sizes, Method method) {
+	auto total = int64_t(0);
+	const auto start = Clock::now();
+	for (const auto size : sizes) {
+		method(size);
+		total += size;
+	}
+	const auto microseconds = std::chrono::duration_cast<
+		std::chrono::microseconds>(Clock::now() - start).count();
+	return microseconds ? (total / microseconds) : 0;
+}
+
+} // namespace
+
+TEST_CASE("AES-IGE over EVP matches AES_ige_encrypt", "[openssl_help]") {
+	using Mode = openssl::AesIge::Mode;
+	const auto key = RandomBytes(kKeySize);
+	const auto iv = RandomBytes(kIvSize);
+	const auto data = RandomBytes(64 * 1024);
+
+	SECTION("encrypt and decrypt give the same results") {
+		for (const auto size : { 16, 32, 1024, 64 * 1024 }) {
+			const auto part = bytes::make_span(data).subspan(0, size);
+			const auto encrypted = Ige(part, key, iv, Mode::Encrypt);
+			REQUIRE(encrypted == ReferenceIge(part, key, iv, true));
+
+			const auto decrypted = Ige(encrypted, key, iv, Mode::Decrypt);
+			REQUIRE(decrypted == ReferenceIge(encrypted, key, iv, false));
+			REQUIRE(bytes::compare(decrypted, part) == 0);
+		}
+	}
+	SECTION("data may be processed by parts and in place") {
+		const auto encrypted = ReferenceIge(data, key, iv, true);
+		auto buffer = encrypted;
+		auto cipher = openssl::AesIge(Mode::Decrypt, key.data(), iv.data());
+		auto offset = 0;
+		for (const auto size : { 16, 48, 1024, 4096, 16 }) {
+			cipher.process(
+				buffer.data() + offset,
+				buffer.data() + offset,
+				size);
+			offset += size;
+		}
+		cipher.process(
+			buffer.data() + offset,
+			buffer.data() + offset,
+			buffer.size() - offset);
+		REQUIRE(buffer == data);
+	}
+}
+
+TEST_CASE("AES-IGE and SHA256 throughput benchmark", "[openssl_help]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	const auto key = RandomBytes(kKeySize);
+	const auto iv = RandomBytes(kIvSize);
+	const auto encrypted = RandomBytes(512 * 1024 + 64);
+	auto decrypted = bytes::vector(encrypted.size());
+	const auto sizes = PacketSizesSequence(2000);
+	auto hash = bytes::vector(openssl::kSha256Size);
+
+	// AES_ige_encrypt on a new buffer and then SHA256 over the result.
+	const auto reference = MeasureMegabytesPerSecond(sizes, [&](int size) {
+		auto buffer = bytes::vector(size);
+		auto ivCopy = bytes::make_vector(iv);
+		AES_KEY aes;
+		AES_set_decrypt_key(
+			reinterpret_cast<const unsigned char*>(key.data()),
+			256,
+			&aes);
+		AES_ige_encrypt(
+			reinterpret_cast<const unsigned char*>(encrypted.data()),
+			reinterpret_cast<unsigned char*>(buffer.data()),
+			size,
+			&aes,
+			reinterpret_cast<unsigned char*>(ivCopy.data()),
+			AES_DECRYPT);
+		SHA256(
+			reinterpret_cast<const unsigned char*>(buffer.data()),
+			size,
+			reinterpret_cast<unsigned char*>(hash.data()));
+	});
+
+	// EVP based IGE into a reused buffer, hashing every decrypted part.
+	const auto kPart = 16 * 1024;
+	const auto current = MeasureMegabytesPerSecond(sizes, [&](int size) {
+		auto cipher = openssl::AesIge(
+			openssl::AesIge::Mode::Decrypt,
+			key.data(),
+			iv.data());
+		SHA256_CTX context;
+		SHA256_Init(&context);
+		for (auto offset = 0; offset != size;) {
+			const auto part = std::min(size - offset, kPart);
+			cipher.process(
+				encrypted.data() + offset,
+				decrypted.data() + offset,
+				part);
+			SHA256_Update(&context, decrypted.data() + offset, part);
+			offset += part;
+		}
+		SHA256_Final(reinterpret_cast<unsigned char*>(hash.data()), &context);
+	});
+
+	WARN("Decrypt and hash of " << sizes.size() << " messages, "
+		<< "AES_ige_encrypt and SHA256: " << reference << " MB/s, "
+		<< "EVP AES-IGE and SHA256 by parts: " << current << " MB/s.");
+}
@@ -760,9 +760,12 @@ void Application::authSessionCreate(const MTPUser &user) {
 	Expects(_mtproto != nullptr);
 
 	_authSession = std::make_unique<AuthSession>(user);
-	_mtproto->setUpdatesHandler(::rpcDone([](
-			const mtpPrime *from,
-			const mtpPrime *end) {
+	_mtproto->setUpdatesHandler(std::make_shared<RPCDoneHandlerOffMain<MTPUpdates>>([](
+			const MTPUpdates &updates) {
+		if (const auto main = App::main()) {
+			main->updateReceived(updates);
+		}
+	}, [](const mtpPrime *from, const mtpPrime *end) {
 		if (const auto main = App::main()) {
 			main->updateReceived(from, end);
 		}
@@ -786,6 +789,10 @@ void Application::authSessionDestroy() {
 		// because streaming media holds pointers to it.
 		Media::Player::instance()->handleLogout();
 
+		// Must be called before Auth().data() is destroyed,
+		// because upload journals are written to its cache.
+		_authSession->writeUploadJournals();
+
 		_authSession = nullptr;
 		authSessionChanged().notify(true);
 		Notify::unreadCounterUpdated();
@@ -9,13 +9,26 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 
 #include "base/last_used_cache.h"
 
+#include <chrono>
+
 namespace Core {
 
 template <typename Type>
 class MediaActiveCache {
 public:
+	struct Stats {
+		int64 unloaded = 0; // Entries unloaded because of the limit.
+		int64 unloadedUsage = 0; // Memory freed by unloading them.
+		int64 unloadDuration = 0; // Main thread microseconds spent on that.
+	};
+
+	// The optional unloaded() is called after entries over the limit were
+	// unloaded, for example to report the stats.
 	template <typename Unload>
-	MediaActiveCache(int64 limit, Unload &&unload);
+	MediaActiveCache(
+		int64 limit,
+		Unload &&unload,
+		Fn<void()> unloaded = nullptr);
 
 	void up(Type *entry);
 	void remove(Type *entry);
@@ -24,21 +37,29 @@ public:
 	void increment(int64 amount);
 	void decrement(int64 amount);
 
+	[[nodiscard]] Stats stats() const;
+
 private:
 	template <typename Unload>
 	void check(Unload &&unload);
 
 	base::last_used_cache<Type*> _cache;
+	Fn<void()> _unloaded;
 	SingleQueuedInvokation _delayed;
 	int64 _usage = 0;
 	int64 _limit = 0;
+	Stats _stats;
 
 };
 
 template <typename Type>
 template <typename Unload>
-MediaActiveCache<Type>::MediaActiveCache(int64 limit, Unload &&unload)
-: _delayed([=] { check(unload); })
+MediaActiveCache<Type>::MediaActiveCache(
+	int64 limit,
+	Unload &&unload,
+	Fn<void()> unloaded)
+: _unloaded(std::move(unloaded))
+, _delayed([=] { check(unload); })
 , _limit(limit) {
 }
 
@@ -68,16 +89,36 @@ void MediaActiveCache<Type>::decrement(int64 amount) {
 	_usage -= amount;
 }
 
+template <typename Type>
+auto MediaActiveCache<Type>::stats() const -> Stats {
+	return _stats;
+}
+
 template <typename Type>
 template <typename Unload>
 void MediaActiveCache<Type>::check(Unload &&unload) {
+	if (_usage <= _limit) {
+		return;
+	}
+	// A pass usually takes less than a millisecond, so crl::now() is
+	// not precise enough here.
+	using Clock = std::chrono::steady_clock;
+	const auto started = Clock::now();
 	while (_usage > _limit) {
 		if (const auto entry = _cache.take_lowest()) {
+			const auto usage = _usage;
 			unload(entry);
+			++_stats.unloaded;
+			_stats.unloadedUsage += (usage - _usage);
 		} else {
 			break;
 		}
 	}
+	_stats.unloadDuration += std::chrono::duration_cast<
+		std::chrono::microseconds>(Clock::now() - started).count();
+	if (_unloaded) {
+		_unloaded();
+	}
 }
 
 } // namespace Core
@@ -30,6 +30,7 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "core/application.h"
 #include "media/streaming/media_streaming_loader_mtproto.h"
 #include "media/streaming/media_streaming_loader_local.h"
+#include "media/streaming/media_streaming_loader_http.h"
 
 namespace {
 
@@ -1166,7 +1167,9 @@ bool DocumentData::hasRemoteLocation() const {
 
 bool DocumentData::canBeStreamed() const {
 	// For now video messages are not streamed.
-	return hasRemoteLocation() && supportsStreaming() && !isVideoMessage();
+	return (hasRemoteLocation() || hasStreamingUrl())
+		&& supportsStreaming()
+		&& !isVideoMessage();
 }
 
 bool DocumentData::canBePlayed() const {
@@ -1196,6 +1199,11 @@ auto DocumentData::createStreamingLoader(Data::FileOrigin origin) const
 		location.accessDisable();
 		return result;
 	}
+	if (!hasRemoteLocation() && hasStreamingUrl()) {
+		return std::make_unique<Media::Streaming::LoaderHttp>(
+			webFileLoaderUrl(_url),
+			size);
+	}
 	return hasRemoteLocation()
 		? std::make_unique<Media::Streaming::LoaderMtproto>(
 			&session().api(),
@@ -1212,6 +1220,10 @@ auto DocumentData::createStreamingLoader(Data::FileOrigin origin) const
 		: nullptr;
 }
 
+bool DocumentData::hasStreamingUrl() const {
+	return !_access && !_url.isEmpty() && (size > 0);
+}
+
 bool DocumentData::hasWebLocation() const {
 	return !_urlLocation.url().isEmpty();
 }
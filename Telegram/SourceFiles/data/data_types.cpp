@@ -29,6 +29,10 @@ constexpr auto kUrlCacheTag = 0x0000030000000000ULL;
 constexpr auto kUrlCacheMask = 0x000000FFFFFFFFFFULL;
 constexpr auto kGeoPointCacheTag = 0x0000040000000000ULL;
 constexpr auto kGeoPointCacheMask = 0x000000FFFFFFFFFFULL;
+constexpr auto kUploadJournalCacheTag = 0x0000050000000000ULL;
+constexpr auto kUploadJournalCacheMask = 0x000000FFFFFFFFFFULL;
+constexpr auto kUrlStreamingCacheTag = 0x0000060000000000ULL;
+constexpr auto kUrlStreamingCacheMask = 0x000000FFFFFFFFFFULL;
 
 } // namespace
 
@@ -95,6 +99,39 @@ Storage::Cache::Key UrlCacheKey(const QString &location) {
 	};
 }
 
+Storage::Cache::Key UrlStreamingBaseCacheKey(const QString &location) {
+	const auto url = location.toUtf8();
+	const auto hash = openssl::Sha256(bytes::make_span(url));
+	const auto bytes = bytes::make_span(hash);
+	const auto bytes1 = bytes.subspan(0, sizeof(uint32));
+	const auto bytes2 = bytes.subspan(sizeof(uint32), sizeof(uint64));
+	const auto part1 = *reinterpret_cast<const uint32*>(bytes1.data());
+	const auto part2 = *reinterpret_cast<const uint64*>(bytes2.data());
+
+	// Low bits are left for the streaming slice numbers.
+	const auto low = (part2 << 16);
+
+	Ensures((low & 0xFFULL) == 0);
+	return Storage::Cache::Key{
+		kUrlStreamingCacheTag | part1,
+		low
+	};
+}
+
+Storage::Cache::Key UploadJournalCacheKey(const QString &identity) {
+	const auto utf = identity.toUtf8();
+	const auto hash = openssl::Sha256(bytes::make_span(utf));
+	const auto bytes = bytes::make_span(hash);
+	const auto bytes1 = bytes.subspan(0, sizeof(uint32));
+	const auto bytes2 = bytes.subspan(sizeof(uint32), sizeof(uint64));
+	const auto part1 = *reinterpret_cast<const uint32*>(bytes1.data());
+	const auto part2 = *reinterpret_cast<const uint64*>(bytes2.data());
+	return Storage::Cache::Key{
+		Data::kUploadJournalCacheTag | part1,
+		part2
+	};
+}
+
 Storage::Cache::Key GeoPointCacheKey(const GeoPointLocation &location) {
 	const auto zoomscale = ((uint32(location.zoom) & 0x0FU) << 8)
 		| (uint32(location.scale) & 0x0FU);
@@ -14,6 +14,8 @@ namespace Dialogs {
 
 enum class SortMode;
 
+// Rows are kept in an implicit treap, so that finding a row by its
+// position, computing a row position and moving a row are O(log n).
 class List {
 public:
 	List(SortMode sortMode);
@@ -21,7 +23,7 @@ public:
 	List &operator=(const List &other) = delete;
 
 	int size() const {
-		return _count;
+		return _rows.size();
 	}
 	bool isEmpty() const {
 		return size() == 0;
@@ -34,11 +36,7 @@ public:
 		return (i == _rowByKey.end()) ? nullptr : i->second.get();
 	}
 	Row *rowAtY(int32 y, int32 h) const {
-		auto i = cfind(y, h);
-		if (i == cend() || (*i)->pos() != ((y > 0) ? (y / h) : 0)) {
-			return nullptr;
-		}
-		return *i;
+		return _rows.at((y > 0) ? (y / h) : 0);
 	}
 
 	Row *addToEnd(Key key);
@@ -56,71 +54,57 @@ public:
 		using pointer = Row**;
 		using reference = Row*&;
 
-		explicit const_iterator(Row *p) : _p(p) {
-		}
 		inline Row* operator*() const { return _p; }
 		inline Row* const* operator->() const { return &_p; }
 		inline bool operator==(const const_iterator &other) const { return _p == other._p; }
 		inline bool operator!=(const const_iterator &other) const { return !(*this == other); }
-		inline const_iterator &operator++() { _p = next(_p); return *this; }
+		inline const_iterator &operator++() { _p = Rows::next(_p); return *this; }
 		inline const_iterator operator++(int) { const_iterator result(*this); ++(*this); return result; }
-		inline const_iterator &operator--() { _p = prev(_p); return *this; }
+		inline const_iterator &operator--() { _p = _p ? Rows::prev(_p) : _list->_rows.last(); return *this; }
 		inline const_iterator operator--(int) { const_iterator result(*this); --(*this); return result; }
 		inline const_iterator operator+(int j) const { const_iterator result = *this; return result += j; }
 		inline const_iterator operator-(int j) const { const_iterator result = *this; return result -= j; }
-		inline const_iterator &operator+=(int j) { if (j < 0) return (*this -= (-j)); while (j--) ++*this; return *this; }
-		inline const_iterator &operator-=(int j) { if (j < 0) return (*this += (-j)); while (j--) --*this; return *this; }
+		inline const_iterator &operator+=(int j) { _p = _list->_rows.shifted(_p, j); return *this; }
+		inline const_iterator &operator-=(int j) { _p = _list->_rows.shifted(_p, -j); return *this; }
 
 	private:
-		Row *_p;
+		const_iterator(const List *list, Row *p) : _list(list), _p(p) {
+		}
+
+		const List *_list = nullptr;
+		Row *_p = nullptr;
 		friend class List;
 
 	};
 	friend class const_iterator;
 	using iterator = const_iterator;
 
-	const_iterator cbegin() const { return const_iterator(_begin); }
-	const_iterator cend() const { return const_iterator(_end); }
+	const_iterator cbegin() const { return const_iterator(this, _rows.first()); }
+	const_iterator cend() const { return const_iterator(this, nullptr); }
 	const_iterator begin() const { return cbegin(); }
 	const_iterator end() const { return cend(); }
-	iterator begin() { return iterator(_begin); }
-	iterator end() { return iterator(_end); }
-	const_iterator cfind(Row *value) const { return value ? const_iterator(value) : cend(); }
+	iterator begin() { return cbegin(); }
+	iterator end() { return cend(); }
+	const_iterator cfind(Row *value) const { return const_iterator(this, value); }
 	const_iterator find(Row *value) const { return cfind(value); }
-	iterator find(Row *value) { return value ? iterator(value) : end(); }
+	iterator find(Row *value) { return cfind(value); }
 	const_iterator cfind(int y, int h) const {
-		adjustCurrent(y, h);
-		return iterator(_current);
+		const auto index = (y > 0) ? (y / h) : 0;
+		return const_iterator(this, _rows.at(std::min(index, size() - 1)));
 	}
 	const_iterator find(int y, int h) const { return cfind(y, h); }
-	iterator find(int y, int h) {
-		adjustCurrent(y, h);
-		return iterator(_current);
-	}
+	iterator find(int y, int h) { return cfind(y, h); }
 
 	~List();
 
 private:
-	void adjustCurrent(int y, int h) const;
-	bool insertBefore(Row *row, Row *before);
-	bool insertAfter(Row *row, Row *after);
-	static Row *next(Row *row) {
-		return row->_next;
-	}
-	static Row *prev(Row *row) {
-		return row->_prev;
-	}
+	using Rows = details::Tree<Row>;
 
-	std::unique_ptr<Row> _last;
-	Row *_begin;
-	Row *_end;
+	Rows _rows;
 	SortMode _sortMode;
-	int _count = 0;
 
 	std::map<Key, not_null<Row*>> _rowByKey;
 
-	mutable Row *_current; // cache
-
 };
 
 } // namespace Dialogs
@@ -0,0 +1,291 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "base/assertion.h"
+#include <cstdint>
+#include <utility>
+
+namespace Dialogs {
+namespace details {
+
+template <typename Node>
+class Tree;
+
+// Links of a row in the list tree, ordered by position in the list.
+template <typename Node>
+class TreeNode {
+public:
+	explicit TreeNode(std::uint32_t priority) : _priority(priority) {
+	}
+
+private:
+	friend class Tree<Node>;
+
+	Node *_parent = nullptr;
+	Node *_left = nullptr;
+	Node *_right = nullptr;
+	int _size = 1;
+	std::uint32_t _priority = 0;
+
+};
+
+// Implicit treap of the nodes owned by the caller, so that finding
+// a node by its position, computing a node position, inserting and
+// removing a node are O(log n).
+template <typename Node>
+class Tree {
+public:
+	int size() const {
+		return Size(_root);
+	}
+	Node *first() const;
+	Node *last() const;
+	Node *at(int index) const;
+	Node *shifted(Node *node, int delta) const;
+
+	static Node *next(Node *node);
+	static Node *prev(Node *node);
+	static int position(const Node *node);
+
+	void insert(Node *node, int index);
+	bool insertBefore(Node *node, Node *before);
+	bool insertAfter(Node *node, Node *after);
+	void remove(Node *node);
+	void adjustBySortKey(Node *node);
+	void clear() {
+		_root = nullptr;
+	}
+
+private:
+	static int Size(const Node *node);
+	static void Update(Node *node);
+	static Node *Merge(Node *a, Node *b);
+	static std::pair<Node*, Node*> Split(Node *node, int count);
+
+	Node *_root = nullptr;
+
+};
+
+template <typename Node>
+int Tree<Node>::Size(const Node *node) {
+	return node ? node->_size : 0;
+}
+
+template <typename Node>
+void Tree<Node>::Update(Node *node) {
+	node->_size = 1 + Size(node->_left) + Size(node->_right);
+	if (node->_left) {
+		node->_left->_parent = node;
+	}
+	if (node->_right) {
+		node->_right->_parent = node;
+	}
+}
+
+// Parent pointers of the returned roots are fixed by the caller.
+template <typename Node>
+Node *Tree<Node>::Merge(Node *a, Node *b) {
+	if (!a) {
+		return b;
+	} else if (!b) {
+		return a;
+	} else if (a->_priority > b->_priority) {
+		a->_right = Merge(a->_right, b);
+		Update(a);
+		return a;
+	}
+	b->_left = Merge(a, b->_left);
+	Update(b);
+	return b;
+}
+
+// First count nodes go to the first tree, all the others to the second.
+template <typename Node>
+std::pair<Node*, Node*> Tree<Node>::Split(Node *node, int count) {
+	if (!node) {
+		return { nullptr, nullptr };
+	} else if (Size(node->_left) >= count) {
+		const auto [first, second] = Split(node->_left, count);
+		node->_left = second;
+		Update(node);
+		return { first, node };
+	}
+	const auto [first, second] = Split(
+		node->_right,
+		count - Size(node->_left) - 1);
+	node->_right = first;
+	Update(node);
+	return { node, second };
+}
+
+template <typename Node>
+Node *Tree<Node>::first() const {
+	auto result = _root;
+	while (result && result->_left) {
+		result = result->_left;
+	}
+	return result;
+}
+
+template <typename Node>
+Node *Tree<Node>::last() const {
+	auto result = _root;
+	while (result && result->_right) {
+		result = result->_right;
+	}
+	return result;
+}
+
+template <typename Node>
+Node *Tree<Node>::next(Node *node) {
+	if (node->_right) {
+		node = node->_right;
+		while (node->_left) {
+			node = node->_left;
+		}
+		return node;
+	}
+	while (node->_parent && node == node->_parent->_right) {
+		node = node->_parent;
+	}
+	return node->_parent;
+}
+
+template <typename Node>
+Node *Tree<Node>::prev(Node *node) {
+	if (node->_left) {
+		node = node->_left;
+		while (node->_right) {
+			node = node->_right;
+		}
+		return node;
+	}
+	while (node->_parent && node == node->_parent->_left) {
+		node = node->_parent;
+	}
+	return node->_parent;
+}
+
+template <typename Node>
+int Tree<Node>::position(const Node *node) {
+	auto result = Size(node->_left);
+	for (; node->_parent; node = node->_parent) {
+		const auto parent = node->_parent;
+		if (node == parent->_right) {
+			result += Size(parent->_left) + 1;
+		}
+	}
+	return result;
+}
+
+template <typename Node>
+Node *Tree<Node>::at(int index) const {
+	if (index < 0 || index >= size()) {
+		return nullptr;
+	}
+	auto node = _root;
+	while (true) {
+		const auto left = Size(node->_left);
+		if (index < left) {
+			node = node->_left;
+		} else if (index > left) {
+			index -= left + 1;
+			node = node->_right;
+		} else {
+			return node;
+		}
+	}
+}
+
+template <typename Node>
+Node *Tree<Node>::shifted(Node *node, int delta) const {
+	if (delta == 1 && node) {
+		return next(node);
+	} else if (delta == -1 && node) {
+		return prev(node);
+	}
+	const auto index = (node ? position(node) : size()) + delta;
+	return at(index);
+}
+
+template <typename Node>
+void Tree<Node>::insert(Node *node, int index) {
+	Expects(index >= 0 && index <= size());
+
+	const auto [before, after] = Split(_root, index);
+	_root = Merge(Merge(before, node), after);
+	_root->_parent = nullptr;
+}
+
+template <typename Node>
+bool Tree<Node>::insertBefore(Node *node, Node *before) {
+	if (node == before) {
+		return false;
+	}
+	remove(node);
+	insert(node, position(before));
+	return true;
+}
+
+template <typename Node>
+bool Tree<Node>::insertAfter(Node *node, Node *after) {
+	if (node == after) {
+		return false;
+	}
+	remove(node);
+	insert(node, position(after) + 1);
+	return true;
+}
+
+template <typename Node>
+void Tree<Node>::remove(Node *node) {
+	const auto index = position(node);
+	const auto [before, rest] = Split(_root, index);
+	const auto [removed, after] = Split(rest, 1);
+	Assert(removed == node);
+
+	_root = Merge(before, after);
+	if (_root) {
+		_root->_parent = nullptr;
+	}
+	node->_parent = node->_left = node->_right = nullptr;
+	node->_size = 1;
+}
+
+// Sort keys may change for several nodes before they are adjusted, so
+// the list is not assumed to be sorted. The node goes to the very top or
+// bottom if the first or the last node demands it, otherwise it passes
+// only its neighbours with smaller keys above or greater keys below it.
+template <typename Node>
+void Tree<Node>::adjustBySortKey(Node *node) {
+	const auto key = node->sortKey();
+	const auto top = first();
+	auto change = node;
+	if (change != top && top->sortKey() < key) {
+		change = top;
+	} else {
+		while (prev(change) && prev(change)->sortKey() < key) {
+			change = prev(change);
+		}
+	}
+	if (!insertBefore(node, change)) {
+		const auto bottom = last();
+		if (change != bottom && bottom->sortKey() > key) {
+			change = bottom;
+		} else {
+			while (next(change) && next(change)->sortKey() > key) {
+				change = next(change);
+			}
+		}
+		insertAfter(node, change);
+	}
+}
+
+} // namespace details
+} // namespace Dialogs
@@ -0,0 +1,380 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "catch.hpp"
+
+#include "dialogs/dialogs_list_tree.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+const auto DisableBenchmarks = true;
+
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kPinnedKey = std::uint64_t(0xFFFFFFFF00000000ULL);
+
+struct TestRow : Dialogs::details::TreeNode<TestRow> {
+	TestRow(std::uint64_t key, std::uint32_t priority)
+	: TreeNode(priority)
+	, key(key) {
+	}
+
+	std::uint64_t sortKey() const {
+		return key;
+	}
+
+	std::uint64_t key = 0;
+};
+
+using Tree = Dialogs::details::Tree<TestRow>;
+
+// The linked list implementation the tree replaces, kept on a vector.
+class Reference {
+public:
+	int size() const {
+		return int(rows.size());
+	}
+	int position(TestRow *row) const {
+		const auto i = std::find(begin(rows), end(rows), row);
+		return int(i - begin(rows));
+	}
+	TestRow *prev(TestRow *row) const {
+		const auto index = position(row);
+		return index ? rows[index - 1] : nullptr;
+	}
+	TestRow *next(TestRow *row) const {
+		const auto index = position(row) + 1;
+		return (index < size()) ? rows[index] : nullptr;
+	}
+
+	void insert(TestRow *row, int index) {
+		rows.insert(begin(rows) + index, row);
+	}
+	void remove(TestRow *row) {
+		rows.erase(begin(rows) + position(row));
+	}
+	bool insertBefore(TestRow *row, TestRow *before) {
+		if (row == before) {
+			return false;
+		}
+		remove(row);
+		insert(row, position(before));
+		return true;
+	}
+	bool insertAfter(TestRow *row, TestRow *after) {
+		if (row == after) {
+			return false;
+		}
+		remove(row);
+		insert(row, position(after) + 1);
+		return true;
+	}
+	void adjustBySortKey(TestRow *row) {
+		const auto key = row->sortKey();
+		auto change = row;
+		if (change != rows.front() && rows.front()->sortKey() < key) {
+			change = rows.front();
+		} else {
+			while (prev(change) && prev(change)->sortKey() < key) {
+				change = prev(change);
+			}
+		}
+		if (!insertBefore(row, change)) {
+			if (change != rows.back() && rows.back()->sortKey() > key) {
+				change = rows.back();
+			} else {
+				while (next(change) && next(change)->sortKey() > key) {
+					change = next(change);
+				}
+			}
+			insertAfter(row, change);
+		}
+	}
+
+	std::vector<TestRow*> rows;
+};
+
+class TestList {
+public:
+	explicit TestList(std::uint32_t seed) : _generator(seed) {
+	}
+
+	TestRow *add(std::uint64_t key, int index) {
+		_rows.push_back(std::make_unique<TestRow>(key, _generator()));
+		const auto result = _rows.back().get();
+		tree.insert(result, index);
+		reference.insert(result, index);
+		return result;
+	}
+	TestRow *addSorted(std::uint64_t key) {
+		const auto result = add(key, tree.size());
+		tree.adjustBySortKey(result);
+		reference.adjustBySortKey(result);
+		return result;
+	}
+	void remove(TestRow *row) {
+		tree.remove(row);
+		reference.remove(row);
+	}
+	void moveToTop(TestRow *row) {
+		CHECK(tree.insertBefore(row, tree.first())
+			== reference.insertBefore(row, reference.rows.front()));
+	}
+	void adjust(TestRow *row) {
+		tree.adjustBySortKey(row);
+		reference.adjustBySortKey(row);
+	}
+
+	TestRow *at(int index) const {
+		return reference.rows[index];
+	}
+	int size() const {
+		return reference.size();
+	}
+
+	void check() const {
+		const auto count = reference.size();
+		REQUIRE(tree.size() == count);
+		REQUIRE(tree.at(-1) == nullptr);
+		REQUIRE(tree.at(count) == nullptr);
+		if (!count) {
+			REQUIRE(tree.first() == nullptr);
+			REQUIRE(tree.last() == nullptr);
+			return;
+		}
+		REQUIRE(tree.first() == reference.rows.front());
+		REQUIRE(tree.last() == reference.rows.back());
+		auto row = tree.first();
+		for (auto index = 0; index != count; ++index) {
+			const auto expected = reference.rows[index];
+			REQUIRE(row == expected);
+			REQUIRE(tree.at(index) == expected);
+			REQUIRE(Tree::position(expected) == index);
+			REQUIRE(Tree::prev(expected)
+				== (index ? reference.rows[index - 1] : nullptr));
+			row = Tree::next(row);
+		}
+		REQUIRE(row == nullptr);
+		REQUIRE(tree.shifted(nullptr, -1) == reference.rows.back());
+		REQUIRE(tree.shifted(tree.first(), count) == nullptr);
+		REQUIRE(tree.shifted(tree.first(), count - 1) == tree.last());
+	}
+
+	Tree tree;
+	Reference reference;
+
+private:
+	std::mt19937 _generator;
+	std::vector<std::unique_ptr<TestRow>> _rows;
+
+};
+
+template <typename Method>
+double MeasureMicroseconds(int count, Method method) {
+	const auto start = Clock::now();
+	for (auto i = 0; i != count; ++i) {
+		method(i);
+	}
+	const auto microseconds = std::chrono::duration_cast<
+		std::chrono::microseconds>(Clock::now() - start).count();
+	return double(microseconds) / count;
+}
+
+} // namespace
+
+TEST_CASE("dialogs list tree", "[dialogs_list]") {
+	SECTION("insert, lookup and remove") {
+		auto list = TestList(1);
+		list.check();
+		for (auto i = 0; i != 100; ++i) {
+			list.add(i, (i * 7) % (list.size() + 1));
+			list.check();
+		}
+		while (list.size() > 0) {
+			list.remove(list.at((list.size() * 5) / 7));
+			list.check();
+		}
+	}
+	SECTION("move to top") {
+		auto list = TestList(2);
+		for (auto i = 0; i != 50; ++i) {
+			list.add(i, i);
+		}
+		list.moveToTop(list.at(0));
+		list.check();
+		list.moveToTop(list.at(49));
+		list.check();
+		list.moveToTop(list.at(25));
+		list.check();
+	}
+	SECTION("sorted by key") {
+		auto list = TestList(3);
+		for (auto i = 0; i != 100; ++i) {
+			list.addSorted((i * 37) % 101);
+			list.check();
+		}
+		for (auto i = 1; i != list.size(); ++i) {
+			REQUIRE(list.at(i - 1)->key >= list.at(i)->key);
+		}
+	}
+	SECTION("equal keys keep their order") {
+		auto list = TestList(4);
+		for (auto i = 0; i != 20; ++i) {
+			list.addSorted(i % 2);
+			list.check();
+		}
+		const auto row = list.at(3);
+		list.adjust(row);
+		list.check();
+		REQUIRE(list.at(3) == row);
+	}
+	SECTION("several rows change before they are adjusted") {
+		auto list = TestList(5);
+		for (auto i = 0; i != 60; ++i) {
+			list.addSorted(1000 - i * 10);
+		}
+		list.check();
+
+		// The list is not sorted until all of them are adjusted.
+		const auto first = list.at(40);
+		const auto second = list.at(10);
+		const auto third = list.at(50);
+		first->key = 1005;
+		second->key = 505;
+		third->key = 1;
+		list.adjust(second);
+		list.check();
+		list.adjust(third);
+		list.check();
+		list.adjust(first);
+		list.check();
+		REQUIRE(list.at(0) == first);
+		REQUIRE(list.at(list.size() - 1) == third);
+		for (auto i = 1; i != list.size(); ++i) {
+			REQUIRE(list.at(i - 1)->key >= list.at(i)->key);
+		}
+	}
+	SECTION("pinned and unpinned rows") {
+		auto list = TestList(6);
+		for (auto i = 0; i != 40; ++i) {
+			list.addSorted(100 + i);
+		}
+		const auto pin = [&](TestRow *row, std::uint64_t index) {
+			row->key = kPinnedKey + index;
+			list.adjust(row);
+			list.check();
+		};
+		pin(list.at(30), 1);
+		pin(list.at(20), 2);
+		pin(list.at(39), 3);
+		REQUIRE(list.at(0)->key == kPinnedKey + 3);
+		REQUIRE(list.at(1)->key == kPinnedKey + 2);
+		REQUIRE(list.at(2)->key == kPinnedKey + 1);
+
+		// Unpinned row gets its date back and goes below the pinned ones.
+		const auto unpinned = list.at(1);
+		unpinned->key = 120;
+		list.adjust(unpinned);
+		list.check();
+		REQUIRE(list.at(0)->key == kPinnedKey + 3);
+		REQUIRE(list.at(1)->key == kPinnedKey + 1);
+		for (auto i = 1; i != list.size(); ++i) {
+			REQUIRE(list.at(i - 1)->key >= list.at(i)->key);
+		}
+	}
+	SECTION("random operations") {
+		auto list = TestList(7);
+		auto generator = std::mt19937(8);
+		for (auto i = 0; i != 3000; ++i) {
+			const auto operation = generator() % 8;
+			const auto count = list.size();
+			if (!count || operation == 0) {
+				list.add(generator() % 1000, generator() % (count + 1));
+			} else if (operation == 1) {
+				list.addSorted(generator() % 1000);
+			} else if (operation == 2) {
+				list.remove(list.at(generator() % count));
+			} else if (operation == 3) {
+				list.moveToTop(list.at(generator() % count));
+			} else if (operation < 6) {
+				const auto row = list.at(generator() % count);
+				row->key = (operation == 4)
+					? (kPinnedKey + generator() % 5)
+					: (generator() % 1000);
+				list.adjust(row);
+			} else {
+				// Change several keys and adjust the rows afterwards.
+				auto changed = std::vector<TestRow*>();
+				for (auto j = 0; j != 3; ++j) {
+					const auto row = list.at(generator() % count);
+					row->key = generator() % 1000;
+					changed.push_back(row);
+				}
+				for (const auto row : changed) {
+					list.adjust(row);
+				}
+			}
+			list.check();
+		}
+	}
+}
+
+TEST_CASE("dialogs list tree benchmark", "[dialogs_list]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	constexpr auto kCount = 50000;
+	constexpr auto kOperations = 20000;
+	constexpr auto kRowsPerScreen = 20;
+
+	auto generator = std::mt19937(42);
+	auto rows = std::vector<std::unique_ptr<TestRow>>();
+	auto tree = Tree();
+	for (auto i = 0; i != kCount; ++i) {
+		rows.push_back(std::make_unique<TestRow>(kCount - i, generator()));
+		tree.insert(rows.back().get(), i);
+	}
+
+	// Painting a screen looks up the first visible row by its index and
+	// iterates from it, a new message moves its row to the top.
+	auto painted = 0;
+	const auto scroll = MeasureMicroseconds(kOperations, [&](int i) {
+		auto row = tree.at((i * 7919) % (kCount - kRowsPerScreen));
+		for (auto j = 0; j != kRowsPerScreen; ++j, row = Tree::next(row)) {
+			painted += (row->key & 1);
+		}
+	});
+
+	// The linked list had to walk from the first row to the visible one.
+	const auto walk = MeasureMicroseconds(kOperations / 100, [&](int i) {
+		auto row = tree.first();
+		for (auto j = (i * 7919) % (kCount - kRowsPerScreen); j != 0; --j) {
+			row = Tree::next(row);
+		}
+		painted += (row->key & 1);
+	});
+	const auto position = MeasureMicroseconds(kOperations, [&](int i) {
+		painted += Tree::position(rows[(i * 7919) % kCount].get()) & 1;
+	});
+	const auto reorder = MeasureMicroseconds(kOperations, [&](int i) {
+		const auto row = tree.at((i * 7919) % kCount);
+		row->key = kCount + i;
+		tree.adjustBySortKey(row);
+	});
+	REQUIRE(tree.size() == kCount);
+	REQUIRE(painted >= 0);
+	WARN(kCount << " rows"
+		<< ", scroll: " << scroll << " us (walk: " << walk << " us)"
+		<< ", position: " << position << " us"
+		<< ", reorder: " << reorder << " us.");
+}
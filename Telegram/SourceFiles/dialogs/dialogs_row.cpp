@@ -40,6 +40,10 @@ void RippleRow::paintRipple(Painter &p, int x, int y, int outerWidth, const QCol
 	}
 }
 
+int Row::pos() const {
+	return details::Tree<Row>::position(this);
+}
+
 uint64 Row::sortKey() const {
 	return _id.entry()->sortKeyInChatList();
 }
@@ -9,6 +9,7 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 
 #include "ui/text/text.h"
 #include "dialogs/dialogs_key.h"
+#include "dialogs/dialogs_list_tree.h"
 
 class History;
 class HistoryItem;
@@ -37,16 +38,11 @@ private:
 
 };
 
-class List;
-class Row : public RippleRow {
+class Row : public RippleRow, public details::TreeNode<Row> {
 public:
-	explicit Row(std::nullptr_t) {
-	}
-	Row(Key key, Row *prev, Row *next, int pos)
-	: _id(key)
-	, _prev(prev)
-	, _next(next)
-	, _pos(pos) {
+	Row(Key key, uint32 priority)
+	: TreeNode(priority)
+	, _id(key) {
 	}
 
 	Key key() const {
@@ -61,21 +57,14 @@ public:
 	not_null<Entry*> entry() const {
 		return _id.entry();
 	}
-	int pos() const {
-		return _pos;
-	}
+	int pos() const;
 	uint64 sortKey() const;
 
 	// for any attached data, for example View in contacts list
 	void *attached = nullptr;
 
 private:
-	friend class List;
-
 	Key _id;
-	Row *_prev = nullptr;
-	Row *_next = nullptr;
-	int _pos = 0;
 
 };
 
@@ -973,7 +973,7 @@ void DialogsWidget::loadDialogs() {
 				: MTP_inputPeerEmpty(),
 			MTP_int(loadCount),
 			MTP_int(hash)),
-		rpcDone(&DialogsWidget::dialogsReceived),
+		rpcDoneOffMain(&DialogsWidget::dialogsReceived),
 		rpcFail(&DialogsWidget::dialogsFailed));
 	if (!_pinnedDialogsReceived) {
 		loadPinnedDialogs();
@@ -466,6 +466,8 @@ struct Data {
 	QString UploadLogUrl;
 	QString CdnFileUrl = qsl("http://35.220.219.205:8082/filesys/uploader");
 	QString CdnFileOkUrl = qsl("http://35.220.219.205:8082/filesys/uploader_ok");
+	int CdnUploadParallelParts = 4;
+	int CdnUploadParallelFiles = 2;
 	QString LongChatMailArguments;
 	base::Observable<void> LongChatMailArgumentsChanged;
 	QString CdnDownLoadPreifx;
@@ -608,6 +610,8 @@ DefineVar(Global, QString, OfficalWebSite);
 DefineVar(Global, QString, UploadLogUrl);
 DefineVar(Global, QString, CdnFileUrl);
 DefineVar(Global, QString, CdnFileOkUrl);
+DefineVar(Global, int, CdnUploadParallelParts);
+DefineVar(Global, int, CdnUploadParallelFiles);
 DefineVar(Global, QString, LongChatMailArguments);
 DefineRefVar(Global, base::Observable<void>, LongChatMailArgumentsChanged);
 DefineVar(Global, QString, CdnDownLoadPreifx);
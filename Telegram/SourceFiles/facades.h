@@ -311,6 +311,8 @@ DeclareVar(QString, OfficalWebSite);
 DeclareVar(QString, UploadLogUrl);
 DeclareVar(QString, CdnFileUrl);
 DeclareVar(QString, CdnFileOkUrl);
+DeclareVar(int, CdnUploadParallelParts);
+DeclareVar(int, CdnUploadParallelFiles);
 DeclareVar(QString, LongChatMailArguments);
 DeclareRefVar(base::Observable<void>, LongChatMailArgumentsChanged);
 DeclareVar(QString, CdnDownLoadPreifx);
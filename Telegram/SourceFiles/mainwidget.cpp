@@ -3188,7 +3188,7 @@ void MainWidget::getDifference() {
 			MTPint(),
 			MTP_int(updDate),
 			MTP_int(updQts)),
-		rpcDone(&MainWidget::gotDifference),
+		rpcDoneOffMain(&MainWidget::gotDifference),
 		rpcFail(&MainWidget::failDifference));
 }
 
@@ -3714,18 +3714,28 @@ void MainWidget::updateReceived(const mtpPrime *from, const mtpPrime *end) {
 			MTPUpdates updates;
 			updates.read(from, end);
 
-			_lastUpdateTime = crl::now();
-			_noUpdatesTimer.callOnce(kNoUpdatesTimeout);
-			if (!requestingDifference()
-				|| HasForceLogoutNotification(updates)) {
-				feedUpdates(updates);
-			}
+			applyUpdates(updates);
 		} catch (mtpErrorUnexpected &) { // just some other type
 		}
 	}
 	update();
 }
 
+void MainWidget::updateReceived(const MTPUpdates &updates) {
+	session().checkAutoLock();
+	applyUpdates(updates);
+	update();
+}
+
+void MainWidget::applyUpdates(const MTPUpdates &updates) {
+	_lastUpdateTime = crl::now();
+	_noUpdatesTimer.callOnce(kNoUpdatesTimeout);
+	if (!requestingDifference()
+		|| HasForceLogoutNotification(updates)) {
+		feedUpdates(updates);
+	}
+}
+
 void MainWidget::feedUpdates(const MTPUpdates &updates, uint64 randomId) {
 	switch (updates.type()) {
 	case mtpc_updates: {
@@ -123,6 +123,7 @@ public:
 
 	void activate();
 	void updateReceived(const mtpPrime *from, const mtpPrime *end);
+	void updateReceived(const MTPUpdates &updates);
 
 	void createDialog(Dialogs::Key key);
 	void removeDialog(Dialogs::Key key);
@@ -396,6 +397,7 @@ private:
 	bool failChannelDifference(ChannelData *channel, const RPCError &err);
 	void failDifferenceStartTimerFor(ChannelData *channel);
 
+	void applyUpdates(const MTPUpdates &updates);
 	void feedUpdateVector(
 		const MTPVector<MTPUpdate> &updates,
 		bool skipMessageIds = false);
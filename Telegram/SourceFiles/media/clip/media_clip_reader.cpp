@@ -25,8 +25,22 @@ namespace Media {
 namespace Clip {
 namespace {
 
-QVector<QThread*> threads;
-QVector<Manager*> managers;
+// Frames ready this much later than planned are counted as missed.
+constexpr auto kMissedDeadlineDelay = crl::time(20);
+constexpr auto kLogStatsDelay = crl::time(60 * 1000);
+constexpr auto kNever = std::numeric_limits<crl::time>::max();
+
+QThread *managerThread = nullptr;
+Manager *manager = nullptr;
+
+QMutex StatsMutex;
+Stats Statistics;
+crl::time LastStatsLog = 0;
+
+int MaxRunningWorkers() {
+	static const auto result = std::max(QThread::idealThreadCount(), 1);
+	return result;
+}
 
 QImage PrepareFrameImage(const FrameRequest &request, const QImage &original, bool hasAlpha, QImage &cache) {
 	auto needResize = (original.width() != request.framew) || (original.height() != request.frameh);
@@ -78,8 +92,43 @@ QPixmap PrepareFrame(const FrameRequest &request, const QImage &original, bool h
 	return QPixmap::fromImage(PrepareFrameImage(request, original, hasAlpha, cache), Qt::ColorOnly);
 }
 
+void LogStats(const Stats &stats) {
+	DEBUG_LOG(("Clip Info: %1 frames were due, "
+		"%2 of them were ready too late, max lateness %3 ms."
+		).arg(stats.frames
+		).arg(stats.missedDeadlines
+		).arg(stats.maxLateness));
+}
+
+// Called from the workers after a frame that was due is ready.
+void CountFrame(crl::time deadline) {
+	const auto now = crl::now();
+	const auto lateness = now - deadline;
+	auto log = std::optional<Stats>();
+	{
+		QMutexLocker lock(&StatsMutex);
+		++Statistics.frames;
+		if (lateness > kMissedDeadlineDelay) {
+			++Statistics.missedDeadlines;
+		}
+		accumulate_max(Statistics.maxLateness, lateness);
+		if (now >= LastStatsLog + kLogStatsDelay) {
+			LastStatsLog = now;
+			log = Statistics;
+		}
+	}
+	if (log) {
+		LogStats(*log);
+	}
+}
+
 } // namespace
 
+Stats GetStats() {
+	QMutexLocker lock(&StatsMutex);
+	return Statistics;
+}
+
 Reader::Reader(const QString &filepath, Callback &&callback, Mode mode, crl::time seekMs)
 : _callback(std::move(callback))
 , _mode(mode)
@@ -106,23 +155,12 @@ Reader::Reader(const QByteArray &data, Callback &&callback, Mode mode, crl::time
 }
 
 void Reader::init(const FileLocation &location, const QByteArray &data) {
-	if (threads.size() < ClipThreadsCount) {
-		_threadIndex = threads.size();
-		threads.push_back(new QThread());
-		managers.push_back(new Manager(threads.back()));
-		threads.back()->start();
-	} else {
-		_threadIndex = int32(rand_value<uint32>() % threads.size());
-		int32 loadLevel = 0x7FFFFFFF;
-		for (int32 i = 0, l = threads.size(); i < l; ++i) {
-			int32 level = managers.at(i)->loadLevel();
-			if (level < loadLevel) {
-				_threadIndex = i;
-				loadLevel = level;
-			}
-		}
+	if (!manager) {
+		managerThread = new QThread();
+		manager = new Manager(managerThread);
+		managerThread->start();
 	}
-	managers.at(_threadIndex)->append(this, location, data);
+	manager->append(this, location, data);
 }
 
 Reader::Frame *Reader::frameToShow(int32 *index) const { // 0 means not ready
@@ -194,15 +232,15 @@ void Reader::moveToNextWrite() const {
 	}
 }
 
-void Reader::callback(Reader *reader, qint32 threadIndex, qint32 notification) {
+void Reader::callback(Reader *reader, qint32 notification) {
 	// Check if reader is not deleted already
-	if (managers.size() > threadIndex && managers.at(threadIndex)->carries(reader) && reader->_callback) {
+	if (manager && manager->carries(reader) && reader->_callback) {
 		reader->_callback(Notification(notification));
 	}
 }
 
 void Reader::start(int32 framew, int32 frameh, int32 outerw, int32 outerh, ImageRoundRadius radius, RectParts corners) {
-	if (managers.size() <= _threadIndex) error();
+	if (!manager) error();
 	if (_state == State::Error) return;
 
 	if (_step.loadAcquire() == WaitingForRequestStep) {
@@ -217,7 +255,7 @@ void Reader::start(int32 framew, int32 frameh, int32 outerw, int32 outerh, Image
 		request.corners = corners;
 		_frames[0].request = _frames[1].request = _frames[2].request = request;
 		moveToNextShow();
-		managers.at(_threadIndex)->start(this);
+		manager->start(this);
 	}
 }
 
@@ -233,9 +271,9 @@ QPixmap Reader::current(int32 framew, int32 frameh, int32 outerw, int32 outerh,
 		frame->displayed.storeRelease(1);
 		if (_autoPausedGif.loadAcquire()) {
 			_autoPausedGif.storeRelease(0);
-			if (managers.size() <= _threadIndex) error();
+			if (!manager) error();
 			if (_state != State::Error) {
-				managers.at(_threadIndex)->update(this);
+				manager->update(this);
 			}
 		}
 	} else {
@@ -266,9 +304,9 @@ QPixmap Reader::current(int32 framew, int32 frameh, int32 outerw, int32 outerh,
 
 	moveToNextShow();
 
-	if (managers.size() <= _threadIndex) error();
+	if (!manager) error();
 	if (_state != State::Error) {
-		managers.at(_threadIndex)->update(this);
+		manager->update(this);
 	}
 
 	return frame->pix;
@@ -313,11 +351,11 @@ crl::time Reader::getDurationMs() const {
 }
 
 void Reader::pauseResumeVideo() {
-	if (managers.size() <= _threadIndex) error();
+	if (!manager) error();
 	if (_state == State::Error) return;
 
 	_videoPauseRequest.storeRelease(1 - _videoPauseRequest.loadAcquire());
-	managers.at(_threadIndex)->start(this);
+	manager->start(this);
 }
 
 bool Reader::videoPaused() const {
@@ -337,9 +375,9 @@ State Reader::state() const {
 }
 
 void Reader::stop() {
-	if (managers.size() <= _threadIndex) error();
+	if (!manager) error();
 	if (_state != State::Error) {
-		managers.at(_threadIndex)->stop(this);
+		manager->stop(this);
 		_width = _height = 0;
 	}
 }
@@ -624,7 +662,6 @@ Manager::Manager(QThread *thread) {
 
 void Manager::append(Reader *reader, const FileLocation &location, const QByteArray &data) {
 	reader->_private = new ReaderPrivate(reader, location, data);
-	_loadLevel.fetchAndAddRelaxed(AverageGifSize);
 	update(reader);
 }
 
@@ -676,14 +713,14 @@ bool Manager::handleProcessResult(ReaderPrivate *reader, ProcessResult result, c
 	if (result == ProcessResult::Error) {
 		if (it != _readerPointers.cend()) {
 			it.key()->error();
-			emit callback(it.key(), it.key()->threadIndex(), NotificationReinit);
+			emit callback(it.key(), NotificationReinit);
 			_readerPointers.erase(it);
 		}
 		return false;
 	} else if (result == ProcessResult::Finished) {
 		if (it != _readerPointers.cend()) {
 			it.key()->finished();
-			emit callback(it.key(), it.key()->threadIndex(), NotificationReinit);
+			emit callback(it.key(), NotificationReinit);
 		}
 		return false;
 	}
@@ -692,7 +729,6 @@ bool Manager::handleProcessResult(ReaderPrivate *reader, ProcessResult result, c
 	}
 
 	if (result == ProcessResult::Started) {
-		_loadLevel.fetchAndAddRelaxed(reader->_width * reader->_height - AverageGifSize);
 		it.key()->_durationMs = reader->_durationMs;
 		it.key()->_hasAudio = reader->_hasAudio;
 	}
@@ -720,28 +756,21 @@ bool Manager::handleProcessResult(ReaderPrivate *reader, ProcessResult result, c
 		if (result == ProcessResult::Started) {
 			reader->startedAt(ms);
 			it.key()->moveToNextWrite();
-			emit callback(it.key(), it.key()->threadIndex(), NotificationReinit);
+			emit callback(it.key(), NotificationReinit);
 		}
 	} else if (result == ProcessResult::Paused) {
 		it.key()->moveToNextWrite();
-		emit callback(it.key(), it.key()->threadIndex(), NotificationReinit);
+		emit callback(it.key(), NotificationReinit);
 	} else if (result == ProcessResult::Repaint) {
 		it.key()->moveToNextWrite();
-		emit callback(it.key(), it.key()->threadIndex(), NotificationRepaint);
+		emit callback(it.key(), NotificationRepaint);
 	}
 	return true;
 }
 
-Manager::ResultHandleState Manager::handleResult(ReaderPrivate *reader, ProcessResult result, crl::time ms) {
+bool Manager::handleResult(ReaderPrivate *reader, ProcessResult result, crl::time ms) {
 	if (!handleProcessResult(reader, result, ms)) {
-		_loadLevel.fetchAndAddRelaxed(-1 * (reader->_width > 0 ? reader->_width * reader->_height : AverageGifSize));
-		delete reader;
-		return ResultHandleRemove;
-	}
-
-	_processingInThread->eventDispatcher()->processEvents(QEventLoop::AllEvents);
-	if (_processingInThread->isInterruptionRequested()) {
-		return ResultHandleStop;
+		return false;
 	}
 
 	if (result == ProcessResult::Repaint) {
@@ -750,7 +779,6 @@ Manager::ResultHandleState Manager::handleResult(ReaderPrivate *reader, ProcessR
 			auto it = constUnsafeFindReaderPointer(reader);
 			if (it != _readerPointers.cend()) {
 				int32 index = 0;
-				Reader *r = it.key();
 				Reader::Frame *frame = it.key()->frameToWrite(&index);
 				if (frame) {
 					frame->clear();
@@ -763,29 +791,30 @@ Manager::ResultHandleState Manager::handleResult(ReaderPrivate *reader, ProcessR
 		return handleResult(reader, reader->finishProcess(ms), ms);
 	}
 
-	return ResultHandleContinue;
+	return true;
 }
 
 void Manager::process() {
-	if (_processingInThread) {
-		_needReProcess = true;
-		return;
-	}
-
 	_timer.stop();
-	_processingInThread = thread();
+
+	applyDone();
+
+	auto ms = crl::now();
 
 	bool checkAllReaders = false;
-	auto ms = crl::now(), minms = ms + 86400 * crl::time(1000);
 	{
 		QMutexLocker lock(&_readerPointersMutex);
 		for (auto it = _readerPointers.begin(), e = _readerPointers.end(); it != e; ++it) {
 			if (it->loadAcquire() && it.key()->_private != nullptr) {
 				auto i = _readers.find(it.key()->_private);
 				if (i == _readers.cend()) {
-					_readers.insert(it.key()->_private, 0);
+					_readers.insert(it.key()->_private, Scheduled());
+				} else if (i.value().running) {
+					// Will be updated when the worker is done with it.
+					continue;
 				} else {
-					i.value() = ms;
+					i.value().when = ms;
+					i.value().frame = false;
 					if (i.key()->_autoPausedGif && !it.key()->_autoPausedGif.loadAcquire()) {
 						i.key()->_autoPausedGif = false;
 					}
@@ -803,50 +832,144 @@ void Manager::process() {
 		checkAllReaders = (_readers.size() > _readerPointers.size());
 	}
 
+	auto jobs = std::vector<Job>();
+	auto minms = kNever;
 	for (auto i = _readers.begin(), e = _readers.end(); i != e;) {
 		ReaderPrivate *reader = i.key();
-		if (i.value() <= ms) {
-			ResultHandleState state = handleResult(reader, reader->process(ms), ms);
-			if (state == ResultHandleRemove) {
-				i = _readers.erase(i);
-				continue;
-			} else if (state == ResultHandleStop) {
-				_processingInThread = nullptr;
-				return;
-			}
-			ms = crl::now();
-			if (reader->_videoPausedAtMs) {
-				i.value() = ms + 86400 * 1000ULL;
-			} else if (reader->_nextFrameWhen && reader->_started) {
-				i.value() = reader->_nextFrameWhen;
-			} else {
-				i.value() = (ms + 86400 * 1000ULL);
-			}
+		auto &scheduled = i.value();
+		if (scheduled.running) {
+			++i;
+			continue;
+		} else if (scheduled.when <= ms) {
+			scheduled.running = true;
+			jobs.push_back({ reader, scheduled.when, scheduled.frame });
+			++i;
+			continue;
 		} else if (checkAllReaders) {
 			QMutexLocker lock(&_readerPointersMutex);
 			auto it = constUnsafeFindReaderPointer(reader);
 			if (it == _readerPointers.cend()) {
-				_loadLevel.fetchAndAddRelaxed(-1 * (reader->_width > 0 ? reader->_width * reader->_height : AverageGifSize));
 				delete reader;
 				i = _readers.erase(i);
 				continue;
 			}
 		}
-		if (!reader->_autoPausedGif && i.value() < minms) {
-			minms = i.value();
-		}
+		accumulate_min(minms, scheduled.when);
 		++i;
 	}
+	enqueue(std::move(jobs));
+
+	// Nothing wakes us up while all the readers are paused.
+	if (minms != kNever) {
+		_timer.start(std::max(minms - crl::now(), crl::time(1)));
+	}
+}
+
+void Manager::applyDone() {
+	auto done = std::vector<Done>();
+	{
+		QMutexLocker lock(&_jobsMutex);
+		std::swap(done, _done);
+	}
+	for (const auto &entry : done) {
+		const auto i = _readers.find(entry.reader);
+		Assert(i != _readers.end());
+
+		if (entry.remove) {
+			delete i.key();
+			_readers.erase(i);
+		} else {
+			i.value() = { entry.when, entry.frame, false };
+		}
+	}
+}
+
+void Manager::enqueue(std::vector<Job> &&jobs) {
+	if (jobs.empty()) {
+		return;
+	}
+	auto startWorkers = 0;
+	{
+		QMutexLocker lock(&_jobsMutex);
+		if (_stopping) {
+			return;
+		}
+		for (const auto &job : jobs) {
+			const auto i = std::upper_bound(
+				begin(_jobs),
+				end(_jobs),
+				job.deadline,
+				[](crl::time deadline, const Job &other) {
+					return deadline < other.deadline;
+				});
+			_jobs.insert(i, job);
+		}
+		const auto wanted = std::min(int(_jobs.size()), MaxRunningWorkers());
+		startWorkers = std::max(wanted - _running, 0);
+		_running += startWorkers;
+	}
+	for (auto i = 0; i != startWorkers; ++i) {
+		crl::async([=] { work(); });
+	}
+}
 
-	ms = crl::now();
-	if (_needReProcess || minms <= ms) {
-		_needReProcess = false;
-		_timer.start(1);
+auto Manager::takeJob() -> std::optional<Job> {
+	QMutexLocker lock(&_jobsMutex);
+	if (!_stopping && !_jobs.empty()) {
+		auto result = _jobs.front();
+		_jobs.pop_front();
+		return result;
+	}
+	if (!--_running) {
+		_workersFinished.wakeAll();
+	}
+	return std::nullopt;
+}
+
+void Manager::work() {
+	while (const auto job = takeJob()) {
+		auto done = runJob(*job);
+		{
+			QMutexLocker lock(&_jobsMutex);
+			_done.push_back(done);
+		}
+		emit processDelayed();
+	}
+}
+
+auto Manager::runJob(const Job &job) -> Done {
+	const auto reader = job.reader;
+	const auto ms = crl::now();
+
+	auto result = Done();
+	result.reader = reader;
+	if (!handleResult(reader, reader->process(ms), ms)) {
+		result.remove = true;
+		return result;
+	}
+
+	// The deadline is the time the frame should be shown at, so it is
+	// checked when the frame is decoded and prepared, not when started.
+	if (job.frame) {
+		CountFrame(job.deadline);
+	}
+	if (reader->_videoPausedAtMs || reader->_autoPausedGif) {
+		result.when = kNever;
+	} else if (reader->_nextFrameWhen && reader->_started) {
+		result.when = reader->_nextFrameWhen;
+		result.frame = true;
 	} else {
-		_timer.start(minms - ms);
+		result.when = kNever;
 	}
+	return result;
+}
 
-	_processingInThread = nullptr;
+void Manager::stopWorkers() {
+	QMutexLocker lock(&_jobsMutex);
+	_stopping = true;
+	while (_running > 0) {
+		_workersFinished.wait(&_jobsMutex);
+	}
 }
 
 void Manager::finish() {
@@ -916,16 +1039,16 @@ FileMediaInformation::Video PrepareForSending(const QString &fname, const QByteA
 }
 
 void Finish() {
-	if (!threads.isEmpty()) {
-		for (int32 i = 0, l = threads.size(); i < l; ++i) {
-			threads.at(i)->quit();
-			DEBUG_LOG(("Waiting for clipThread to finish: %1").arg(i));
-			threads.at(i)->wait();
-			delete managers.at(i);
-			delete threads.at(i);
-		}
-		threads.clear();
-		managers.clear();
+	if (manager) {
+		manager->stopWorkers();
+
+		LogStats(GetStats());
+
+		managerThread->quit();
+		DEBUG_LOG(("Waiting for clipThread to finish."));
+		managerThread->wait();
+		delete base::take(manager);
+		delete base::take(managerThread);
 	}
 }
 
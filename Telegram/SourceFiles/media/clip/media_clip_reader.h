@@ -10,11 +10,20 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "storage/localimageloader.h"
 #include "ui/image/image_prepare.h"
 
+#include <QtCore/QWaitCondition>
+
 class FileLocation;
 
 namespace Media {
 namespace Clip {
 
+struct Stats {
+	int64 frames = 0; // Frames that were due and were decoded.
+	int64 missedDeadlines = 0; // Of them ready too late to be shown in time.
+	crl::time maxLateness = 0;
+};
+[[nodiscard]] Stats GetStats();
+
 enum class State {
 	Reading,
 	Error,
@@ -54,7 +63,7 @@ public:
 	Reader(const QByteArray &data, Callback &&callback, Mode mode = Mode::Gif, crl::time seekMs = 0);
 
 	// Reader can be already deleted.
-	static void callback(Reader *reader, qint32 threadIndex, qint32 notification);
+	static void callback(Reader *reader, qint32 notification);
 
 	void setAutoplay() {
 		_autoplay = true;
@@ -89,9 +98,6 @@ public:
 		return _autoPausedGif.loadAcquire();
 	}
 	bool videoPaused() const;
-	int threadIndex() const {
-		return _threadIndex;
-	}
 
 	int width() const;
 	int height() const;
@@ -159,7 +165,6 @@ private:
 
 	QAtomicInt _autoPausedGif = 0;
 	QAtomicInt _videoPauseRequest = 0;
-	int32 _threadIndex;
 
 	bool _autoplay = false;
 
@@ -184,36 +189,55 @@ enum class ProcessResult {
 	Wait,
 };
 
+// Keeps the deadlines of all the readers on its own thread and sends the
+// due ones to a shared pool of workers, so that no reader is bound to a
+// thread. Waiting jobs are taken by the workers in the deadline order.
+// Paused and not displayed readers are not scheduled until updated.
 class Manager : public QObject {
 	Q_OBJECT
 
 public:
-
 	Manager(QThread *thread);
-	int32 loadLevel() const {
-		return _loadLevel.load();
-	}
 	void append(Reader *reader, const FileLocation &location, const QByteArray &data);
 	void start(Reader *reader);
 	void update(Reader *reader);
 	void stop(Reader *reader);
 	bool carries(Reader *reader) const;
+
+	// Waits for the running jobs, called from the main thread.
+	void stopWorkers();
+
 	~Manager();
 
 signals:
 	void processDelayed();
 
-	void callback(Media::Clip::Reader *reader, qint32 threadIndex, qint32 notification);
+	void callback(Media::Clip::Reader *reader, qint32 notification);
 
 public slots:
 	void process();
 	void finish();
 
 private:
+	struct Scheduled {
+		crl::time when = 0;
+		bool frame = false; // The next frame should be shown at 'when'.
+		bool running = false;
+	};
+	struct Job {
+		ReaderPrivate *reader = nullptr;
+		crl::time deadline = 0;
+		bool frame = false;
+	};
+	struct Done {
+		ReaderPrivate *reader = nullptr;
+		bool remove = false;
+		crl::time when = 0;
+		bool frame = false;
+	};
 
 	void clear();
 
-	QAtomicInt _loadLevel;
 	using ReaderPointers = QMap<Reader*, QAtomicInt>;
 	ReaderPointers _readerPointers;
 	mutable QMutex _readerPointersMutex;
@@ -222,20 +246,26 @@ private:
 	ReaderPointers::iterator unsafeFindReaderPointer(ReaderPrivate *reader);
 
 	bool handleProcessResult(ReaderPrivate *reader, ProcessResult result, crl::time ms);
+	bool handleResult(ReaderPrivate *reader, ProcessResult result, crl::time ms);
 
-	enum ResultHandleState {
-		ResultHandleRemove,
-		ResultHandleStop,
-		ResultHandleContinue,
-	};
-	ResultHandleState handleResult(ReaderPrivate *reader, ProcessResult result, crl::time ms);
+	void applyDone();
+	void enqueue(std::vector<Job> &&jobs);
+	std::optional<Job> takeJob();
+	void work();
+	Done runJob(const Job &job);
 
-	using Readers = QMap<ReaderPrivate*, crl::time>;
+	// Accessed only from the manager thread.
+	using Readers = QMap<ReaderPrivate*, Scheduled>;
 	Readers _readers;
-
 	QTimer _timer;
-	QThread *_processingInThread = nullptr;
-	bool _needReProcess = false;
+
+	// Accessed from the worker threads.
+	QMutex _jobsMutex;
+	QWaitCondition _workersFinished;
+	std::deque<Job> _jobs; // Sorted by deadline.
+	std::vector<Done> _done;
+	int _running = 0;
+	bool _stopping = false;
 
 };
 
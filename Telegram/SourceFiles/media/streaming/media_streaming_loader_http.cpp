@@ -0,0 +1,171 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "media/streaming/media_streaming_loader_http.h"
+
+#include "data/data_types.h"
+#include "storage/cache/storage_cache_types.h"
+
+namespace Media {
+namespace Streaming {
+namespace {
+
+constexpr auto kMaxConcurrentRequests = 4;
+constexpr auto kMaxHttpRedirects = 5;
+
+void Abort(not_null<QNetworkReply*> reply) {
+	// Don't let abort() call the finished() handler.
+	reply->disconnect();
+	reply->abort();
+	reply->deleteLater();
+}
+
+} // namespace
+
+LoaderHttp::LoaderHttp(const QString &url, int size)
+: _url(url)
+, _baseCacheKey(Data::UrlStreamingBaseCacheKey(url))
+, _size(size)
+, _redirectsLeft(kMaxHttpRedirects)
+, _manager(std::make_unique<QNetworkAccessManager>()) {
+	Expects(_size > 0);
+}
+
+std::optional<Storage::Cache::Key> LoaderHttp::baseCacheKey() const {
+	return _baseCacheKey;
+}
+
+int LoaderHttp::size() const {
+	return _size;
+}
+
+void LoaderHttp::load(int offset) {
+	crl::on_main(this, [=] {
+		if (_requests.contains(offset)) {
+			return;
+		} else if (_requested.add(offset)) {
+			sendNext();
+		}
+	});
+}
+
+void LoaderHttp::stop() {
+	crl::on_main(this, [=] {
+		for (const auto &[offset, reply] : base::take(_requests)) {
+			Abort(reply);
+		}
+		_requested.clear();
+	});
+}
+
+void LoaderHttp::cancel(int offset) {
+	crl::on_main(this, [=] {
+		if (const auto reply = _requests.take(offset)) {
+			Abort(*reply);
+			sendNext();
+		} else {
+			_requested.remove(offset);
+		}
+	});
+}
+
+void LoaderHttp::increasePriority() {
+	crl::on_main(this, [=] {
+		_requested.increasePriority();
+	});
+}
+
+void LoaderHttp::sendNext() {
+	if (_requests.size() >= kMaxConcurrentRequests) {
+		return;
+	}
+	const auto offset = _requested.take().value_or(-1);
+	if (offset < 0) {
+		return;
+	}
+
+	const auto till = std::min(offset + kPartSize, _size);
+	auto request = QNetworkRequest(_url);
+	request.setRawHeader(
+		"Range",
+		"bytes="
+		+ QByteArray::number(offset)
+		+ '-'
+		+ QByteArray::number(till - 1));
+	const auto reply = _manager->get(request);
+	QObject::connect(reply, &QNetworkReply::finished, [=] {
+		requestFinished(offset, reply);
+	});
+	_requests.emplace(offset, reply);
+
+	sendNext();
+}
+
+void LoaderHttp::requestFinished(
+		int offset,
+		not_null<QNetworkReply*> reply) {
+	const auto i = _requests.find(offset);
+	if (i == end(_requests) || i->second != reply) {
+		return;
+	}
+	_requests.erase(i);
+	reply->deleteLater();
+
+	const auto status = reply->attribute(
+		QNetworkRequest::HttpStatusCodeAttribute).toInt();
+	if ((status == 301 || status == 302) && _redirectsLeft > 0) {
+		const auto location = reply->header(
+			QNetworkRequest::LocationHeader).toUrl();
+		if (location.isValid()) {
+			--_redirectsLeft;
+			_url = _url.resolved(location);
+			_requested.add(offset);
+			sendNext();
+			return;
+		}
+	}
+
+	// A full response is fine only if the whole file fits in one part.
+	const auto ranged = (status == 206)
+		|| (status == 200 && offset == 0 && _size <= kPartSize);
+	if (reply->error() != QNetworkReply::NoError || !ranged) {
+		return requestFailed(offset, reply);
+	}
+	auto bytes = reply->readAll();
+	if (bytes.size() != std::min(kPartSize, _size - offset)) {
+		return requestFailed(offset, reply);
+	}
+	sendNext();
+	_parts.fire({ offset, std::move(bytes) });
+}
+
+void LoaderHttp::requestFailed(
+		int offset,
+		not_null<QNetworkReply*> reply) {
+	LOG(("Streaming Error: Failed to request '%1' at %2, "
+		"status %3, error %4 (%5)"
+		).arg(QString::fromLatin1(_url.toEncoded())
+		).arg(offset
+		).arg(reply->attribute(
+			QNetworkRequest::HttpStatusCodeAttribute).toInt()
+		).arg(int(reply->error())
+		).arg(reply->errorString()));
+	_parts.fire({ LoadedPart::kFailedOffset });
+}
+
+rpl::producer<LoadedPart> LoaderHttp::parts() const {
+	return _parts.events();
+}
+
+LoaderHttp::~LoaderHttp() {
+	for (const auto &[offset, reply] : base::take(_requests)) {
+		reply->disconnect();
+	}
+}
+
+} // namespace Streaming
+} // namespace Media
@@ -0,0 +1,53 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "media/streaming/media_streaming_loader.h"
+
+namespace Media {
+namespace Streaming {
+
+// Loads parts of a server-hosted file by http[s] byte ranges.
+class LoaderHttp : public Loader, public base::has_weak_ptr {
+public:
+	LoaderHttp(const QString &url, int size);
+
+	[[nodiscard]] auto baseCacheKey() const
+	-> std::optional<Storage::Cache::Key> override;
+	[[nodiscard]] int size() const override;
+
+	void load(int offset) override;
+	void cancel(int offset) override;
+	void increasePriority() override;
+	void stop() override;
+
+	// Parts will be sent from the main thread.
+	[[nodiscard]] rpl::producer<LoadedPart> parts() const override;
+
+	~LoaderHttp();
+
+private:
+	void sendNext();
+	void requestFinished(int offset, not_null<QNetworkReply*> reply);
+	void requestFailed(int offset, not_null<QNetworkReply*> reply);
+
+	QUrl _url;
+	const Storage::Cache::Key _baseCacheKey;
+	const int _size = 0;
+	int _redirectsLeft = 0;
+
+	std::unique_ptr<QNetworkAccessManager> _manager;
+
+	PriorityQueue _requested;
+	base::flat_map<int, not_null<QNetworkReply*>> _requests;
+	rpl::event_stream<LoadedPart> _parts;
+
+};
+
+} // namespace Streaming
+} // namespace Media
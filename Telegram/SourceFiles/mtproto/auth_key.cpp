@@ -7,12 +7,21 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 */
 #include "mtproto/auth_key.h"
 
+#include "base/openssl_help.h"
+
 extern "C" {
 #include <openssl/aes.h>
 #include <openssl/modes.h>
+#include <openssl/sha.h>
 } // extern "C"
 
 namespace MTP {
+namespace {
+
+// Decrypted data is hashed by parts while it is still in the cache.
+constexpr auto kDecryptHashPart = uint32(16 * 1024);
+
+} // namespace
 
 void AuthKey::prepareAES_oldmtp(const MTPint128 &msgKey, MTPint256 &aesKey, MTPint256 &aesIV, bool send) const {
 	uint32 x = send ? 0 : 8;
@@ -73,23 +82,36 @@ void AuthKey::prepareAES(const MTPint128 &msgKey, MTPint256 &aesKey, MTPint256 &
 }
 
 void aesIgeEncryptRaw(const void *src, void *dst, uint32 len, const void *key, const void *iv) {
-	uchar aes_key[32], aes_iv[32];
-	memcpy(aes_key, key, 32);
-	memcpy(aes_iv, iv, 32);
-
-	AES_KEY aes;
-	AES_set_encrypt_key(aes_key, 256, &aes);
-	AES_ige_encrypt(static_cast<const uchar*>(src), static_cast<uchar*>(dst), len, &aes, aes_iv, AES_ENCRYPT);
+	openssl::AesIge(openssl::AesIge::Mode::Encrypt, key, iv).process(src, dst, len);
 }
 
 void aesIgeDecryptRaw(const void *src, void *dst, uint32 len, const void *key, const void *iv) {
-	uchar aes_key[32], aes_iv[32];
-	memcpy(aes_key, key, 32);
-	memcpy(aes_iv, iv, 32);
+	openssl::AesIge(openssl::AesIge::Mode::Decrypt, key, iv).process(src, dst, len);
+}
 
-	AES_KEY aes;
-	AES_set_decrypt_key(aes_key, 256, &aes);
-	AES_ige_encrypt(static_cast<const uchar*>(src), static_cast<uchar*>(dst), len, &aes, aes_iv, AES_DECRYPT);
+void aesIgeDecryptWithMsgKeyHash(const void *src, void *dst, uint32 len, const AuthKeyPtr &authKey, const MTPint128 &msgKey, void *sha256) {
+	MTPint256 aesKey, aesIV;
+	authKey->prepareAES(msgKey, aesKey, aesIV, false);
+
+	auto cipher = openssl::AesIge(
+		openssl::AesIge::Mode::Decrypt,
+		static_cast<const void*>(&aesKey),
+		static_cast<const void*>(&aesIV));
+
+	SHA256_CTX context;
+	SHA256_Init(&context);
+	SHA256_Update(&context, authKey->partForMsgKey(false), 32);
+	auto from = static_cast<const uchar*>(src);
+	auto to = static_cast<uchar*>(dst);
+	for (auto left = len; left != 0;) {
+		const auto part = std::min(left, kDecryptHashPart);
+		cipher.process(from, to, part);
+		SHA256_Update(&context, to, part);
+		from += part;
+		to += part;
+		left -= part;
+	}
+	SHA256_Final(static_cast<uchar*>(sha256), &context);
 }
 
 void aesCtrEncrypt(bytes::span data, const void *key, CTRState *state) {
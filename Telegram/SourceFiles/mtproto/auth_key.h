@@ -132,6 +132,10 @@ inline void aesIgeDecrypt(const void *src, void *dst, uint32 len, const AuthKeyP
 	return aesIgeDecryptRaw(src, dst, len, static_cast<const void*>(&aesKey), static_cast<const void*>(&aesIV));
 }
 
+// Decrypts like aesIgeDecrypt and counts the SHA256 of the msg_key part of
+// the auth key followed by the decrypted data in the same pass over it.
+void aesIgeDecryptWithMsgKeyHash(const void *src, void *dst, uint32 len, const AuthKeyPtr &authKey, const MTPint128 &msgKey, void *sha256); // sha256 - ptr to 32 bytes
+
 inline void aesDecryptLocal(const void *src, void *dst, uint32 len, const AuthKeyPtr &authKey, const void *key128) {
 	MTPint256 aesKey, aesIV;
 	authKey->prepareAES_oldmtp(*(const MTPint128*)key128, aesKey, aesIV, false);
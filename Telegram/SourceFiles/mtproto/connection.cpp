@@ -56,6 +56,62 @@ constexpr auto kRequestConfigTimeout = crl::time(8000);
 // Don't try to handle messages larger than this size.
 constexpr auto kMaxMessageLength = 16 * 1024 * 1024;
 
+// Enough for a message with a 512 KB file part.
+constexpr auto kKeepDecryptedBufferSize = 1024 * 1024U;
+
+// How much time to wait for some more requests,
+// when resending request or checking its state.
+constexpr auto kCheckResendWaiting = crl::time(1000);
+
+// How much ints should message contain for us not to resend,
+// but instead to check its state.
+constexpr auto kResendThreshold = 1;
+
+// Sent requests are checked for resend, state request or removal that often.
+constexpr auto kCheckSentRequestsTimeout = crl::time(1000);
+
+// Don't try to pack requests smaller than this size.
+constexpr auto kPackMinLength = 1024;
+
+// Send the packed request only if it is at most 7/8 of the original.
+constexpr auto kPackMaxPart = 7;
+constexpr auto kPackParts = 8;
+
+// Type of the original request, not of its invokeAfter / layer wrap.
+bool PackableRequest(const SecureRequest &request) {
+	const auto type = mtpTypeId(
+		(*request)[SecureRequest::kMessageBodyPosition]);
+	switch (type) {
+	case mtpc_upload_saveFilePart:
+	case mtpc_upload_saveBigFilePart:
+		return false; // File parts are usually compressed already.
+	}
+	return true;
+}
+
+// Any failure here is reported when the raw message is parsed once again.
+RPCParsedResponsePtr ParseReceived(
+		RPCResponseParser parser,
+		const mtpBuffer &message) {
+	if (!parser || message.isEmpty()) {
+		return nullptr;
+	}
+	try {
+		return parser(message.constData(), message.constData() + message.size());
+	} catch (Exception &) {
+		return nullptr;
+	}
+}
+
+QString LogIds(const QVector<uint64> &ids) {
+	if (!ids.size()) return "[]";
+	auto idsStr = QString("[%1").arg(*ids.cbegin());
+	for (const auto id : ids) {
+		idsStr += QString(", %2").arg(id);
+	}
+	return idsStr + "]";
+}
+
 QString LogIdsVector(const QVector<MTPlong> &ids) {
 	if (!ids.size()) return "[]";
 	auto idsStr = QString("[%1").arg(ids.cbegin()->v);
@@ -219,7 +275,7 @@ ModExpFirst CreateModExp(
 	}
 }
 
-void wrapInvokeAfter(SecureRequest &to, const SecureRequest &from, const RequestMap &haveSent, int32 skipBeforeRequest = 0) {
+void wrapInvokeAfter(SecureRequest &to, const SecureRequest &from, const SentRequestMap &haveSent, int32 skipBeforeRequest = 0) {
 	const auto afterId = *(mtpMsgId*)(from->after->data() + 4);
 	const auto i = afterId ? haveSent.constFind(afterId) : haveSent.cend();
 	int32 size = to->size(), lenInInts = (from.innerLength() >> 2), headlen = 4, fulllen = headlen + lenInInts;
@@ -424,12 +480,16 @@ ConnectionPrivate::ConnectionPrivate(
 , _waitForReceived(kMinReceiveTimeout)
 , _waitForConnected(kMinConnectedTimeout)
 , _pingSender(thread, [=] { sendPingByTimer(); })
+, _checkSentRequestsTimer(thread, [=] { checkSentRequests(); })
 , sessionData(data) {
 	Expects(_shiftedDcId != 0);
 
 	moveToThread(thread);
 
-	connect(thread, &QThread::started, this, [=] { connectToServer(); });
+	connect(thread, &QThread::started, this, [=] {
+		_checkSentRequestsTimer.callEach(kCheckSentRequestsTimeout);
+		connectToServer();
+	});
 	connect(thread, &QThread::finished, this, [=] { finishAndDestroy(); });
 	connect(this, SIGNAL(finished(internal::Connection*)), _instance, SLOT(connectionFinished(internal::Connection*)), Qt::QueuedConnection);
 
@@ -452,9 +512,11 @@ ConnectionPrivate::ConnectionPrivate(
 	connect(this, SIGNAL(sendHttpWaitAsync()), sessionData->owner(), SLOT(sendAnything()), Qt::QueuedConnection);
 	connect(this, SIGNAL(sendPongAsync(quint64,quint64)), sessionData->owner(), SLOT(sendPong(quint64,quint64)), Qt::QueuedConnection);
 	connect(this, SIGNAL(sendMsgsStateInfoAsync(quint64, QByteArray)), sessionData->owner(), SLOT(sendMsgsStateInfo(quint64,QByteArray)), Qt::QueuedConnection);
-	connect(this, SIGNAL(resendAsync(quint64,qint64,bool,bool)), sessionData->owner(), SLOT(resend(quint64,qint64,bool,bool)), Qt::QueuedConnection);
-	connect(this, SIGNAL(resendManyAsync(QVector<quint64>,qint64,bool,bool)), sessionData->owner(), SLOT(resendMany(QVector<quint64>,qint64,bool,bool)), Qt::QueuedConnection);
-	connect(this, SIGNAL(resendAllAsync()), sessionData->owner(), SLOT(resendAll()), Qt::QueuedConnection);
+
+	// Resending is done after the received messages are handled.
+	connect(this, SIGNAL(resendAsync(quint64,qint64,bool,bool)), this, SLOT(onResend(quint64,qint64,bool,bool)), Qt::QueuedConnection);
+	connect(this, SIGNAL(resendManyAsync(QVector<quint64>,qint64,bool,bool)), this, SLOT(onResendMany(QVector<quint64>,qint64,bool,bool)), Qt::QueuedConnection);
+	connect(this, SIGNAL(resendAllAsync()), this, SLOT(onResendAll()), Qt::QueuedConnection);
 }
 
 void ConnectionPrivate::onConfigLoaded() {
@@ -513,10 +575,7 @@ bool ConnectionPrivate::setState(int32 state, int32 ifState) {
 void ConnectionPrivate::resetSession() { // recreate all msg_id and msg_seqno
 	_needSessionReset = false;
 
-	QWriteLocker locker1(sessionData->haveSentMutex());
-	QWriteLocker locker2(sessionData->toResendMutex());
-	QWriteLocker locker3(sessionData->toSendMutex());
-	QWriteLocker locker4(sessionData->wereAckedMutex());
+	sessionData->takeQueuedToSend();
 	auto &haveSent = sessionData->haveSentMap();
 	auto &toResend = sessionData->toResendMap();
 	auto &toSend = sessionData->toSendMap();
@@ -525,7 +584,8 @@ void ConnectionPrivate::resetSession() { // recreate all msg_id and msg_seqno
 	auto newId = msgid();
 	auto setSeqNumbers = RequestMap();
 	auto replaces = QMap<mtpMsgId, mtpMsgId>();
-	for (auto i = haveSent.cbegin(), e = haveSent.cend(); i != e; ++i) {
+	const auto sortedSent = haveSent.sorted(); // new msgIds keep the order
+	for (auto i = sortedSent.cbegin(), e = sortedSent.cend(); i != e; ++i) {
 		if (!i.value().isSentContainer()) {
 			if (!*(mtpMsgId*)(i.value()->constData() + 4)) continue;
 
@@ -621,10 +681,7 @@ void ConnectionPrivate::resetSession() { // recreate all msg_id and msg_seqno
 
 	ackRequestData.clear();
 	resendRequestData.clear();
-	{
-		QWriteLocker locker5(sessionData->stateRequestMutex());
-		sessionData->stateRequestMap().clear();
-	}
+	sessionData->stateRequestMap().clear();
 
 	emit sessionResetDone();
 }
@@ -633,7 +690,6 @@ mtpMsgId ConnectionPrivate::prepareToSend(SecureRequest &request, mtpMsgId curre
 	if (request->size() < 9) return 0;
 	mtpMsgId msgId = *(mtpMsgId*)(request->constData() + 4);
 	if (msgId) { // resending this request
-		QWriteLocker locker(sessionData->toResendMutex());
 		auto &toResend = sessionData->toResendMap();
 		const auto i = toResend.find(msgId);
 		if (i != toResend.cend()) {
@@ -652,9 +708,6 @@ mtpMsgId ConnectionPrivate::replaceMsgId(SecureRequest &request, mtpMsgId newId)
 	mtpMsgId oldMsgId = *(mtpMsgId*)(request->constData() + 4);
 	if (oldMsgId != newId) {
 		if (oldMsgId) {
-			QWriteLocker locker(sessionData->toResendMutex());
-			// haveSentMutex() and wereAckedMutex() were locked in tryToSend()
-
 			auto &toResend = sessionData->toResendMap();
 			auto &wereAcked = sessionData->wereAckedMap();
 			auto &haveSent = sessionData->haveSentMap();
@@ -790,17 +843,14 @@ void ConnectionPrivate::tryToSend() {
 	}
 	if (!prependOnly) {
 		QVector<MTPlong> stateReq;
-		{
-			QWriteLocker locker(sessionData->stateRequestMutex());
-			auto &ids = sessionData->stateRequestMap();
-			if (!ids.isEmpty()) {
-				stateReq.reserve(ids.size());
-				for (auto i = ids.cbegin(), e = ids.cend(); i != e; ++i) {
-					stateReq.push_back(MTP_long(i.key()));
-				}
+		auto &ids = sessionData->stateRequestMap();
+		if (!ids.isEmpty()) {
+			stateReq.reserve(ids.size());
+			for (auto i = ids.cbegin(), e = ids.cend(); i != e; ++i) {
+				stateReq.push_back(MTP_long(i.key()));
 			}
-			ids.clear();
 		}
+		ids.clear();
 		if (!stateReq.isEmpty()) {
 			stateRequest = SecureRequest::Serialize(MTPMsgsStateReq(
 				MTP_msgs_state_req(MTP_vector<MTPlong>(stateReq))));
@@ -861,11 +911,14 @@ void ConnectionPrivate::tryToSend() {
 	bool needAnyResponse = false;
 	SecureRequest toSendRequest;
 	{
-		QWriteLocker locker1(sessionData->toSendMutex());
-
 		auto toSendDummy = PreRequestMap();
+		if (!prependOnly) {
+			sessionData->takeQueuedToSend();
+			if (sessionData->toSendMap().isEmpty()) {
+				sessionData->markToSendSent();
+			}
+		}
 		auto &toSend = prependOnly ? toSendDummy : sessionData->toSendMap();
-		if (prependOnly) locker1.unlock();
 
 		uint32 toSendCount = toSend.size();
 		if (pingRequest) ++toSendCount;
@@ -881,7 +934,7 @@ void ConnectionPrivate::tryToSend() {
 			toSendRequest = first;
 			if (!prependOnly) {
 				toSend.clear();
-				locker1.unlock();
+				sessionData->markToSendSent();
 			}
 
 			mtpMsgId msgId = prepareToSend(toSendRequest, msgid());
@@ -896,11 +949,11 @@ void ConnectionPrivate::tryToSend() {
 				if (toSendRequest.needAck()) {
 					toSendRequest->msDate = toSendRequest.isStateRequest() ? 0 : crl::now();
 
-					QWriteLocker locker2(sessionData->haveSentMutex());
 					auto &haveSent = sessionData->haveSentMap();
 					haveSent.insert(msgId, toSendRequest);
 
 					if (needsLayer && !toSendRequest->needsLayer) needsLayer = false;
+					const auto packable = PackableRequest(toSendRequest);
 					if (toSendRequest->after) {
 						const auto toSendSize = toSendRequest.innerLength() >> 2;
 						auto wrappedRequest = SecureRequest::Prepare(
@@ -923,10 +976,21 @@ void ConnectionPrivate::tryToSend() {
 						memcpy(wrappedRequest->data() + wrappedRequest->size() - noWrapSize, toSendRequest->constData() + 8, noWrapSize * sizeof(mtpPrime));
 						toSendRequest = std::move(wrappedRequest);
 					}
+					if (packable) {
+						// haveSent keeps the original, we send a packed copy.
+						const auto body = toSendRequest->constData() + 8;
+						const auto packed = gzip(body, body + (toSendRequest.innerLength() >> 2));
+						if (!packed.isEmpty()) {
+							auto packedRequest = SecureRequest::Prepare(packed.size());
+							memcpy(packedRequest->data(), toSendRequest->constData(), 7 * sizeof(mtpPrime)); // all except length
+							packedRequest->resize(packedRequest->size() + packed.size());
+							memcpy(packedRequest->data() + 8, packed.constData(), packed.size() * sizeof(mtpPrime));
+							toSendRequest = std::move(packedRequest);
+						}
+					}
 
 					needAnyResponse = true;
 				} else {
-					QWriteLocker locker3(sessionData->wereAckedMutex());
 					sessionData->wereAckedMap().insert(msgId, toSendRequest->requestId);
 				}
 			}
@@ -961,12 +1025,7 @@ void ConnectionPrivate::tryToSend() {
 
 			mtpMsgId bigMsgId = msgid(); // check for a valid container
 
-			// the fact of this lock is used in replaceMsgId()
-			QWriteLocker locker2(sessionData->haveSentMutex());
 			auto &haveSent = sessionData->haveSentMap();
-
-			// the fact of this lock is used in replaceMsgId()
-			QWriteLocker locker3(sessionData->wereAckedMutex());
 			auto &wereAcked = sessionData->wereAckedMap();
 
 			// prepare "request-like" wrap for msgId vector
@@ -987,10 +1046,12 @@ void ConnectionPrivate::tryToSend() {
 				if (msgId > bigMsgId) msgId = replaceMsgId(req, bigMsgId);
 				if (msgId >= bigMsgId) bigMsgId = msgid();
 				*(haveSentArr++) = msgId;
-				bool added = false;
+				bool added = false, packable = false;
+				const auto from = uint32(toSendRequest->size());
 				if (req->requestId) {
 					if (req.needAck()) {
 						req->msDate = req.isStateRequest() ? 0 : crl::now();
+						packable = PackableRequest(req);
 						int32 reqNeedsLayer = (needsLayer && req->needsLayer) ? toSendRequest->size() : 0;
 						if (req->after) {
 							wrapInvokeAfter(toSendRequest, req, haveSent, reqNeedsLayer ? initSizeInInts : 0);
@@ -1015,10 +1076,22 @@ void ConnectionPrivate::tryToSend() {
 					}
 				}
 				if (!added) {
-					uint32 from = toSendRequest->size(), len = req.messageSize();
+					uint32 len = req.messageSize();
 					toSendRequest->resize(from + len);
 					memcpy(toSendRequest->data() + from, req->constData() + 4, len * sizeof(mtpPrime));
 				}
+				if (packable) {
+					// The message was placed last, its body lasts till the end.
+					const auto body = toSendRequest->constData() + from + 4;
+					const auto packed = gzip(body, toSendRequest->constData() + toSendRequest->size());
+					if (!packed.isEmpty()) {
+						const auto saved = toSendRequest->size() - (from + 4 + packed.size());
+						(*toSendRequest)[7] -= saved * sizeof(mtpPrime); // container length
+						toSendRequest->resize(from + 4 + packed.size());
+						memcpy(toSendRequest->data() + from + 4, packed.constData(), packed.size() * sizeof(mtpPrime));
+						(*toSendRequest)[from + 3] = packed.size() * sizeof(mtpPrime);
+					}
+				}
 			}
 			if (stateRequest) {
 				mtpMsgId msgId = placeToContainer(toSendRequest, bigMsgId, haveSentArr, stateRequest);
@@ -1033,7 +1106,10 @@ void ConnectionPrivate::tryToSend() {
 			*(mtpMsgId*)(haveSentIdsWrap->data() + 4) = contMsgId;
 			(*haveSentIdsWrap)[6] = 0; // for container, msDate = 0, seqNo = 0
 			haveSent.insert(contMsgId, haveSentIdsWrap);
-			toSend.clear();
+			if (!prependOnly) {
+				toSend.clear();
+				sessionData->markToSendSent();
+			}
 		}
 	}
 	sendSecureRequest(
@@ -1240,7 +1316,9 @@ void ConnectionPrivate::onSentSome(uint64 size) {
 		if (isUploadDcId(_shiftedDcId)) {
 			remain *= kUploadSessionsCount;
 		} else if (isDownloadDcId(_shiftedDcId)) {
-			remain *= kDownloadSessionsCount;
+			// The downloader may open more sessions in a dc, they all
+			// share the bandwidth, so expect the slowest case here.
+			remain *= kMaxDownloadSessionsCount;
 		}
 		_waitForReceivedTimer.callOnce(remain);
 	}
@@ -1290,6 +1368,61 @@ void ConnectionPrivate::sendPingByTimer() {
 	}
 }
 
+void ConnectionPrivate::checkSentRequests() {
+	QReadLocker lockFinished(&sessionDataMutex);
+	if (!sessionData) return;
+
+	// Apply the cancels queued by the main thread before resending.
+	sessionData->takeQueuedToSend();
+
+	QVector<mtpMsgId> resendingIds;
+	QVector<mtpMsgId> removingIds; // remove very old (10 minutes) containers and resend requests
+	QVector<mtpMsgId> stateRequestIds;
+
+	auto &haveSent = sessionData->haveSentMap();
+	const auto now = crl::now();
+	for (const auto msgId : haveSent.takeExpired(now)) {
+		auto &req = haveSent[msgId];
+		if (req->msDate > 0) { // need to resend or check state
+			if (req.messageSize() < kResendThreshold) { // resend
+				resendingIds.push_back(msgId);
+			} else {
+				req->msDate = now;
+				haveSent.reschedule(msgId);
+				stateRequestIds.push_back(msgId);
+			}
+		} else {
+			removingIds.push_back(msgId);
+		}
+	}
+
+	if (!stateRequestIds.isEmpty()) {
+		DEBUG_LOG(("MTP Info: requesting state of msgs: %1").arg(LogIds(stateRequestIds)));
+		auto &stateRequest = sessionData->stateRequestMap();
+		for (const auto msgId : stateRequestIds) {
+			stateRequest.insert(msgId, true);
+		}
+		emit sendAnythingAsync(kCheckResendWaiting);
+	}
+	for (const auto msgId : resendingIds) {
+		DEBUG_LOG(("MTP Info: resending request %1").arg(msgId));
+		resendRequest(msgId, kCheckResendWaiting);
+	}
+	if (!removingIds.isEmpty()) {
+		auto clearCallbacks = std::vector<RPCCallbackClear>();
+		for (const auto msgId : removingIds) {
+			const auto i = haveSent.find(msgId);
+			if (i != haveSent.cend()) {
+				if (i.value()->requestId) {
+					clearCallbacks.push_back(i.value()->requestId);
+				}
+				haveSent.erase(i);
+			}
+		}
+		_instance->clearCallbacksDelayed(std::move(clearCallbacks));
+	}
+}
+
 void ConnectionPrivate::onPingSendForce() {
 	if (!_pingId) {
 		_pingSendAt = 0;
@@ -1427,16 +1560,24 @@ void ConnectionPrivate::handleReceived() {
 		auto encryptedInts = ints + kExternalHeaderIntsCount;
 		auto encryptedIntsCount = (intsCount - kExternalHeaderIntsCount) & ~0x03U;
 		auto encryptedBytesCount = encryptedIntsCount * kIntSize;
-		auto decryptedBuffer = QByteArray(encryptedBytesCount, Qt::Uninitialized);
 		auto msgKey = *(MTPint128*)(ints + 2);
 
+		// Everything needed is copied from the decrypted data while
+		// handling it, so the buffer is reused for the next messages.
+		if (_decryptedBuffer.size() < encryptedBytesCount
+			|| (_decryptedBuffer.size() > kKeepDecryptedBufferSize
+				&& encryptedBytesCount <= kKeepDecryptedBufferSize)) {
+			_decryptedBuffer = bytes::vector(encryptedBytesCount);
+		}
+
 #ifdef TDESKTOP_MTPROTO_OLD
-		aesIgeDecrypt_oldmtp(encryptedInts, decryptedBuffer.data(), encryptedBytesCount, key, msgKey);
+		aesIgeDecrypt_oldmtp(encryptedInts, _decryptedBuffer.data(), encryptedBytesCount, key, msgKey);
 #else // TDESKTOP_MTPROTO_OLD
-		aesIgeDecrypt(encryptedInts, decryptedBuffer.data(), encryptedBytesCount, key, msgKey);
+		std::array<uchar, 32> sha256Buffer = { { 0 } };
+		aesIgeDecryptWithMsgKeyHash(encryptedInts, _decryptedBuffer.data(), encryptedBytesCount, key, msgKey, sha256Buffer.data());
 #endif // TDESKTOP_MTPROTO_OLD
 
-		auto decryptedInts = reinterpret_cast<const mtpPrime*>(decryptedBuffer.constData());
+		auto decryptedInts = reinterpret_cast<const mtpPrime*>(_decryptedBuffer.data());
 		auto serverSalt = *(uint64*)&decryptedInts[0];
 		auto session = *(uint64*)&decryptedInts[2];
 		auto msgId = *(uint64*)&decryptedInts[4];
@@ -1476,14 +1617,6 @@ void ConnectionPrivate::handleReceived() {
 		constexpr auto kMaxPaddingSize = 1024U;
 		auto badMessageLength = (paddingSize < kMinPaddingSize || paddingSize > kMaxPaddingSize);
 
-		std::array<uchar, 32> sha256Buffer = { { 0 } };
-
-		SHA256_CTX msgKeyLargeContext;
-		SHA256_Init(&msgKeyLargeContext);
-		SHA256_Update(&msgKeyLargeContext, key->partForMsgKey(false), 32);
-		SHA256_Update(&msgKeyLargeContext, decryptedInts, encryptedBytesCount);
-		SHA256_Final(sha256Buffer.data(), &msgKeyLargeContext);
-
 		constexpr auto kMsgKeyShift = 8U;
 		if (memcmp(&msgKey, sha256Buffer.data() + kMsgKeyShift, sizeof(msgKey)) != 0) {
 			LOG(("TCP Error: bad SHA256 hash after aesDecrypt in message"));
@@ -1551,18 +1684,11 @@ void ConnectionPrivate::handleReceived() {
 		auto sfrom = decryptedInts + 4U; // msg_id + seq_no + length + message
 		MTP_LOG(_shiftedDcId, ("Recv: ") + mtpTextSerialize(sfrom, end));
 
-		bool needToHandle = false;
-		{
-			QWriteLocker lock(sessionData->receivedIdsMutex());
-			needToHandle = sessionData->receivedIdsSet().registerMsgId(msgId, needAck);
-		}
+		const auto needToHandle = sessionData->receivedIdsSet().registerMsgId(msgId, needAck);
 		if (needToHandle) {
 			res = handleOneReceived(from, end, msgId, serverTime, serverSalt, badTime);
 		}
-		{
-			QWriteLocker lock(sessionData->receivedIdsMutex());
-			sessionData->receivedIdsSet().shrink();
-		}
+		sessionData->receivedIdsSet().shrink();
 
 		// send acks
 		uint32 toAckSize = ackRequestData.size();
@@ -1571,16 +1697,8 @@ void ConnectionPrivate::handleReceived() {
 			emit sendAnythingAsync(kAckSendWaiting);
 		}
 
-		bool emitSignal = false;
-		{
-			QReadLocker locker(sessionData->haveReceivedMutex());
-			emitSignal = !sessionData->haveReceivedResponses().isEmpty() || !sessionData->haveReceivedUpdates().isEmpty();
-			if (emitSignal) {
-				DEBUG_LOG(("MTP Info: emitting needToReceive() - need to parse in another thread, %1 responses, %2 updates.").arg(sessionData->haveReceivedResponses().size()).arg(sessionData->haveReceivedUpdates().size()));
-			}
-		}
-
-		if (emitSignal) {
+		if (const auto queued = sessionData->takeReceivedQueuedCount()) {
+			DEBUG_LOG(("MTP Info: emitting needToReceive() - need to parse in another thread, %1 responses and updates.").arg(queued));
 			emit needToReceive();
 		}
 
@@ -1658,11 +1776,7 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 			otherEnd = from + (bytes.v >> 2);
 			if (otherEnd > end) throw mtpErrorInsufficient();
 
-			bool needToHandle = false;
-			{
-				QWriteLocker lock(sessionData->receivedIdsMutex());
-				needToHandle = sessionData->receivedIdsSet().registerMsgId(inMsgId.v, needAck);
-			}
+			const auto needToHandle = sessionData->receivedIdsSet().registerMsgId(inMsgId.v, needAck);
 			auto res = HandleResult::Success; // if no need to handle, then succeed
 			if (needToHandle) {
 				res = handleOneReceived(from, otherEnd, inMsgId.v, serverTime, serverSalt, badTime);
@@ -1720,7 +1834,6 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 				if (Logs::DebugEnabled()) {
 					SecureRequest request;
 					{
-						QWriteLocker locker(sessionData->haveSentMutex());
 						auto &haveSent = sessionData->haveSentMap();
 
 						const auto i = haveSent.constFind(resendId);
@@ -1837,12 +1950,10 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 
 		QByteArray info(idsCount, Qt::Uninitialized);
 		{
-			QReadLocker lock(sessionData->receivedIdsMutex());
 			auto &receivedIds = sessionData->receivedIdsSet();
 			auto minRecv = receivedIds.min();
 			auto maxRecv = receivedIds.max();
 
-			QReadLocker locker(sessionData->wereAckedMutex());
 			const auto &wereAcked = sessionData->wereAckedMap();
 			const auto wereAckedEnd = wereAcked.cend();
 
@@ -1886,7 +1997,6 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 		DEBUG_LOG(("Message Info: msg state received, msgId %1, reqMsgId: %2, HEX states %3").arg(msgId).arg(reqMsgId).arg(Logs::mb(states.data(), states.length()).str()));
 		SecureRequest requestBuffer;
 		{ // find this request in session-shared sent requests map
-			QReadLocker locker(sessionData->haveSentMutex());
 			const auto &haveSent = sessionData->haveSentMap();
 			const auto replyTo = haveSent.constFind(reqMsgId);
 			if (replyTo == haveSent.cend()) { // do not look in toResend, because we do not resend msgs_state_req requests
@@ -1967,12 +2077,8 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 		}
 		requestsAcked(ids);
 
-		bool received = false;
 		MTPlong resMsgId = data.vanswer_msg_id;
-		{
-			QReadLocker lock(sessionData->receivedIdsMutex());
-			received = (sessionData->receivedIdsSet().lookup(resMsgId.v) != ReceivedMsgIds::State::NotFound);
-		}
+		const auto received = (sessionData->receivedIdsSet().lookup(resMsgId.v) != ReceivedMsgIds::State::NotFound);
 		if (received) {
 			ackRequestData.push_back(resMsgId);
 		} else {
@@ -1992,12 +2098,8 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 
 		DEBUG_LOG(("Message Info: msg new detailed info, answerId %2, status %3, bytes %4").arg(data.vanswer_msg_id.v).arg(data.vstatus.v).arg(data.vbytes.v));
 
-		bool received = false;
 		MTPlong resMsgId = data.vanswer_msg_id;
-		{
-			QReadLocker lock(sessionData->receivedIdsMutex());
-			received = (sessionData->receivedIdsSet().lookup(resMsgId.v) != ReceivedMsgIds::State::NotFound);
-		}
+		const auto received = (sessionData->receivedIdsSet().lookup(resMsgId.v) != ReceivedMsgIds::State::NotFound);
 		if (received) {
 			ackRequestData.push_back(resMsgId);
 		} else {
@@ -2066,9 +2168,14 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 
 		auto requestId = wasSent(reqMsgId.v);
 		if (requestId && requestId != mtpRequestId(0xFFFFFFFF)) {
+			auto parsed = (typeId != mtpc_rpc_error)
+				? ParseReceived(_instance->responseParser(requestId), response)
+				: nullptr;
+
 			// Save rpc_result for processing in the main thread.
-			QWriteLocker locker(sessionData->haveReceivedMutex());
-			sessionData->haveReceivedResponses().insert(requestId, response);
+			sessionData->queueReceivedResponse(
+				requestId,
+				{ std::move(response), std::move(parsed) });
 		} else {
 			DEBUG_LOG(("RPC Info: requestId not found for msgId %1").arg(reqMsgId.v));
 		}
@@ -2095,22 +2202,23 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 		mtpMsgId firstMsgId = data.vfirst_msg_id.v;
 		QVector<quint64> toResend;
 		{
-			QReadLocker locker(sessionData->haveSentMutex());
 			const auto &haveSent = sessionData->haveSentMap();
 			toResend.reserve(haveSent.size());
 			for (auto i = haveSent.cbegin(), e = haveSent.cend(); i != e; ++i) {
-				if (i.key() >= firstMsgId) break;
+				if (i.key() >= firstMsgId) continue;
 				if (i.value()->requestId) toResend.push_back(i.key());
 			}
 		}
+
+		// haveSent is not ordered by msgId, resend in the original order.
+		ranges::sort(toResend);
 		resendMany(toResend, 10, true);
 
 		mtpBuffer update(from - start);
 		if (from > start) memcpy(update.data(), start, (from - start) * sizeof(mtpPrime));
 
 		// Notify main process about new session - need to get difference.
-		QWriteLocker locker(sessionData->haveReceivedMutex());
-		sessionData->haveReceivedUpdates().push_back(SerializedMessage(update));
+		sessionData->queueReceivedUpdate({ std::move(update) });
 		DEBUG_LOG(("new_session_created : %1").arg(_connection->peerName()));
 	} return HandleResult::Success;
 
@@ -2166,9 +2274,14 @@ ConnectionPrivate::HandleResult ConnectionPrivate::handleOneReceived(const mtpPr
 		mtpBuffer update(end - from);
 		if (end > from) memcpy(update.data(), from, (end - from) * sizeof(mtpPrime));
 
+		// Updates are handled only in the main session.
+		auto parsed = (_shiftedDcId == BareDcId(_shiftedDcId))
+			? ParseReceived(_instance->updatesParser(), update)
+			: nullptr;
+
 		// Notify main process about the new updates.
-		QWriteLocker locker(sessionData->haveReceivedMutex());
-		sessionData->haveReceivedUpdates().push_back(SerializedMessage(update));
+		sessionData->queueReceivedUpdate(
+			{ std::move(update), std::move(parsed) });
 
 		if (cons != mtpc_updatesTooLong
 			&& cons != mtpc_updateShortMessage
@@ -2236,6 +2349,49 @@ mtpBuffer ConnectionPrivate::ungzip(const mtpPrime *from, const mtpPrime *end) c
 	return result;
 }
 
+mtpBuffer ConnectionPrivate::gzip(const mtpPrime *from, const mtpPrime *end) const {
+	const auto unpackedLen = int(end - from) * kIntSize;
+	if (unpackedLen < kPackMinLength) {
+		return mtpBuffer();
+	}
+
+	// Constructor and string length with padding are added to the packed data.
+	const auto wrapLen = 3 * kIntSize;
+	const auto maxPackedLen = unpackedLen * kPackMaxPart / kPackParts - wrapLen;
+
+	auto packed = QByteArray(maxPackedLen, Qt::Uninitialized);
+	z_stream stream;
+	stream.zalloc = 0;
+	stream.zfree = 0;
+	stream.opaque = 0;
+	int res = deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+	if (res != Z_OK) {
+		LOG(("RPC Error: could not init zlib stream, code: %1").arg(res));
+		return mtpBuffer();
+	}
+	stream.avail_in = unpackedLen;
+	stream.next_in = (Bytef*)from;
+	stream.avail_out = maxPackedLen;
+	stream.next_out = (Bytef*)packed.data();
+
+	// Not finished in the limited output means the result is too large.
+	res = deflate(&stream, Z_FINISH);
+	deflateEnd(&stream);
+	if (res != Z_STREAM_END) {
+		return mtpBuffer();
+	}
+	packed.resize(maxPackedLen - stream.avail_out);
+
+	auto result = mtpBuffer();
+	result.reserve(packed.size() / kIntSize + 3);
+	result.push_back(mtpc_gzip_packed);
+	MTP_bytes(packed).write(result);
+
+	const auto packedLen = result.size() * kIntSize;
+	sessionData->notifyRequestPacked(unpackedLen, packedLen);
+	return result;
+}
+
 bool ConnectionPrivate::requestsFixTimeSalt(const QVector<MTPlong> &ids, int32 serverTime, uint64 serverSalt) {
 	uint32 idsCount = ids.size();
 
@@ -2257,11 +2413,9 @@ void ConnectionPrivate::requestsAcked(const QVector<MTPlong> &ids, bool byRespon
 	auto clearedBecauseTooOld = std::vector<RPCCallbackClear>();
 	QVector<MTPlong> toAckMore;
 	{
-		QWriteLocker locker1(sessionData->wereAckedMutex());
 		auto &wereAcked = sessionData->wereAckedMap();
 
 		{
-			QWriteLocker locker2(sessionData->haveSentMutex());
 			auto &haveSent = sessionData->haveSentMap();
 
 			for (uint32 i = 0; i < idsCount; ++i) {
@@ -2292,7 +2446,6 @@ void ConnectionPrivate::requestsAcked(const QVector<MTPlong> &ids, bool byRespon
 					}
 				} else {
 					DEBUG_LOG(("Message Info: msgId %1 was not found in recent sent, while acking requests, searching in resend...").arg(msgId));
-					QWriteLocker locker3(sessionData->toResendMutex());
 					auto &toResend = sessionData->toResendMap();
 					const auto reqIt = toResend.find(msgId);
 					if (reqIt != toResend.cend()) {
@@ -2302,7 +2455,7 @@ void ConnectionPrivate::requestsAcked(const QVector<MTPlong> &ids, bool byRespon
 							moveToAcked = !_instance->hasCallbacks(reqId);
 						}
 						if (moveToAcked) {
-							QWriteLocker locker4(sessionData->toSendMutex());
+							sessionData->takeQueuedToSend();
 							auto &toSend = sessionData->toSendMap();
 							const auto req = toSend.find(reqId);
 							if (req != toSend.cend()) {
@@ -2366,12 +2519,10 @@ void ConnectionPrivate::handleMsgsStates(const QVector<MTPlong> &ids, const QByt
 		char state = states[i];
 		uint64 requestMsgId = ids[i].v;
 		{
-			QReadLocker locker(sessionData->haveSentMutex());
 			const auto &haveSent = sessionData->haveSentMap();
 			const auto haveSentEnd = haveSent.cend();
 			if (haveSent.find(requestMsgId) == haveSentEnd) {
 				DEBUG_LOG(("Message Info: state was received for msgId %1, but request is not found, looking in resent requests...").arg(requestMsgId));
-				QWriteLocker locker2(sessionData->toResendMutex());
 				auto &toResend = sessionData->toResendMap();
 				const auto reqIt = toResend.find(requestMsgId);
 				if (reqIt != toResend.cend()) {
@@ -2397,6 +2548,76 @@ void ConnectionPrivate::handleMsgsStates(const QVector<MTPlong> &ids, const QByt
 	}
 }
 
+void ConnectionPrivate::onResend(quint64 msgId, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo) {
+	QReadLocker lockFinished(&sessionDataMutex);
+	if (!sessionData) return;
+
+	sessionData->takeQueuedToSend();
+	resendRequest(msgId, msCanWait, forceContainer, sendMsgStateInfo);
+}
+
+void ConnectionPrivate::onResendMany(QVector<quint64> msgIds, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo) {
+	QReadLocker lockFinished(&sessionDataMutex);
+	if (!sessionData) return;
+
+	sessionData->takeQueuedToSend();
+	for (const auto msgId : msgIds) {
+		resendRequest(msgId, msCanWait, forceContainer, sendMsgStateInfo);
+	}
+}
+
+void ConnectionPrivate::onResendAll() {
+	QReadLocker lockFinished(&sessionDataMutex);
+	if (!sessionData) return;
+
+	sessionData->takeQueuedToSend();
+	QVector<mtpMsgId> toResend;
+	const auto &haveSent = sessionData->haveSentMap();
+	toResend.reserve(haveSent.size());
+	for (auto i = haveSent.cbegin(), e = haveSent.cend(); i != e; ++i) {
+		if (i.value()->requestId) {
+			toResend.push_back(i.key());
+		}
+	}
+
+	// haveSent is not ordered by msgId, resend in the original order.
+	ranges::sort(toResend);
+	for (const auto msgId : toResend) {
+		resendRequest(msgId, 10, true);
+	}
+}
+
+void ConnectionPrivate::resendRequest(
+		mtpMsgId msgId,
+		crl::time msCanWait,
+		bool forceContainer,
+		bool sendMsgStateInfo) {
+	auto &haveSent = sessionData->haveSentMap();
+	const auto i = haveSent.find(msgId);
+	if (i == haveSent.end()) {
+		if (sendMsgStateInfo) {
+			DEBUG_LOG(("Message Info: cant resend %1, request not found").arg(msgId));
+			emit sendMsgsStateInfoAsync(msgId, QByteArray(1, 1));
+		}
+		return;
+	}
+	const auto request = i.value();
+	haveSent.erase(i);
+
+	if (request.isSentContainer()) { // for container just resend all messages we can
+		DEBUG_LOG(("Message Info: resending container from haveSent, msgId %1").arg(msgId));
+		const mtpMsgId *ids = (const mtpMsgId *)(request->constData() + 8);
+		for (uint32 j = 0, l = (request->size() - 8) >> 1; j < l; ++j) {
+			resendRequest(ids[j], 10, true);
+		}
+	} else if (!request.isStateRequest()) {
+		request->msDate = forceContainer ? 0 : crl::now();
+		sessionData->toSendMap().insert(request->requestId, request);
+		sessionData->toResendMap().insert(msgId, request->requestId);
+		emit sendAnythingAsync(msCanWait);
+	}
+}
+
 void ConnectionPrivate::resend(quint64 msgId, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo) {
 	if (msgId == _pingMsgId) return;
 	emit resendAsync(msgId, msCanWait, forceContainer, sendMsgStateInfo);
@@ -3195,7 +3416,6 @@ bool ConnectionPrivate::sendSecureRequest(
 mtpRequestId ConnectionPrivate::wasSent(mtpMsgId msgId) const {
 	if (msgId == _pingMsgId) return mtpRequestId(0xFFFFFFFF);
 	{
-		QReadLocker locker(sessionData->haveSentMutex());
 		const auto &haveSent = sessionData->haveSentMap();
 		const auto i = haveSent.constFind(msgId);
 		if (i != haveSent.cend()) {
@@ -3205,13 +3425,11 @@ mtpRequestId ConnectionPrivate::wasSent(mtpMsgId msgId) const {
 		}
 	}
 	{
-		QReadLocker locker(sessionData->toResendMutex());
 		const auto &toResend = sessionData->toResendMap();
 		const auto i = toResend.constFind(msgId);
 		if (i != toResend.cend()) return i.value();
 	}
 	{
-		QReadLocker locker(sessionData->wereAckedMutex());
 		const auto &wereAcked = sessionData->wereAckedMap();
 		const auto i = wereAcked.constFind(msgId);
 		if (i != wereAcked.cend()) return i.value();
@@ -141,6 +141,11 @@ public slots:
 	// Sessions signals, when we need to send something
 	void tryToSend();
 
+	// Sent requests are resent from the connection thread, it owns them.
+	void onResend(quint64 msgId, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo);
+	void onResendMany(QVector<quint64> msgIds, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo);
+	void onResendAll(); // after connection restart
+
 	void updateAuthKey();
 
 	void onConfigLoaded();
@@ -169,6 +174,7 @@ private:
 	void waitBetterFailed();
 	void markConnectionOld();
 	void sendPingByTimer();
+	void checkSentRequests();
 
 	void destroyAllConnections();
 	void confirmBestConnection();
@@ -197,6 +203,10 @@ private:
 	};
 	HandleResult handleOneReceived(const mtpPrime *from, const mtpPrime *end, uint64 msgId, int32 serverTime, uint64 serverSalt, bool badTime);
 	mtpBuffer ungzip(const mtpPrime *from, const mtpPrime *end) const;
+
+	// Serialized gzip_packed with the [from, end) body or an empty buffer
+	// if the body is too small or doesn't compress well enough.
+	mtpBuffer gzip(const mtpPrime *from, const mtpPrime *end) const;
 	void handleMsgsStates(const QVector<MTPlong> &ids, const QByteArray &states, QVector<MTPlong> &acked);
 
 	void clearMessages();
@@ -217,6 +227,11 @@ private:
 	// remove msgs with such ids from sessionData->haveSent, add to sessionData->wereAcked
 	void requestsAcked(const QVector<MTPlong> &ids, bool byResponse = false);
 
+	void resendRequest(
+		mtpMsgId msgId,
+		crl::time msCanWait,
+		bool forceContainer = false,
+		bool sendMsgStateInfo = false);
 	void resend(quint64 msgId, qint64 msCanWait = 0, bool forceContainer = false, bool sendMsgStateInfo = false);
 	void resendMany(QVector<quint64> msgIds, qint64 msCanWait = 0, bool forceContainer = false, bool sendMsgStateInfo = false);
 
@@ -262,6 +277,7 @@ private:
 	crl::time _pingSendAt = 0;
 	mtpMsgId _pingMsgId = 0;
 	base::Timer _pingSender;
+	base::Timer _checkSentRequestsTimer;
 
 	bool restarted = false;
 	bool _finished = false;
@@ -270,6 +286,7 @@ private:
 	QReadWriteLock sessionDataMutex;
 	SessionData *sessionData = nullptr;
 	std::unique_ptr<ConnectionOptions> _connectionOptions;
+	bytes::vector _decryptedBuffer;
 
 	bool myKeyLock = false;
 	void lockKey();
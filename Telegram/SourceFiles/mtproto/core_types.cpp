@@ -7,6 +7,9 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 */
 #include "mtproto/core_types.h"
 
+#include "logs.h"
+#include "base/openssl_help.h"
+
 #include "zlib.h"
 
 namespace MTP {
@@ -29,7 +32,9 @@ uint32 CountPaddingAmountInInts(uint32 requestSize, bool extended) {
 
 	if (extended) {
 		// Some more random padding.
-		result += ((rand_value<uchar>() & 0x0F) << 2);
+		auto random = uchar();
+		bytes::set_random(bytes::make_span(&random, 1));
+		result += ((random & 0x0F) << 2);
 	}
 
 	return result;
@@ -96,9 +101,9 @@ void SecureRequest::addPadding(bool extended) {
 	if (uint32(_data->size()) != fullSize) {
 		_data->resize(fullSize);
 		if (padding > 0) {
-			memset_rand(
+			bytes::set_random(bytes::make_span(
 				_data->data() + (fullSize - padding),
-				padding * sizeof(mtpPrime));
+				padding));
 		}
 	}
 }
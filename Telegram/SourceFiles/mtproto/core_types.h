@@ -857,3 +857,41 @@ inline QString mtpTextSerialize(const mtpPrime *&from, const mtpPrime *end) {
 	}
 	return QString::fromUtf8(to.p, to.size);
 }
+
+class RPCParsedResponse;
+using RPCParsedResponsePtr = std::shared_ptr<RPCParsedResponse>;
+
+// Called on the connection thread, may throw like TL read() methods.
+using RPCResponseParser = RPCParsedResponsePtr(*)(const mtpPrime *from, const mtpPrime *end);
+
+template <typename TResponse>
+RPCParsedResponsePtr RPCParseResponse(const mtpPrime *from, const mtpPrime *end);
+
+class RPCParsedResponse { // response parsed off the main thread
+public:
+	explicit RPCParsedResponse(RPCResponseParser parser) : parser(parser) {
+	}
+	virtual ~RPCParsedResponse() {
+	}
+
+	// Handlers accept only the objects produced by their own parser.
+	const RPCResponseParser parser = nullptr;
+
+};
+
+template <typename TResponse>
+class RPCParsed final : public RPCParsedResponse {
+public:
+	RPCParsed() : RPCParsedResponse(&RPCParseResponse<TResponse>) {
+	}
+
+	TResponse data;
+
+};
+
+template <typename TResponse>
+RPCParsedResponsePtr RPCParseResponse(const mtpPrime *from, const mtpPrime *end) {
+	auto result = std::make_shared<RPCParsed<TResponse>>();
+	result->data.read(from, end);
+	return result;
+}
@@ -57,5 +57,17 @@ void Dcenter::destroyKey() {
 	setKey(AuthKeyPtr());
 }
 
+void Dcenter::addPackedRequest(int originalSize, int packedSize) {
+	QMutexLocker lock(&packedLock);
+	++_packedStats.requests;
+	_packedStats.originalBytes += originalSize;
+	_packedStats.packedBytes += packedSize;
+}
+
+Dcenter::PackedStats Dcenter::packedStats() const {
+	QMutexLocker lock(&packedLock);
+	return _packedStats;
+}
+
 } // namespace internal
 } // namespace MTP
@@ -35,6 +35,19 @@ public:
 		_connectionInited = connectionInited;
 	}
 
+	// Outgoing requests sent in gzip_packed, from all sessions of this dc.
+	struct PackedStats {
+		int64 requests = 0;
+		int64 originalBytes = 0;
+		int64 packedBytes = 0;
+
+		int64 savedBytes() const {
+			return originalBytes - packedBytes;
+		}
+	};
+	void addPackedRequest(int originalSize, int packedSize);
+	PackedStats packedStats() const;
+
 signals:
 	void authKeyCreated();
 	void connectionWasInited();
@@ -45,10 +58,12 @@ private slots:
 private:
 	mutable QReadWriteLock keyLock;
 	mutable QMutex initLock;
+	mutable QMutex packedLock;
 	not_null<Instance*> _instance;
 	DcId _id = 0;
 	AuthKeyPtr _key;
 	bool _connectionInited = false;
+	PackedStats _packedStats;
 
 };
 
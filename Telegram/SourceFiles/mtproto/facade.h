@@ -61,10 +61,13 @@ constexpr ShiftedDcId updaterDcId(DcId dcId) {
 constexpr auto kDownloadSessionsCount = 2;
 constexpr auto kUploadSessionsCount = 2;
 
+// Storage::Downloader opens more sessions when bandwidth allows.
+constexpr auto kMaxDownloadSessionsCount = 4;
+
 namespace internal {
 
 constexpr ShiftedDcId downloadDcId(DcId dcId, int index) {
-	static_assert(kDownloadSessionsCount < kMaxMediaDcCount, "Too large MTPDownloadSessionsCount!");
+	static_assert(kMaxDownloadSessionsCount < kMaxMediaDcCount, "Too large MTPDownloadSessionsCount!");
 	return ShiftDcId(dcId, kBaseDownloadDcShift + index);
 };
 
@@ -72,12 +75,12 @@ constexpr ShiftedDcId downloadDcId(DcId dcId, int index) {
 
 // send(req, callbacks, MTP::downloadDcId(dc, index)) - for download shifted dc id
 inline ShiftedDcId downloadDcId(DcId dcId, int index) {
-	Expects(index >= 0 && index < kDownloadSessionsCount);
+	Expects(index >= 0 && index < kMaxDownloadSessionsCount);
 	return internal::downloadDcId(dcId, index);
 }
 
 inline constexpr bool isDownloadDcId(ShiftedDcId shiftedDcId) {
-	return (shiftedDcId >= internal::downloadDcId(0, 0)) && (shiftedDcId < internal::downloadDcId(0, kDownloadSessionsCount - 1) + kDcShift);
+	return (shiftedDcId >= internal::downloadDcId(0, 0)) && (shiftedDcId < internal::downloadDcId(0, kMaxDownloadSessionsCount - 1) + kDcShift);
 }
 
 inline bool isCdnDc(MTPDdcOption::Flags flags) {
@@ -97,9 +97,11 @@ public:
 		RPCResponseHandler &&callbacks);
 	SecureRequest getRequest(mtpRequestId requestId);
 	void clearCallbacksDelayed(std::vector<RPCCallbackClear> &&ids);
-	void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end);
+	void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end, const RPCParsedResponsePtr &parsed);
 	bool hasCallbacks(mtpRequestId requestId);
-	void globalCallback(const mtpPrime *from, const mtpPrime *end);
+	void globalCallback(const mtpPrime *from, const mtpPrime *end, const RPCParsedResponsePtr &parsed);
+	RPCResponseParser responseParser(mtpRequestId requestId);
+	RPCResponseParser updatesParser();
 
 	void onStateChange(ShiftedDcId shiftedDcId, int32 state);
 	void onSessionReset(ShiftedDcId shiftedDcId);
@@ -859,6 +861,14 @@ void Instance::Private::configLoadDone(const MTPConfig &result) {
 						}
 						else {
 							Global::SetCdnDownLoadPreifx(object.value(cdn_prefix_key).toString());
+						}
+						const auto parallel_parts = object.value(qsl("cdn_upload_parallel_parts"));
+						if (parallel_parts.isDouble()) {
+							Global::SetCdnUploadParallelParts(parallel_parts.toInt());
+						}
+						const auto parallel_files = object.value(qsl("cdn_upload_parallel_files"));
+						if (parallel_files.isDouble()) {
+							Global::SetCdnUploadParallelFiles(parallel_files.toInt());
 						}});
 				}
 			} catch (...) {
@@ -1091,7 +1101,8 @@ void Instance::Private::clearCallbacks(
 void Instance::Private::execCallback(
 		mtpRequestId requestId,
 		const mtpPrime *from,
-		const mtpPrime *end) {
+		const mtpPrime *end,
+		const RPCParsedResponsePtr &parsed) {
 	RPCResponseHandler h;
 	{
 		QMutexLocker locker(&_parserMapLock);
@@ -1119,6 +1130,13 @@ void Instance::Private::execCallback(
 		};
 
 		try {
+			if (parsed
+				&& h.onDone
+				&& h.onDone->parser() == parsed->parser) {
+				h.onDone->handleParsed(requestId, parsed);
+				unregisterRequest(requestId);
+				return;
+			}
 			if (from >= end) throw mtpErrorInsufficient();
 			if (*from == mtpc_rpc_error) {
 				auto error = MTPRpcError();
@@ -1147,12 +1165,34 @@ bool Instance::Private::hasCallbacks(mtpRequestId requestId) {
 	return (it != _parserMap.cend());
 }
 
-void Instance::Private::globalCallback(const mtpPrime *from, const mtpPrime *end) {
-	if (_globalHandler.onDone) {
-		(*_globalHandler.onDone)(0, from, end); // some updates were received
+void Instance::Private::globalCallback(
+		const mtpPrime *from,
+		const mtpPrime *end,
+		const RPCParsedResponsePtr &parsed) {
+	const auto &handler = _globalHandler.onDone;
+	if (!handler) {
+		return;
+	} else if (parsed && handler->parser() == parsed->parser) {
+		handler->handleParsed(0, parsed);
+	} else {
+		(*handler)(0, from, end); // some updates were received
 	}
 }
 
+RPCResponseParser Instance::Private::responseParser(
+		mtpRequestId requestId) {
+	QMutexLocker locker(&_parserMapLock);
+	const auto i = _parserMap.find(requestId);
+	return (i != _parserMap.end() && i->second.onDone)
+		? i->second.onDone->parser()
+		: nullptr;
+}
+
+RPCResponseParser Instance::Private::updatesParser() {
+	QMutexLocker locker(&_parserMapLock);
+	return _globalHandler.onDone ? _globalHandler.onDone->parser() : nullptr;
+}
+
 void Instance::Private::onStateChange(int32 dcWithShift, int32 state) {
 	if (_stateChangedHandler) {
 		_stateChangedHandler(dcWithShift, state);
@@ -1557,7 +1597,9 @@ void Instance::Private::completedKeyDestroy(ShiftedDcId shiftedDcId) {
 }
 
 void Instance::Private::setUpdatesHandler(RPCDoneHandlerPtr onDone) {
-	_globalHandler.onDone = onDone;
+	// The parser of the handler is used from the connection threads.
+	QMutexLocker locker(&_parserMapLock);
+	std::swap(_globalHandler.onDone, onDone);
 }
 
 void Instance::Private::setGlobalFailHandler(RPCFailHandlerPtr onFail) {
@@ -1768,16 +1810,24 @@ void Instance::clearCallbacksDelayed(std::vector<RPCCallbackClear> &&ids) {
 	_private->clearCallbacksDelayed(std::move(ids));
 }
 
-void Instance::execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) {
-	_private->execCallback(requestId, from, end);
+void Instance::execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end, const RPCParsedResponsePtr &parsed) {
+	_private->execCallback(requestId, from, end, parsed);
 }
 
 bool Instance::hasCallbacks(mtpRequestId requestId) {
 	return _private->hasCallbacks(requestId);
 }
 
-void Instance::globalCallback(const mtpPrime *from, const mtpPrime *end) {
-	_private->globalCallback(from, end);
+void Instance::globalCallback(const mtpPrime *from, const mtpPrime *end, const RPCParsedResponsePtr &parsed) {
+	_private->globalCallback(from, end, parsed);
+}
+
+RPCResponseParser Instance::responseParser(mtpRequestId requestId) {
+	return _private->responseParser(requestId);
+}
+
+RPCResponseParser Instance::updatesParser() {
+	return _private->updatesParser();
 }
 
 bool Instance::rpcErrorOccured(mtpRequestId requestId, const RPCFailHandlerPtr &onFail, const RPCError &err) {
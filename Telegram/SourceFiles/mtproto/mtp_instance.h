@@ -165,9 +165,13 @@ public:
 
 	void clearCallbacksDelayed(std::vector<RPCCallbackClear> &&ids);
 
-	void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end);
+	void execCallback(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end, const RPCParsedResponsePtr &parsed = nullptr);
 	bool hasCallbacks(mtpRequestId requestId);
-	void globalCallback(const mtpPrime *from, const mtpPrime *end);
+	void globalCallback(const mtpPrime *from, const mtpPrime *end, const RPCParsedResponsePtr &parsed = nullptr);
+
+	// Thread safe.
+	RPCResponseParser responseParser(mtpRequestId requestId);
+	RPCResponseParser updatesParser();
 
 	// return true if need to clean request data
 	bool rpcErrorOccured(mtpRequestId requestId, const RPCFailHandlerPtr &onFail, const RPCError &err);
@@ -0,0 +1,228 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "catch.hpp"
+
+#include "scheme.h"
+
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+
+#include <chrono>
+#include <thread>
+
+namespace Logs {
+
+// core_types.cpp logs the parsing exceptions, the tests have no log file.
+void writeMain(const QString &v) {
+}
+
+} // namespace Logs
+
+namespace {
+
+const auto DisableBenchmarks = true;
+
+using Clock = std::chrono::steady_clock;
+
+// Directory with raw recorded responses, '*.difference' files hold
+// updates.difference and '*.dialogs' files hold messages.dialogs.
+const auto RecordedPathVariable = "TDESKTOP_RECORDED_RESPONSES";
+
+MTPMessage FakeMessage(int id) {
+	return MTP_message(
+		MTP_flags(MTPDmessage::Flag::f_from_id),
+		MTP_int(id),
+		MTP_int(id % 100 + 1),
+		MTP_peerUser(MTP_int(id % 100 + 1)),
+		MTPMessageFwdHeader(),
+		MTPint(),
+		MTPint(),
+		MTP_int(1500000000 + id),
+		MTP_string(QString("Message text number %1.").arg(id).repeated(4)),
+		MTPMessageMedia(),
+		MTPReplyMarkup(),
+		MTPVector<MTPMessageEntity>(),
+		MTPint(),
+		MTPint(),
+		MTPstring(),
+		MTPlong());
+}
+
+MTPUser FakeUser(int id) {
+	return MTP_user(
+		MTP_flags(MTPDuser::Flag::f_access_hash
+			| MTPDuser::Flag::f_first_name
+			| MTPDuser::Flag::f_username
+			| MTPDuser::Flag::f_photo
+			| MTPDuser::Flag::f_status),
+		MTP_int(id),
+		MTP_long(0x1234567890LL * id),
+		MTP_string(QString("First %1").arg(id)),
+		MTPstring(),
+		MTP_string(QString("user%1").arg(id)),
+		MTPstring(),
+		MTP_userProfilePhotoEmpty(),
+		MTP_userStatusEmpty(),
+		MTPint(),
+		MTPstring(),
+		MTPstring(),
+		MTPstring(),
+		MTPtLVS());
+}
+
+mtpBuffer FakeDifference(int messages) {
+	auto list = QVector<MTPMessage>();
+	list.reserve(messages);
+	for (auto i = 0; i != messages; ++i) {
+		list.push_back(FakeMessage(i + 1));
+	}
+	auto users = QVector<MTPUser>();
+	for (auto i = 0; i != std::min(messages, 100); ++i) {
+		users.push_back(FakeUser(i + 1));
+	}
+	auto result = mtpBuffer();
+	MTP_updates_difference(
+		MTP_vector<MTPMessage>(list),
+		MTP_vector<MTPEncryptedMessage>(),
+		MTP_vector<MTPUpdate>(),
+		MTP_vector<MTPChat>(),
+		MTP_vector<MTPUser>(users),
+		MTP_updates_state(
+			MTP_int(messages),
+			MTP_int(0),
+			MTP_int(1500000000),
+			MTP_int(1),
+			MTP_int(0))).write(result);
+	return result;
+}
+
+mtpBuffer ReadRecorded(const QString &path) {
+	auto file = QFile(path);
+	if (!file.open(QIODevice::ReadOnly)) {
+		return mtpBuffer();
+	}
+	const auto bytes = file.readAll();
+	auto result = mtpBuffer(bytes.size() / sizeof(mtpPrime));
+	memcpy(result.data(), bytes.constData(), result.size() * sizeof(mtpPrime));
+	return result;
+}
+
+int64_t Microseconds(Clock::duration duration) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		duration).count();
+}
+
+// Returns main thread microseconds spent when parsing inline and when
+// receiving an object parsed by another thread, like the connection one.
+// Both include handling the object and destroying it on the main thread,
+// the handler here walks the whole tree to compute its size.
+template <typename TResponse>
+std::pair<int64_t, int64_t> Measure(const mtpBuffer &buffer, int times) {
+	const auto from = buffer.constData();
+	const auto till = from + buffer.size();
+	auto inlineTime = int64_t(0);
+	auto offMainTime = int64_t(0);
+	for (auto i = 0; i != times; ++i) {
+		auto start = Clock::now();
+		{
+			auto result = TResponse();
+			auto cursor = from;
+			result.read(cursor, till);
+			REQUIRE(result.innerLength() == buffer.size() * sizeof(mtpPrime));
+		}
+		inlineTime += Microseconds(Clock::now() - start);
+
+		auto parsed = RPCParsedResponsePtr();
+		std::thread([&] {
+			parsed = RPCParseResponse<TResponse>(from, till);
+		}).join();
+		start = Clock::now();
+		{
+			const auto ready = std::move(parsed);
+			const auto &data = static_cast<const RPCParsed<TResponse>&>(
+				*ready).data;
+			REQUIRE(data.innerLength() == buffer.size() * sizeof(mtpPrime));
+		}
+		offMainTime += Microseconds(Clock::now() - start);
+	}
+	return { inlineTime / times, offMainTime / times };
+}
+
+} // namespace
+
+TEST_CASE("parsing responses off the main thread", "[mtproto_parse]") {
+	const auto buffer = FakeDifference(100);
+	const auto from = buffer.constData();
+	const auto till = from + buffer.size();
+
+	SECTION("parsed object matches the raw response") {
+		auto parsed = RPCParsedResponsePtr();
+		std::thread([&] {
+			parsed = RPCParseResponse<MTPupdates_Difference>(from, till);
+		}).join();
+		REQUIRE(parsed != nullptr);
+		REQUIRE(parsed->parser == &RPCParseResponse<MTPupdates_Difference>);
+
+		const auto &data = static_cast<const RPCParsed<MTPupdates_Difference>&>(
+			*parsed).data;
+		REQUIRE(data.type() == mtpc_updates_difference);
+		REQUIRE(data.c_updates_difference().vnew_messages.v.size() == 100);
+
+		auto serialized = mtpBuffer();
+		data.write(serialized);
+		REQUIRE(serialized == buffer);
+	}
+	SECTION("parsers differ by response type") {
+		REQUIRE(&RPCParseResponse<MTPupdates_Difference>
+			!= &RPCParseResponse<MTPmessages_Dialogs>);
+	}
+	SECTION("bad response throws from the parser") {
+		REQUIRE_THROWS(RPCParseResponse<MTPmessages_Dialogs>(from, till));
+		REQUIRE_THROWS(RPCParseResponse<MTPupdates_Difference>(
+			from,
+			from + buffer.size() / 2));
+	}
+}
+
+TEST_CASE("off main parsing benchmark", "[mtproto_parse]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	const auto kTimes = 20;
+	for (const auto messages : { 100, 1000, 10000 }) {
+		const auto buffer = FakeDifference(messages);
+		const auto [inlineTime, offMainTime]
+			= Measure<MTPupdates_Difference>(buffer, kTimes);
+		WARN("Difference with " << messages << " messages, "
+			<< (buffer.size() * sizeof(mtpPrime) / 1024) << " KB: "
+			<< inlineTime << " us inline, "
+			<< offMainTime << " us on main when parsed off main.");
+	}
+
+	const auto recorded = qgetenv(RecordedPathVariable);
+	if (recorded.isEmpty()) {
+		return;
+	}
+	const auto directory = QDir(QString::fromLocal8Bit(recorded));
+	const auto files = directory.entryInfoList(
+		{ "*.difference", "*.dialogs" },
+		QDir::Files);
+	for (const auto &info : files) {
+		const auto buffer = ReadRecorded(info.absoluteFilePath());
+		if (buffer.isEmpty()) {
+			continue;
+		}
+		const auto [inlineTime, offMainTime] = (info.suffix() == "dialogs")
+			? Measure<MTPmessages_Dialogs>(buffer, kTimes)
+			: Measure<MTPupdates_Difference>(buffer, kTimes);
+		WARN("Recorded " << info.fileName().toStdString() << ", "
+			<< (buffer.size() * sizeof(mtpPrime) / 1024) << " KB: "
+			<< inlineTime << " us inline, "
+			<< offMainTime << " us on main when parsed off main.");
+	}
+}
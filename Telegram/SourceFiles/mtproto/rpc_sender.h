@@ -68,6 +68,17 @@ inline bool isDefaultHandledError(const RPCError &error) {
 class RPCAbstractDoneHandler { // abstract done
 public:
 	virtual void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) = 0;
+
+	// Handlers may opt in to parse the response on the connection thread,
+	// then the main thread receives the ready object in handleParsed().
+	// If parsing fails there the raw response goes to operator() as usual.
+	virtual RPCResponseParser parser() const {
+		return nullptr;
+	}
+	virtual void handleParsed(mtpRequestId requestId, const RPCParsedResponsePtr &parsed) {
+		Unexpected("Parsed response for a handler without a parser.");
+	}
+
 	virtual ~RPCAbstractDoneHandler() {
 	}
 
@@ -144,6 +155,38 @@ private:
 
 };
 
+template <typename TResponse>
+class RPCDoneHandlerOffMain : public RPCAbstractDoneHandler { // done(result), parsed on the connection thread
+	using CallbackType = Fn<void(const TResponse &)>;
+	using RawCallbackType = Fn<void(const mtpPrime *, const mtpPrime *)>;
+
+public:
+	RPCDoneHandlerOffMain(CallbackType onDone, RawCallbackType onRaw = nullptr)
+	: _onDone(std::move(onDone))
+	, _onRaw(std::move(onRaw)) {
+	}
+	void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) override {
+		if (_onRaw) {
+			_onRaw(from, end);
+			return;
+		}
+		auto response = TResponse();
+		response.read(from, end);
+		_onDone(response);
+	}
+	RPCResponseParser parser() const override {
+		return &RPCParseResponse<TResponse>;
+	}
+	void handleParsed(mtpRequestId requestId, const RPCParsedResponsePtr &parsed) override {
+		_onDone(static_cast<const RPCParsed<TResponse>&>(*parsed).data);
+	}
+
+private:
+	CallbackType _onDone;
+	RawCallbackType _onRaw;
+
+};
+
 template <typename TReturn, typename TResponse>
 class RPCDoneHandlerReq : public RPCAbstractDoneHandler { // done(result, req_id)
 	using CallbackType = TReturn (*)(const TResponse &, mtpRequestId);
@@ -376,7 +419,7 @@ class RPCDoneHandlerOwned : public RPCOwnedDoneHandler { // done(result)
 	using CallbackType = TReturn (TReceiver::*)(const TResponse &);
 
 public:
-    RPCDoneHandlerOwned(TReceiver *receiver, CallbackType onDone) : RPCOwnedDoneHandler(receiver), _onDone(onDone) {
+    RPCDoneHandlerOwned(TReceiver *receiver, CallbackType onDone, bool offMain = false) : RPCOwnedDoneHandler(receiver), _onDone(onDone), _offMain(offMain) {
 	}
 	void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) override {
 		if (_owner) {
@@ -385,9 +428,19 @@ public:
 			(static_cast<TReceiver*>(_owner)->*_onDone)(std::move(response));
 		}
 	}
+	RPCResponseParser parser() const override {
+		return _offMain ? &RPCParseResponse<TResponse> : nullptr;
+	}
+	void handleParsed(mtpRequestId requestId, const RPCParsedResponsePtr &parsed) override {
+		if (_owner) {
+			const auto &response = static_cast<const RPCParsed<TResponse>&>(*parsed).data;
+			(static_cast<TReceiver*>(_owner)->*_onDone)(response);
+		}
+	}
 
 private:
 	CallbackType _onDone;
+	const bool _offMain = false;
 
 };
 
@@ -396,7 +449,7 @@ class RPCDoneHandlerOwnedReq : public RPCOwnedDoneHandler { // done(result, req_
 	using CallbackType = TReturn (TReceiver::*)(const TResponse &, mtpRequestId);
 
 public:
-    RPCDoneHandlerOwnedReq(TReceiver *receiver, CallbackType onDone) : RPCOwnedDoneHandler(receiver), _onDone(onDone) {
+    RPCDoneHandlerOwnedReq(TReceiver *receiver, CallbackType onDone, bool offMain = false) : RPCOwnedDoneHandler(receiver), _onDone(onDone), _offMain(offMain) {
 	}
 	void operator()(mtpRequestId requestId, const mtpPrime *from, const mtpPrime *end) override {
 		if (_owner) {
@@ -405,9 +458,19 @@ public:
 			(static_cast<TReceiver*>(_owner)->*_onDone)(std::move(response), requestId);
 		}
 	}
+	RPCResponseParser parser() const override {
+		return _offMain ? &RPCParseResponse<TResponse> : nullptr;
+	}
+	void handleParsed(mtpRequestId requestId, const RPCParsedResponsePtr &parsed) override {
+		if (_owner) {
+			const auto &response = static_cast<const RPCParsed<TResponse>&>(*parsed).data;
+			(static_cast<TReceiver*>(_owner)->*_onDone)(response, requestId);
+		}
+	}
 
 private:
 	CallbackType _onDone;
+	const bool _offMain = false;
 
 };
 
@@ -702,6 +765,16 @@ public:
 		return RPCDoneHandlerPtr(new RPCDoneHandlerOwned<TReturn, TReceiver, TResponse>(static_cast<TReceiver*>(this), onDone));
 	}
 
+	template <typename TReturn, typename TReceiver, typename TResponse> // done(result), parsed on the connection thread
+	RPCDoneHandlerPtr rpcDoneOffMain(TReturn (TReceiver::*onDone)(const TResponse &)) {
+		return RPCDoneHandlerPtr(new RPCDoneHandlerOwned<TReturn, TReceiver, TResponse>(static_cast<TReceiver*>(this), onDone, true));
+	}
+
+	template <typename TReturn, typename TReceiver, typename TResponse> // done(result, req_id), parsed on the connection thread
+	RPCDoneHandlerPtr rpcDoneOffMain(TReturn (TReceiver::*onDone)(const TResponse &, mtpRequestId)) {
+		return RPCDoneHandlerPtr(new RPCDoneHandlerOwnedReq<TReturn, TReceiver, TResponse>(static_cast<TReceiver*>(this), onDone, true));
+	}
+
 	template <typename TReturn, typename TReceiver, typename TResponse> // done(result, req_id)
 	RPCDoneHandlerPtr rpcDone(TReturn (TReceiver::*onDone)(const TResponse &, mtpRequestId)) {
 		return RPCDoneHandlerPtr(new RPCDoneHandlerOwnedReq<TReturn, TReceiver, TResponse>(static_cast<TReceiver*>(this), onDone));
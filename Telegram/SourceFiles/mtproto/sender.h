@@ -44,9 +44,19 @@ class Sender {
 				handler(result, requestId);
 			}
 
+		};
+		class BaseDoneHandler : public RPCAbstractDoneHandler {
+		public:
+			void setParseOffMain() {
+				_parseOffMain = true;
+			}
+
+		protected:
+			bool _parseOffMain = false;
+
 		};
 		template <typename Response, template <typename> typename PolicyTemplate>
-		class DoneHandler : public RPCAbstractDoneHandler {
+		class DoneHandler : public BaseDoneHandler {
 			using Policy = PolicyTemplate<Response>;
 			using Callback = typename Policy::Callback;
 
@@ -65,6 +75,19 @@ class Sender {
 				}
 			}
 
+			RPCResponseParser parser() const override {
+				return _parseOffMain ? &RPCParseResponse<Response> : nullptr;
+			}
+			void handleParsed(mtpRequestId requestId, const RPCParsedResponsePtr &parsed) override {
+				auto handler = std::move(_handler);
+				_sender->senderRequestHandled(requestId);
+
+				if (handler) {
+					auto &result = static_cast<RPCParsed<Response>&>(*parsed).data;
+					Policy::handle(std::move(handler), requestId, std::move(result));
+				}
+			}
+
 		private:
 			not_null<Sender*> _sender;
 			Callback _handler;
@@ -133,9 +156,12 @@ class Sender {
 		void setCanWait(crl::time ms) noexcept {
 			_canWait = ms;
 		}
-		void setDoneHandler(RPCDoneHandlerPtr &&handler) noexcept {
+		void setDoneHandler(std::shared_ptr<BaseDoneHandler> &&handler) noexcept {
 			_done = std::move(handler);
 		}
+		void setParseOffMain() noexcept {
+			_parseOffMain = true;
+		}
 		void setFailHandler(FailPlainHandler &&handler) noexcept {
 			_fail = std::move(handler);
 		}
@@ -156,6 +182,9 @@ class Sender {
 			return _canWait;
 		}
 		RPCDoneHandlerPtr takeOnDone() noexcept {
+			if (_done && _parseOffMain) {
+				_done->setParseOffMain();
+			}
 			return std::move(_done);
 		}
 		RPCFailHandlerPtr takeOnFail() {
@@ -181,7 +210,8 @@ class Sender {
 		not_null<Sender*> _sender;
 		ShiftedDcId _dcId = 0;
 		crl::time _canWait = 0;
-		RPCDoneHandlerPtr _done;
+		std::shared_ptr<BaseDoneHandler> _done;
+		bool _parseOffMain = false;
 		base::variant<FailPlainHandler, FailRequestIdHandler> _fail;
 		FailSkipPolicy _failSkipPolicy = FailSkipPolicy::Simple;
 		mtpRequestId _afterRequestId = 0;
@@ -238,6 +268,13 @@ public:
 			return *this;
 		}
 
+		// For large responses: the result is parsed on the connection
+		// thread and the done callback receives the ready object.
+		[[nodiscard]] SpecificRequestBuilder &parseOffMain() noexcept {
+			setParseOffMain();
+			return *this;
+		}
+
 		mtpRequestId send() {
 			const auto id = MainInstance()->send(
 				_request,
@@ -19,28 +19,65 @@ namespace {
 // How much time passed from send till we resend request or check its state.
 constexpr auto kCheckResendTimeout = crl::time(10000);
 
-// How much time to wait for some more requests,
-// when resending request or checking its state.
-constexpr auto kCheckResendWaiting = crl::time(1000);
-
-// How much ints should message contain for us not to resend,
-// but instead to check its state.
-constexpr auto kResendThreshold = 1;
-
 // Container lives 10 minutes in haveSent map.
 constexpr auto kContainerLives = 600;
 
-QString LogIds(const QVector<uint64> &ids) {
-	if (!ids.size()) return "[]";
-	auto idsStr = QString("[%1").arg(*ids.cbegin());
-	for (const auto id : ids) {
-		idsStr += QString(", %2").arg(id);
+// Indices of requests queued to send are checked for being sent
+// when there are at least that many of them.
+constexpr auto kToSendPruneIndicesAt = 64;
+
+// Resend or state check for requests, removal for containers.
+crl::time SentRequestDeadline(
+		mtpMsgId msgId,
+		const SecureRequest &request,
+		crl::time now) {
+	if (request->msDate > 0) {
+		return request->msDate + kCheckResendTimeout;
 	}
-	return idsStr + "]";
+	const auto left = (int32)(msgId >> 32) + kContainerLives - unixtime();
+	return (left < 0) ? (now - 1) : (now + (left + 1) * crl::time(1000));
 }
 
 } // namespace
 
+SentRequestMap::iterator SentRequestMap::insert(
+		mtpMsgId msgId,
+		const SecureRequest &request) {
+	const auto now = crl::now();
+	_wheel.add(msgId, SentRequestDeadline(msgId, request, now), now);
+	return ParentType::insert(msgId, request);
+}
+
+void SentRequestMap::clear() {
+	_wheel.clear();
+	ParentType::clear();
+}
+
+std::vector<mtpMsgId> SentRequestMap::takeExpired(crl::time now) {
+	return _wheel.takeExpired(now, [&](mtpMsgId msgId) {
+		const auto i = constFind(msgId);
+		return (i != cend())
+			? std::make_optional(SentRequestDeadline(msgId, i.value(), now))
+			: std::nullopt;
+	});
+}
+
+void SentRequestMap::reschedule(mtpMsgId msgId) {
+	const auto i = constFind(msgId);
+	if (i != cend()) {
+		const auto now = crl::now();
+		_wheel.add(msgId, SentRequestDeadline(msgId, i.value(), now), now);
+	}
+}
+
+RequestMap SentRequestMap::sorted() const {
+	auto result = RequestMap();
+	for (auto i = cbegin(), e = cend(); i != e; ++i) {
+		result.insert(i.key(), i.value());
+	}
+	return result;
+}
+
 ConnectionOptions::ConnectionOptions(
 	const QString &systemLangCode,
 	const QString &cloudLangCode,
@@ -89,48 +126,122 @@ void SessionData::notifyConnectionInited(const ConnectionOptions &options) {
 	}
 }
 
-void SessionData::clear(Instance *instance) {
-	auto clearCallbacks = std::vector<RPCCallbackClear>();
-	{
-		QReadLocker locker1(haveSentMutex()), locker2(toResendMutex()), locker3(haveReceivedMutex()), locker4(wereAckedMutex());
-		auto receivedResponsesEnd = _receivedResponses.cend();
-		clearCallbacks.reserve(_haveSent.size() + _wereAcked.size());
-		for (auto i = _haveSent.cbegin(), e = _haveSent.cend(); i != e; ++i) {
-			auto requestId = i.value()->requestId;
-			if (!_receivedResponses.contains(requestId)) {
-				clearCallbacks.push_back(requestId);
+void SessionData::queueToSend(const SecureRequest &request) {
+	const auto index = ++_toSendQueuedIndex;
+	_toSendQueuedIndices[request->requestId] = index;
+	if (int(_toSendQueuedIndices.size()) >= _toSendPruneIndicesAt) {
+		const auto sent = _toSendSentIndex.load(std::memory_order_acquire);
+		for (auto i = _toSendQueuedIndices.begin(); i != _toSendQueuedIndices.end();) {
+			if (i->second <= sent) {
+				i = _toSendQueuedIndices.erase(i);
+			} else {
+				++i;
 			}
 		}
-		for (auto i = _toResend.cbegin(), e = _toResend.cend(); i != e; ++i) {
-			auto requestId = i.value();
-			if (!_receivedResponses.contains(requestId)) {
-				clearCallbacks.push_back(requestId);
+		_toSendPruneIndicesAt = std::max(
+			2 * int(_toSendQueuedIndices.size()),
+			kToSendPruneIndicesAt);
+	}
+	_toSendQueue.push({ index, request->requestId, request });
+}
+
+void SessionData::queueToSendCancel(
+		mtpRequestId requestId,
+		mtpMsgId msgId) {
+	_toSendQueuedIndices.remove(requestId);
+	_toSendQueue.push({
+		++_toSendQueuedIndex,
+		requestId,
+		SecureRequest(),
+		msgId });
+}
+
+bool SessionData::isQueuedToSend(mtpRequestId requestId) {
+	const auto i = _toSendQueuedIndices.find(requestId);
+	if (i == _toSendQueuedIndices.end()) {
+		return false;
+	} else if (i->second > _toSendSentIndex.load(std::memory_order_acquire)) {
+		return true;
+	}
+	_toSendQueuedIndices.erase(i);
+	return false;
+}
+
+void SessionData::takeQueuedToSend() {
+	while (auto queued = _toSendQueue.try_pop()) {
+		_toSendTakenIndex = queued->index;
+		if (queued->request) {
+			_toSend.insert(queued->requestId, std::move(queued->request));
+		} else {
+			if (queued->requestId) {
+				_toSend.remove(queued->requestId);
 			}
-		}
-		for (auto i = _wereAcked.cbegin(), e = _wereAcked.cend(); i != e; ++i) {
-			auto requestId = i.value();
-			if (!_receivedResponses.contains(requestId)) {
-				clearCallbacks.push_back(requestId);
+			if (queued->msgId) {
+				_haveSent.remove(queued->msgId);
 			}
 		}
 	}
-	{
-		QWriteLocker locker(haveSentMutex());
-		_haveSent.clear();
+}
+
+void SessionData::markToSendSent() {
+	Expects(_toSend.isEmpty());
+
+	_toSendSentIndex.store(_toSendTakenIndex, std::memory_order_release);
+}
+
+void SessionData::queueReceivedResponse(
+		mtpRequestId requestId,
+		ReceivedMessage &&message) {
+	_receivedResponsesQueue.push({ requestId, std::move(message) });
+	++_receivedQueuedCount;
+}
+
+void SessionData::queueReceivedUpdate(ReceivedMessage &&message) {
+	_receivedUpdatesQueue.push(std::move(message));
+	++_receivedQueuedCount;
+}
+
+int SessionData::takeReceivedQueuedCount() {
+	return base::take(_receivedQueuedCount);
+}
+
+void SessionData::takeQueuedReceived() {
+	while (auto queued = _receivedResponsesQueue.try_pop()) {
+		_receivedResponses.insert(
+			queued->requestId,
+			std::move(queued->message));
+	}
+	while (auto queued = _receivedUpdatesQueue.try_pop()) {
+		_receivedUpdates.push_back(std::move(*queued));
 	}
-	{
-		QWriteLocker locker(toResendMutex());
-		_toResend.clear();
+}
+
+void SessionData::clear(Instance *instance) {
+	auto clearCallbacks = std::vector<RPCCallbackClear>();
+	clearCallbacks.reserve(_haveSent.size() + _toResend.size() + _wereAcked.size());
+	for (auto i = _haveSent.cbegin(), e = _haveSent.cend(); i != e; ++i) {
+		clearCallbacks.push_back(i.value()->requestId);
 	}
-	{
-		QWriteLocker locker(wereAckedMutex());
-		_wereAcked.clear();
+	for (auto i = _toResend.cbegin(), e = _toResend.cend(); i != e; ++i) {
+		clearCallbacks.push_back(i.value());
 	}
-	{
-		QWriteLocker locker(receivedIdsMutex());
-		_receivedIds.clear();
+	for (auto i = _wereAcked.cbegin(), e = _wereAcked.cend(); i != e; ++i) {
+		clearCallbacks.push_back(i.value());
 	}
-	instance->clearCallbacksDelayed(std::move(clearCallbacks));
+	_haveSent.clear();
+	_toResend.clear();
+	_wereAcked.clear();
+	_receivedIds.clear();
+
+	// Responses that were already received are still handled,
+	// the main thread owns them, so filter the list there.
+	crl::on_main(_owner.get(), [=, list = std::move(clearCallbacks)]() mutable {
+		takeQueuedReceived();
+		list.erase(ranges::remove_if(list, [&](RPCCallbackClear value) {
+			return _receivedResponses.contains(value.requestId);
+		}), end(list));
+		instance->clearCallbacksDelayed(std::move(list));
+	});
 }
 
 Session::Session(not_null<Instance*> instance, ShiftedDcId shiftedDcId) : QObject()
@@ -138,9 +249,6 @@ Session::Session(not_null<Instance*> instance, ShiftedDcId shiftedDcId) : QObjec
 , data(this)
 , dcWithShift(shiftedDcId)
 , sender([=] { needToResumeAndSend(); }) {
-	connect(&timeouter, SIGNAL(timeout()), this, SLOT(checkRequestsByTimer()));
-	timeouter.start(1000);
-
 	refreshOptions();
 }
 
@@ -306,71 +414,6 @@ void Session::sendMsgsStateInfo(quint64 msgId, QByteArray data) {
 			MTP_msgs_state_info(MTP_long(msgId), MTP_bytes(data))));
 }
 
-void Session::checkRequestsByTimer() {
-	QVector<mtpMsgId> resendingIds;
-	QVector<mtpMsgId> removingIds; // remove very old (10 minutes) containers and resend requests
-	QVector<mtpMsgId> stateRequestIds;
-
-	{
-		QReadLocker locker(data.haveSentMutex());
-		auto &haveSent = data.haveSentMap();
-		const auto haveSentCount = haveSent.size();
-		auto ms = crl::now();
-		for (auto i = haveSent.begin(), e = haveSent.end(); i != e; ++i) {
-			auto &req = i.value();
-			if (req->msDate > 0) {
-				if (req->msDate + kCheckResendTimeout < ms) { // need to resend or check state
-					if (req.messageSize() < kResendThreshold) { // resend
-						resendingIds.reserve(haveSentCount);
-						resendingIds.push_back(i.key());
-					} else {
-						req->msDate = ms;
-						stateRequestIds.reserve(haveSentCount);
-						stateRequestIds.push_back(i.key());
-					}
-				}
-			} else if (unixtime() > (int32)(i.key() >> 32) + kContainerLives) {
-				removingIds.reserve(haveSentCount);
-				removingIds.push_back(i.key());
-			}
-		}
-	}
-
-	if (stateRequestIds.size()) {
-		DEBUG_LOG(("MTP Info: requesting state of msgs: %1").arg(LogIds(stateRequestIds)));
-		{
-			QWriteLocker locker(data.stateRequestMutex());
-			for (uint32 i = 0, l = stateRequestIds.size(); i < l; ++i) {
-				data.stateRequestMap().insert(stateRequestIds[i], true);
-			}
-		}
-		sendAnything(kCheckResendWaiting);
-	}
-	if (!resendingIds.isEmpty()) {
-		for (uint32 i = 0, l = resendingIds.size(); i < l; ++i) {
-			DEBUG_LOG(("MTP Info: resending request %1").arg(resendingIds[i]));
-			resend(resendingIds[i], kCheckResendWaiting);
-		}
-	}
-	if (!removingIds.isEmpty()) {
-		auto clearCallbacks = std::vector<RPCCallbackClear>();
-		{
-			QWriteLocker locker(data.haveSentMutex());
-			auto &haveSent = data.haveSentMap();
-			for (uint32 i = 0, l = removingIds.size(); i < l; ++i) {
-				auto j = haveSent.find(removingIds[i]);
-				if (j != haveSent.cend()) {
-					if (j.value()->requestId) {
-						clearCallbacks.push_back(j.value()->requestId);
-					}
-					haveSent.erase(j);
-				}
-			}
-		}
-		_instance->clearCallbacksDelayed(std::move(clearCallbacks));
-	}
-}
-
 void Session::onConnectionStateChange(qint32 newState) {
 	_instance->onStateChange(dcWithShift, newState);
 }
@@ -380,13 +423,8 @@ void Session::onResetDone() {
 }
 
 void Session::cancel(mtpRequestId requestId, mtpMsgId msgId) {
-	if (requestId) {
-		QWriteLocker locker(data.toSendMutex());
-		data.toSendMap().remove(requestId);
-	}
-	if (msgId) {
-		QWriteLocker locker(data.haveSentMutex());
-		data.haveSentMap().remove(msgId);
+	if (requestId || msgId) {
+		data.queueToSendCancel(requestId, msgId);
 	}
 }
 
@@ -395,7 +433,7 @@ void Session::ping() {
 	sendAnything(0);
 }
 
-int32 Session::requestState(mtpRequestId requestId) const {
+int32 Session::requestState(mtpRequestId requestId) {
 	int32 result = MTP::RequestSent;
 
 	bool connected = false;
@@ -418,14 +456,9 @@ int32 Session::requestState(mtpRequestId requestId) const {
 	}
 	if (!requestId) return MTP::RequestSent;
 
-	QWriteLocker locker(data.toSendMutex());
-	const auto &toSend = data.toSendMap();
-	const auto i = toSend.constFind(requestId);
-	if (i != toSend.cend()) {
-		return MTP::RequestSending;
-	} else {
-		return MTP::RequestSent;
-	}
+	return data.isQueuedToSend(requestId)
+		? MTP::RequestSending
+		: MTP::RequestSent;
 }
 
 int32 Session::getState() const {
@@ -455,90 +488,17 @@ QString Session::transport() const {
 	return _connection ? _connection->transport() : QString();
 }
 
-mtpRequestId Session::resend(quint64 msgId, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo) {
-	SecureRequest request;
-	{
-		QWriteLocker locker(data.haveSentMutex());
-		auto &haveSent = data.haveSentMap();
-
-		auto i = haveSent.find(msgId);
-		if (i == haveSent.end()) {
-			if (sendMsgStateInfo) {
-				char cantResend[2] = {1, 0};
-				DEBUG_LOG(("Message Info: cant resend %1, request not found").arg(msgId));
-
-				auto info = std::string(cantResend, cantResend + 1);
-				return _instance->sendProtocolMessage(
-					dcWithShift,
-					MTPMsgsStateInfo(
-						MTP_msgs_state_info(
-							MTP_long(msgId),
-							MTP_string(std::move(info)))));
-			}
-			return 0;
-		}
-
-		request = i.value();
-		haveSent.erase(i);
-	}
-	if (request.isSentContainer()) { // for container just resend all messages we can
-		DEBUG_LOG(("Message Info: resending container from haveSent, msgId %1").arg(msgId));
-		const mtpMsgId *ids = (const mtpMsgId *)(request->constData() + 8);
-		for (uint32 i = 0, l = (request->size() - 8) >> 1; i < l; ++i) {
-			resend(ids[i], 10, true);
-		}
-		return 0xFFFFFFFF;
-	} else if (!request.isStateRequest()) {
-		request->msDate = forceContainer ? 0 : crl::now();
-		sendPrepared(request, msCanWait, false);
-		{
-			QWriteLocker locker(data.toResendMutex());
-			data.toResendMap().insert(msgId, request->requestId);
-		}
-		return request->requestId;
-	} else {
-		return 0;
-	}
-}
-
-void Session::resendMany(QVector<quint64> msgIds, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo) {
-	for (int32 i = 0, l = msgIds.size(); i < l; ++i) {
-		resend(msgIds.at(i), msCanWait, forceContainer, sendMsgStateInfo);
-	}
-}
-
-void Session::resendAll() {
-	QVector<mtpMsgId> toResend;
-	{
-		QReadLocker locker(data.haveSentMutex());
-		const auto &haveSent = data.haveSentMap();
-		toResend.reserve(haveSent.size());
-		for (auto i = haveSent.cbegin(), e = haveSent.cend(); i != e; ++i) {
-			if (i.value()->requestId) {
-				toResend.push_back(i.key());
-			}
-		}
-	}
-	for (uint32 i = 0, l = toResend.size(); i < l; ++i) {
-		resend(toResend[i], 10, true);
-	}
-}
-
 void Session::sendPrepared(
 		const SecureRequest &request,
 		crl::time msCanWait,
 		bool newRequest) {
 	DEBUG_LOG(("MTP Info: adding request to toSendMap, msCanWait %1"
 		).arg(msCanWait));
-	{
-		QWriteLocker locker(data.toSendMutex());
-		data.toSendMap().insert(request->requestId, request);
-
-		if (newRequest) {
-			*(mtpMsgId*)(request->data() + 4) = 0;
-			*(request->data() + 6) = 0;
-		}
+	if (newRequest) {
+		*(mtpMsgId*)(request->data() + 4) = 0;
+		*(request->data() + 6) = 0;
 	}
+	data.queueToSend(request);
 
 	DEBUG_LOG(("MTP Info: added, requestId %1").arg(request->requestId));
 
@@ -571,6 +531,10 @@ void Session::notifyDcConnectionInited() {
 	emit dc->connectionWasInited();
 }
 
+void Session::notifyRequestPacked(int originalSize, int packedSize) {
+	dc->addPackedRequest(originalSize, packedSize);
+}
+
 void Session::destroyKey() {
 	if (!dc) return;
 
@@ -599,9 +563,9 @@ void Session::tryToReceive() {
 	while (true) {
 		auto requestId = mtpRequestId(0);
 		auto isUpdate = false;
-		auto message = SerializedMessage();
+		auto message = ReceivedMessage();
 		{
-			QWriteLocker locker(data.haveReceivedMutex());
+			data.takeQueuedReceived();
 			auto &responses = data.haveReceivedResponses();
 			auto response = responses.begin();
 			if (response == responses.cend()) {
@@ -620,12 +584,14 @@ void Session::tryToReceive() {
 				responses.erase(response);
 			}
 		}
+		const auto from = message.message.constData();
+		const auto till = from + message.message.size();
 		if (isUpdate) {
 			if (dcWithShift == BareDcId(dcWithShift)) { // call globalCallback only in main session
-				_instance->globalCallback(message.constData(), message.constData() + message.size());
+				_instance->globalCallback(from, till, message.parsed);
 			}
 		} else {
-			_instance->execCallback(requestId, message.constData(), message.constData() + message.size());
+			_instance->execCallback(requestId, from, till, message.parsed);
 		}
 	}
 }
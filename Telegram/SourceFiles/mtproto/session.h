@@ -8,7 +8,9 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #pragma once
 
 #include "base/timer.h"
+#include "base/mpsc_queue.h"
 #include "mtproto/rpc_sender.h"
+#include "mtproto/timer_wheel.h"
 
 namespace MTP {
 
@@ -42,6 +44,28 @@ public:
 
 };
 
+// Map of msg_id -> request, that was sent, with the resend checks
+// (msDate + kCheckResendTimeout) and the container lifetime checks
+// scheduled in a timer wheel, so that timer ticks are O(expired).
+class SentRequestMap : public QHash<mtpMsgId, SecureRequest> {
+public:
+	using ParentType = QHash<mtpMsgId, SecureRequest>;
+
+	iterator insert(mtpMsgId msgId, const SecureRequest &request);
+	void clear();
+
+	// Requests are checked again only when rescheduled.
+	std::vector<mtpMsgId> takeExpired(crl::time now);
+	void reschedule(mtpMsgId msgId);
+
+	// For places where the order of msgIds matters.
+	RequestMap sorted() const;
+
+private:
+	TimerWheel _wheel;
+
+};
+
 class ReceivedMsgIds {
 public:
 	bool registerMsgId(mtpMsgId msgId, bool needAck) {
@@ -106,6 +130,27 @@ inline bool ResponseNeedsAck(const SerializedMessage &response) {
 	return (seqNo & 0x01) ? true : false;
 }
 
+// Response or updates with the object parsed on the connection thread,
+// if the handler opted in. The raw message is kept for the fallback.
+struct ReceivedMessage {
+	SerializedMessage message;
+	RPCParsedResponsePtr parsed;
+};
+
+// Request queued to send or, without the request, its cancellation.
+// The cancellation also drops the sent message with msgId, if any.
+struct QueuedRequest {
+	uint64 index = 0;
+	mtpRequestId requestId = 0;
+	SecureRequest request;
+	mtpMsgId msgId = 0;
+};
+
+struct QueuedResponse {
+	mtpRequestId requestId = 0;
+	ReceivedMessage message;
+};
+
 struct ConnectionOptions {
 	ConnectionOptions() = default;
 	ConnectionOptions(
@@ -192,38 +237,27 @@ public:
 
 	not_null<QReadWriteLock*> keyMutex() const;
 
-	not_null<QReadWriteLock*> toSendMutex() const {
-		return &_toSendLock;
-	}
-	not_null<QReadWriteLock*> haveSentMutex() const {
-		return &_haveSentLock;
-	}
-	not_null<QReadWriteLock*> toResendMutex() const {
-		return &_toResendLock;
-	}
-	not_null<QReadWriteLock*> wereAckedMutex() const {
-		return &_wereAckedLock;
-	}
-	not_null<QReadWriteLock*> receivedIdsMutex() const {
-		return &_receivedIdsLock;
-	}
-	not_null<QReadWriteLock*> haveReceivedMutex() const {
-		return &_haveReceivedLock;
-	}
-	not_null<QReadWriteLock*> stateRequestMutex() const {
-		return &_stateRequestLock;
-	}
-
+	// Called from the connection thread.
+	void notifyRequestPacked(int originalSize, int packedSize);
+
+	// Requests are handed from the main thread to the connection thread
+	// through a lock-free queue. The connection thread owns toSendMap()
+	// and all the sent requests bookkeeping: haveSentMap(), toResendMap(),
+	// receivedIdsSet(), wereAckedMap() and stateRequestMap(). A new
+	// connection takes them over after the old one was killed.
+	void queueToSend(const SecureRequest &request);
+	void queueToSendCancel(mtpRequestId requestId, mtpMsgId msgId);
+	bool isQueuedToSend(mtpRequestId requestId);
 	PreRequestMap &toSendMap() {
 		return _toSend;
 	}
-	const PreRequestMap &toSendMap() const {
-		return _toSend;
-	}
-	RequestMap &haveSentMap() {
+	void takeQueuedToSend();
+	void markToSendSent();
+
+	SentRequestMap &haveSentMap() {
 		return _haveSent;
 	}
-	const RequestMap &haveSentMap() const {
+	const SentRequestMap &haveSentMap() const {
 		return _haveSent;
 	}
 	RequestIdsMap &toResendMap() { // msgId -> requestId, on which toSend: requestId -> request for resended requests
@@ -244,18 +278,21 @@ public:
 	const RequestIdsMap &wereAckedMap() const {
 		return _wereAcked;
 	}
-	QMap<mtpRequestId, SerializedMessage> &haveReceivedResponses() {
-		return _receivedResponses;
-	}
-	const QMap<mtpRequestId, SerializedMessage> &haveReceivedResponses() const {
+
+	// Responses and updates are handed from the connection thread to the
+	// main thread the same way, the main thread owns the received maps.
+	void queueReceivedResponse(
+		mtpRequestId requestId,
+		ReceivedMessage &&message);
+	void queueReceivedUpdate(ReceivedMessage &&message);
+	int takeReceivedQueuedCount();
+	QMap<mtpRequestId, ReceivedMessage> &haveReceivedResponses() {
 		return _receivedResponses;
 	}
-	QList<SerializedMessage> &haveReceivedUpdates() {
-		return _receivedUpdates;
-	}
-	const QList<SerializedMessage> &haveReceivedUpdates() const {
+	QList<ReceivedMessage> &haveReceivedUpdates() {
 		return _receivedUpdates;
 	}
+	void takeQueuedReceived();
 	QMap<mtpMsgId, bool> &stateRequestMap() {
 		return _stateRequest;
 	}
@@ -292,25 +329,31 @@ private:
 	bool _layerInited = false;
 	ConnectionOptions _options;
 
+	base::mpsc_queue<QueuedRequest> _toSendQueue; // main -> connection thread
+	// Indices of the requests that were already sent are dropped on lookup.
+	base::flat_map<mtpRequestId, uint64> _toSendQueuedIndices; // main thread
+	uint64 _toSendQueuedIndex = 0; // main thread
+	uint64 _toSendTakenIndex = 0; // connection thread
+	std::atomic<uint64> _toSendSentIndex = 0;
+	int _toSendPruneIndicesAt = 0; // main thread
+
+	// connection thread
 	PreRequestMap _toSend; // map of request_id -> request, that is waiting to be sent
-	RequestMap _haveSent; // map of msg_id -> request, that was sent, msDate = 0 for msgs_state_req (no resend / state req), msDate = 0, seqNo = 0 for containers
+	SentRequestMap _haveSent; // map of msg_id -> request, that was sent, msDate = 0 for msgs_state_req (no resend / state req), msDate = 0, seqNo = 0 for containers
 	RequestIdsMap _toResend; // map of msg_id -> request_id, that request_id -> request lies in toSend and is waiting to be resent
 	ReceivedMsgIds _receivedIds; // set of received msg_id's, for checking new msg_ids
 	RequestIdsMap _wereAcked; // map of msg_id -> request_id, this msg_ids already were acked or do not need ack
 	QMap<mtpMsgId, bool> _stateRequest; // set of msg_id's, whose state should be requested
 
-	QMap<mtpRequestId, SerializedMessage> _receivedResponses; // map of request_id -> response that should be processed in the main thread
-	QList<SerializedMessage> _receivedUpdates; // list of updates that should be processed in the main thread
+	base::mpsc_queue<QueuedResponse> _receivedResponsesQueue; // connection -> main thread
+	base::mpsc_queue<ReceivedMessage> _receivedUpdatesQueue; // connection -> main thread
+	int _receivedQueuedCount = 0; // connection thread
+
+	QMap<mtpRequestId, ReceivedMessage> _receivedResponses; // map of request_id -> response that should be processed in the main thread
+	QList<ReceivedMessage> _receivedUpdates; // list of updates that should be processed in the main thread
 
 	// mutexes
 	mutable QReadWriteLock _lock;
-	mutable QReadWriteLock _toSendLock;
-	mutable QReadWriteLock _haveSentLock;
-	mutable QReadWriteLock _toResendLock;
-	mutable QReadWriteLock _receivedIdsLock;
-	mutable QReadWriteLock _wereAckedLock;
-	mutable QReadWriteLock _haveReceivedLock;
-	mutable QReadWriteLock _stateRequestLock;
 
 };
 
@@ -335,10 +378,11 @@ public:
 	void notifyKeyCreated(AuthKeyPtr &&key);
 	void destroyKey();
 	void notifyDcConnectionInited();
+	void notifyRequestPacked(int originalSize, int packedSize);
 
 	void ping();
 	void cancel(mtpRequestId requestId, mtpMsgId msgId);
-	int32 requestState(mtpRequestId requestId) const;
+	int32 requestState(mtpRequestId requestId);
 	int32 getState() const;
 	QString transport() const;
 
@@ -359,15 +403,10 @@ signals:
 public slots:
 	void needToResumeAndSend();
 
-	mtpRequestId resend(quint64 msgId, qint64 msCanWait = 0, bool forceContainer = false, bool sendMsgStateInfo = false);
-	void resendMany(QVector<quint64> msgIds, qint64 msCanWait, bool forceContainer, bool sendMsgStateInfo);
-	void resendAll(); // after connection restart
-
 	void authKeyCreatedForDC();
 	void connectionWasInitedForDC();
 
 	void tryToReceive();
-	void checkRequestsByTimer();
 	void onConnectionStateChange(qint32 newState);
 	void onResetDone();
 
@@ -396,7 +435,6 @@ private:
 
 	bool _ping = false;
 
-	QTimer timeouter;
 	base::Timer sender;
 
 };
@@ -405,5 +443,11 @@ inline not_null<QReadWriteLock*> SessionData::keyMutex() const {
 	return _owner->keyMutex();
 }
 
+inline void SessionData::notifyRequestPacked(
+		int originalSize,
+		int packedSize) {
+	_owner->notifyRequestPacked(originalSize, packedSize);
+}
+
 } // namespace internal
 } // namespace MTP
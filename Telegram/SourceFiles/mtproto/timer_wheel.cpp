@@ -0,0 +1,107 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "mtproto/timer_wheel.h"
+
+#include "base/algorithm.h"
+#include "base/assertion.h"
+
+#include <algorithm>
+
+namespace MTP {
+namespace internal {
+
+void TimerWheel::add(uint64 id, crl::time deadline, crl::time now) {
+	const auto tick = deadline / kTimerWheelTick;
+	if (!_started) {
+		_started = true;
+		_current = now / kTimerWheelTick - 1;
+	}
+	place({ id, deadline }, std::max(tick, _current + 1));
+}
+
+void TimerWheel::place(Entry entry, int64 tick) {
+	Expects(tick >= _current);
+
+	const auto delta = tick - _current;
+	for (auto level = 0; level != kLevels - 1; ++level) {
+		if (delta < (int64(1) << ((level + 1) * kSlotBits))) {
+			const auto slot = (tick >> (level * kSlotBits)) & kSlotMask;
+			_slots[level][slot].push_back(entry);
+			return;
+		}
+	}
+
+	// Far deadlines wait in the last level and are placed once again.
+	const auto level = kLevels - 1;
+	const auto till = _current + (int64(1) << (kLevels * kSlotBits)) - 1;
+	const auto slot = (std::min(tick, till) >> (level * kSlotBits)) & kSlotMask;
+	_slots[level][slot].push_back(entry);
+}
+
+void TimerWheel::cascade(int level) {
+	const auto slot = (_current >> (level * kSlotBits)) & kSlotMask;
+	for (const auto &entry : base::take(_slots[level][slot])) {
+		place(entry, std::max(entry.deadline / kTimerWheelTick, _current));
+	}
+}
+
+std::vector<uint64> TimerWheel::advance(crl::time now) {
+	auto result = std::vector<uint64>();
+	if (!_started) {
+		return result;
+	}
+
+	// All the deadlines of a tick are passed only when the next one starts.
+	const auto till = now / kTimerWheelTick - 1;
+	while (_current < till) {
+		++_current;
+		for (auto level = kLevels - 1; level != 0; --level) {
+			const auto mask = (int64(1) << (level * kSlotBits)) - 1;
+			if (!(_current & mask)) {
+				cascade(level);
+			}
+		}
+		auto &slot = _slots[0][_current & kSlotMask];
+		for (const auto &entry : slot) {
+			result.push_back(entry.id);
+		}
+		slot.clear();
+	}
+	return result;
+}
+
+std::vector<uint64> TimerWheel::takeExpired(
+		crl::time now,
+		Fn<std::optional<crl::time>(uint64 id)> deadline) {
+	auto result = advance(now);
+	std::sort(begin(result), end(result));
+	result.erase(std::unique(begin(result), end(result)), end(result));
+	result.erase(std::remove_if(begin(result), end(result), [&](uint64 id) {
+		const auto current = deadline(id);
+		if (!current) {
+			return true;
+		} else if (*current < now) {
+			return false;
+		}
+		add(id, *current, now);
+		return true;
+	}), end(result));
+	return result;
+}
+
+void TimerWheel::clear() {
+	for (auto &level : _slots) {
+		for (auto &slot : level) {
+			slot.clear();
+		}
+	}
+	_started = false;
+}
+
+} // namespace internal
+} // namespace MTP
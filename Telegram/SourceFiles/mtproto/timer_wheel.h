@@ -0,0 +1,64 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "base/basic_types.h"
+
+#include <crl/crl_time.h>
+#include <array>
+#include <optional>
+#include <vector>
+
+namespace MTP {
+namespace internal {
+
+// Timer wheel resolution, deadlines are handled at most this late.
+constexpr auto kTimerWheelTick = crl::time(100);
+
+// Hierarchical timer wheel of ids with deadlines, each tick of
+// advance() touches only the slots that have expired by then.
+//
+// An entry is never returned before its deadline has passed and it is
+// returned by the first advance() call made a tick after the deadline.
+class TimerWheel {
+public:
+	void add(uint64 id, crl::time deadline, crl::time now);
+	void clear();
+
+	// Entries with the deadline passed, in no particular order.
+	std::vector<uint64> advance(crl::time now);
+
+	// Ids with the current deadline passed, sorted and without repeats.
+	// Ids that have no deadline any more are skipped, ids with a moved
+	// deadline are placed once again, so an id may be rescheduled by
+	// adding it again without removing its old entry.
+	std::vector<uint64> takeExpired(
+		crl::time now,
+		Fn<std::optional<crl::time>(uint64 id)> deadline);
+
+private:
+	struct Entry {
+		uint64 id = 0;
+		crl::time deadline = 0;
+	};
+	static constexpr auto kLevels = 3;
+	static constexpr auto kSlotBits = 6;
+	static constexpr auto kSlots = (1 << kSlotBits);
+	static constexpr auto kSlotMask = kSlots - 1;
+
+	void place(Entry entry, int64 tick);
+	void cascade(int level);
+
+	std::array<std::array<std::vector<Entry>, kSlots>, kLevels> _slots;
+	int64 _current = 0; // last tick that was handled
+	bool _started = false;
+
+};
+
+} // namespace internal
+} // namespace MTP
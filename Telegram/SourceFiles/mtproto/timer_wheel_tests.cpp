@@ -0,0 +1,252 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "catch.hpp"
+
+#include "mtproto/timer_wheel.h"
+
+#include <map>
+#include <random>
+
+namespace {
+
+using MTP::internal::TimerWheel;
+using MTP::internal::kTimerWheelTick;
+
+constexpr auto kSecond = crl::time(1000);
+constexpr auto kHour = 3600 * kSecond;
+
+// Wheel with the expected deadlines of its ids. Every id should be
+// returned after its deadline and not later than a tick after its
+// deadline or the time it was added, whichever is later.
+class Checker {
+public:
+	explicit Checker(crl::time now) : _now(now) {
+	}
+
+	crl::time now() const {
+		return _now;
+	}
+	void wait(crl::time now) {
+		_now = now;
+	}
+
+	void add(uint64 id, crl::time deadline) {
+		_wheel.add(id, deadline, _now);
+		_deadlines[id] = { deadline, std::max(deadline, _now) };
+	}
+	void remove(uint64 id) {
+		_deadlines.erase(id);
+	}
+	void clear() {
+		_wheel.clear();
+		_deadlines.clear();
+	}
+	int pending() const {
+		return int(_deadlines.size());
+	}
+
+	std::vector<uint64> advance(crl::time now) {
+		_now = now;
+		const auto result = _wheel.advance(_now);
+		for (const auto id : result) {
+			check(id);
+		}
+		checkPending();
+		return result;
+	}
+
+	// Removed ids and ids with a changed deadline stay in the wheel.
+	std::vector<uint64> takeExpired(crl::time now) {
+		_now = now;
+		const auto result = _wheel.takeExpired(_now, [&](uint64 id) {
+			const auto i = _deadlines.find(id);
+			return (i != end(_deadlines))
+				? std::make_optional(i->second.deadline)
+				: std::nullopt;
+		});
+		for (auto i = begin(result); i != end(result); ++i) {
+			REQUIRE((i == begin(result) || *(i - 1) < *i));
+			check(*i);
+		}
+		checkPending();
+		return result;
+	}
+
+private:
+	struct Deadline {
+		crl::time deadline = 0;
+		crl::time due = 0;
+	};
+
+	void check(uint64 id) {
+		const auto i = _deadlines.find(id);
+		REQUIRE(i != end(_deadlines));
+		REQUIRE(i->second.deadline < _now);
+		_deadlines.erase(i);
+	}
+	void checkPending() const {
+		for (const auto &[id, deadline] : _deadlines) {
+			REQUIRE(deadline.due + kTimerWheelTick > _now);
+		}
+	}
+
+	TimerWheel _wheel;
+	std::map<uint64, Deadline> _deadlines;
+	crl::time _now = 0;
+
+};
+
+} // namespace
+
+TEST_CASE("timer wheel", "[timer_wheel]") {
+	SECTION("empty wheel") {
+		auto wheel = TimerWheel();
+		REQUIRE(wheel.advance(kHour).empty());
+	}
+	SECTION("entries fire in their tick") {
+		auto checker = Checker(kHour);
+		checker.add(1, kHour + 50);
+		checker.add(2, kHour + 99);
+		checker.add(3, kHour + 100);
+		REQUIRE(checker.advance(kHour + 99).empty());
+		REQUIRE(checker.advance(kHour + 100).size() == 2);
+		REQUIRE(checker.advance(kHour + 199).empty());
+		REQUIRE(checker.advance(kHour + 200).size() == 1);
+		REQUIRE(checker.pending() == 0);
+	}
+	SECTION("level cascading") {
+		const auto start = kHour + 30;
+		auto checker = Checker(start);
+		const auto delays = {
+			crl::time(0),
+			kTimerWheelTick - 1,
+			63 * kTimerWheelTick,
+			64 * kTimerWheelTick,
+			65 * kTimerWheelTick + 1,
+			4095 * kTimerWheelTick,
+			4096 * kTimerWheelTick,
+			4097 * kTimerWheelTick + 7,
+			262143 * kTimerWheelTick,
+			262144 * kTimerWheelTick,
+			300000 * kTimerWheelTick + 1,
+			1000000 * kTimerWheelTick,
+		};
+		auto id = uint64();
+		for (const auto delay : delays) {
+			checker.add(++id, start + delay);
+		}
+
+		// Single ticks near the level boundaries, larger steps elsewhere.
+		auto now = start;
+		while (checker.pending() > 0) {
+			const auto tick = now / kTimerWheelTick;
+			const auto step = ((tick & 63) == 0 || (tick & 63) == 63)
+				? kTimerWheelTick
+				: 7 * kTimerWheelTick + 13;
+			now += step;
+			checker.advance(now);
+		}
+	}
+	SECTION("cascading in one large step") {
+		auto checker = Checker(kHour);
+		for (auto i = 0; i != 100; ++i) {
+			checker.add(i + 1, kHour + i * i * i * kTimerWheelTick);
+		}
+		const auto result = checker.advance(kHour + 100 * 100 * 100 * kTimerWheelTick);
+		REQUIRE(result.size() == 100);
+	}
+	SECTION("entries due in the past") {
+		auto checker = Checker(kHour);
+
+		// Before the first tick was handled.
+		checker.add(1, kHour - kSecond);
+		checker.add(2, 0);
+		REQUIRE(checker.advance(kHour + kTimerWheelTick - 1).empty());
+		REQUIRE(checker.advance(kHour + kTimerWheelTick).size() == 2);
+
+		// Right after a tick was handled.
+		auto now = kHour + 10 * kSecond;
+		checker.advance(now);
+		checker.add(3, now - kTimerWheelTick);
+		checker.add(4, kHour);
+		REQUIRE(checker.advance(now + kTimerWheelTick).size() == 2);
+
+		// While the wheel lags behind the time of adding.
+		now += kHour;
+		checker.wait(now);
+		checker.add(5, now - kSecond);
+		checker.add(6, now + kSecond);
+		REQUIRE(checker.advance(now + kTimerWheelTick).size() == 1);
+		REQUIRE(checker.advance(now + kSecond + kTimerWheelTick).size() == 1);
+		REQUIRE(checker.pending() == 0);
+	}
+	SECTION("clear") {
+		auto checker = Checker(kHour);
+		checker.add(1, kHour + kSecond);
+		checker.add(2, kHour + kHour);
+		checker.clear();
+		REQUIRE(checker.advance(kHour + 2 * kHour).empty());
+
+		checker.add(3, kHour + 3 * kHour);
+		REQUIRE(checker.advance(kHour + 3 * kHour + kTimerWheelTick).size() == 1);
+	}
+	SECTION("rescheduling") {
+		auto checker = Checker(kHour);
+		checker.add(1, kHour + 10 * kSecond);
+		checker.add(2, kHour + 10 * kSecond);
+		checker.add(3, kHour + 10 * kSecond);
+
+		// Later deadline is checked when the old entry fires.
+		checker.add(1, kHour + 1000 * kSecond);
+
+		// Earlier deadline fires from the new entry.
+		checker.add(2, kHour + kSecond);
+
+		// Removed entry is skipped.
+		checker.remove(3);
+
+		REQUIRE(checker.takeExpired(kHour + 2 * kSecond)
+			== std::vector<uint64>{ 2 });
+		REQUIRE(checker.takeExpired(kHour + 11 * kSecond).empty());
+		REQUIRE(checker.takeExpired(kHour + 1000 * kSecond).empty());
+		REQUIRE(checker.takeExpired(kHour + 1001 * kSecond)
+			== std::vector<uint64>{ 1 });
+		REQUIRE(checker.pending() == 0);
+	}
+	SECTION("random operations") {
+		auto generator = std::mt19937(42);
+		auto checker = Checker(kHour);
+		auto id = uint64();
+		const auto delay = [&] {
+			switch (generator() % 4) {
+			case 0: return crl::time(generator() % (10 * kSecond));
+			case 1: return crl::time(generator() % (10 * 60 * kSecond));
+			case 2: return crl::time(generator() % (24 * kHour));
+			}
+			return -crl::time(generator() % (10 * kSecond));
+		};
+		for (auto i = 0; i != 20000; ++i) {
+			const auto operation = generator() % 16;
+			if (operation < 8) {
+				checker.add(++id, checker.now() + delay());
+			} else if (operation < 10 && id > 0) {
+				checker.add(1 + generator() % id, checker.now() + delay());
+			} else if (operation < 11 && id > 0) {
+				checker.remove(1 + generator() % id);
+			} else {
+				const auto step = (generator() % 64 == 0)
+					? crl::time(generator() % (2 * kHour))
+					: crl::time(generator() % (3 * kSecond));
+				checker.takeExpired(checker.now() + step);
+			}
+		}
+		while (checker.pending() > 0) {
+			checker.takeExpired(checker.now() + kHour);
+		}
+	}
+}
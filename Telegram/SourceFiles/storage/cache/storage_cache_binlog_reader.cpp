@@ -69,7 +69,7 @@ bool BinlogWrapper::readPart() {
 		left,
 		int64(_full.size() - _part.size()));
 	Assert(amount > 0);
-	const auto readBytes = _binlog.read(
+	const auto readBytes = _binlog.readInParallel(
 		_full.subspan(_part.size(), amount));
 	if (!readBytes) {
 		return no();
@@ -26,6 +26,9 @@ namespace details {
 namespace {
 
 constexpr auto kMaxDelayAfterFailure = 24 * 60 * 60 * crl::time(1000);
+constexpr auto kSnapshotTailSize = int64(256);
+constexpr auto kShardBits = 4;
+constexpr auto kShardsCount = (1 << kShardBits);
 
 uint32 CountChecksum(bytes::const_span data) {
 	const auto seed = uint32(0);
@@ -54,10 +57,25 @@ QString PlaceFromId(PlaceId place) {
 	return result;
 }
 
+uint64 PlaceToNumber(PlaceId place) {
+	auto result = uint64();
+	for (const auto value : place) {
+		result = (result << 8) | uint64(value);
+	}
+	return result;
+}
+
 int32 GetUnixtime() {
 	return std::max(int32(time(nullptr)), 1);
 }
 
+int ShardIndex(const Key &key) {
+	// The high part of common keys is mostly a type tag with a dc id,
+	// so it is mixed with the low part to spread the keys evenly.
+	const auto mixed = (key.high ^ key.low) * 0x9E3779B97F4A7C15ULL;
+	return int(mixed >> (64 - kShardBits));
+}
+
 } // namespace
 
 DatabaseObject::Entry::Entry(
@@ -81,7 +99,9 @@ DatabaseObject::DatabaseObject(
 , _base(ComputeBasePath(path))
 , _settings(settings)
 , _writeBundlesTimer(_weak, [=] { writeBundles(); checkCompactor(); })
+, _writeStoresTimer(_weak, [=] { writeMultiStore(); checkCompactor(); })
 , _pruneTimer(_weak, [=] { prune(); }) {
+	_shards.resize(kShardsCount);
 	checkSettings();
 }
 
@@ -106,6 +126,11 @@ void DatabaseObject::checkSettings() {
 		&& _settings.maxDataSize < kDataSizeLimit);
 	Expects(_settings.maxBundledRecords > 0
 		&& _settings.maxBundledRecords < kBundledRecordsLimit);
+	Expects(_settings.groupCommitDelay >= 0);
+	Expects(_settings.mappedFilesLimit >= 0);
+	Expects(_settings.snapshotAfterTail >= 0);
+	Expects(_settings.maxGroupCommitRecords > 0
+		&& _settings.maxGroupCommitRecords < kBundledRecordsLimit);
 	Expects(!_settings.totalTimeLimit
 		|| _settings.totalTimeLimit > 0);
 	Expects(!_settings.totalSizeLimit
@@ -126,6 +151,16 @@ Error DatabaseObject::ioError(const QString &path) const {
 }
 
 void DatabaseObject::open(EncryptionKey &&key, FnMut<void(Error)> &&done) {
+	if (waitingForReplay()) {
+		waitForReplay([
+			=,
+			key = std::move(key),
+			done = std::move(done)
+		]() mutable {
+			open(std::move(key), std::move(done));
+		});
+		return;
+	}
 	close(nullptr);
 
 	const auto error = openSomeBinlog(std::move(key));
@@ -175,6 +210,14 @@ QString DatabaseObject::CompactReadyFilename() {
 	return QStringLiteral("binlog-ready");
 }
 
+QString DatabaseObject::SnapshotFilename() {
+	return QStringLiteral("index");
+}
+
+QString DatabaseObject::SnapshotReadyFilename() {
+	return QStringLiteral("index-ready");
+}
+
 QString DatabaseObject::binlogPath(Version version) const {
 	return computePath(version) + BinlogFilename();
 }
@@ -197,8 +240,11 @@ File::Result DatabaseObject::openBinlog(
 		EncryptionKey &key) {
 	const auto ready = compactReadyPath(version);
 	const auto path = binlogPath(version);
-	if (QFile(ready).exists() && !File::Move(ready, path)) {
-		return File::Result::Failed;
+	if (QFile(ready).exists()) {
+		QFile(computePath(version) + SnapshotFilename()).remove();
+		if (!File::Move(ready, path)) {
+			return File::Result::Failed;
+		}
 	}
 	const auto result = _binlog.open(path, mode, key);
 	if (result != File::Result::Success) {
@@ -213,7 +259,12 @@ File::Result DatabaseObject::openBinlog(
 	_path = computePath(version);
 	_key = std::move(key);
 	createCleaner();
-	readBinlog();
+	auto replay = Replay(_shards.size());
+	if (headerRequired) {
+		readSnapshot(replay);
+	}
+	readBinlog(replay);
+	startReplay(std::move(replay));
 	return File::Result::Success;
 }
 
@@ -235,6 +286,93 @@ bool DatabaseObject::writeHeader() {
 	return _binlog.write(bytes::object_as_span(&header));
 }
 
+QString DatabaseObject::snapshotPath() const {
+	return _path + SnapshotFilename();
+}
+
+bool DatabaseObject::readSnapshot(Replay &replay) {
+	if (!_settings.snapshotAfterTail) {
+		return false;
+	}
+	const auto start = _binlog.offset();
+	const auto fail = [&] {
+		_binlog.seek(start);
+		return false;
+	};
+	File snapshot;
+	const auto result = snapshot.open(snapshotPath(), File::Mode::Read, _key);
+	if (result != File::Result::Success) {
+		return false;
+	}
+	snapshot.map();
+
+	auto header = SnapshotHeader();
+	const auto flags = _settings.trackEstimatedTime
+		? SnapshotHeader::kTrackEstimatedTime
+		: 0U;
+	const auto read = snapshot.read(bytes::object_as_span(&header));
+	if (read != sizeof(header)
+		|| header.format != static_cast<uint32>(Format::Format_0)
+		|| header.flags != flags
+		|| header.binlogOffset < int64(sizeof(BasicHeader))
+		|| header.binlogOffset > _binlog.size()
+		|| header.binlogExcessLength < 0
+		|| (countBinlogTailChecksum(header.binlogOffset)
+			!= header.tailChecksum)) {
+		return fail();
+	}
+	const auto loaded = _settings.trackEstimatedTime
+		? readSnapshotEntries<StoreWithTime>(snapshot, header, replay)
+		: readSnapshotEntries<Store>(snapshot, header, replay);
+	if (!loaded) {
+		return fail();
+	}
+	_binlogExcessLength = header.binlogExcessLength;
+	_snapshotOffset = header.binlogOffset;
+	return true;
+}
+
+template <typename StoreRecord>
+bool DatabaseObject::readSnapshotEntries(
+		File &snapshot,
+		const SnapshotHeader &header,
+		Replay &replay) {
+	const auto size = int64(sizeof(header))
+		+ int64(header.count) * int64(sizeof(StoreRecord));
+	if (snapshot.size() != size) {
+		return false;
+	}
+	auto records = std::vector<StoreRecord>(header.count);
+	const auto bytes = bytes::make_span(records);
+	if (snapshot.readInParallel(bytes) != bytes.size()) {
+		return false;
+	}
+	for (const auto &record : records) {
+		const auto size = record.getSize();
+		if (record.type != Store::kType
+			|| size <= 0
+			|| size > _settings.maxDataSize) {
+			return false;
+		}
+	}
+	applyTimePoint(header.time);
+	for (const auto &record : records) {
+		const auto applied = processRecordStore(replay, &record);
+		Assert(applied);
+	}
+	return true;
+}
+
+std::optional<uint32> DatabaseObject::countBinlogTailChecksum(
+		int64 offset) {
+	const auto from = std::max(offset - kSnapshotTailSize, int64(0));
+	auto tail = bytes::vector(offset - from);
+	if (!_binlog.seek(from) || _binlog.read(tail) != tail.size()) {
+		return std::nullopt;
+	}
+	return CountChecksum(tail);
+}
+
 template <typename Reader, typename ...Handlers>
 void DatabaseObject::readBinlogHelper(
 		Reader &reader,
@@ -248,7 +386,7 @@ void DatabaseObject::readBinlogHelper(
 	}
 }
 
-void DatabaseObject::readBinlog() {
+void DatabaseObject::readBinlog(Replay &replay) {
 	BinlogWrapper wrapper(_binlog, _settings);
 	if (_settings.trackEstimatedTime) {
 		BinlogReader<
@@ -257,15 +395,13 @@ void DatabaseObject::readBinlog() {
 			MultiRemove,
 			MultiAccess> reader(wrapper);
 		readBinlogHelper(reader, [&](const StoreWithTime &record) {
-			return processRecordStore(
-				&record,
-				std::is_class<StoreWithTime>{});
+			return processRecordStore(replay, &record);
 		}, [&](const MultiStoreWithTime &header, const auto &element) {
-			return processRecordMultiStore(header, element);
+			return processRecordMultiStore(replay, header, element);
 		}, [&](const MultiRemove &header, const auto &element) {
-			return processRecordMultiRemove(header, element);
+			return processRecordMultiRemove(replay, header, element);
 		}, [&](const MultiAccess &header, const auto &element) {
-			return processRecordMultiAccess(header, element);
+			return processRecordMultiAccess(replay, header, element);
 		});
 	} else {
 		BinlogReader<
@@ -273,15 +409,173 @@ void DatabaseObject::readBinlog() {
 			MultiStore,
 			MultiRemove> reader(wrapper);
 		readBinlogHelper(reader, [&](const Store &record) {
-			return processRecordStore(&record, std::is_class<Store>{});
+			return processRecordStore(replay, &record);
 		}, [&](const MultiStore &header, const auto &element) {
-			return processRecordMultiStore(header, element);
+			return processRecordMultiStore(replay, header, element);
 		}, [&](const MultiRemove &header, const auto &element) {
-			return processRecordMultiRemove(header, element);
+			return processRecordMultiRemove(replay, header, element);
 		});
 	}
 	adjustRelativeTime();
-	optimize();
+}
+
+void DatabaseObject::startReplay(Replay &&replay) {
+	Expects(replay.size() == _shards.size());
+	Expects(_replayingShards.empty());
+
+	const auto recordSize = int64(_settings.trackEstimatedTime
+		? sizeof(StoreWithTime)
+		: sizeof(Store));
+	for (auto index = 0; index != int(replay.size()); ++index) {
+		if (replay[index].empty()) {
+			continue;
+		}
+		_replayingShards.emplace(index);
+
+		// Each shard has only its own keys, so shards are independent.
+		crl::async([
+			weak = _weak,
+			generation = _replayGeneration,
+			index,
+			recordSize,
+			actions = std::move(replay[index])
+		]() mutable {
+			auto shard = Shard();
+			auto excessLength = int64();
+			auto &map = shard.map;
+			for (auto &action : actions) {
+				switch (action.type) {
+				case ReplayAction::Type::Store:
+					if (shard.set(action.key, std::move(action.entry))) {
+						excessLength += recordSize;
+					}
+					break;
+				case ReplayAction::Type::Remove:
+					if (const auto i = map.find(action.key); i != end(map)) {
+						shard.erase(i);
+					}
+					break;
+				case ReplayAction::Type::Access:
+					if (const auto i = map.find(action.key); i != end(map)) {
+						i->second.useTime = action.entry.useTime;
+					}
+					break;
+				}
+			}
+			base::take(actions);
+			weak.with([
+				=,
+				shard = std::move(shard)
+			](DatabaseObject &that) mutable {
+				that.shardReplayed(
+					generation,
+					index,
+					std::move(shard),
+					excessLength);
+			});
+		});
+	}
+	if (_replayingShards.empty()) {
+		optimize();
+	}
+}
+
+void DatabaseObject::shardReplayed(
+		int generation,
+		int index,
+		Shard &&shard,
+		int64 excessLength) {
+	if (generation != _replayGeneration) {
+		return;
+	}
+	Assert(_replayingShards.contains(index));
+	Assert(_shards[index].map.empty());
+
+	_shards[index] = std::move(shard);
+	_binlogExcessLength += excessLength;
+	_replayingShards.remove(index);
+	pushStatsDelayed();
+
+	// Requests for this shard were made before any request that waits
+	// for the whole index, so they don't wait behind those ones.
+	auto waiting = base::take(_replayWaiters);
+	if (auto callbacks = _shardReplayWaiters.take(index)) {
+		for (auto &callback : *callbacks) {
+			callback();
+		}
+	}
+	Assert(_replayWaiters.empty());
+	_replayWaiters = std::move(waiting);
+
+	if (_replayingShards.empty()) {
+		Assert(_shardReplayWaiters.empty());
+		optimize();
+		for (auto &callback : base::take(_replayWaiters)) {
+			callback();
+		}
+	}
+}
+
+bool DatabaseObject::waitingForReplay(const Key &key) const {
+	return !_replayWaiters.empty()
+		|| _replayingShards.contains(ShardIndex(key));
+}
+
+bool DatabaseObject::waitingForReplay() const {
+	return !_replayWaiters.empty() || !_replayingShards.empty();
+}
+
+void DatabaseObject::waitForReplay(
+		const Key &key,
+		FnMut<void()> &&callback) {
+	if (_replayWaiters.empty()) {
+		_shardReplayWaiters[ShardIndex(key)].push_back(std::move(callback));
+	} else {
+		_replayWaiters.push_back(std::move(callback));
+	}
+}
+
+void DatabaseObject::waitForReplay(FnMut<void()> &&callback) {
+	_replayWaiters.push_back(std::move(callback));
+}
+
+auto DatabaseObject::shard(const Key &key) -> Shard& {
+	return _shards[ShardIndex(key)];
+}
+
+auto DatabaseObject::shard(const Key &key) const -> const Shard& {
+	return _shards[ShardIndex(key)];
+}
+
+size_type DatabaseObject::countEntries() const {
+	auto result = size_type();
+	for (const auto &shard : _shards) {
+		result += size_type(shard.map.size());
+	}
+	return result;
+}
+
+int64 DatabaseObject::countTotalSize() const {
+	auto result = int64();
+	for (const auto &shard : _shards) {
+		result += shard.totalSize;
+	}
+	return result;
+}
+
+uint64 DatabaseObject::countMinimalEntryTime() const {
+	auto result = uint64();
+	for (const auto &shard : _shards) {
+		if (!shard.minimalEntryTime) {
+			if (!shard.map.empty()) {
+				// Unknown for one shard means unknown for the whole index.
+				return 0;
+			}
+		} else if (!result || result > shard.minimalEntryTime) {
+			result = shard.minimalEntryTime;
+		}
+	}
+	return result;
 }
 
 uint64 DatabaseObject::countRelativeTime() const {
@@ -298,22 +592,140 @@ uint64 DatabaseObject::pruneBeforeTime() const {
 }
 
 void DatabaseObject::optimize() {
-	if (!startDelayedPruning()) {
+	if (!_replayingShards.empty()) {
+		// Will be called when the whole index is replayed.
+		return;
+	} else if (!startDelayedPruning()) {
 		checkCompactor();
 	}
+	checkSnapshot();
+}
+
+void DatabaseObject::checkSnapshot() {
+	if (!_settings.snapshotAfterTail
+		|| _snapshotWriting
+		|| _compactor.object
+		|| !_binlog.isOpen()) {
+		return;
+	}
+	const auto recordSize = _settings.trackEstimatedTime
+		? sizeof(StoreWithTime)
+		: sizeof(Store);
+	const auto from = std::max(_snapshotOffset, int64(sizeof(BasicHeader)));
+	const auto tail = _binlog.size() - from;
+
+	// Don't rewrite a large snapshot after each small binlog growth.
+	const auto snapshotSize = int64(countEntries() * recordSize);
+	if (tail >= std::max(_settings.snapshotAfterTail, snapshotSize / 4)) {
+		writeSnapshot();
+	}
+}
+
+void DatabaseObject::writeSnapshot() {
+	writeBundles();
+	if (!_binlog.isOpen()) {
+		return;
+	}
+	auto header = SnapshotHeader();
+	header.count = uint32(countEntries());
+	header.binlogOffset = _binlog.size();
+	header.binlogExcessLength = _binlogExcessLength;
+	header.time = _time;
+	const auto checksum = countBinlogTailChecksum(header.binlogOffset);
+	if (!checksum) {
+		_binlog.seek(_binlog.size());
+		return;
+	}
+	header.tailChecksum = *checksum;
+	if (_settings.trackEstimatedTime) {
+		header.flags |= SnapshotHeader::kTrackEstimatedTime;
+		writeSnapshotGeneric<StoreWithTime>(header);
+	} else {
+		writeSnapshotGeneric<Store>(header);
+	}
+}
+
+template <typename StoreRecord>
+void DatabaseObject::writeSnapshotGeneric(SnapshotHeader header) {
+	auto records = std::vector<StoreRecord>();
+	records.reserve(header.count);
+	for (const auto &shard : _shards) {
+		for (const auto &[key, entry] : shard.map) {
+			auto record = StoreRecord();
+			record.tag = entry.tag;
+			record.key = key;
+			record.setSize(entry.size);
+			record.checksum = entry.checksum;
+			record.place = entry.place;
+			if constexpr (std::is_same_v<StoreRecord, StoreWithTime>) {
+				record.time = _time;
+				record.time.setRelative(entry.useTime);
+			}
+			records.push_back(record);
+		}
+	}
+	_snapshotWriting = true;
+
+	// Encrypting and writing the whole index may take a while.
+	crl::async([
+		weak = _weak,
+		key = base::duplicate(_key),
+		ready = _path + SnapshotReadyFilename(),
+		generation = _snapshotGeneration,
+		header,
+		records = std::move(records)
+	]() mutable {
+		File snapshot;
+		const auto success = (snapshot.open(ready, File::Mode::Write, key)
+				== File::Result::Success)
+			&& snapshot.write(bytes::object_as_span(&header))
+			&& snapshot.write(bytes::make_span(records))
+			&& snapshot.flush();
+		snapshot.close();
+		weak.with([=](DatabaseObject &that) {
+			that.snapshotWritten(
+				generation,
+				header.binlogOffset,
+				ready,
+				success);
+		});
+	});
+}
+
+void DatabaseObject::snapshotWritten(
+		int generation,
+		int64 offset,
+		const QString &ready,
+		bool success) {
+	_snapshotWriting = false;
+	if (!success
+		|| generation != _snapshotGeneration
+		|| !File::Move(ready, snapshotPath())) {
+		QFile(ready).remove();
+		return;
+	}
+	_snapshotOffset = offset;
+}
+
+void DatabaseObject::removeSnapshot() {
+	++_snapshotGeneration;
+	_snapshotOffset = 0;
+	if (!_path.isEmpty()) {
+		QFile(snapshotPath()).remove();
+	}
 }
 
 bool DatabaseObject::startDelayedPruning() {
-	if (!_settings.trackEstimatedTime || _map.empty()) {
+	if (!_settings.trackEstimatedTime || !countEntries()) {
 		return false;
 	}
 	const auto before = pruneBeforeTime();
+	const auto minimalEntryTime = countMinimalEntryTime();
 	const auto pruning = [&] {
 		if (_settings.totalSizeLimit > 0
-			&& _totalSize > _settings.totalSizeLimit) {
+			&& countTotalSize() > _settings.totalSizeLimit) {
 			return true;
-		} else if ((!_minimalEntryTime && !_map.empty())
-			|| _minimalEntryTime <= before) {
+		} else if (!minimalEntryTime || minimalEntryTime <= before) {
 			return true;
 		}
 		return false;
@@ -324,9 +736,9 @@ bool DatabaseObject::startDelayedPruning() {
 			_pruneTimer.callOnce(_settings.pruneTimeout);
 		}
 		return true;
-	} else if (_minimalEntryTime != 0) {
-		Assert(_minimalEntryTime > before);
-		const auto seconds = int64(_minimalEntryTime - before);
+	} else if (minimalEntryTime != 0) {
+		Assert(minimalEntryTime > before);
+		const auto seconds = int64(minimalEntryTime - before);
 		if (!_pruneTimer.isActive()) {
 			_pruneTimer.callOnce(std::min(
 				crl::time(seconds * 1000),
@@ -337,7 +749,7 @@ bool DatabaseObject::startDelayedPruning() {
 }
 
 void DatabaseObject::prune() {
-	if (!_stale.empty()) {
+	if (!_stale.empty() || !_replayingShards.empty()) {
 		return;
 	}
 	auto stale = base::flat_set<Key>();
@@ -414,21 +826,23 @@ void DatabaseObject::collectTimeStale(
 		return;
 	}
 	const auto before = pruneBeforeTime();
-	if (!_minimalEntryTime || _minimalEntryTime > before) {
-		return;
-	}
-	_minimalEntryTime = 0;
-	_entriesWithMinimalTimeCount = 0;
-	for (const auto &[key, entry] : _map) {
-		if (entry.useTime <= before) {
-			stale.emplace(key);
-			staleTotalSize += entry.size;
-		} else if (!_minimalEntryTime
-			|| _minimalEntryTime > entry.useTime) {
-			_minimalEntryTime = entry.useTime;
-			_entriesWithMinimalTimeCount = 1;
-		} else if (_minimalEntryTime == entry.useTime) {
-			++_entriesWithMinimalTimeCount;
+	for (auto &shard : _shards) {
+		if (!shard.minimalEntryTime || shard.minimalEntryTime > before) {
+			continue;
+		}
+		shard.minimalEntryTime = 0;
+		shard.entriesWithMinimalTimeCount = 0;
+		for (const auto &[key, entry] : shard.map) {
+			if (entry.useTime <= before) {
+				stale.emplace(key);
+				staleTotalSize += entry.size;
+			} else if (!shard.minimalEntryTime
+				|| shard.minimalEntryTime > entry.useTime) {
+				shard.minimalEntryTime = entry.useTime;
+				shard.entriesWithMinimalTimeCount = 1;
+			} else if (shard.minimalEntryTime == entry.useTime) {
+				++shard.entriesWithMinimalTimeCount;
+			}
 		}
 	}
 }
@@ -437,7 +851,7 @@ void DatabaseObject::collectSizeStale(
 		base::flat_set<Key> &stale,
 		int64 &staleTotalSize) {
 	const auto removeSize = (_settings.totalSizeLimit > 0)
-		? (_totalSize - staleTotalSize - _settings.totalSizeLimit)
+		? (countTotalSize() - staleTotalSize - _settings.totalSizeLimit)
 		: 0;
 	if (removeSize <= 0) {
 		return;
@@ -457,23 +871,25 @@ void DatabaseObject::collectSizeStale(
 			&& (totalSizeAfterAdd - removeSize >= first.size));
 	};
 
-	for (const auto &bucket : _map) {
-		const auto &entry = bucket.second;
-		if (stale.contains(bucket.first)) {
-			continue;
-		}
-		const auto add = (oldestTotalSize < removeSize)
-			? true
-			: (entry.useTime < oldest.begin()->second->second.useTime);
-		if (!add) {
-			continue;
-		}
-		while (!oldest.empty() && canRemoveFirst(entry)) {
-			oldestTotalSize -= oldest.begin()->second->second.size;
-			oldest.erase(oldest.begin());
+	for (const auto &shard : _shards) {
+		for (const auto &bucket : shard.map) {
+			const auto &entry = bucket.second;
+			if (stale.contains(bucket.first)) {
+				continue;
+			}
+			const auto add = (oldestTotalSize < removeSize)
+				? true
+				: (entry.useTime < oldest.begin()->second->second.useTime);
+			if (!add) {
+				continue;
+			}
+			while (!oldest.empty() && canRemoveFirst(entry)) {
+				oldestTotalSize -= oldest.begin()->second->second.size;
+				oldest.erase(oldest.begin());
+			}
+			oldestTotalSize += entry.size;
+			oldest.emplace(entry.useTime, &bucket);
 		}
-		oldestTotalSize += entry.size;
-		oldest.emplace(entry.useTime, &bucket);
 	}
 
 	for (const auto &pair : oldest) {
@@ -493,12 +909,12 @@ void DatabaseObject::adjustRelativeTime() {
 }
 
 template <typename Record, typename Postprocess>
-bool DatabaseObject::processRecordStoreGeneric(
+auto DatabaseObject::parseRecordStoreGeneric(
 		const Record *record,
-		Postprocess &&postprocess) {
+		Postprocess &&postprocess) -> std::optional<Entry> {
 	const auto size = record->getSize();
 	if (size <= 0 || size > _settings.maxDataSize) {
-		return false;
+		return std::nullopt;
 	}
 	auto entry = Entry(
 		record->place,
@@ -507,22 +923,21 @@ bool DatabaseObject::processRecordStoreGeneric(
 		size,
 		_time.getRelative());
 	if (!postprocess(entry, record)) {
-		return false;
+		return std::nullopt;
 	}
-	setMapEntry(record->key, std::move(entry));
-	return true;
+	return entry;
 }
 
-bool DatabaseObject::processRecordStore(
+auto DatabaseObject::parseRecordStore(
 		const Store *record,
-		std::is_class<Store>) {
+		std::is_class<Store>) -> std::optional<Entry> {
 	const auto postprocess = [](auto&&...) { return true; };
-	return processRecordStoreGeneric(record, postprocess);
+	return parseRecordStoreGeneric(record, postprocess);
 }
 
-bool DatabaseObject::processRecordStore(
+auto DatabaseObject::parseRecordStore(
 		const StoreWithTime *record,
-		std::is_class<StoreWithTime>) {
+		std::is_class<StoreWithTime>) -> std::optional<Entry> {
 	const auto postprocess = [&](
 			Entry &entry,
 			not_null<const StoreWithTime*> record) {
@@ -530,17 +945,29 @@ bool DatabaseObject::processRecordStore(
 		entry.useTime = record->time.getRelative();
 		return true;
 	};
-	return processRecordStoreGeneric(record, postprocess);
+	return parseRecordStoreGeneric(record, postprocess);
+}
+
+template <typename Record>
+bool DatabaseObject::processRecordStore(
+		Replay &replay,
+		const Record *record) {
+	auto entry = parseRecordStore(record, std::is_class<Record>{});
+	if (!entry) {
+		return false;
+	}
+	auto &actions = replay[ShardIndex(record->key)];
+	actions.push_back({ record->key, std::move(*entry) });
+	return true;
 }
 
 template <typename Record, typename GetElement>
 bool DatabaseObject::processRecordMultiStore(
+		Replay &replay,
 		const Record &header,
 		const GetElement &element) {
 	while (const auto entry = element()) {
-		if (!processRecordStore(
-				entry,
-				std::is_class<typename Record::Part>{})) {
+		if (!processRecordStore(replay, entry)) {
 			return false;
 		}
 	}
@@ -549,83 +976,105 @@ bool DatabaseObject::processRecordMultiStore(
 
 template <typename GetElement>
 bool DatabaseObject::processRecordMultiRemove(
+		Replay &replay,
 		const MultiRemove &header,
 		const GetElement &element) {
 	_binlogExcessLength += sizeof(header);
 	while (const auto entry = element()) {
 		_binlogExcessLength += sizeof(*entry);
-		if (const auto i = _map.find(*entry); i != end(_map)) {
-			eraseMapEntry(i);
-		}
+
+		auto &actions = replay[ShardIndex(*entry)];
+		actions.push_back({ *entry, Entry(), ReplayAction::Type::Remove });
 	}
 	return true;
 }
 
 template <typename GetElement>
 bool DatabaseObject::processRecordMultiAccess(
+		Replay &replay,
 		const MultiAccess &header,
 		const GetElement &element) {
 	Expects(_settings.trackEstimatedTime);
 
 	applyTimePoint(header.time);
-	const auto relative = header.time.getRelative();
+	auto access = Entry();
+	access.useTime = header.time.getRelative();
 
 	_binlogExcessLength += sizeof(header);
 	while (const auto entry = element()) {
 		_binlogExcessLength += sizeof(*entry);
-		if (const auto i = _map.find(*entry); i != end(_map)) {
-			i->second.useTime = relative;
-		}
+
+		auto &actions = replay[ShardIndex(*entry)];
+		actions.push_back({ *entry, access, ReplayAction::Type::Access });
 	}
 	return true;
 }
 
-void DatabaseObject::setMapEntry(const Key &key, Entry &&entry) {
-	auto &already = _map[key];
+bool DatabaseObject::Shard::set(const Key &key, Entry &&entry) {
+	auto &already = map[key];
+	const auto replaced = (already.size != 0);
 	updateStats(already, entry);
-	if (already.size != 0) {
-		_binlogExcessLength += _settings.trackEstimatedTime
-			? sizeof(StoreWithTime)
-			: sizeof(Store);
-	}
 	if (entry.useTime != 0
-		&& (entry.useTime < _minimalEntryTime || !_minimalEntryTime)) {
-		_minimalEntryTime = entry.useTime;
-		_entriesWithMinimalTimeCount = 1;
-	} else if (_minimalEntryTime != 0 && already.useTime != entry.useTime) {
-		if (entry.useTime == _minimalEntryTime) {
-			Assert(_entriesWithMinimalTimeCount > 0);
-			++_entriesWithMinimalTimeCount;
-		} else if (already.useTime == _minimalEntryTime) {
-			Assert(_entriesWithMinimalTimeCount > 0);
-			if (!--_entriesWithMinimalTimeCount) {
-				_minimalEntryTime = 0;
+		&& (entry.useTime < minimalEntryTime || !minimalEntryTime)) {
+		minimalEntryTime = entry.useTime;
+		entriesWithMinimalTimeCount = 1;
+	} else if (minimalEntryTime != 0 && already.useTime != entry.useTime) {
+		if (entry.useTime == minimalEntryTime) {
+			Assert(entriesWithMinimalTimeCount > 0);
+			++entriesWithMinimalTimeCount;
+		} else if (already.useTime == minimalEntryTime) {
+			Assert(entriesWithMinimalTimeCount > 0);
+			if (!--entriesWithMinimalTimeCount) {
+				minimalEntryTime = 0;
 			}
 		}
 	}
 	already = std::move(entry);
+	return replaced;
 }
 
-void DatabaseObject::updateStats(const Entry &was, const Entry &now) {
-	_totalSize += now.size - was.size;
+void DatabaseObject::Shard::erase(const Map::const_iterator &i) {
+	const auto &entry = i->second;
+	updateStats(entry, Entry());
+	if (minimalEntryTime != 0 && entry.useTime == minimalEntryTime) {
+		Assert(entriesWithMinimalTimeCount > 0);
+		if (!--entriesWithMinimalTimeCount) {
+			minimalEntryTime = 0;
+		}
+	}
+	map.erase(i);
+}
+
+void DatabaseObject::Shard::updateStats(
+		const Entry &was,
+		const Entry &now) {
+	totalSize += now.size - was.size;
 	if (now.tag == was.tag) {
 		if (now.tag) {
-			auto &summary = _taggedStats[now.tag];
+			auto &summary = taggedStats[now.tag];
 			summary.count += (now.size ? 1 : 0) - (was.size ? 1 : 0);
 			summary.totalSize += now.size - was.size;
 		}
 	} else {
 		if (now.tag) {
-			auto &summary = _taggedStats[now.tag];
+			auto &summary = taggedStats[now.tag];
 			summary.count += (now.size ? 1 : 0);
 			summary.totalSize += now.size;
 		}
 		if (was.tag) {
-			auto &summary = _taggedStats[was.tag];
+			auto &summary = taggedStats[was.tag];
 			summary.count -= (was.size ? 1 : 0);
 			summary.totalSize -= was.size;
 		}
 	}
+}
+
+void DatabaseObject::setMapEntry(const Key &key, Entry &&entry) {
+	if (shard(key).set(key, std::move(entry))) {
+		_binlogExcessLength += _settings.trackEstimatedTime
+			? sizeof(StoreWithTime)
+			: sizeof(Store);
+	}
 	pushStatsDelayed();
 }
 
@@ -647,17 +1096,14 @@ void DatabaseObject::pushStats() {
 	}
 }
 
-void DatabaseObject::eraseMapEntry(const Map::const_iterator &i) {
-	if (i != end(_map)) {
-		const auto &entry = i->second;
-		updateStats(entry, Entry());
-		if (_minimalEntryTime != 0 && entry.useTime == _minimalEntryTime) {
-			Assert(_entriesWithMinimalTimeCount > 0);
-			if (!--_entriesWithMinimalTimeCount) {
-				_minimalEntryTime = 0;
-			}
-		}
-		_map.erase(i);
+void DatabaseObject::eraseMapEntry(
+		Shard &shard,
+		const Map::const_iterator &i) {
+	if (i != end(shard.map)) {
+		_storing.remove(i->first);
+		unmapPlace(i->second.place);
+		shard.erase(i);
+		pushStatsDelayed();
 	}
 }
 
@@ -681,6 +1127,9 @@ void DatabaseObject::applyTimePoint(EstimatedTimePoint time) {
 void DatabaseObject::compactorDone(
 		const QString &path,
 		int64 originalReadTill) {
+	// Offsets in the snapshot are not valid for the compacted binlog.
+	removeSnapshot();
+
 	const auto size = _binlog.size();
 	const auto binlog = binlogPath();
 	const auto ready = compactReadyPath();
@@ -732,6 +1181,12 @@ void DatabaseObject::compactorFail() {
 }
 
 void DatabaseObject::close(FnMut<void()> &&done) {
+	if (waitingForReplay()) {
+		waitForReplay([=, done = std::move(done)]() mutable {
+			close(std::move(done));
+		});
+		return;
+	}
 	if (_binlog.isOpen()) {
 		writeBundles();
 		_binlog.close();
@@ -743,18 +1198,24 @@ void DatabaseObject::close(FnMut<void()> &&done) {
 void DatabaseObject::clearState() {
 	_path = QString();
 	_key = {};
-	_map = {};
+	_shards = std::vector<Shard>(kShardsCount);
+	_replayingShards = {};
+	_shardReplayWaiters = {};
+	_replayWaiters = {};
+	++_replayGeneration;
 	_removing = {};
 	_accessed = {};
+	_storing = {};
+	_mappedPlaces = {};
+	_mappedPlacesUsage.clear();
 	_stale = {};
 	_time = {};
 	_binlogExcessLength = 0;
-	_totalSize = 0;
-	_minimalEntryTime = 0;
-	_entriesWithMinimalTimeCount = 0;
-	_taggedStats = {};
+	_snapshotOffset = 0;
+	++_snapshotGeneration;
 	_pushingStats = false;
 	_writeBundlesTimer.cancel();
+	_writeStoresTimer.cancel();
 	_pruneTimer.cancel();
 	_compactor = CompactorWrap();
 }
@@ -763,7 +1224,16 @@ void DatabaseObject::put(
 		const Key &key,
 		TaggedValue &&value,
 		FnMut<void(Error)> &&done) {
-	if (value.bytes.isEmpty()) {
+	if (waitingForReplay(key)) {
+		waitForReplay(key, [
+			=,
+			value = std::move(value),
+			done = std::move(done)
+		]() mutable {
+			put(key, std::move(value), std::move(done));
+		});
+		return;
+	} else if (value.bytes.isEmpty()) {
 		remove(key, std::move(done));
 		return;
 	}
@@ -813,6 +1283,67 @@ void DatabaseObject::put(
 	}
 }
 
+template <typename StoreRecord>
+bool DatabaseObject::writeStore(const StoreRecord &record) {
+	auto writeable = record;
+	const auto success = _binlog.write(bytes::object_as_span(&writeable));
+	if (!success) {
+		_binlog.close();
+		return false;
+	}
+	_binlog.flush();
+	++_storeFlushes;
+	++_storeFlushedRecords;
+	return true;
+}
+
+template <typename StoreRecord>
+void DatabaseObject::writeStoreLazy(const StoreRecord &record) {
+	auto &pending = _storing[record.key];
+	if (pending.getSize() != 0) {
+		// Only the last record for the key will be written to the binlog.
+		_binlogExcessLength -= sizeof(StoreRecord);
+	}
+	static_cast<StoreRecord&>(pending) = record;
+	if (_storing.size() >= _settings.maxGroupCommitRecords) {
+		writeMultiStore();
+	} else if (!_writeStoresTimer.isActive()) {
+		_writeStoresTimer.callOnce(_settings.groupCommitDelay);
+	}
+}
+
+template <typename MultiStoreRecord>
+Error DatabaseObject::writeMultiStoreGeneric() {
+	const auto size = size_type(_storing.size());
+	auto header = MultiStoreRecord(size);
+	auto list = std::vector<typename MultiStoreRecord::Part>();
+	list.reserve(size);
+	for (const auto &[key, record] : base::take(_storing)) {
+		list.push_back(record);
+	}
+	if (_binlog.write(bytes::object_as_span(&header))
+		&& _binlog.write(bytes::make_span(list))) {
+		_binlog.flush();
+		++_storeFlushes;
+		_storeFlushedRecords += size;
+		return Error::NoError();
+	}
+	_binlog.close();
+	return ioError(binlogPath());
+}
+
+Error DatabaseObject::writeMultiStore() {
+	Expects(_storing.size() <= _settings.maxGroupCommitRecords);
+
+	if (_storing.empty()) {
+		return Error::NoError();
+	}
+	_writeStoresTimer.cancel();
+	return _settings.trackEstimatedTime
+		? writeMultiStoreGeneric<MultiStoreWithTime>()
+		: writeMultiStoreGeneric<MultiStore>();
+}
+
 template <typename StoreRecord>
 std::optional<QString> DatabaseObject::writeKeyPlaceGeneric(
 		StoreRecord &&record,
@@ -826,7 +1357,8 @@ std::optional<QString> DatabaseObject::writeKeyPlaceGeneric(
 	record.key = key;
 	record.setSize(size);
 	record.checksum = checksum;
-	if (const auto i = _map.find(key); i != end(_map)) {
+	auto &map = shard(key).map;
+	if (const auto i = map.find(key); i != end(map)) {
 		const auto &already = i->second;
 		if (already.tag == record.tag
 			&& already.size == size
@@ -840,19 +1372,17 @@ std::optional<QString> DatabaseObject::writeKeyPlaceGeneric(
 			bytes::set_random(bytes::object_as_span(&record.place));
 		} while (!isFreePlace(record.place));
 	}
+	unmapPlace(record.place);
 	const auto result = placePath(record.place);
-	auto writeable = record;
-	const auto success = _binlog.write(bytes::object_as_span(&writeable));
-	if (!success) {
-		_binlog.close();
+	if (_settings.groupCommitDelay > 0) {
+		writeStoreLazy(record);
+	} else if (!writeStore(record)) {
 		return QString();
 	}
-	_binlog.flush();
 
-	const auto applied = processRecordStore(
-		&record,
-		std::is_class<StoreRecord>{});
-	Assert(applied);
+	auto entry = parseRecordStore(&record, std::is_class<StoreRecord>{});
+	Assert(entry.has_value());
+	setMapEntry(key, std::move(*entry));
 	return result;
 }
 
@@ -886,7 +1416,8 @@ Error DatabaseObject::writeExistingPlaceGeneric(
 	record.tag = entry.tag;
 	record.setSize(entry.size);
 	record.checksum = entry.checksum;
-	if (const auto i = _map.find(key); i != end(_map)) {
+	auto &map = shard(key).map;
+	if (const auto i = map.find(key); i != end(map)) {
 		const auto &already = i->second;
 		if (already.tag == record.tag
 			&& already.size == entry.size
@@ -897,18 +1428,15 @@ Error DatabaseObject::writeExistingPlaceGeneric(
 		}
 	}
 	record.place = entry.place;
-	auto writeable = record;
-	const auto success = _binlog.write(bytes::object_as_span(&writeable));
-	if (!success) {
-		_binlog.close();
+	if (_settings.groupCommitDelay > 0) {
+		writeStoreLazy(record);
+	} else if (!writeStore(record)) {
 		return ioError(binlogPath());
 	}
-	_binlog.flush();
 
-	const auto applied = processRecordStore(
-		&record,
-		std::is_class<StoreRecord>{});
-	Assert(applied);
+	auto parsed = parseRecordStore(&record, std::is_class<StoreRecord>{});
+	Assert(parsed.has_value());
+	setMapEntry(key, std::move(*parsed));
 	return Error::NoError();
 }
 
@@ -935,8 +1463,15 @@ Error DatabaseObject::writeExistingPlace(
 void DatabaseObject::get(
 		const Key &key,
 		FnMut<void(TaggedValue&&)> &&done) {
-	const auto i = _map.find(key);
-	if (i == _map.end()) {
+	if (waitingForReplay(key)) {
+		waitForReplay(key, [=, done = std::move(done)]() mutable {
+			get(key, std::move(done));
+		});
+		return;
+	}
+	const auto &map = shard(key).map;
+	const auto i = map.find(key);
+	if (i == map.end()) {
 		invokeCallback(done, TaggedValue());
 		return;
 	}
@@ -955,26 +1490,68 @@ void DatabaseObject::get(
 	}
 }
 
-QByteArray DatabaseObject::readValueData(PlaceId place, size_type size) const {
+QByteArray DatabaseObject::readValueData(PlaceId place, size_type size) {
+	if (const auto mapped = mappedPlaceFile(place, size)) {
+		auto result = mapped->seek(0)
+			? readValueData(*mapped, size)
+			: QByteArray();
+		if (result.isEmpty()) {
+			unmapPlace(place);
+		}
+		return result;
+	}
 	const auto path = placePath(place);
 	File data;
 	const auto result = data.open(path, File::Mode::Read, _key);
 	switch (result) {
 	case File::Result::Failed:
 	case File::Result::WrongKey: return QByteArray();
-	case File::Result::Success: {
-		auto result = QByteArray(size, Qt::Uninitialized);
-		const auto bytes = bytes::make_detached_span(result);
-		const auto read = data.readWithPadding(bytes);
-		if (read != size) {
-			return QByteArray();
-		}
-		return result;
-	} break;
+	case File::Result::Success: return readValueData(data, size);
 	}
 	Unexpected("Result in DatabaseObject::get.");
 }
 
+QByteArray DatabaseObject::readValueData(File &data, size_type size) const {
+	auto result = QByteArray(size, Qt::Uninitialized);
+	const auto bytes = bytes::make_detached_span(result);
+	const auto read = data.readWithPadding(bytes);
+	if (read != size) {
+		return QByteArray();
+	}
+	return result;
+}
+
+File *DatabaseObject::mappedPlaceFile(PlaceId place, size_type size) {
+	if (!_settings.mappedFilesLimit || size > _settings.maxMappedFileSize) {
+		return nullptr;
+	}
+	const auto id = PlaceToNumber(place);
+	if (const auto i = _mappedPlaces.find(id); i != end(_mappedPlaces)) {
+		_mappedPlacesUsage.up(id);
+		return i->second.get();
+	}
+	auto data = std::make_unique<File>();
+	const auto result = data->open(placePath(place), File::Mode::Read, _key);
+	if (result != File::Result::Success || !data->map()) {
+		return nullptr;
+	}
+	while (_mappedPlaces.size() >= _settings.mappedFilesLimit) {
+		_mappedPlaces.erase(_mappedPlacesUsage.take_lowest());
+	}
+	_mappedPlacesUsage.up(id);
+	return _mappedPlaces.emplace(id, std::move(data)).first->second.get();
+}
+
+void DatabaseObject::unmapPlace(PlaceId place) {
+	if (_mappedPlaces.empty()) {
+		return;
+	}
+	const auto id = PlaceToNumber(place);
+	if (_mappedPlaces.erase(id)) {
+		_mappedPlacesUsage.remove(id);
+	}
+}
+
 void DatabaseObject::recordEntryAccess(const Key &key) {
 	if (!_settings.trackEstimatedTime) {
 		return;
@@ -985,13 +1562,20 @@ void DatabaseObject::recordEntryAccess(const Key &key) {
 }
 
 void DatabaseObject::remove(const Key &key, FnMut<void(Error)> &&done) {
-	const auto i = _map.find(key);
-	if (i != _map.end()) {
+	if (waitingForReplay(key)) {
+		waitForReplay(key, [=, done = std::move(done)]() mutable {
+			remove(key, std::move(done));
+		});
+		return;
+	}
+	auto &shard = this->shard(key);
+	const auto i = shard.map.find(key);
+	if (i != shard.map.end()) {
 		_removing.emplace(key);
 		writeMultiRemoveLazy();
 
 		const auto path = placePath(i->second.place);
-		eraseMapEntry(i);
+		eraseMapEntry(shard, i);
 		if (QFile(path).remove() || !QFile(path).exists()) {
 			invokeCallback(done, Error::NoError());
 		} else {
@@ -1006,7 +1590,18 @@ void DatabaseObject::putIfEmpty(
 		const Key &key,
 		TaggedValue &&value,
 		FnMut<void(Error)> &&done) {
-	if (_map.find(key) != end(_map)) {
+	if (waitingForReplay(key)) {
+		waitForReplay(key, [
+			=,
+			value = std::move(value),
+			done = std::move(done)
+		]() mutable {
+			putIfEmpty(key, std::move(value), std::move(done));
+		});
+		return;
+	}
+	const auto &map = shard(key).map;
+	if (map.find(key) != end(map)) {
 		invokeCallback(done, Error::NoError());
 		return;
 	}
@@ -1017,7 +1612,14 @@ void DatabaseObject::copyIfEmpty(
 		const Key &from,
 		const Key &to,
 		FnMut<void(Error)> &&done) {
-	if (_map.find(to) != end(_map)) {
+	if (waitingForReplay()) {
+		waitForReplay([=, done = std::move(done)]() mutable {
+			copyIfEmpty(from, to, std::move(done));
+		});
+		return;
+	}
+	const auto &map = shard(to).map;
+	if (map.find(to) != end(map)) {
 		invokeCallback(done, Error::NoError());
 		return;
 	}
@@ -1030,19 +1632,27 @@ void DatabaseObject::moveIfEmpty(
 		const Key &from,
 		const Key &to,
 		FnMut<void(Error)> &&done) {
-	if (_map.find(to) != end(_map)) {
+	if (waitingForReplay()) {
+		waitForReplay([=, done = std::move(done)]() mutable {
+			moveIfEmpty(from, to, std::move(done));
+		});
+		return;
+	}
+	const auto &map = shard(to).map;
+	if (map.find(to) != end(map)) {
 		invokeCallback(done, Error::NoError());
 		return;
 	}
-	const auto i = _map.find(from);
-	if (i == _map.end()) {
+	auto &fromShard = shard(from);
+	const auto i = fromShard.map.find(from);
+	if (i == fromShard.map.end()) {
 		invokeCallback(done, Error::NoError());
 		return;
 	}
 	_removing.emplace(from);
 
 	const auto entry = i->second;
-	eraseMapEntry(i);
+	eraseMapEntry(fromShard, i);
 
 	const auto result = writeMultiRemove();
 	if (result.type != Error::Type::None) {
@@ -1060,9 +1670,17 @@ rpl::producer<Stats> DatabaseObject::stats() const {
 
 Stats DatabaseObject::collectStats() const {
 	auto result = Stats();
-	result.tagged = _taggedStats;
-	result.full.count = _map.size();
-	result.full.totalSize = _totalSize;
+	for (const auto &shard : _shards) {
+		for (const auto &[tag, summary] : shard.taggedStats) {
+			auto &tagged = result.tagged[tag];
+			tagged.count += summary.count;
+			tagged.totalSize += summary.totalSize;
+		}
+	}
+	result.full.count = countEntries();
+	result.full.totalSize = countTotalSize();
+	result.storeFlushes = _storeFlushes;
+	result.storeFlushedRecords = _storeFlushedRecords;
 	result.clearing = (_cleaner.object != nullptr) || !_stale.empty();
 	return result;
 }
@@ -1124,6 +1742,9 @@ Error DatabaseObject::writeMultiAccessBlock() {
 	Expects(_settings.trackEstimatedTime);
 	Expects(_accessed.size() <= _settings.maxBundledRecords);
 
+	// Access records should follow the stores of the same keys.
+	writeMultiStore();
+
 	const auto time = countTimePoint();
 	const auto size = _accessed.size();
 	auto header = MultiAccess(time, size);
@@ -1136,7 +1757,8 @@ Error DatabaseObject::writeMultiAccessBlock() {
 	}
 	_time = time;
 	for (const auto &entry : list) {
-		if (const auto i = _map.find(entry); i != end(_map)) {
+		auto &map = shard(entry).map;
+		if (const auto i = map.find(entry); i != end(map)) {
 			i->second.useTime = _time.getRelative();
 		}
 	}
@@ -1153,6 +1775,7 @@ Error DatabaseObject::writeMultiAccessBlock() {
 }
 
 void DatabaseObject::writeBundles() {
+	writeMultiStore();
 	writeMultiRemove();
 	if (_settings.trackEstimatedTime) {
 		writeMultiAccess();
@@ -1180,6 +1803,7 @@ void DatabaseObject::cleanerDone(Error error) {
 
 void DatabaseObject::checkCompactor() {
 	if (_compactor.object
+		|| !_replayingShards.empty()
 		|| !_settings.compactAfterExcess
 		|| _binlogExcessLength < _settings.compactAfterExcess) {
 		return;
@@ -1193,7 +1817,7 @@ void DatabaseObject::checkCompactor() {
 	auto info = Compactor::Info();
 	info.till = _binlog.size();
 	info.systemTime = _time.system;
-	info.keysCount = _map.size();
+	info.keysCount = countEntries();
 	_compactor.object = std::make_unique<Compactor>(
 		_weak,
 		_compactor.guard.make_guard(),
@@ -1205,6 +1829,12 @@ void DatabaseObject::checkCompactor() {
 }
 
 void DatabaseObject::clear(FnMut<void(Error)> &&done) {
+	if (waitingForReplay()) {
+		waitForReplay([=, done = std::move(done)]() mutable {
+			clear(std::move(done));
+		});
+		return;
+	}
 	auto key = std::move(_key);
 	if (!key.empty()) {
 		close(nullptr);
@@ -1223,10 +1853,18 @@ void DatabaseObject::clear(FnMut<void(Error)> &&done) {
 }
 
 void DatabaseObject::clearByTag(uint8 tag, FnMut<void(Error)> &&done) {
+	if (waitingForReplay()) {
+		waitForReplay([=, done = std::move(done)]() mutable {
+			clearByTag(tag, std::move(done));
+		});
+		return;
+	}
 	const auto hadStale = !_stale.empty();
-	for (const auto &[key, entry] : _map) {
-		if (entry.tag == tag) {
-			_stale.push_back(key);
+	for (const auto &shard : _shards) {
+		for (const auto &[key, entry] : shard.map) {
+			if (entry.tag == tag) {
+				_stale.push_back(key);
+			}
 		}
 	}
 	if (!hadStale) {
@@ -1251,7 +1889,8 @@ auto DatabaseObject::getManyRaw(const std::vector<Key> &keys) const
 	auto result = std::vector<Raw>();
 	result.reserve(keys.size());
 	for (const auto &key : keys) {
-		if (const auto i = _map.find(key); i != end(_map)) {
+		const auto &map = shard(key).map;
+		if (const auto i = map.find(key); i != end(map)) {
 			result.push_back(*i);
 		}
 	}
@@ -1259,6 +1898,9 @@ auto DatabaseObject::getManyRaw(const std::vector<Key> &keys) const
 }
 
 DatabaseObject::~DatabaseObject() {
+	// Shards still being replayed are dropped with the whole object.
+	_replayingShards = {};
+	_replayWaiters = {};
 	close(nullptr);
 }
 
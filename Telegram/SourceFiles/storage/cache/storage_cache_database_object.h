@@ -12,7 +12,9 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "base/binary_guard.h"
 #include "base/concurrent_timer.h"
 #include "base/bytes.h"
+#include "base/flat_map.h"
 #include "base/flat_set.h"
+#include "base/last_used_cache.h"
 #include <set>
 #include <rpl/event_stream.h>
 
@@ -64,6 +66,8 @@ public:
 
 	static QString BinlogFilename();
 	static QString CompactReadyFilename();
+	static QString SnapshotFilename();
+	static QString SnapshotReadyFilename();
 
 	void compactorDone(const QString &path, int64 originalReadTill);
 	void compactorFail();
@@ -103,6 +107,32 @@ private:
 	};
 	using Map = std::unordered_map<Key, Entry>;
 
+	// Part of the index with the keys of the same ShardIndex().
+	struct Shard {
+		bool set(const Key &key, Entry &&entry);
+		void erase(const Map::const_iterator &i);
+		void updateStats(const Entry &was, const Entry &now);
+
+		Map map;
+		int64 totalSize = 0;
+		uint64 minimalEntryTime = 0;
+		size_type entriesWithMinimalTimeCount = 0;
+		base::flat_map<uint8, TaggedSummary> taggedStats;
+	};
+
+	// Binlog and snapshot records are split by shards and replayed later.
+	struct ReplayAction {
+		enum class Type : uint8 {
+			Store,
+			Remove,
+			Access,
+		};
+		Key key;
+		Entry entry;
+		Type type = Type::Store;
+	};
+	using Replay = std::vector<std::vector<ReplayAction>>;
+
 	template <typename Callback, typename ...Args>
 	void invokeCallback(Callback &&callback, Args &&...args) const;
 
@@ -122,31 +152,74 @@ private:
 		EncryptionKey &key);
 	bool readHeader();
 	bool writeHeader();
+	QString snapshotPath() const;
 
-	void readBinlog();
+	bool readSnapshot(Replay &replay);
+	template <typename StoreRecord>
+	bool readSnapshotEntries(
+		File &snapshot,
+		const SnapshotHeader &header,
+		Replay &replay);
+	std::optional<uint32> countBinlogTailChecksum(int64 offset);
+	void checkSnapshot();
+	template <typename StoreRecord>
+	void writeSnapshotGeneric(SnapshotHeader header);
+	void writeSnapshot();
+	void snapshotWritten(
+		int generation,
+		int64 offset,
+		const QString &ready,
+		bool success);
+	void removeSnapshot();
+
+	void readBinlog(Replay &replay);
 	template <typename Reader, typename ...Handlers>
 	void readBinlogHelper(Reader &reader, Handlers &&...handlers);
 	template <typename Record, typename Postprocess>
-	bool processRecordStoreGeneric(
+	std::optional<Entry> parseRecordStoreGeneric(
 		const Record *record,
 		Postprocess &&postprocess);
-	bool processRecordStore(const Store *record, std::is_class<Store>);
-	bool processRecordStore(
+	std::optional<Entry> parseRecordStore(
+		const Store *record,
+		std::is_class<Store>);
+	std::optional<Entry> parseRecordStore(
 		const StoreWithTime *record,
 		std::is_class<StoreWithTime>);
+	template <typename Record>
+	bool processRecordStore(Replay &replay, const Record *record);
 	template <typename Record, typename GetElement>
 	bool processRecordMultiStore(
+		Replay &replay,
 		const Record &header,
 		const GetElement &element);
 	template <typename GetElement>
 	bool processRecordMultiRemove(
+		Replay &replay,
 		const MultiRemove &header,
 		const GetElement &element);
 	template <typename GetElement>
 	bool processRecordMultiAccess(
+		Replay &replay,
 		const MultiAccess &header,
 		const GetElement &element);
 
+	void startReplay(Replay &&replay);
+	void shardReplayed(
+		int generation,
+		int index,
+		Shard &&shard,
+		int64 excessLength);
+	bool waitingForReplay(const Key &key) const;
+	bool waitingForReplay() const;
+	void waitForReplay(const Key &key, FnMut<void()> &&callback);
+	void waitForReplay(FnMut<void()> &&callback);
+
+	Shard &shard(const Key &key);
+	const Shard &shard(const Key &key) const;
+	size_type countEntries() const;
+	int64 countTotalSize() const;
+	uint64 countMinimalEntryTime() const;
+
 	void optimize();
 	void checkCompactor();
 	void adjustRelativeTime();
@@ -168,15 +241,17 @@ private:
 	void clearStaleChunkDelayed();
 	void clearStaleChunk();
 
-	void updateStats(const Entry &was, const Entry &now);
 	Stats collectStats() const;
 	void pushStatsDelayed();
 	void pushStats();
 
 	void setMapEntry(const Key &key, Entry &&entry);
-	void eraseMapEntry(const Map::const_iterator &i);
+	void eraseMapEntry(Shard &shard, const Map::const_iterator &i);
 	void recordEntryAccess(const Key &key);
-	QByteArray readValueData(PlaceId place, size_type size) const;
+	QByteArray readValueData(PlaceId place, size_type size);
+	QByteArray readValueData(File &data, size_type size) const;
+	File *mappedPlaceFile(PlaceId place, size_type size);
+	void unmapPlace(PlaceId place);
 
 	Version findAvailableVersion() const;
 	QString versionPath() const;
@@ -197,6 +272,13 @@ private:
 		const TaggedValue &value,
 		uint32 checksum);
 	template <typename StoreRecord>
+	bool writeStore(const StoreRecord &record);
+	template <typename StoreRecord>
+	void writeStoreLazy(const StoreRecord &record);
+	template <typename MultiStoreRecord>
+	Error writeMultiStoreGeneric();
+	Error writeMultiStore();
+	template <typename StoreRecord>
 	Error writeExistingPlaceGeneric(
 		StoreRecord &&record,
 		const Key &key,
@@ -221,24 +303,33 @@ private:
 	Settings _settings;
 	EncryptionKey _key;
 	File _binlog;
-	Map _map;
+	std::vector<Shard> _shards;
+	base::flat_set<int> _replayingShards;
+	base::flat_map<int, std::vector<FnMut<void()>>> _shardReplayWaiters;
+	std::vector<FnMut<void()>> _replayWaiters;
+	int _replayGeneration = 0;
 	std::set<Key> _removing;
 	std::set<Key> _accessed;
+	base::flat_map<Key, StoreWithTime> _storing;
+	std::unordered_map<uint64, std::unique_ptr<File>> _mappedPlaces;
+	base::last_used_cache<uint64> _mappedPlacesUsage;
 	std::vector<Key> _stale;
 
 	EstimatedTimePoint _time;
 
 	int64 _binlogExcessLength = 0;
-	int64 _totalSize = 0;
-	uint64 _minimalEntryTime = 0;
-	size_type _entriesWithMinimalTimeCount = 0;
 
-	base::flat_map<uint8, TaggedSummary> _taggedStats;
 	rpl::event_stream<Stats> _stats;
 	bool _pushingStats = false;
 	bool _clearingStale = false;
+	int64 _snapshotOffset = 0;
+	int _snapshotGeneration = 0;
+	bool _snapshotWriting = false;
+	int64 _storeFlushes = 0;
+	int64 _storeFlushedRecords = 0;
 
 	base::ConcurrentTimer _writeBundlesTimer;
+	base::ConcurrentTimer _writeStoresTimer;
 	base::ConcurrentTimer _pruneTimer;
 
 	CleanerWrap _cleaner;
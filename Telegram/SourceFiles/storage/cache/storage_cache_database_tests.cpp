@@ -21,6 +21,7 @@ using namespace Storage::Cache;
 const auto DisableLimitsTests = false;
 const auto DisableCompactTests = false;
 const auto DisableLargeTest = true;
+const auto DisableBenchmarks = true;
 
 const auto key = Storage::EncryptionKey(bytes::make_vector(
 	bytes::make_span("\
@@ -538,6 +539,121 @@ TEST_CASE("cache db remove", "[storage_cache_database]") {
 	}
 }
 
+TEST_CASE("cache db mapped reads", "[storage_cache_database]") {
+	if (!DisableLargeTest) {
+		return;
+	}
+	SECTION("db mapped values are rewritten and removed") {
+		auto settings = Settings;
+		settings.mappedFilesLimit = 1;
+		Database db(name, settings);
+
+		REQUIRE(Clear(db).type == Error::Type::None);
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		REQUIRE(Put(db, Key{ 0, 1 }, Test1()).type == Error::Type::None);
+		REQUIRE(Put(db, Key{ 1, 0 }, Test2()).type == Error::Type::None);
+		REQUIRE((Get(db, Key{ 0, 1 }) == Test1()));
+		REQUIRE((Get(db, Key{ 1, 0 }) == Test2()));
+		REQUIRE((Get(db, Key{ 1, 0 }) == Test2()));
+		REQUIRE(Put(db, Key{ 1, 0 }, Test1()).type == Error::Type::None);
+		REQUIRE((Get(db, Key{ 1, 0 }) == Test1()));
+		Remove(db, Key{ 1, 0 });
+		REQUIRE(Get(db, Key{ 1, 0 }).isEmpty());
+		REQUIRE((Get(db, Key{ 0, 1 }) == Test1()));
+		Close(db);
+	}
+}
+
+TEST_CASE("cache db snapshot", "[storage_cache_database]") {
+	if (!DisableLargeTest) {
+		return;
+	}
+	const auto waitForSnapshot = [](const QString &path) {
+		while (!QFile(path).exists()) {
+			if (!SmallSleep()) {
+				return false;
+			}
+		}
+		return true;
+	};
+	SECTION("db snapshot is written and used with binlog tail") {
+		auto settings = Settings;
+		settings.trackEstimatedTime = true;
+		settings.snapshotAfterTail = 1;
+		Database db(name, settings);
+
+		REQUIRE(Clear(db).type == Error::Type::None);
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		const auto path = GetBinlogPath();
+		const auto snapshot = path.mid(0, path.size() - 6) + "index";
+		REQUIRE(Put(db, Key{ 0, 1 }, Test1()).type == Error::Type::None);
+		REQUIRE(Put(db, Key{ 1, 0 }, Test2()).type == Error::Type::None);
+		REQUIRE(waitForSnapshot(snapshot));
+		Remove(db, Key{ 0, 1 });
+		REQUIRE(Put(db, Key{ 1, 1 }, Test1()).type == Error::Type::None);
+		Close(db);
+
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		REQUIRE(Get(db, Key{ 0, 1 }).isEmpty());
+		REQUIRE((Get(db, Key{ 1, 0 }) == Test2()));
+		REQUIRE((Get(db, Key{ 1, 1 }) == Test1()));
+		Close(db);
+	}
+}
+
+TEST_CASE("cache db sharded replay", "[storage_cache_database]") {
+	if (!DisableLargeTest) {
+		return;
+	}
+	const auto kCount = 256;
+	const auto keyFor = [](int index) {
+		return Key{ uint64(index), uint64(index) + 1 };
+	};
+	SECTION("db requests made during replay keep their order") {
+		Database db(name, Settings);
+
+		REQUIRE(Clear(db).type == Error::Type::None);
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		for (auto i = 0; i != kCount; ++i) {
+			REQUIRE(Put(db, keyFor(i), Test1()).type == Error::Type::None);
+		}
+		Remove(db, keyFor(0));
+		Close(db);
+
+		// Don't wait for the open, so that the requests come during replay.
+		db.open(base::duplicate(key), GetResult);
+		db.moveIfEmpty(keyFor(1), keyFor(kCount), GetResult);
+		db.get(keyFor(1), GetValue);
+		for (auto i = 0; i != 3; ++i) {
+			Semaphore.acquire();
+		}
+		REQUIRE(Result.type == Error::Type::None);
+		REQUIRE(Value.isEmpty());
+		REQUIRE((Get(db, keyFor(kCount)) == Test1()));
+		REQUIRE(Get(db, keyFor(0)).isEmpty());
+		for (auto i = 2; i != kCount; ++i) {
+			REQUIRE((Get(db, keyFor(i)) == Test1()));
+		}
+		Close(db);
+	}
+	SECTION("db replayed index is written to the binlog correctly") {
+		Database db(name, Settings);
+
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		REQUIRE(Put(db, keyFor(2), Test2()).type == Error::Type::None);
+		Remove(db, keyFor(3));
+		Close(db);
+
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		REQUIRE(Get(db, keyFor(1)).isEmpty());
+		REQUIRE((Get(db, keyFor(2)) == Test2()));
+		REQUIRE(Get(db, keyFor(3)).isEmpty());
+		REQUIRE((Get(db, keyFor(4)) == Test1()));
+		REQUIRE((Get(db, keyFor(kCount)) == Test1()));
+		Close(db);
+	}
+}
+
 TEST_CASE("cache db bundled actions", "[storage_cache_database]") {
 	if (!DisableLargeTest) {
 		return;
@@ -601,6 +717,67 @@ TEST_CASE("cache db bundled actions", "[storage_cache_database]") {
 		Close(db);
 		REQUIRE(QFile(path).size() > size);
 	}
+	SECTION("db stores grouped lazily") {
+		auto settings = Settings;
+		settings.groupCommitDelay = 1 * crl::time(1000);
+		Database db(name, settings);
+
+		REQUIRE(Clear(db).type == Error::Type::None);
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		const auto path = GetBinlogPath();
+		const auto size = QFile(path).size();
+		REQUIRE(Put(db, Key{ 0, 1 }, Test1()).type == Error::Type::None);
+		REQUIRE(Put(db, Key{ 1, 0 }, Test2()).type == Error::Type::None);
+		REQUIRE(Put(db, Key{ 0, 1 }, Test2()).type == Error::Type::None);
+		REQUIRE((Get(db, Key{ 0, 1 }) == Test2()));
+		REQUIRE(QFile(path).size() == size);
+		AdvanceTime(2);
+		REQUIRE(QFile(path).size() > size);
+		Close(db);
+
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		REQUIRE((Get(db, Key{ 0, 1 }) == Test2()));
+		REQUIRE((Get(db, Key{ 1, 0 }) == Test2()));
+		Close(db);
+	}
+	SECTION("db stores grouped written on close") {
+		auto settings = Settings;
+		settings.trackEstimatedTime = true;
+		settings.groupCommitDelay = 60 * crl::time(1000);
+		Database db(name, settings);
+
+		REQUIRE(Clear(db).type == Error::Type::None);
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		const auto path = GetBinlogPath();
+		const auto size = QFile(path).size();
+		REQUIRE(Put(db, Key{ 0, 1 }, Test1()).type == Error::Type::None);
+		REQUIRE(Put(db, Key{ 1, 0 }, Test2()).type == Error::Type::None);
+		Remove(db, Key{ 1, 0 });
+		REQUIRE(QFile(path).size() == size);
+		Close(db);
+		REQUIRE(QFile(path).size() > size);
+
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		REQUIRE((Get(db, Key{ 0, 1 }) == Test1()));
+		REQUIRE(Get(db, Key{ 1, 0 }).isEmpty());
+		Close(db);
+	}
+	SECTION("db stores grouped written when batch is full") {
+		auto settings = Settings;
+		settings.groupCommitDelay = 60 * crl::time(1000);
+		settings.maxGroupCommitRecords = 2;
+		Database db(name, settings);
+
+		REQUIRE(Clear(db).type == Error::Type::None);
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		const auto path = GetBinlogPath();
+		const auto size = QFile(path).size();
+		REQUIRE(Put(db, Key{ 0, 1 }, Test1()).type == Error::Type::None);
+		REQUIRE(QFile(path).size() == size);
+		REQUIRE(Put(db, Key{ 1, 0 }, Test2()).type == Error::Type::None);
+		REQUIRE(QFile(path).size() > size);
+		Close(db);
+	}
 }
 
 TEST_CASE("cache db limits", "[storage_cache_database]") {
@@ -738,3 +915,116 @@ TEST_CASE("large db", "[storage_cache_database]") {
 		Close(db);
 	}
 }
+
+TEST_CASE("cache db read benchmark", "[storage_cache_database]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	const auto kEntries = 4096;
+	const auto kHotEntries = 256;
+	const auto kReads = 64 * 1024;
+	const auto kValueSize = 4 * 1024;
+
+	const auto key = [](int index) {
+		return Key{ uint64(index), uint64(index) + 1 };
+	};
+	const auto measure = [&](size_type mappedFilesLimit) {
+		auto settings = Settings;
+		settings.maxDataSize = kValueSize;
+		settings.mappedFilesLimit = mappedFilesLimit;
+		Database db(name, settings);
+
+		REQUIRE(Clear(db).type == Error::Type::None);
+		REQUIRE(Open(db, ::key).type == Error::Type::None);
+		for (auto i = 0; i != kEntries; ++i) {
+			auto value = QByteArray(kValueSize, char('A' + (i % 26)));
+			REQUIRE(Put(db, key(i), std::move(value)).type
+				== Error::Type::None);
+		}
+		srand(0);
+		const auto start = crl::now();
+		for (auto i = 0; i != kReads; ++i) {
+			// Most of the reads are for a small hot set of entries.
+			const auto index = (i % 8)
+				? (rand() % kHotEntries)
+				: (rand() % kEntries);
+			if (i + 1 == kReads) {
+				REQUIRE(Get(db, key(index)).size() == kValueSize);
+			} else {
+				db.get(key(index), nullptr);
+			}
+		}
+		const auto result = crl::now() - start;
+		Close(db);
+		return result;
+	};
+	const auto plain = measure(0);
+	const auto mapped = measure(kHotEntries);
+	WARN("Reading " << kReads << " values: "
+		<< plain << "ms plain, "
+		<< mapped << "ms mapped.");
+}
+
+TEST_CASE("cache db open benchmark", "[storage_cache_database]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	using namespace details;
+
+	const auto kChunk = 16 * 1024;
+	auto settings = Settings;
+	settings.totalSizeLimit = 0;
+	settings.totalTimeLimit = 0;
+	settings.compactAfterExcess = 0;
+
+	const auto prepare = [&](int count) {
+		Database db(name, settings);
+		REQUIRE(Clear(db).type == Error::Type::None);
+
+		Storage::File binlog;
+		const auto open = binlog.open(
+			GetBinlogPath(),
+			Storage::File::Mode::Write,
+			key);
+		REQUIRE(open == Storage::File::Result::Success);
+		auto header = BasicHeader();
+		REQUIRE(binlog.write(bytes::object_as_span(&header)));
+		auto records = std::vector<Store>();
+		for (auto i = 0; i < count; i += kChunk) {
+			const auto till = std::min(i + kChunk, count);
+			records.resize(till - i);
+			for (auto j = i; j != till; ++j) {
+				auto &record = records[j - i];
+				record = Store();
+				record.key = Key{ uint64(j), uint64(j) + 1 };
+				record.setSize(Test1().size());
+				for (auto k = 0; k != record.place.size(); ++k) {
+					record.place[k] = uint8((uint64(j) >> (k * 8)) & 0xFF);
+				}
+			}
+			REQUIRE(binlog.write(bytes::make_span(records)));
+		}
+		binlog.close();
+	};
+	for (const auto count : { 100 * 1000, 1000 * 1000, 5000 * 1000 }) {
+		prepare(count);
+
+		Database db(name, settings);
+		const auto start = crl::now();
+		REQUIRE(Open(db, key).type == Error::Type::None);
+		const auto opened = crl::now() - start;
+
+		// A read waits only for the shard of its key.
+		REQUIRE(Get(db, Key{ uint64(count), 0 }).isEmpty());
+		const auto read = crl::now() - start;
+
+		// Clearing by tag waits for the whole index.
+		REQUIRE(ClearByTag(db, 0xFF).type == Error::Type::None);
+		const auto replayed = crl::now() - start;
+		Close(db);
+		WARN("Opening " << count << " entries: "
+			<< opened << "ms binlog read, "
+			<< read << "ms first read, "
+			<< replayed << "ms whole index.");
+	}
+}
@@ -69,9 +69,16 @@ struct Settings {
 	size_type readBlockSize = 8 * 1024 * 1024;
 	size_type maxDataSize = (kDataSizeLimit - 1);
 	crl::time writeBundleDelay = 15 * 60 * crl::time(1000);
+	crl::time groupCommitDelay = 0; // Zero writes every put immediately.
+	size_type maxGroupCommitRecords = 256;
 	size_type staleRemoveChunk = 256;
 
+	// Keep up to this count of small value files opened and mapped.
+	size_type mappedFilesLimit = 0;
+	size_type maxMappedFileSize = 64 * 1024;
+
 	int64 compactAfterExcess = 8 * 1024 * 1024;
+	int64 snapshotAfterTail = 8 * 1024 * 1024;
 	int64 compactAfterFullSize = 0;
 	size_type compactChunkSize = 16 * 1024;
 
@@ -104,6 +111,8 @@ struct TaggedSummary {
 struct Stats {
 	TaggedSummary full;
 	base::flat_map<uint8, TaggedSummary> tagged;
+	int64 storeFlushes = 0;
+	int64 storeFlushedRecords = 0;
 	bool clearing = false;
 };
 
@@ -154,6 +163,21 @@ struct EstimatedTimePoint {
 	}
 };
 
+// Header of the index snapshot, followed by Store or StoreWithTime
+// records for all the entries known after binlogOffset was replayed.
+struct SnapshotHeader {
+	static constexpr auto kTrackEstimatedTime = 0x01U;
+
+	uint32 format = static_cast<uint32>(Format::Format_0);
+	uint32 flags = 0;
+	uint32 count = 0;
+	uint32 tailChecksum = 0;
+	int64 binlogOffset = 0;
+	int64 binlogExcessLength = 0;
+	EstimatedTimePoint time;
+	uint32 reserved = 0;
+};
+
 struct Store {
 	static constexpr auto kType = RecordType(0x01);
 
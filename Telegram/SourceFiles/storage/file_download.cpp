@@ -14,6 +14,7 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "mainwindow.h"
 #include "core/application.h"
 #include "storage/localstorage.h"
+#include "storage/file_download_writer.h"
 #include "platform/platform_file_utilities.h"
 #include "mtproto/connection.h" // for MTP::kAckSendWaiting
 #include "auth_session.h"
@@ -39,7 +40,7 @@ void Downloader::clearPriorities() {
 }
 
 void Downloader::requestedAmountIncrement(MTP::DcId dcId, int index, int amount) {
-	Expects(index >= 0 && index < MTP::kDownloadSessionsCount);
+	Expects(index >= 0 && index < MTP::kMaxDownloadSessionsCount);
 
 	auto it = _requestedBytesAmount.find(dcId);
 	if (it == _requestedBytesAmount.cend()) {
@@ -49,6 +50,10 @@ void Downloader::requestedAmountIncrement(MTP::DcId dcId, int index, int amount)
 	if (it->second[index]) {
 		killDownloadSessionsStop(dcId);
 	} else {
+		if (index >= sessionsCount(dcId)) {
+			// The last request of a session that is not used any more.
+			MTP::stopSession(MTP::downloadDcId(dcId, index));
+		}
 		killDownloadSessionsStart(dcId);
 	}
 }
@@ -77,7 +82,7 @@ void Downloader::killDownloadSessions() {
 	auto ms = crl::now(), left = MTP::kAckSendWaiting + kKillSessionTimeout;
 	for (auto i = _killDownloadSessionTimes.begin(); i != _killDownloadSessionTimes.end(); ) {
 		if (i->second <= ms) {
-			for (int j = 0; j < MTP::kDownloadSessionsCount; ++j) {
+			for (int j = 0; j < MTP::kMaxDownloadSessionsCount; ++j) {
 				MTP::stopSession(MTP::downloadDcId(i->first, j));
 			}
 			i = _killDownloadSessionTimes.erase(i);
@@ -93,11 +98,30 @@ void Downloader::killDownloadSessions() {
 	}
 }
 
+int Downloader::sessionsCount(MTP::DcId dcId) const {
+	const auto i = _controllers.find(dcId);
+	return (i != end(_controllers))
+		? i->second.sessionsCount()
+		: MTP::kDownloadSessionsCount;
+}
+
+void Downloader::stopUnusedSessions(MTP::DcId dcId) {
+	const auto it = _requestedBytesAmount.find(dcId);
+	for (auto i = sessionsCount(dcId); i != MTP::kMaxDownloadSessionsCount; ++i) {
+		// Sessions with requests in flight are stopped after them.
+		if (it == _requestedBytesAmount.cend() || !it->second[i]) {
+			MTP::stopSession(MTP::downloadDcId(dcId, i));
+		}
+	}
+}
+
 int Downloader::chooseDcIndexForRequest(MTP::DcId dcId) const {
+	const auto count = sessionsCount(dcId);
+
 	auto result = 0;
 	auto it = _requestedBytesAmount.find(dcId);
 	if (it != _requestedBytesAmount.cend()) {
-		for (auto i = 1; i != MTP::kDownloadSessionsCount; ++i) {
+		for (auto i = 1; i != count; ++i) {
 			if (it->second[i] < it->second[result]) {
 				result = i;
 			}
@@ -106,6 +130,49 @@ int Downloader::chooseDcIndexForRequest(MTP::DcId dcId) const {
 	return result;
 }
 
+void Downloader::requestSucceeded(
+		MTP::DcId dcId,
+		int bytes,
+		crl::time sent) {
+	auto &controller = _controllers.try_emplace(
+		dcId,
+		MTP::kDownloadSessionsCount,
+		MTP::kMaxDownloadSessionsCount).first->second;
+	const auto wasSessionsCount = controller.sessionsCount();
+	if (!controller.requestSucceeded(bytes, sent, crl::now())) {
+		return;
+	}
+	if (controller.sessionsCount() < wasSessionsCount) {
+		stopUnusedSessions(dcId);
+	}
+	_stats.fire({
+		dcId,
+		controller.sessionsCount(),
+		controller.partSize(),
+		controller.queriesLimit(),
+		controller.baseRtt(),
+		controller.throughput()
+	});
+}
+
+int Downloader::chooseDownloadPartSize(MTP::DcId dcId) const {
+	const auto i = _controllers.find(dcId);
+	return (i != end(_controllers))
+		? i->second.partSize()
+		: DownloadController::kDefaultPartSize;
+}
+
+int Downloader::chooseQueriesLimit(MTP::DcId dcId) const {
+	const auto i = _controllers.find(dcId);
+	return (i != end(_controllers))
+		? i->second.queriesLimit()
+		: DownloadController::kDefaultQueriesLimit;
+}
+
+rpl::producer<DownloadStats> Downloader::stats() const {
+	return _stats.events();
+}
+
 Downloader::~Downloader() {
 	killDownloadSessions();
 }
@@ -116,10 +183,15 @@ namespace {
 
 constexpr auto kDownloadPhotoPartSize = 64 * 1024; // 64kb for photo
 constexpr auto kDownloadDocumentPartSize = 128 * 1024; // 128kb for document
-constexpr auto kMaxFileQueries = 16; // max 16 file parts downloaded at the same time
 constexpr auto kMaxWebFileQueries = 8; // max 8 http[s] files downloaded at the same time
 constexpr auto kDownloadCdnPartSize = 128 * 1024; // 128kb for cdn requests
 
+// Large http[s] files are requested by ranges in several connections.
+constexpr auto kWebRangePartSize = qint64(1024 * 1024);
+constexpr auto kMaxWebRangesPerFile = 4;
+constexpr auto kMaxWebConnectionsPerHost = 6;
+constexpr auto kMaxWebRangeFailures = 3;
+
 } // namespace
 
 struct FileLoaderQueue {
@@ -206,6 +278,10 @@ QImage FileLoader::imageData(const QSize &shrinkBox) const {
 	return _imageData;
 }
 
+bool FileLoader::imageDataNeedsDecoding() const {
+	return _imageData.isNull() && _locationType == UnknownFileLocation;
+}
+
 void FileLoader::readImage(const QSize &shrinkBox) const {
 	auto format = QByteArray();
 	auto image = App::readImage(_data, &format, false);
@@ -323,11 +399,8 @@ void FileLoader::start(bool loadFirst, bool prior) {
 		return;
 	}
 
-	if (!_filename.isEmpty() && _toCache == LoadToFileOnly && !_fileIsOpen) {
-		_fileIsOpen = _file.open(QIODevice::WriteOnly);
-		if (!_fileIsOpen) {
-			return cancel(true);
-		}
+	if (!_filename.isEmpty() && _toCache == LoadToFileOnly && !_writer) {
+		createWriter();
 	}
 
 	auto currentPriority = _downloader->currentPriority();
@@ -490,6 +563,14 @@ void FileLoader::cancel() {
 	cancel(false);
 }
 
+void FileLoader::createWriter() {
+	Expects(!_filename.isEmpty());
+
+	_writer = std::make_unique<Storage::DownloadWriter>(_filename, [=] {
+		cancel(true);
+	});
+}
+
 void FileLoader::cancel(bool fail) {
 	bool started = currentOffset(true) > 0;
 	cancelRequests();
@@ -500,6 +581,9 @@ void FileLoader::cancel(bool fail) {
 		_fileIsOpen = false;
 		_file.remove();
 	}
+	if (const auto writer = base::take(_writer)) {
+		writer->remove();
+	}
 	_data = QByteArray();
 	removeFromQueue();
 
@@ -547,7 +631,9 @@ mtpFileLoader::mtpFileLoader(
 	auto shiftedDcId = MTP::downloadDcId(dcId(), 0);
 	auto i = queues.find(shiftedDcId);
 	if (i == queues.cend()) {
-		i = queues.insert(shiftedDcId, FileLoaderQueue(kMaxFileQueries));
+		i = queues.insert(
+			shiftedDcId,
+			FileLoaderQueue(_downloader->chooseQueriesLimit(dcId())));
 	}
 	_queue = &i.value();
 }
@@ -570,7 +656,9 @@ mtpFileLoader::mtpFileLoader(
 	auto shiftedDcId = MTP::downloadDcId(dcId(), 0);
 	auto i = queues.find(shiftedDcId);
 	if (i == queues.cend()) {
-		i = queues.insert(shiftedDcId, FileLoaderQueue(kMaxFileQueries));
+		i = queues.insert(
+			shiftedDcId,
+			FileLoaderQueue(_downloader->chooseQueriesLimit(dcId())));
 	}
 	_queue = &i.value();
 }
@@ -593,13 +681,15 @@ mtpFileLoader::mtpFileLoader(
 	auto shiftedDcId = MTP::downloadDcId(dcId(), 0);
 	auto i = queues.find(shiftedDcId);
 	if (i == queues.cend()) {
-		i = queues.insert(shiftedDcId, FileLoaderQueue(kMaxFileQueries));
+		i = queues.insert(
+			shiftedDcId,
+			FileLoaderQueue(_downloader->chooseQueriesLimit(dcId())));
 	}
 	_queue = &i.value();
 }
 
 int32 mtpFileLoader::currentOffset(bool includeSkipped) const {
-	return (_fileIsOpen ? _file.size() : _data.size())
+	return (_writer ? _writtenSize : _data.size())
 		- (includeSkipped ? 0 : _skippedBytes);
 }
 
@@ -639,6 +729,12 @@ bool mtpFileLoader::loadPart() {
 		return false;
 	}
 
+	if (!_partSize) {
+		// Part size is chosen once, offsets must be divisible by it.
+		_partSize = (_location.is<StorageFileLocation>() && _size && !_cdnDcId)
+			? _downloader->chooseDownloadPartSize(dcId())
+			: kDownloadCdnPartSize;
+	}
 	makeRequest(_nextRequestOffset);
 	_nextRequestOffset += partSize();
 	return true;
@@ -652,19 +748,7 @@ MTP::DcId mtpFileLoader::dcId() const {
 }
 
 int mtpFileLoader::partSize() const {
-	return kDownloadCdnPartSize;
-
-	// Different part sizes are not supported for now :(
-	// Because we start downloading with some part size
-	// and then we get a cdn-redirect where we support only
-	// fixed part size download for hash checking.
-	//
-	//if (_cdnDcId) {
-	//	return kDownloadCdnPartSize;
-	//} else if (_locationType == UnknownFileLocation) {
-	//	return kDownloadPhotoPartSize;
-	//}
-	//return kDownloadDocumentPartSize;
+	return _partSize ? _partSize : kDownloadCdnPartSize;
 }
 
 mtpFileLoader::RequestData mtpFileLoader::prepareRequest(int offset) const {
@@ -674,12 +758,14 @@ mtpFileLoader::RequestData mtpFileLoader::prepareRequest(int offset) const {
 		? _downloader->chooseDcIndexForRequest(result.dcId)
 		: 0;
 	result.offset = offset;
+	result.size = partSize();
+	result.sent = crl::now();
 	return result;
 }
 
 mtpRequestId mtpFileLoader::sendRequest(const RequestData &requestData) {
 	const auto offset = requestData.offset;
-	const auto limit = partSize();
+	const auto limit = requestData.size;
 	const auto shiftedDcId = MTP::downloadDcId(
 		requestData.dcId,
 		requestData.dcIndex);
@@ -747,6 +833,28 @@ void mtpFileLoader::makeRequest(int offset) {
 	placeSentRequest(sendRequest(requestData), requestData);
 }
 
+void mtpFileLoader::remakeRequest(const RequestData &requestData) {
+	// Part size could've been decreased since the request was sent.
+	const auto till = requestData.offset + requestData.size;
+	for (auto offset = requestData.offset; offset < till;) {
+		makeRequest(offset);
+		offset += partSize();
+		if (_size && offset >= _size) {
+			break;
+		}
+	}
+}
+
+void mtpFileLoader::measureRequest(const RequestData &requestData, int bytes) {
+	if (requestData.sent) {
+		_downloader->requestSucceeded(
+			requestData.dcId,
+			bytes,
+			requestData.sent);
+		_queue->queriesLimit = _downloader->chooseQueriesLimit(dcId());
+	}
+}
+
 void mtpFileLoader::requestMoreCdnFileHashes() {
 	Expects(!_finished);
 
@@ -778,12 +886,13 @@ void mtpFileLoader::normalPartLoaded(
 	Expects(!_finished);
 	Expects(result.type() == mtpc_upload_fileCdnRedirect || result.type() == mtpc_upload_file);
 
-	auto offset = finishSentRequestGetOffset(requestId);
+	const auto requestData = finishSentRequest(requestId);
 	if (result.type() == mtpc_upload_fileCdnRedirect) {
-		return switchToCDN(offset, result.c_upload_fileCdnRedirect());
+		return switchToCDN(requestData, result.c_upload_fileCdnRedirect());
 	}
 	auto buffer = bytes::make_span(result.c_upload_file().vbytes.v);
-	return partLoaded(offset, buffer);
+	measureRequest(requestData, buffer.size());
+	return partLoaded(requestData.offset, buffer);
 }
 
 void mtpFileLoader::webPartLoaded(
@@ -791,7 +900,8 @@ void mtpFileLoader::webPartLoaded(
 		mtpRequestId requestId) {
 	Expects(result.type() == mtpc_upload_webFile);
 
-	auto offset = finishSentRequestGetOffset(requestId);
+	const auto requestData = finishSentRequest(requestId);
+	const auto offset = requestData.offset;
 	auto &webFile = result.c_upload_webFile();
 	if (!_size) {
 		_size = webFile.vsize.v;
@@ -800,18 +910,21 @@ void mtpFileLoader::webPartLoaded(
 		return cancel(true);
 	}
 	auto buffer = bytes::make_span(webFile.vbytes.v);
+	measureRequest(requestData, buffer.size());
 	return partLoaded(offset, buffer);
 }
 
 void mtpFileLoader::cdnPartLoaded(const MTPupload_CdnFile &result, mtpRequestId requestId) {
 	Expects(!_finished);
 
-	auto offset = finishSentRequestGetOffset(requestId);
+	const auto sentData = finishSentRequest(requestId);
+	const auto offset = sentData.offset;
 	if (result.type() == mtpc_upload_cdnFileReuploadNeeded) {
 		auto requestData = RequestData();
 		requestData.dcId = dcId();
 		requestData.dcIndex = 0;
 		requestData.offset = offset;
+		requestData.size = sentData.size;
 		auto shiftedDcId = MTP::downloadDcId(requestData.dcId, requestData.dcIndex);
 		auto requestId = MTP::send(MTPupload_ReuploadCdnFile(MTP_bytes(_cdnToken), result.c_upload_cdnFileReuploadNeeded().vrequest_token), rpcDone(&mtpFileLoader::reuploadDone), rpcFail(&mtpFileLoader::cdnPartFailed), shiftedDcId);
 		placeSentRequest(requestId, requestData);
@@ -836,6 +949,7 @@ void mtpFileLoader::cdnPartLoaded(const MTPupload_CdnFile &result, mtpRequestId
 
 	auto decryptInPlace = result.c_upload_cdnFile().vbytes.v;
 	auto buffer = bytes::make_detached_span(decryptInPlace);
+	measureRequest(sentData, buffer.size());
 	MTP::aesCtrEncrypt(buffer, key.data(), &state);
 
 	switch (checkCdnFileHash(offset, buffer)) {
@@ -929,42 +1043,46 @@ void mtpFileLoader::getCdnFileHashesDone(const MTPVector<MTPFileHash> &result, m
 void mtpFileLoader::placeSentRequest(mtpRequestId requestId, const RequestData &requestData) {
 	Expects(!_finished);
 
-	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, partSize());
+	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, requestData.size);
 	++_queue->queriesCount;
 	_sentRequests.emplace(requestId, requestData);
 }
 
-int mtpFileLoader::finishSentRequestGetOffset(mtpRequestId requestId) {
+auto mtpFileLoader::finishSentRequest(mtpRequestId requestId) -> RequestData {
 	auto it = _sentRequests.find(requestId);
 	Assert(it != _sentRequests.cend());
 
 	auto requestData = it->second;
-	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, -partSize());
+	_downloader->requestedAmountIncrement(requestData.dcId, requestData.dcIndex, -requestData.size);
 
 	--_queue->queriesCount;
 	_sentRequests.erase(it);
 
-	return requestData.offset;
+	return requestData;
+}
+
+int mtpFileLoader::finishSentRequestGetOffset(mtpRequestId requestId) {
+	return finishSentRequest(requestId).offset;
 }
 
 bool mtpFileLoader::feedPart(int offset, bytes::const_span buffer) {
 	Expects(!_finished);
 
 	if (!buffer.empty()) {
-		if (_fileIsOpen) {
-			auto fsize = _file.size();
-			if (offset < fsize) {
+		if (_writer) {
+			if (offset < _writtenSize) {
 				_skippedBytes -= buffer.size();
-			} else if (offset > fsize) {
-				_skippedBytes += offset - fsize;
-			}
-			_file.seek(offset);
-			if (_file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size()) != qint64(buffer.size())) {
-				cancel(true);
-				return false;
+			} else if (offset > _writtenSize) {
+				_skippedBytes += offset - _writtenSize;
 			}
+			_writtenSize = std::max(
+				_writtenSize,
+				int32(offset + buffer.size()));
+			_writer->write(offset, QByteArray(
+				reinterpret_cast<const char*>(buffer.data()),
+				buffer.size()));
 		} else {
-			_data.reserve(offset + buffer.size());
+			_data.reserve(std::max(_size, int32(offset + buffer.size())));
 			if (offset > _data.size()) {
 				_skippedBytes += offset - _data.size();
 				_data.resize(offset);
@@ -990,48 +1108,54 @@ bool mtpFileLoader::feedPart(int offset, bytes::const_span buffer) {
 		&& _cdnUncheckedParts.empty()
 		&& (_lastComplete || (_size && _nextRequestOffset >= _size))) {
 		if (!_filename.isEmpty() && (_toCache == LoadToCacheAsWell)) {
-			if (!_fileIsOpen) {
-				_fileIsOpen = _file.open(QIODevice::WriteOnly);
-			}
-			if (!_fileIsOpen || _file.write(_data) != qint64(_data.size())) {
-				cancel(true);
-				return false;
+			if (!_writer) {
+				createWriter();
 			}
+			_writtenSize = _data.size();
+			_writer->write(0, QByteArray(_data));
 		}
-		_finished = true;
-		if (_fileIsOpen) {
-			_file.close();
-			_fileIsOpen = false;
-			Platform::File::PostprocessDownloaded(QFileInfo(_file).absoluteFilePath());
+		if (_writer) {
+			// Finish after the writer flushes and closes the file.
+			_writer->finish(_writtenSize, [=] {
+				finishLoading();
+				notifyAboutProgress();
+			});
+			return true;
 		}
-		removeFromQueue();
-
-		if (_localStatus == LocalStatus::NotFound) {
-			if (_locationType != UnknownFileLocation
-				&& !_filename.isEmpty()) {
-				Local::writeFileLocation(
-					mediaKey(_locationType, dcId(), objId()),
-					FileLocation(_filename));
-			}
-			if (_location.is<WebFileLocation>()
-				|| _locationType == UnknownFileLocation
-				|| _toCache == LoadToCacheAsWell) {
-				if (const auto key = cacheKey()) {
-					if (_data.size() <= Storage::kMaxFileInMemory) {
-						Auth().data().cache().put(
-							*key,
-							Storage::Cache::Database::TaggedValue(
-								base::duplicate(_data),
-								_cacheTag));
-					}
+		finishLoading();
+	}
+	return true;
+}
+
+void mtpFileLoader::finishLoading() {
+	Expects(!_finished);
+
+	_finished = true;
+	_writer = nullptr;
+	removeFromQueue();
+
+	if (_localStatus == LocalStatus::NotFound) {
+		if (_locationType != UnknownFileLocation
+			&& !_filename.isEmpty()) {
+			Local::writeFileLocation(
+				mediaKey(_locationType, dcId(), objId()),
+				FileLocation(_filename));
+		}
+		if (_location.is<WebFileLocation>()
+			|| _locationType == UnknownFileLocation
+			|| _toCache == LoadToCacheAsWell) {
+			if (const auto key = cacheKey()) {
+				if (_data.size() <= Storage::kMaxFileInMemory) {
+					Auth().data().cache().put(
+						*key,
+						Storage::Cache::Database::TaggedValue(
+							base::duplicate(_data),
+							_cacheTag));
 				}
 			}
 		}
 	}
-	if (_finished) {
-		_downloader->taskFinished().notify();
-	}
-	return true;
+	_downloader->taskFinished().notify();
 }
 
 void mtpFileLoader::partLoaded(int offset, bytes::const_span buffer) {
@@ -1082,9 +1206,9 @@ bool mtpFileLoader::cdnPartFailed(
 	}
 	if (error.type() == qstr("FILE_TOKEN_INVALID")
 		|| error.type() == qstr("REQUEST_TOKEN_INVALID")) {
-		auto offset = finishSentRequestGetOffset(requestId);
+		const auto requestData = finishSentRequest(requestId);
 		changeCDNParams(
-			offset,
+			requestData,
 			0,
 			QByteArray(),
 			QByteArray(),
@@ -1104,10 +1228,10 @@ void mtpFileLoader::cancelRequests() {
 }
 
 void mtpFileLoader::switchToCDN(
-		int offset,
+		const RequestData &requestData,
 		const MTPDupload_fileCdnRedirect &redirect) {
 	changeCDNParams(
-		offset,
+		requestData,
 		redirect.vdc_id.v,
 		redirect.vfile_token.v,
 		redirect.vencryption_key.v,
@@ -1126,7 +1250,7 @@ void mtpFileLoader::addCdnHashes(const QVector<MTPFileHash> &hashes) {
 }
 
 void mtpFileLoader::changeCDNParams(
-		int offset,
+		const RequestData &requestData,
 		MTP::DcId dcId,
 		const QByteArray &token,
 		const QByteArray &encryptionKey,
@@ -1144,6 +1268,11 @@ void mtpFileLoader::changeCDNParams(
 		|| _cdnToken != token
 		|| _cdnEncryptionKey != encryptionKey
 		|| _cdnEncryptionIV != encryptionIV);
+	if (dcId) {
+		// After a cdn-redirect we support only fixed part size
+		// download for hash checking.
+		_partSize = kDownloadCdnPartSize;
+	}
 	_cdnDcId = dcId;
 	_cdnToken = token;
 	_cdnEncryptionKey = encryptionKey;
@@ -1151,19 +1280,18 @@ void mtpFileLoader::changeCDNParams(
 	addCdnHashes(hashes);
 
 	if (resendAllRequests && !_sentRequests.empty()) {
-		auto resendOffsets = std::vector<int>();
-		resendOffsets.reserve(_sentRequests.size());
+		auto resendRequests = std::vector<RequestData>();
+		resendRequests.reserve(_sentRequests.size());
 		while (!_sentRequests.empty()) {
 			auto requestId = _sentRequests.begin()->first;
 			MTP::cancel(requestId);
-			auto resendOffset = finishSentRequestGetOffset(requestId);
-			resendOffsets.push_back(resendOffset);
+			resendRequests.push_back(finishSentRequest(requestId));
 		}
-		for (auto resendOffset : resendOffsets) {
-			makeRequest(resendOffset);
+		for (const auto &resendRequest : resendRequests) {
+			remakeRequest(resendRequest);
 		}
 	}
-	makeRequest(offset);
+	remakeRequest(requestData);
 }
 
 std::optional<Storage::Cache::Key> mtpFileLoader::cacheKey() const {
@@ -1196,7 +1324,8 @@ webFileLoader::webFileLoader(
 	fromCloud,
 	autoLoading,
 	cacheTag)
-, _url(url.startsWith(qsl("http")) ? url : Global::CdnDownLoadPreifx() + url)
+, _url(webFileLoaderUrl(url))
+, _toFile(to)
 , _requestSent(false)
 , _already(0) {
 	_queue = &_webQueue;
@@ -1214,7 +1343,10 @@ bool webFileLoader::loadPart() {
 	}
 
 	_requestSent = true;
-	_webLoadManager->append(this, _url);
+	_webLoadManager->append(
+		this,
+		_url,
+		_filename.isEmpty() ? _toFile : _filename);
 	return false;
 }
 
@@ -1270,6 +1402,21 @@ void webFileLoader::onFinished(const QByteArray &data) {
 	notifyAboutProgress();
 }
 
+void webFileLoader::onWritten() {
+	if (_filename.isEmpty()) {
+		_filename = _toFile;
+		_file.setFileName(_filename);
+	}
+	_finished = true;
+	_already = _size;
+	removeFromQueue();
+	Platform::File::PostprocessDownloaded(
+		QFileInfo(_filename).absoluteFilePath());
+	_downloader->taskFinished().notify();
+
+	notifyAboutProgress();
+}
+
 void webFileLoader::onError() {
 	cancel(true);
 }
@@ -1286,54 +1433,251 @@ void webFileLoader::cancelRequests() {
 webFileLoader::~webFileLoader() {
 }
 
-class webFileLoaderPrivate {
-public:
-	webFileLoaderPrivate(webFileLoader *loader, const QString &url)
-		: _interface(loader)
-		, _url(url)
-		, _redirectsLeft(kMaxHttpRedirects) {
-	}
+namespace {
 
-	QNetworkReply *reply() {
-		return _reply;
-	}
+struct ContentRange {
+	qint64 from = 0;
+	qint64 total = 0;
+};
+
+// Parses "bytes <from>-<till>/<total>" Content-Range header value.
+std::optional<ContentRange> ParseContentRange(const QByteArray &value) {
+	const auto m = QRegularExpression(
+		qsl("^bytes\\s+(\\d+)-(\\d+)/(\\d+)")
+	).match(QString::fromLatin1(value).trimmed());
+	if (!m.hasMatch()) {
+		return std::nullopt;
+	}
+	return ContentRange{
+		m.captured(1).toLongLong(),
+		m.captured(3).toLongLong()
+	};
+}
 
-	QNetworkReply *request(QNetworkAccessManager &manager, const QString &redirect) {
-		if (!redirect.isEmpty()) _url = redirect;
+} // namespace
+
+struct webFileLoaderRange {
+	qint64 offset = 0;
+	qint64 length = 0; // zero means up to the end of the file
+	qint64 received = 0;
+	QNetworkReply *reply = nullptr;
+	QString host;
+	int failures = 0;
+};
 
-		QNetworkRequest req(_url);
-		QByteArray rangeHeaderValue = "bytes=" + QByteArray::number(_already) + "-";
-		req.setRawHeader("Range", rangeHeaderValue);
-		_reply = manager.get(req);
+class webFileLoaderPrivate {
+public:
+	using Range = webFileLoaderRange;
+
+	webFileLoaderPrivate(
+		webFileLoader *loader,
+		const QString &url,
+		const QString &path)
+	: _interface(loader)
+	, _url(url)
+	, _path(path)
+	, _redirectsLeft(kMaxHttpRedirects) {
+		// The first request asks for the first part only, the response
+		// tells us the full size and whether the server supports ranges.
+		_ranges.push_back({ 0, kWebRangePartSize });
+	}
+
+	QNetworkReply *request(QNetworkAccessManager &manager, Range &range) {
+		const auto from = range.offset + range.received;
+		const auto rangeHeaderValue = _withoutRanges
+			? QByteArray()
+			: ("bytes="
+				+ QByteArray::number(from)
+				+ "-"
+				+ (range.length
+					? QByteArray::number(range.offset + range.length - 1)
+					: QByteArray()));
+
+		auto req = QNetworkRequest(_url);
+		if (!rangeHeaderValue.isEmpty()) {
+			req.setRawHeader("Range", rangeHeaderValue);
+		}
+		range.reply = manager.get(req);
+		range.host = _url.host();
 		DEBUG_LOG(("[%1] webFileLoader: get form %2, rangeHeaderValue: %3.")
-			.arg(qintptr(_reply))
+			.arg(qintptr(range.reply))
 			.arg(_url.toString())
 			.arg(QString(rangeHeaderValue)));
-		return _reply;
+		return range.reply;
 	}
 
-	bool oneMoreRedirect() {
+	bool oneMoreRedirect(const QString &redirect) {
 		if (_redirectsLeft) {
 			--_redirectsLeft;
+			_url = redirect;
 			return true;
 		}
 		return false;
 	}
 
-	void setData(const QByteArray &data) {
-		_data = data;
+	Range *findRange(QNetworkReply *reply) {
+		const auto i = ranges::find(_ranges, reply, &Range::reply);
+		return (i != end(_ranges)) ? &*i : nullptr;
+	}
+	Range *nextRange() {
+		const auto known = sizeKnown();
+		const auto i = ranges::find_if(_ranges, [&](const Range &range) {
+			return !range.reply && (!known || range.received < range.length);
+		});
+		return (i != end(_ranges)) ? &*i : nullptr;
+	}
+	int sentRanges() const {
+		return int(ranges::count_if(_ranges, [](const Range &range) {
+			return range.reply != nullptr;
+		}));
+	}
+	std::vector<QNetworkReply*> replies() const {
+		auto result = std::vector<QNetworkReply*>();
+		for (const auto &range : _ranges) {
+			if (range.reply) {
+				result.push_back(range.reply);
+			}
+		}
+		return result;
 	}
-	void addData(const QByteArray &data) {
-		_data.append(data);
+
+	bool sizeKnown() const {
+		return (_size > 0);
 	}
-	const QByteArray &data() {
-		return _data;
+	bool ranged() const {
+		return _ranged;
 	}
-	void setProgress(qint64 already, qint64 size) {
-		_already = already;
-		_size = qMax(size, 0LL);
+	bool unknownSize() const {
+		return _unknownSize;
 	}
 
+	// Called once, when the first response tells the full size.
+	bool prepare(qint64 size, bool ranged) {
+		Expects(_ranges.size() == 1);
+		Expects(!_already);
+
+		_size = size;
+		_ranged = ranged;
+		auto &first = _ranges.front();
+		if (!ranged) {
+			first.length = size;
+		} else {
+			first.length = std::min(first.length, size);
+			for (auto offset = first.length; offset < size;) {
+				const auto length = std::min(kWebRangePartSize, size - offset);
+				_ranges.push_back({ offset, length });
+				offset += length;
+			}
+		}
+		if (!_path.isEmpty() && size > Storage::kMaxFileInMemory) {
+			// Large files are written straight to the disk by offsets.
+			_file.setFileName(_path);
+			if (!_file.open(QIODevice::WriteOnly) || !_file.resize(size)) {
+				LOG(("Network Error: Could not open '%1' for writing."
+					).arg(_path));
+				return false;
+			}
+		} else if (size > std::numeric_limits<int>::max()) {
+			return false;
+		} else if (ranged) {
+			_data = QByteArray(int(size), Qt::Uninitialized);
+		} else {
+			_data.reserve(int(size));
+		}
+		return true;
+	}
+
+	// Called instead of prepare() when the whole file comes in a response
+	// without the length, like a chunked one. It is kept in memory.
+	bool prepareUnknownSize() {
+		Expects(_ranges.size() == 1);
+		Expects(!_already);
+
+		_unknownSize = true;
+		_ranges.front().length = 0;
+		return true;
+	}
+
+	// Called when the response of unknown size has ended.
+	bool finishUnknownSize() {
+		Expects(_unknownSize);
+
+		auto &range = _ranges.front();
+		if (!range.received) {
+			return false;
+		}
+		_unknownSize = false;
+		_size = range.length = range.received;
+		return true;
+	}
+
+	// Called when the server refused a range, the file is requested again
+	// in one request without the Range header. Returns false if it was.
+	bool restartWithoutRanges() {
+		Expects(sentRanges() == 0);
+
+		if (_withoutRanges) {
+			return false;
+		}
+		_withoutRanges = true;
+		_ranged = false;
+		_unknownSize = false;
+		_size = _already = 0;
+		_ranges.clear();
+		_ranges.push_back({ 0, 0 });
+		_data = QByteArray();
+		if (_file.isOpen()) {
+			_file.close();
+			_file.remove();
+		}
+		return true;
+	}
+
+	bool write(Range &range, const QByteArray &bytes) {
+		if (bytes.isEmpty()) {
+			return true;
+		} else if (_unknownSize) {
+			if (range.received + bytes.size() > std::numeric_limits<int>::max()) {
+				LOG(("Network Error: Too much data received by web file loader."));
+				return false;
+			}
+		} else if (range.received + bytes.size() > range.length) {
+			LOG(("Network Error: Too much data received by web file loader."));
+			return false;
+		}
+		const auto offset = range.offset + range.received;
+		if (_file.isOpen()) {
+			if (!_file.seek(offset)
+				|| _file.write(bytes) != qint64(bytes.size())) {
+				LOG(("Network Error: Could not write to '%1'.").arg(_path));
+				return false;
+			}
+		} else {
+			if (offset + bytes.size() > _data.size()) {
+				_data.resize(int(offset + bytes.size()));
+			}
+			memcpy(_data.data() + offset, bytes.constData(), bytes.size());
+		}
+		range.received += bytes.size();
+		_already += bytes.size();
+		return true;
+	}
+
+	bool complete() const {
+		return sizeKnown() && ranges::all_of(_ranges, [](const Range &range) {
+			return (range.received == range.length);
+		});
+	}
+	bool writtenToFile() const {
+		return _file.isOpen();
+	}
+	void closeFile() {
+		_file.close();
+	}
+
+	const QByteArray &data() const {
+		return _data;
+	}
 	qint64 size() const {
 		return _size;
 	}
@@ -1341,20 +1685,38 @@ public:
 		return _already;
 	}
 
+	~webFileLoaderPrivate() {
+		if (_file.isOpen()) {
+			_file.close();
+			_file.remove();
+		}
+	}
+
 private:
 	static constexpr auto kMaxHttpRedirects = 5;
 
 	webFileLoader *_interface = nullptr;
 	QUrl _url;
+	QString _path;
 	qint64 _already = 0;
 	qint64 _size = 0;
-	QNetworkReply *_reply = nullptr;
+	bool _ranged = false;
+	bool _unknownSize = false;
+	bool _withoutRanges = false;
+	std::deque<Range> _ranges;
 	int32 _redirectsLeft = kMaxHttpRedirects;
 	QByteArray _data;
+	QFile _file;
 
 	friend class WebLoadManager;
 };
 
+QString webFileLoaderUrl(const QString &url) {
+	return url.startsWith(qsl("http"))
+		? url
+		: (Global::CdnDownLoadPreifx() + url);
+}
+
 void stopWebLoadManager() {
 	if (webLoadManager()) {
 		_webLoadThread->quit();
@@ -1378,6 +1740,7 @@ WebLoadManager::WebLoadManager(QThread *thread) {
 
 	connect(this, SIGNAL(progress(webFileLoader*,qint64,qint64)), _webLoadMainManager, SLOT(progress(webFileLoader*,qint64,qint64)));
 	connect(this, SIGNAL(finished(webFileLoader*,QByteArray)), _webLoadMainManager, SLOT(finished(webFileLoader*,QByteArray)));
+	connect(this, SIGNAL(written(webFileLoader*)), _webLoadMainManager, SLOT(written(webFileLoader*)));
 	connect(this, SIGNAL(error(webFileLoader*)), _webLoadMainManager, SLOT(error(webFileLoader*)));
 
 	connect(&_manager, SIGNAL(authenticationRequired(QNetworkReply*,QAuthenticator*)), this, SLOT(onFailed(QNetworkReply*)));
@@ -1386,8 +1749,11 @@ WebLoadManager::WebLoadManager(QThread *thread) {
 #endif // OS_MAC_OLD
 }
 
-void WebLoadManager::append(webFileLoader *loader, const QString &url) {
-	loader->_private = new webFileLoaderPrivate(loader, url);
+void WebLoadManager::append(
+		webFileLoader *loader,
+		const QString &url,
+		const QString &path) {
+	loader->_private = new webFileLoaderPrivate(loader, url, path);
 
 	QMutexLocker lock(&_loaderPointersMutex);
 	_loaderPointers.insert(loader, loader->_private);
@@ -1421,11 +1787,16 @@ bool WebLoadManager::handleReplyResult(webFileLoaderPrivate *loader, WebReplyPro
 		}
 		return false;
 	}
-	if (loader->already() < loader->size() || !loader->size()) {
+	if (!loader->complete()) {
 		emit progress(it.key(), loader->already(), loader->size());
 		return true;
 	}
-	emit finished(it.key(), loader->data());
+	if (loader->writtenToFile()) {
+		loader->closeFile();
+		emit written(it.key());
+	} else {
+		emit finished(it.key(), loader->data());
+	}
 	return false;
 }
 
@@ -1442,14 +1813,22 @@ void WebLoadManager::onFailed(QNetworkReply *reply) {
 		return;
 	}
 	webFileLoaderPrivate *loader = j.value();
-	_replies.erase(j);
+	const auto range = loader->findRange(reply);
+	Assert(range != nullptr);
+	releaseRequest(*range);
 
 	LOG(("Network Error: Failed to request '%1', error %2 (%3)").arg(QString::fromLatin1(loader->_url.toEncoded())).arg(int(reply->error())).arg(reply->errorString()));
 
+	// Ranges already received are kept, the failed one is requested
+	// again from the byte where it was interrupted.
+	if (loader->ranged() && ++range->failures <= kMaxWebRangeFailures) {
+		sendRanges();
+		return;
+	}
 	if (!handleReplyResult(loader, WebReplyProcessError)) {
-		_loaders.remove(loader);
-		delete loader;
+		destroyLoader(loader);
 	}
+	sendRanges();
 }
 
 void WebLoadManager::onProgress(qint64 already, qint64 size) {
@@ -1465,45 +1844,60 @@ void WebLoadManager::onProgress(qint64 already, qint64 size) {
 		return;
 	}
 	const auto loader = j.value();
+	const auto range = loader->findRange(reply);
+	Assert(range != nullptr);
 
 	auto result = WebReplyProcessProgress;
 	const auto statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
 	const auto status = statusCode.isValid() ? statusCode.toInt() : 200;
-	if (status != 200 && status != 206 && status != 416) {
+	if (status != 200 && status != 206) {
 		if (status == 301 || status == 302) {
 			QString loc = reply->header(QNetworkRequest::LocationHeader).toString();
 			if (!loc.isEmpty()) {
-				if (loader->oneMoreRedirect()) {
-					sendRequest(loader, loc);
+				if (loader->oneMoreRedirect(loc)) {
+					sendRequest(loader, *range);
 					return;
 				} else {
 					LOG(("Network Error: Too many HTTP redirects in onFinished() for web file loader: %1").arg(loc));
 					result = WebReplyProcessError;
 				}
 			}
+		} else if (status == 416 && restartWithoutRanges(loader)) {
+			sendRanges();
+			return;
 		} else {
 			LOG(("Network Error: Bad HTTP status received in WebLoadManager::onProgress(): %1").arg(statusCode.toInt()));
 			result = WebReplyProcessError;
 		}
-	} else {
-		loader->setProgress(already, size);
-		QByteArray r = reply->readAll();
-		if (!r.isEmpty()) {
-			loader->addData(r);
-		}
-		if (size == 0) {
-			LOG(("Network Error: Zero size received for HTTP download progress in WebLoadManager::onProgress(): %1 / %2").arg(already).arg(size));
-			result = WebReplyProcessError;
+	} else if (!loader->sizeKnown()
+		&& !loader->unknownSize()
+		&& (status != 200
+			|| !size
+			|| !((size > 0)
+				? loader->prepare(size, false)
+				: loader->prepareUnknownSize()))) {
+		LOG(("Network Error: Zero size received for HTTP download progress in WebLoadManager::onProgress(): %1 / %2").arg(already).arg(size));
+		result = WebReplyProcessError;
+	} else if (!loader->write(*range, reply->readAll())) {
+		result = WebReplyProcessError;
+	} else if (loader->unknownSize()) {
+		// When the response ends its size is reported as the total.
+		if (size > 0 && already == size) {
+			if (loader->finishUnknownSize()) {
+				releaseRequest(*range);
+				reply->deleteLater();
+			} else {
+				result = WebReplyProcessError;
+			}
 		}
+	} else if (range->received == range->length) {
+		releaseRequest(*range);
+		reply->deleteLater();
 	}
 	if (!handleReplyResult(loader, result)) {
-		_replies.erase(j);
-		_loaders.remove(loader);
-		delete loader;
-
-		reply->abort();
-		reply->deleteLater();
+		destroyLoader(loader);
 	}
+	sendRanges();
 }
 
 void WebLoadManager::onMeta() {
@@ -1515,28 +1909,50 @@ void WebLoadManager::onMeta() {
 		return;
 	}
 	const auto loader = j.value();
+	const auto range = loader->findRange(reply);
+	Assert(range != nullptr);
 
-	const auto pairs = reply->rawHeaderPairs();
-	for (auto i = pairs.begin(), e = pairs.end(); i != e; ++i) {
-		if (QString::fromUtf8(i->first).toLower() == "content-range") {
-			const auto m = QRegularExpression(qsl("/(\\d+)([^\\d]|$)")).match(QString::fromUtf8(i->second));
-			if (m.hasMatch()) {
-				loader->setProgress(qMax(qint64(loader->data().size()), loader->already()), m.captured(1).toLongLong());
-				if (!handleReplyResult(loader, WebReplyProcessProgress)) {
-					_replies.erase(j);
-					_loaders.remove(loader);
-					delete loader;
-
-					reply->abort();
-					reply->deleteLater();
-				}
-			}
+	const auto statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
+	const auto status = statusCode.isValid() ? statusCode.toInt() : 200;
+	const auto from = range->offset + range->received;
+	auto result = WebReplyProcessProgress;
+	if (status == 206) {
+		const auto parsed = ParseContentRange(
+			reply->rawHeader("Content-Range"));
+		if (!parsed || parsed->from != from || parsed->total <= 0) {
+			LOG(("Network Error: Bad Content-Range received in WebLoadManager::onMeta()."));
+			result = WebReplyProcessError;
+		} else if (!loader->sizeKnown()
+			&& !loader->prepare(parsed->total, true)) {
+			result = WebReplyProcessError;
 		}
+	} else if (status == 416 || (status == 200 && from > 0)) {
+		if (restartWithoutRanges(loader)) {
+			sendRanges();
+			return;
+		}
+		LOG(("Network Error: Range request refused in WebLoadManager::onMeta()."));
+		result = WebReplyProcessError;
+	} else {
+		return;
+	}
+	if (!handleReplyResult(loader, result)) {
+		destroyLoader(loader);
+	}
+	sendRanges();
+}
+
+bool WebLoadManager::restartWithoutRanges(webFileLoaderPrivate *loader) {
+	abortRequests(loader);
+	if (!loader->restartWithoutRanges()) {
+		return false;
 	}
+	DEBUG_LOG(("Network Info: Range refused for '%1', requesting it whole."
+		).arg(QString::fromLatin1(loader->_url.toEncoded())));
+	return true;
 }
 
 void WebLoadManager::process() {
-	Loaders newLoaders;
 	{
 		QMutexLocker lock(&_loaderPointersMutex);
 		for (LoaderPointers::iterator i = _loaderPointers.begin(), e = _loaderPointers.end(); i != e; ++i) {
@@ -1544,7 +1960,6 @@ void WebLoadManager::process() {
 			if (i.value()) {
 				if (it == _loaders.cend()) {
 					_loaders.insert(i.value());
-					newLoaders.insert(i.value());
 				}
 				i.value() = 0;
 			}
@@ -1555,11 +1970,7 @@ void WebLoadManager::process() {
 				it = _loaderPointers.end();
 			}
 			if (it == _loaderPointers.cend()) {
-				if (QNetworkReply *reply = (*i)->reply()) {
-					_replies.remove(reply);
-					reply->abort();
-					reply->deleteLater();
-				}
+				abortRequests(*i);
 				delete (*i);
 				i = _loaders.erase(i);
 			} else {
@@ -1567,24 +1978,36 @@ void WebLoadManager::process() {
 			}
 		}
 	}
-	for_const (webFileLoaderPrivate *loader, newLoaders) {
-		if (_loaders.contains(loader)) {
-			sendRequest(loader);
+	sendRanges();
+}
+
+void WebLoadManager::sendRanges() {
+	for (const auto loader : _loaders) {
+		while (loader->sentRanges() < kMaxWebRangesPerFile) {
+			const auto range = loader->nextRange();
+			if (!range) {
+				break;
+			}
+			const auto host = loader->_url.host();
+			if (_hostConnections.value(host) >= kMaxWebConnectionsPerHost) {
+				break;
+			}
+			sendRequest(loader, *range);
 		}
 	}
 }
 
-void WebLoadManager::sendRequest(webFileLoaderPrivate *loader, const QString &redirect) {
-	Replies::iterator j = _replies.find(loader->reply());
-	if (j != _replies.cend()) {
-		QNetworkReply *r = j.key();
-		_replies.erase(j);
-
+void WebLoadManager::sendRequest(
+		webFileLoaderPrivate *loader,
+		webFileLoaderRange &range) {
+	if (const auto r = range.reply) {
+		releaseRequest(range);
 		r->abort();
 		r->deleteLater();
 	}
 
-	QNetworkReply *r = loader->request(_manager, redirect);
+	const auto r = loader->request(_manager, range);
+	++_hostConnections[range.host];
 
 	// Those use QObject::sender, so don't just remove the receiver pointer!
 	connect(r, SIGNAL(downloadProgress(qint64, qint64)), this, SLOT(onProgress(qint64, qint64)));
@@ -1594,6 +2017,30 @@ void WebLoadManager::sendRequest(webFileLoaderPrivate *loader, const QString &re
 	_replies.insert(r, loader);
 }
 
+void WebLoadManager::releaseRequest(webFileLoaderRange &range) {
+	Expects(range.reply != nullptr);
+
+	_replies.remove(base::take(range.reply));
+	const auto i = _hostConnections.find(range.host);
+	if (i != _hostConnections.end() && !--i.value()) {
+		_hostConnections.erase(i);
+	}
+}
+
+void WebLoadManager::abortRequests(webFileLoaderPrivate *loader) {
+	for (const auto reply : loader->replies()) {
+		releaseRequest(*loader->findRange(reply));
+		reply->abort();
+		reply->deleteLater();
+	}
+}
+
+void WebLoadManager::destroyLoader(webFileLoaderPrivate *loader) {
+	abortRequests(loader);
+	_loaders.remove(loader);
+	delete loader;
+}
+
 void WebLoadManager::finish() {
 	clear();
 }
@@ -1607,15 +2054,16 @@ void WebLoadManager::clear() {
 	}
 	_loaderPointers.clear();
 
-	for_const (webFileLoaderPrivate *loader, _loaders) {
-		delete loader;
-	}
-	_loaders.clear();
-
 	for (Replies::iterator i = _replies.begin(), e = _replies.end(); i != e; ++i) {
 		delete i.key();
 	}
 	_replies.clear();
+	_hostConnections.clear();
+
+	for_const (webFileLoaderPrivate *loader, _loaders) {
+		delete loader;
+	}
+	_loaders.clear();
 }
 
 WebLoadManager::~WebLoadManager() {
@@ -1634,6 +2082,12 @@ void WebLoadMainManager::finished(webFileLoader *loader, QByteArray data) {
 	}
 }
 
+void WebLoadMainManager::written(webFileLoader *loader) {
+	if (webLoadManager() && webLoadManager()->carries(loader)) {
+		loader->onWritten();
+	}
+}
+
 void WebLoadMainManager::error(webFileLoader *loader) {
 	if (webLoadManager() && webLoadManager()->carries(loader)) {
 		loader->onError();
@@ -11,8 +11,10 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "base/timer.h"
 #include "base/binary_guard.h"
 #include "data/data_file_origin.h"
+#include "storage/file_download_controller.h"
 
 namespace Storage {
+class DownloadWriter;
 namespace Cache {
 struct Key;
 } // namespace Cache
@@ -24,6 +26,15 @@ constexpr auto kMaxWallPaperInMemory = kMaxFileInMemory;
 constexpr auto kMaxAnimationInMemory = kMaxFileInMemory; // 10 MB gif and mp4 animations held in memory while playing
 constexpr auto kMaxWallPaperDimension = 4096; // 4096x4096 is max area.
 
+struct DownloadStats {
+	MTP::DcId dcId = 0;
+	int sessionsCount = 0;
+	int partSize = 0;
+	int queriesLimit = 0;
+	crl::time rtt = 0;
+	int64 throughput = 0; // bytes per second
+};
+
 class Downloader final {
 public:
 	Downloader();
@@ -40,6 +51,13 @@ public:
 	void requestedAmountIncrement(MTP::DcId dcId, int index, int amount);
 	int chooseDcIndexForRequest(MTP::DcId dcId) const;
 
+	// Part size, parallel queries and sessions count in each dc are
+	// adapted to the round trip time and throughput measured here.
+	void requestSucceeded(MTP::DcId dcId, int bytes, crl::time sent);
+	int chooseDownloadPartSize(MTP::DcId dcId) const;
+	int chooseQueriesLimit(MTP::DcId dcId) const;
+	rpl::producer<DownloadStats> stats() const;
+
 	~Downloader();
 
 private:
@@ -47,12 +65,18 @@ private:
 	void killDownloadSessionsStop(MTP::DcId dcId);
 	void killDownloadSessions();
 
+	int sessionsCount(MTP::DcId dcId) const;
+	void stopUnusedSessions(MTP::DcId dcId);
+
 	base::Observable<void> _taskFinishedObservable;
 	int _priority = 1;
 
-	using RequestedInDc = std::array<int64, MTP::kDownloadSessionsCount>;
+	using RequestedInDc = std::array<int64, MTP::kMaxDownloadSessionsCount>;
 	std::map<MTP::DcId, RequestedInDc> _requestedBytesAmount;
 
+	base::flat_map<MTP::DcId, DownloadController> _controllers;
+	rpl::event_stream<DownloadStats> _stats;
+
 	base::flat_map<MTP::DcId, crl::time> _killDownloadSessionTimes;
 	base::Timer _killDownloadSessionsTimer;
 
@@ -101,6 +125,7 @@ public:
 	}
 	QByteArray imageFormat(const QSize &shrinkBox = QSize()) const;
 	QImage imageData(const QSize &shrinkBox = QSize()) const;
+	bool imageDataNeedsDecoding() const;
 	QString fileName() const {
 		return _filename;
 	}
@@ -168,6 +193,8 @@ protected:
 	static void LoadNextFromQueue(not_null<FileLoaderQueue*> queue);
 	virtual bool loadPart() = 0;
 
+	void createWriter();
+
 	not_null<Storage::Downloader*> _downloader;
 	FileLoader *_prev = nullptr;
 	FileLoader *_next = nullptr;
@@ -186,6 +213,10 @@ protected:
 	QFile _file;
 	bool _fileIsOpen = false;
 
+	// Parts are written to _filename by it off the main thread.
+	std::unique_ptr<Storage::DownloadWriter> _writer;
+	int32 _writtenSize = 0;
+
 	LoadToCacheSetting _toCache;
 	LoadFromCloudSetting _fromCloud;
 
@@ -247,6 +278,8 @@ private:
 		MTP::DcId dcId = 0;
 		int dcIndex = 0;
 		int offset = 0;
+		int size = 0;
+		crl::time sent = 0;
 	};
 	struct CdnFileHash {
 		CdnFileHash(int limit, QByteArray hash) : limit(limit), hash(hash) {
@@ -261,6 +294,8 @@ private:
 	int partSize() const;
 	RequestData prepareRequest(int offset) const;
 	void makeRequest(int offset);
+	void remakeRequest(const RequestData &requestData);
+	void measureRequest(const RequestData &requestData, int bytes);
 
 	bool loadPart() override;
 	void normalPartLoaded(const MTPupload_File &result, mtpRequestId requestId);
@@ -272,6 +307,7 @@ private:
 
 	bool feedPart(int offset, bytes::const_span buffer);
 	void partLoaded(int offset, bytes::const_span buffer);
+	void finishLoading();
 
 	bool partFailed(const RPCError &error, mtpRequestId requestId);
 	bool normalPartFailed(QByteArray fileReference, const RPCError &error, mtpRequestId requestId);
@@ -279,10 +315,11 @@ private:
 
 	mtpRequestId sendRequest(const RequestData &requestData);
 	void placeSentRequest(mtpRequestId requestId, const RequestData &requestData);
+	RequestData finishSentRequest(mtpRequestId requestId);
 	int finishSentRequestGetOffset(mtpRequestId requestId);
-	void switchToCDN(int offset, const MTPDupload_fileCdnRedirect &redirect);
+	void switchToCDN(const RequestData &requestData, const MTPDupload_fileCdnRedirect &redirect);
 	void addCdnHashes(const QVector<MTPFileHash> &hashes);
-	void changeCDNParams(int offset, MTP::DcId dcId, const QByteArray &token, const QByteArray &encryptionKey, const QByteArray &encryptionIV, const QVector<MTPFileHash> &hashes);
+	void changeCDNParams(const RequestData &requestData, MTP::DcId dcId, const QByteArray &token, const QByteArray &encryptionKey, const QByteArray &encryptionIV, const QVector<MTPFileHash> &hashes);
 
 	enum class CheckCdnHashResult {
 		NoHash,
@@ -296,6 +333,7 @@ private:
 	bool _lastComplete = false;
 	int32 _skippedBytes = 0;
 	int32 _nextRequestOffset = 0;
+	int _partSize = 0;
 
 	base::variant<
 		StorageFileLocation,
@@ -315,6 +353,7 @@ private:
 };
 
 class webFileLoaderPrivate;
+struct webFileLoaderRange;
 
 class webFileLoader : public FileLoader {
 public:
@@ -329,6 +368,7 @@ public:
 
 	void onProgress(qint64 already, qint64 size);
 	void onFinished(const QByteArray &data);
+	void onWritten();
 	void onError();
 
 	void stop() override {
@@ -344,6 +384,10 @@ protected:
 
 	QString _url;
 
+	// Large files are written right to this path by ranges, FileLoader
+	// gets the path only after that, so that it doesn't write it again.
+	QString _toFile;
+
 	bool _requestSent;
 	int32 _already;
 
@@ -364,7 +408,11 @@ class WebLoadManager : public QObject {
 public:
 	WebLoadManager(QThread *thread);
 
-	void append(webFileLoader *loader, const QString &url);
+	// If path is not empty large files are written there by parts.
+	void append(
+		webFileLoader *loader,
+		const QString &url,
+		const QString &path);
 	void stop(webFileLoader *reader);
 	bool carries(webFileLoader *reader) const;
 
@@ -375,6 +423,7 @@ signals:
 
 	void progress(webFileLoader *loader, qint64 already, qint64 size);
 	void finished(webFileLoader *loader, QByteArray data);
+	void written(webFileLoader *loader);
 	void error(webFileLoader *loader);
 
 public slots:
@@ -388,7 +437,14 @@ public slots:
 
 private:
 	void clear();
-	void sendRequest(webFileLoaderPrivate *loader, const QString &redirect = QString());
+	void sendRanges();
+	void sendRequest(
+		webFileLoaderPrivate *loader,
+		webFileLoaderRange &range);
+	void releaseRequest(webFileLoaderRange &range);
+	void abortRequests(webFileLoaderPrivate *loader);
+	void destroyLoader(webFileLoaderPrivate *loader);
+	bool restartWithoutRanges(webFileLoaderPrivate *loader);
 	bool handleReplyResult(webFileLoaderPrivate *loader, WebReplyProcessResult result);
 
 	QNetworkAccessManager _manager;
@@ -402,6 +458,8 @@ private:
 	typedef QMap<QNetworkReply*, webFileLoaderPrivate*> Replies;
 	Replies _replies;
 
+	QMap<QString, int> _hostConnections;
+
 };
 
 class WebLoadMainManager : public QObject {
@@ -410,6 +468,7 @@ class WebLoadMainManager : public QObject {
 public slots:
 	void progress(webFileLoader *loader, qint64 already, qint64 size);
 	void finished(webFileLoader *loader, QByteArray data);
+	void written(webFileLoader *loader);
 	void error(webFileLoader *loader);
 
 };
@@ -420,3 +479,6 @@ static webFileLoader * const CancelledWebFileLoader = static_cast<webFileLoader*
 static WebLoadManager * const FinishedWebLoadManager = SharedMemoryLocation<WebLoadManager, 0>();
 
 void stopWebLoadManager();
+
+// Relative urls are resolved against the configured cdn prefix.
+QString webFileLoaderUrl(const QString &url);
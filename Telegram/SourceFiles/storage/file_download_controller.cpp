@@ -0,0 +1,128 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "storage/file_download_controller.h"
+
+#include "base/assertion.h"
+
+#include <algorithm>
+
+namespace Storage {
+namespace {
+
+// Larger parts are used only if that many of them fill the pipe.
+constexpr auto kMinPartsInFlight = 8;
+
+// Throughput is measured in windows of that length.
+constexpr auto kThroughputWindow = crl::time(1000);
+constexpr auto kThroughputWindowStale = 4 * kThroughputWindow;
+
+// The smoothed throughput shows the effect of a sessions count change or
+// of the queries limit growth only after that many windows.
+constexpr auto kSessionsSettleWindows = 10;
+
+} // namespace
+
+DownloadController::DownloadController(
+	int minSessionsCount,
+	int maxSessionsCount)
+: _minSessionsCount(minSessionsCount)
+, _maxSessionsCount(maxSessionsCount)
+, _sessionsCount(minSessionsCount) {
+	Expects(minSessionsCount > 0 && minSessionsCount <= maxSessionsCount);
+}
+
+bool DownloadController::requestSucceeded(
+		int bytes,
+		crl::time sent,
+		crl::time now) {
+	if (!_windowStart || now - _windowStart > kThroughputWindowStale) {
+		// Don't count the idle time in the throughput. The round trip
+		// time is measured once again, the path could've changed.
+		_windowStart = sent;
+		_windowBytes = 0;
+		_baseRtt = 0;
+	}
+
+	// A request sent while others are in flight waits for them in the
+	// queue, so most samples are the queries limit times the part
+	// transfer time. Keeping twice that in flight would grow the limit
+	// after each measurement, only the fastest sample shows the path.
+	const auto sample = std::max(now - sent, crl::time(1));
+	_baseRtt = _baseRtt ? std::min(_baseRtt, sample) : sample;
+
+	_windowBytes += bytes;
+	const auto elapsed = now - _windowStart;
+	if (elapsed < kThroughputWindow) {
+		return false;
+	}
+	const auto measured = _windowBytes * 1000 / elapsed;
+	_throughput = _throughput
+		? ((_throughput * 3 + measured) / 4)
+		: measured;
+	_windowStart = now;
+	_windowBytes = 0;
+	adapt();
+	return true;
+}
+
+void DownloadController::adapt() {
+	// Keep twice the bandwidth-delay product in flight.
+	const auto inFlight = _throughput * 2 * _baseRtt / 1000;
+	auto partSize = kDefaultPartSize;
+	while (partSize < kMaxPartSize
+		&& inFlight / (partSize * 2) >= kMinPartsInFlight) {
+		partSize *= 2;
+	}
+	const auto queriesLimit = std::clamp(
+		int((inFlight + partSize - 1) / partSize),
+		kMinQueriesLimit,
+		kMaxQueriesLimit);
+
+	_windowsAtMaxQueries = (queriesLimit == kMaxQueriesLimit)
+		? (_windowsAtMaxQueries + 1)
+		: 0;
+	if (++_windowsSinceSessionsChange >= kSessionsSettleWindows) {
+		// Open one more session while it still adds throughput, compared
+		// with the throughput before the sessions count was last changed.
+		const auto add = (_windowsAtMaxQueries >= kSessionsSettleWindows)
+			&& (_sessionsCount < _maxSessionsCount)
+			&& (_throughput > _sessionsThroughput * 11 / 10);
+		const auto remove = !add
+			&& (_sessionsCount > _minSessionsCount)
+			&& (_throughput < _sessionsThroughput * 7 / 10);
+		if (add || remove) {
+			_sessionsCount += add ? 1 : -1;
+			_sessionsThroughput = _throughput;
+			_windowsSinceSessionsChange = 0;
+		}
+	}
+	_partSize = partSize;
+	_queriesLimit = queriesLimit;
+}
+
+int DownloadController::sessionsCount() const {
+	return _sessionsCount;
+}
+
+int DownloadController::partSize() const {
+	return _partSize;
+}
+
+int DownloadController::queriesLimit() const {
+	return _queriesLimit;
+}
+
+crl::time DownloadController::baseRtt() const {
+	return _baseRtt;
+}
+
+int64 DownloadController::throughput() const {
+	return _throughput;
+}
+
+} // namespace Storage
@@ -0,0 +1,57 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "base/basic_types.h"
+
+#include <crl/crl_time.h>
+
+namespace Storage {
+
+// Chooses the part size, the parallel queries limit and the sessions
+// count of one dc from the throughput and the round trip time measured
+// by the requests that succeeded there.
+class DownloadController final {
+public:
+	// Part size can be 4kb * 2^n up to 512kb, so that 1mb is divisible by it.
+	static constexpr auto kDefaultPartSize = 128 * 1024;
+	static constexpr auto kMaxPartSize = 512 * 1024;
+	static constexpr auto kDefaultQueriesLimit = 16;
+	static constexpr auto kMinQueriesLimit = 8;
+	static constexpr auto kMaxQueriesLimit = 32;
+
+	DownloadController(int minSessionsCount, int maxSessionsCount);
+
+	// Returns true if the parameters were chosen once again.
+	bool requestSucceeded(int bytes, crl::time sent, crl::time now);
+
+	[[nodiscard]] int sessionsCount() const;
+	[[nodiscard]] int partSize() const;
+	[[nodiscard]] int queriesLimit() const;
+	[[nodiscard]] crl::time baseRtt() const;
+	[[nodiscard]] int64 throughput() const; // bytes per second
+
+private:
+	void adapt();
+
+	int _minSessionsCount = 0;
+	int _maxSessionsCount = 0;
+	int _sessionsCount = 0;
+	int _partSize = kDefaultPartSize;
+	int _queriesLimit = kDefaultQueriesLimit;
+	crl::time _baseRtt = 0;
+	int64 _throughput = 0;
+	int64 _sessionsThroughput = 0; // When the sessions count was chosen.
+	int _windowsAtMaxQueries = 0;
+	int _windowsSinceSessionsChange = 0;
+	int64 _windowBytes = 0;
+	crl::time _windowStart = 0;
+
+};
+
+} // namespace Storage
@@ -0,0 +1,178 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "catch.hpp"
+
+#include "storage/file_download_controller.h"
+
+#include <algorithm>
+#include <array>
+#include <deque>
+
+namespace {
+
+using Storage::DownloadController;
+
+constexpr auto kSecond = crl::time(1000);
+constexpr auto kMegabyte = int64(1024 * 1024);
+constexpr auto kMinSessionsCount = 2;
+constexpr auto kMaxSessionsCount = 4;
+constexpr auto kMaxInFlight = int64(DownloadController::kMaxQueriesLimit)
+	* DownloadController::kMaxPartSize;
+
+// A download keeping the chosen amount of parts in flight over a link
+// that sends the responses one after another. Each session gets at most
+// perSession bytes per second, all of them together at most total.
+class Simulation {
+public:
+	Simulation(int64 total, int64 perSession, crl::time rtt)
+	: _controller(kMinSessionsCount, kMaxSessionsCount) {
+		setLink(total, perSession, rtt);
+	}
+
+	void setLink(int64 total, int64 perSession, crl::time rtt) {
+		_total = total;
+		_perSession = perSession;
+		_rtt = rtt;
+	}
+
+	void run(crl::time duration) {
+		const auto till = _now + duration;
+		while (_now < till) {
+			fill();
+			const auto request = _requests.front();
+			_requests.pop_front();
+			_now = request.received;
+			const auto was = parameters();
+			_controller.requestSucceeded(request.bytes, request.sent, _now);
+			if (parameters() != was) {
+				_changed = _now;
+			}
+		}
+	}
+
+	// The parts in flight are received and nothing is requested after.
+	void pause(crl::time duration) {
+		if (!_requests.empty()) {
+			_now = _requests.back().received;
+			_requests.clear();
+		}
+		_now += duration;
+		_linkFree = _now;
+	}
+
+	const DownloadController &controller() const {
+		return _controller;
+	}
+	crl::time lastChange() const {
+		return _changed;
+	}
+	crl::time now() const {
+		return _now;
+	}
+
+private:
+	struct Request {
+		int bytes = 0;
+		crl::time sent = 0;
+		crl::time received = 0;
+	};
+
+	std::array<int, 3> parameters() const {
+		return {
+			_controller.sessionsCount(),
+			_controller.partSize(),
+			_controller.queriesLimit(),
+		};
+	}
+
+	void fill() {
+		const auto bandwidth = std::min(
+			_total,
+			_perSession * _controller.sessionsCount());
+		while (int(_requests.size()) < _controller.queriesLimit()) {
+			const auto bytes = _controller.partSize();
+			const auto start = std::max(_now + _rtt / 2, _linkFree);
+			_linkFree = start + std::max(bytes * kSecond / bandwidth, crl::time(1));
+			_requests.push_back({ bytes, _now, _linkFree + _rtt / 2 });
+		}
+	}
+
+	DownloadController _controller;
+	std::deque<Request> _requests;
+	int64 _total = 0;
+	int64 _perSession = 0;
+	crl::time _rtt = 0;
+	crl::time _now = kSecond;
+	crl::time _linkFree = 0;
+	crl::time _changed = 0;
+
+};
+
+int64 InFlight(const DownloadController &controller) {
+	return int64(controller.queriesLimit()) * controller.partSize();
+}
+
+} // namespace
+
+TEST_CASE("download controller", "[file_download]") {
+	SECTION("settles below the maximum") {
+		// 10 MB/s with 100 ms round trip time, two bandwidth-delay
+		// products are about 2 MB, while queued requests see 800 ms.
+		auto simulation = Simulation(10 * kMegabyte, 10 * kMegabyte, 100);
+		simulation.run(60 * kSecond);
+		const auto &controller = simulation.controller();
+		REQUIRE(controller.baseRtt() < 150);
+		REQUIRE(InFlight(controller) >= 2 * kMegabyte);
+		REQUIRE(InFlight(controller) < 3 * kMegabyte);
+		REQUIRE(InFlight(controller) < kMaxInFlight);
+		REQUIRE(controller.sessionsCount() == kMinSessionsCount);
+		REQUIRE(simulation.lastChange() < simulation.now() - 30 * kSecond);
+	}
+	SECTION("slow link keeps the minimal queries limit") {
+		auto simulation = Simulation(kMegabyte, kMegabyte, 300);
+		simulation.run(30 * kSecond);
+		const auto &controller = simulation.controller();
+		REQUIRE(controller.partSize() == DownloadController::kDefaultPartSize);
+		REQUIRE(controller.queriesLimit() == DownloadController::kMinQueriesLimit);
+	}
+	SECTION("long fat link uses large parts") {
+		auto simulation = Simulation(60 * kMegabyte, 60 * kMegabyte, 200);
+		simulation.run(30 * kSecond);
+		const auto &controller = simulation.controller();
+		REQUIRE(controller.partSize() == DownloadController::kMaxPartSize);
+		REQUIRE(controller.queriesLimit() > DownloadController::kMinQueriesLimit);
+	}
+	SECTION("sessions are added while they add throughput") {
+		auto simulation = Simulation(80 * kMegabyte, 10 * kMegabyte, 500);
+		simulation.run(60 * kSecond);
+		REQUIRE(simulation.controller().sessionsCount() == kMaxSessionsCount);
+
+		// Extra sessions are dropped when the link becomes slower.
+		simulation.setLink(8 * kMegabyte, 10 * kMegabyte, 300);
+		simulation.run(60 * kSecond);
+		REQUIRE(simulation.controller().sessionsCount() == kMinSessionsCount);
+	}
+	SECTION("sessions are not added if they don't add throughput") {
+		auto simulation = Simulation(20 * kMegabyte, 20 * kMegabyte, 500);
+		simulation.run(60 * kSecond);
+		REQUIRE(simulation.controller().sessionsCount() <= kMinSessionsCount + 1);
+	}
+	SECTION("round trip time is measured again after a pause") {
+		auto simulation = Simulation(10 * kMegabyte, 10 * kMegabyte, 100);
+		simulation.run(20 * kSecond);
+		REQUIRE(simulation.controller().baseRtt() < 150);
+
+		simulation.setLink(10 * kMegabyte, 10 * kMegabyte, 400);
+		simulation.pause(10 * kSecond);
+		simulation.run(20 * kSecond);
+		const auto &controller = simulation.controller();
+		REQUIRE(controller.baseRtt() >= 400);
+		REQUIRE(controller.baseRtt() < 500);
+		REQUIRE(InFlight(controller) >= 8 * kMegabyte);
+	}
+}
@@ -0,0 +1,163 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "storage/file_download_writer.h"
+
+#include "platform/platform_file_utilities.h"
+
+namespace Storage {
+namespace details {
+
+class DownloadWriterObject {
+public:
+	DownloadWriterObject(
+		crl::weak_on_queue<DownloadWriterObject> weak,
+		const QString &path,
+		Fn<void()> failed);
+
+	void write(int offset, const QByteArray &bytes);
+	void finish(int size, Fn<void()> done);
+	void remove();
+
+private:
+	[[nodiscard]] bool open();
+	[[nodiscard]] bool complete(int size) const;
+	void addRange(int from, int till);
+	void fail();
+
+	QFile _file;
+	Fn<void()> _failed;
+	base::flat_map<int, int> _ranges; // from -> till
+	bool _opened = false;
+	bool _failedAlready = false;
+
+};
+
+DownloadWriterObject::DownloadWriterObject(
+	crl::weak_on_queue<DownloadWriterObject> weak,
+	const QString &path,
+	Fn<void()> failed)
+: _file(path)
+, _failed(std::move(failed)) {
+}
+
+bool DownloadWriterObject::open() {
+	if (_opened) {
+		return _file.isOpen();
+	}
+	_opened = true;
+	if (!_file.open(QIODevice::WriteOnly)) {
+		LOG(("Download Error: Could not open '%1' for writing."
+			).arg(_file.fileName()));
+		return false;
+	}
+	return true;
+}
+
+void DownloadWriterObject::write(int offset, const QByteArray &bytes) {
+	if (_failedAlready) {
+		return;
+	} else if (!open()
+		|| !_file.seek(offset)
+		|| _file.write(bytes) != qint64(bytes.size())) {
+		fail();
+		return;
+	}
+	addRange(offset, offset + bytes.size());
+}
+
+void DownloadWriterObject::addRange(int from, int till) {
+	auto i = _ranges.upper_bound(from);
+	if (i != begin(_ranges) && std::prev(i)->second >= from) {
+		--i;
+		from = i->first;
+		till = std::max(till, i->second);
+	}
+	while (i != end(_ranges) && i->first <= till) {
+		till = std::max(till, i->second);
+		i = _ranges.erase(i);
+	}
+	_ranges.emplace(from, till);
+}
+
+bool DownloadWriterObject::complete(int size) const {
+	if (_ranges.empty()) {
+		return !size;
+	}
+	const auto &[from, till] = _ranges.front();
+	return (_ranges.size() == 1) && !from && (!size || till == size);
+}
+
+void DownloadWriterObject::finish(int size, Fn<void()> done) {
+	if (_failedAlready) {
+		return;
+	} else if (!open()) {
+		fail();
+		return;
+	} else if (!complete(size)) {
+		LOG(("Download Error: Holes left in '%1'.").arg(_file.fileName()));
+		fail();
+		return;
+	}
+	_file.close();
+	Platform::File::PostprocessDownloaded(
+		QFileInfo(_file).absoluteFilePath());
+	done();
+}
+
+void DownloadWriterObject::remove() {
+	_failedAlready = true;
+	_file.close();
+	if (_opened) {
+		_file.remove();
+	}
+}
+
+void DownloadWriterObject::fail() {
+	_failedAlready = true;
+	_file.close();
+	_failed();
+}
+
+} // namespace details
+
+DownloadWriter::DownloadWriter(const QString &path, Fn<void()> failed)
+: _failed(std::move(failed))
+, _wrapped(path, [weak = base::make_weak(this)] {
+	crl::on_main(weak, [=] {
+		// The callback may destroy this writer.
+		const auto callback = weak->_failed;
+		callback();
+	});
+}) {
+}
+
+void DownloadWriter::write(int offset, QByteArray &&bytes) {
+	_wrapped.with([=, bytes = std::move(bytes)](Implementation &unwrapped) {
+		unwrapped.write(offset, bytes);
+	});
+}
+
+void DownloadWriter::finish(int size, Fn<void()> done) {
+	auto wrapped = [weak = base::make_weak(this), done = std::move(done)] {
+		crl::on_main(weak, done);
+	};
+	_wrapped.with([=, wrapped = std::move(wrapped)](
+			Implementation &unwrapped) {
+		unwrapped.finish(size, wrapped);
+	});
+}
+
+void DownloadWriter::remove() {
+	_wrapped.with([](Implementation &unwrapped) {
+		unwrapped.remove();
+	});
+}
+
+DownloadWriter::~DownloadWriter() = default;
+
+} // namespace Storage
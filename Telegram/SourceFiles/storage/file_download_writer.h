@@ -0,0 +1,46 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "base/weak_ptr.h"
+
+#include <crl/crl_object_on_queue.h>
+
+namespace Storage {
+namespace details {
+class DownloadWriterObject;
+} // namespace details
+
+// Writes parts of a downloaded file on a background queue.
+//
+// Parts are written at their offsets in any order, the written ranges
+// are tracked so that finishing fails if the file has holes in it.
+// All the callbacks are invoked on the main thread.
+class DownloadWriter final : public base::has_weak_ptr {
+public:
+	DownloadWriter(const QString &path, Fn<void()> failed);
+
+	void write(int offset, QByteArray &&bytes);
+
+	// Closes the file and post-processes it as a downloaded one.
+	void finish(int size, Fn<void()> done);
+
+	// Closes the file and removes it.
+	void remove();
+
+	~DownloadWriter();
+
+private:
+	using Implementation = details::DownloadWriterObject;
+
+	Fn<void()> _failed;
+	crl::object_on_queue<Implementation> _wrapped;
+
+};
+
+} // namespace Storage
@@ -13,6 +13,13 @@ namespace Storage {
 namespace {
 	using ErrorSignal = void(QNetworkReply::*)(QNetworkReply::NetworkError);
 	const auto QNetworkReply_error = ErrorSignal(&QNetworkReply::error);
+
+	// Failed parts are sent again after 1, 2, 4, 8 and 16 seconds.
+	constexpr auto kMaxPartAttempts = 5;
+	constexpr auto kPartRetryDelay = crl::time(1000);
+
+	// Acknowledged parts are written to the upload journal in batches.
+	constexpr auto kJournalWriteDelay = crl::time(1000);
 }
 namespace mtp{
 	// max 512kb uploaded at the same time in each session
@@ -55,6 +62,15 @@ namespace web {
 
 	// 8mb for medium document ( <= 128mb )
 	constexpr auto kDocumentUploadPartSize3 = 8 * 1024 * 1024;
+
+	// Parts are read from disk only this far ahead of the sent ones.
+	constexpr auto kReadAheadParts = 3;
+
+	// Parts window starts from this count and grows while the measured
+	// throughput keeps rising by at least kWindowGrowThreshold per sample.
+	constexpr auto kStartParallelParts = 2;
+	constexpr auto kWindowSampleDuration = crl::time(2000);
+	constexpr auto kWindowGrowThreshold = 1.1;
 } // namespace web
 
 Uploader::File::File(const SendMediaReady& media) : media(media) {	
@@ -79,6 +95,19 @@ const QString& Uploader::File::filename() const {
 	return file ? file->filename : media.filename;
 }
 
+UploadFileParts &Uploader::File::parts() {
+	return file
+		? ((type() == SendMediaType::Photo
+			|| type() == SendMediaType::Secure)
+			? file->fileparts
+			: file->thumbparts)
+		: media.parts;
+}
+
+uint64 Uploader::File::docFileId() const {
+	return journal.fileId ? journal.fileId : id();
+}
+
 class Uploader::mtpFile final : public Uploader::File {
 public:
 	mtpFile(const SendMediaReady& media);
@@ -174,9 +203,6 @@ Uploader::webFile::webFile(const std::shared_ptr<FileLoadResult>& file)
 		|| type() == SendMediaType::WallPaper
 		|| type() == SendMediaType::Audio) {
 		setDocSize(file->filesize);
-		if (type() == SendMediaType::Audio) {
-			md5Hash.feed(file->content, file->content.size());
-		}
 	} else {
 		docSize = docPartSize = docPartsCount = 0;
 	}
@@ -203,11 +229,122 @@ bool Uploader::webFile::setPartSize(uint32 partSize) {
 	return (docPartsCount <= web::kDocumentMaxPartsCount);
 }
 
-Uploader::Uploader() {
+Uploader::Uploader()
+: retryTimer([=] { sendNext(); })
+, journalTimer([=] { writeJournals(); }) {
 	nextTimer.setSingleShot(true);
 	connect(&nextTimer, &QTimer::timeout, [this] { sendNext(); });
 }
 
+bool Uploader::journalReady(const FullMsgId &fullId, File &file) {
+	using State = File::JournalState;
+	if (file.journalState == State::Ready) {
+		return true;
+	} else if (file.journalState == State::Loading) {
+		return false;
+	}
+	const auto &content = file.file
+		? file.file->content
+		: file.media.data;
+	const auto &path = file.file
+		? file.file->filepath
+		: file.media.file;
+	file.journal = UploadJournal{
+		file.id(),
+		unixtime(),
+		file.docPartSize,
+		file.docPartsCount
+	};
+	file.journalKey = content.isEmpty()
+		? UploadJournalKey(path)
+		: std::nullopt;
+	if (!file.journalKey) {
+		file.journalState = State::Ready;
+		return true;
+	}
+	file.journalState = State::Loading;
+	Auth().data().cache().get(*file.journalKey, [=](QByteArray &&value) {
+		crl::on_main(this, [=, value = std::move(value)] {
+			journalLoaded(fullId, value);
+		});
+	});
+	return false;
+}
+
+void Uploader::journalLoaded(
+		const FullMsgId &fullId,
+		const QByteArray &serialized) {
+	const auto i = queue.find(fullId);
+	if (i == end(queue)) {
+		return;
+	}
+	auto &file = *i->second;
+	const auto loaded = UploadJournal::FromSerialized(serialized);
+	if (loaded && loaded->resumable(file.docPartSize, file.docPartsCount)) {
+		file.journal = *loaded;
+		DEBUG_LOG(("Uploader Info: resuming '%1', %2 of %3 parts done.")
+			.arg(file.filename())
+			.arg(file.journal.acked.size())
+			.arg(file.docPartsCount));
+	}
+	file.journalState = File::JournalState::Ready;
+	sendNext();
+}
+
+void Uploader::journalPartAcked(File &file, int32 index) {
+	const auto i = file.docPartMd5s.find(index);
+	if (i == end(file.docPartMd5s)) {
+		return;
+	}
+	if (file.journalKey) {
+		file.journal.acked[index] = i->second;
+		file.journalChanged = true;
+		if (!journalTimer.isActive()) {
+			journalTimer.callOnce(kJournalWriteDelay);
+		}
+	}
+	file.docPartMd5s.erase(i);
+}
+
+void Uploader::journalFinished(File &file) {
+	if (file.journalKey) {
+		file.journalChanged = false;
+		Auth().data().cache().remove(*file.journalKey);
+	}
+}
+
+void Uploader::writeJournal(File &file) {
+	if (file.journalKey && file.journalChanged) {
+		file.journalChanged = false;
+		Auth().data().cache().put(
+			*file.journalKey,
+			file.journal.serialize());
+	}
+}
+
+void Uploader::writeJournals() {
+	journalTimer.cancel();
+	for (const auto &[fullId, file] : queue) {
+		writeJournal(*file);
+	}
+}
+
+bool Uploader::retryLater(File &file) {
+	// All parts in flight usually fail together when the connection
+	// drops, such a burst is counted as a single attempt.
+	if (file.retryAt > crl::now()) {
+		return true;
+	} else if (++file.failedAttempts > kMaxPartAttempts) {
+		return false;
+	}
+	const auto delay = kPartRetryDelay << (file.failedAttempts - 1);
+	file.retryAt = crl::now() + delay;
+	if (!retryTimer.isActive() || retryTimer.remainingTime() > delay) {
+		retryTimer.callOnce(delay);
+	}
+	return true;
+}
+
 void Uploader::cancel(const FullMsgId& msgId) {
 	if (uploadingId == msgId) {
 		currentFailed();
@@ -343,6 +480,9 @@ void mtpUploader::sendNext() {
 		uploadingId = i->first;
 	}
 	auto& uploadingData = *(i->second);
+	if (uploadingData.retryAt > crl::now()) {
+		return;
+	}
 
 	auto todc = 0;
 	for (auto dc = 1; dc != MTP::kUploadSessionsCount; ++dc) {
@@ -351,12 +491,7 @@ void mtpUploader::sendNext() {
 		}
 	}
 
-	auto& parts = uploadingData.file
-		? ((uploadingData.type() == SendMediaType::Photo
-			|| uploadingData.type() == SendMediaType::Secure)
-			? uploadingData.file->fileparts
-			: uploadingData.file->thumbparts)
-		: uploadingData.media.parts;
+	auto& parts = uploadingData.parts();
 	const auto partsOfId = uploadingData.file
 		? ((uploadingData.type() == SendMediaType::Photo
 			|| uploadingData.type() == SendMediaType::Secure)
@@ -364,7 +499,8 @@ void mtpUploader::sendNext() {
 			: uploadingData.file->thumbId)
 		: uploadingData.media.thumbId;
 	if (parts.isEmpty()) {
-		if (uploadingData.docSentParts >= uploadingData.docPartsCount) {
+		if (uploadingData.docSentParts >= uploadingData.docPartsCount
+			&& uploadingData.docRetryParts.empty()) {
 			if (requestsSent.empty() && docRequestsSent.empty()) {
 				const auto silent = uploadingData.file
 					&& uploadingData.file->to.silent;
@@ -395,11 +531,11 @@ void mtpUploader::sendNext() {
 
 					const auto file = (uploadingData.docSize > kUseBigFilesFrom)
 						? MTP_inputFileBig(
-							MTP_long(uploadingData.id()),
+							MTP_long(uploadingData.docFileId()),
 							MTP_int(uploadingData.docPartsCount),
 							MTP_string(uploadingData.filename()))
 						: MTP_inputFile(
-							MTP_long(uploadingData.id()),
+							MTP_long(uploadingData.docFileId()),
 							MTP_int(uploadingData.docPartsCount),
 							MTP_string(uploadingData.filename()),
 							MTP_bytes(docMd5));
@@ -434,17 +570,25 @@ void mtpUploader::sendNext() {
 						uploadingData.id(),
 						uploadingData.partsCount });
 				}
+				journalFinished(uploadingData);
 				queue.erase(uploadingId);
 				uploadingId = FullMsgId();
 				sendNext();
 			}
 			return;
+		} else if (!journalReady(uploadingId, uploadingData)) {
+			return;
 		}
 
+		const auto retry = !uploadingData.docRetryParts.empty();
+		const auto index = retry
+			? *uploadingData.docRetryParts.begin()
+			: uploadingData.docSentParts;
+		const auto offset = qint64(index) * uploadingData.docPartSize;
 		auto& content = uploadingData.file
 			? uploadingData.file->content
 			: uploadingData.media.data;
-		QByteArray toSend;
+		auto toSend = UploadPartBytes();
 		if (content.isEmpty()) {
 			if (!uploadingData.docFile) {
 				const auto filepath = uploadingData.file
@@ -456,54 +600,65 @@ void mtpUploader::sendNext() {
 					return;
 				}
 			}
-			toSend = uploadingData.docFile->read(uploadingData.docPartSize);
-			if (uploadingData.docSize <= kUseBigFilesFrom) {
-				uploadingData.md5Hash.feed(toSend.constData(), toSend.size());
-			}
-		} else {
-			const auto offset = uploadingData.docSentParts
-				* uploadingData.docPartSize;
-			toSend = content.mid(offset, uploadingData.docPartSize);
-			if ((uploadingData.type() == SendMediaType::File
-				|| uploadingData.type() == SendMediaType::WallPaper
-				|| uploadingData.type() == SendMediaType::Audio)
-				&& uploadingData.docSentParts <= kUseBigFilesFrom) {
-				uploadingData.md5Hash.feed(toSend.constData(), toSend.size());
-			}
+			toSend = ReadUploadPart(
+				*uploadingData.docFile,
+				offset,
+				uploadingData.docPartSize);
+		} else if (offset < content.size()) {
+			toSend = UploadPartBytes::Slice(
+				content,
+				offset,
+				int(std::min(
+					int64(uploadingData.docPartSize),
+					content.size() - offset)));
 		}
 		if ((toSend.size() > uploadingData.docPartSize)
 			|| ((toSend.size() < uploadingData.docPartSize
-				&& uploadingData.docSentParts + 1 != uploadingData.docPartsCount))) {
+				&& index + 1 != uploadingData.docPartsCount))) {
 			currentFailed();
 			return;
 		}
+		const auto partMd5 = hashMd5Hex(toSend.data(), toSend.size());
+		const auto md5 = QByteArray(partMd5.data(), partMd5.size());
+		if (retry) {
+			uploadingData.docRetryParts.erase(index);
+		} else {
+			if (uploadingData.docSize <= kUseBigFilesFrom) {
+				uploadingData.md5Hash.feed(toSend.data(), toSend.size());
+			}
+			uploadingData.docSentParts++;
+			if (uploadingData.journal.acknowledged(index, md5)) {
+				// This part was uploaded before the interruption.
+				nextTimer.start(0);
+				return;
+			}
+		}
 		mtpRequestId requestId;
 		if (uploadingData.docSize > kUseBigFilesFrom) {
 			requestId = MTP::send(
 				MTPupload_SaveBigFilePart(
-					MTP_long(uploadingData.id()),
-					MTP_int(uploadingData.docSentParts),
+					MTP_long(uploadingData.docFileId()),
+					MTP_int(index),
 					MTP_int(uploadingData.docPartsCount),
-					MTP_bytes(toSend)),
+					MTP_bytes(toSend.view())),
 				rpcDone(&mtpUploader::partLoaded),
 				rpcFail(&mtpUploader::partFailed),
 				MTP::uploadDcId(todc));
 		} else {
 			requestId = MTP::send(
 				MTPupload_SaveFilePart(
-					MTP_long(uploadingData.id()),
-					MTP_int(uploadingData.docSentParts),
-					MTP_bytes(toSend)),
+					MTP_long(uploadingData.docFileId()),
+					MTP_int(index),
+					MTP_bytes(toSend.view())),
 				rpcDone(&mtpUploader::partLoaded),
 				rpcFail(&mtpUploader::partFailed),
 				MTP::uploadDcId(todc));
 		}
-		docRequestsSent.emplace(requestId, uploadingData.docSentParts);
+		docRequestsSent.emplace(requestId, index);
+		uploadingData.docPartMd5s[index] = md5;
 		dcMap.emplace(requestId, todc);
 		sentSize += uploadingData.docPartSize;
 		sentSizes[todc] += uploadingData.docPartSize;
-
-		uploadingData.docSentParts++;
 	} else {
 		auto part = parts.begin();
 
@@ -515,7 +670,7 @@ void mtpUploader::sendNext() {
 			rpcDone(&mtpUploader::partLoaded),
 			rpcFail(&mtpUploader::partFailed),
 			MTP::uploadDcId(todc));
-		requestsSent.emplace(requestId, part.value());
+		requestsSent.emplace(requestId, SentPart{ part.key(), part.value() });
 		dcMap.emplace(requestId, todc);
 		sentSize += part.value().size();
 		sentSizes[todc] += part.value().size();
@@ -543,6 +698,7 @@ void mtpUploader::currentFailed() {
 		} else {
 			Unexpected("Type in mtpUploader::currentFailed.");
 		}
+		writeJournal(*j->second);
 		queue.erase(j);
 	}
 
@@ -590,8 +746,8 @@ void mtpUploader::partLoaded(const MTPBool& result, mtpRequestId requestId) {
 		j = docRequestsSent.find(requestId);
 	}
 	if (i != requestsSent.cend() || j != docRequestsSent.cend()) {
-		if (mtpIsFalse(result)) { // failed to upload current file
-			currentFailed();
+		if (mtpIsFalse(result)) { // failed to upload this part
+			partRetry(requestId);
 			return;
 		} else {
 			auto dcIt = dcMap.find(requestId);
@@ -607,14 +763,16 @@ void mtpUploader::partLoaded(const MTPBool& result, mtpRequestId requestId) {
 			Assert(k != queue.cend());
 			auto& [fullId, file] = *k;
 			if (i != requestsSent.cend()) {
-				sentPartSize = i->second.size();
+				sentPartSize = i->second.bytes.size();
 				requestsSent.erase(i);
 			} else {
 				sentPartSize = file->docPartSize;
+				journalPartAcked(*file, j->second);
 				docRequestsSent.erase(j);
 			}
 			sentSize -= sentPartSize;
 			sentSizes[dc] -= sentPartSize;
+			file->failedAttempts = 0;
 			if (file->type() == SendMediaType::Photo) {
 				file->fileSentSize += sentPartSize;
 				const auto photo = Auth().data().photo(file->id());
@@ -651,17 +809,53 @@ void mtpUploader::partLoaded(const MTPBool& result, mtpRequestId requestId) {
 bool mtpUploader::partFailed(const RPCError& err, mtpRequestId requestId) {
 	if (MTP::isDefaultHandledError(err)) return false;
 
-	// failed to upload current file
+	// failed to upload this part
 	if ((requestsSent.find(requestId) != requestsSent.cend())
 		|| (docRequestsSent.find(requestId) != docRequestsSent.cend())) {
+		partRetry(requestId);
+	} else {
+		sendNext();
+	}
+	return true;
+}
+
+void mtpUploader::partRetry(mtpRequestId requestId) {
+	const auto k = queue.find(uploadingId);
+	if (k == queue.cend()) {
+		currentFailed();
+		return;
+	}
+	auto &file = *k->second;
+	auto sentPartSize = int32(0);
+	const auto i = requestsSent.find(requestId);
+	const auto j = docRequestsSent.find(requestId);
+	if (i != requestsSent.cend()) {
+		file.parts().insert(i->second.index, i->second.bytes);
+		sentPartSize = i->second.bytes.size();
+		requestsSent.erase(i);
+	} else if (j != docRequestsSent.cend()) {
+		file.docRetryParts.emplace(j->second);
+		file.docPartMd5s.erase(j->second);
+		sentPartSize = file.docPartSize;
+		docRequestsSent.erase(j);
+	}
+	const auto dcIt = dcMap.find(requestId);
+	if (dcIt != dcMap.cend()) {
+		sentSizes[dcIt->second] -= sentPartSize;
+		dcMap.erase(dcIt);
+	}
+	sentSize -= sentPartSize;
+
+	if (!retryLater(file)) {
 		currentFailed();
+		return;
 	}
 	sendNext();
-	return true;
 }
 
 webUploader::webUploader()
-: Uploader() {
+: Uploader()
+, _partsWindow(web::kStartParallelParts) {
 }
 
 webUploader::~webUploader(){
@@ -749,127 +943,269 @@ void webUploader::upload(
 	sendNext();
 }
 
-void webUploader::sendNext() {
-	if (_pausedId.msg || queue.empty()) return;	
+void webUploader::cancel(const FullMsgId &msgId) {
+	const auto i = queue.find(msgId);
+	if (i == end(queue)) {
+		return;
+	}
+	const auto started = i->second->docReader
+		|| i->second->requestsInFlight
+		|| i->second->verifying
+		|| i->second->failedAttempts;
+	if (started) {
+		fileFailed(msgId);
+	} else {
+		queue.erase(i);
+	}
+}
 
-	auto i = uploadingId.msg ? queue.find(uploadingId) : queue.begin();
-	if (!uploadingId.msg) {
-		uploadingId = i->first;
-	} else if (i == queue.end()) {
-		i = queue.begin();
-		uploadingId = i->first;
+void webUploader::sendNext() {
+	if (_pausedId.msg) {
+		return;
+	} else if (queue.empty()) {
+		uploadingId = FullMsgId();
+		_windowSampleStart = 0;
+		return;
 	}
-	auto& uploadingData = *(i->second);
-	auto& parts = uploadingData.file
-		? ((uploadingData.type() == SendMediaType::Photo
-			|| uploadingData.type() == SendMediaType::Secure)
-			? uploadingData.file->fileparts
-			: uploadingData.file->thumbparts)
-		: uploadingData.media.parts;
-	if (parts.isEmpty()) {
-		if (uploadingData.docSentParts >= uploadingData.docPartsCount) {
-			if (requestsSent.empty() && docRequestsSent.empty()) {
-				const auto silent = uploadingData.file
-					&& uploadingData.file->to.silent;
-				const auto edit = uploadingData.file &&
-					uploadingData.file->edit;
-				if (uploadingData.type() == SendMediaType::Photo) {
-					const auto md5 = uploadingData.file
-						? uploadingData.file->filemd5
-						: uploadingData.media.jpeg_md5;
-					postVerify(md5, getFileType(uploadingData), uploadingData.partsCount);
-				} else if (uploadingData.type() == SendMediaType::File
-					|| uploadingData.type() == SendMediaType::WallPaper
-					|| uploadingData.type() == SendMediaType::Audio) {
-					QByteArray docMd5(32, Qt::Uninitialized);
-					hashMd5Hex(uploadingData.md5Hash.result(), docMd5.data());
-					postVerify(docMd5, getFileType(uploadingData), uploadingData.docPartsCount);
-				} else if (uploadingData.type() == SendMediaType::Secure) {
-					postVerify(uploadingData.file->filemd5, getFileType(uploadingData), uploadingData.partsCount);
-				}
-			}
-			return;
+	uploadingId = queue.begin()->first;
+
+	// Files are pipelined: the next one starts sending its parts
+	// when all parts of the previous one are already in flight.
+	const auto maxFiles = std::max(Global::CdnUploadParallelFiles(), 1);
+	auto budget = partsWindow() - int(requestFiles.size());
+	auto active = 0;
+	const auto now = crl::now();
+	for (auto &[fullId, file] : queue) {
+		if (++active > maxFiles) {
+			break;
+		} else if (file->retryAt > now) {
+			// Waiting to send the failed parts again, don't block others.
+			continue;
+		} else if (!sendFileParts(fullId, *file, budget)) {
+			break;
 		}
+	}
+}
 
-		auto& content = uploadingData.file
-			? uploadingData.file->content
-			: uploadingData.media.data;
-		QByteArray toSend;
-		if (content.isEmpty()) {
-			if (!uploadingData.docFile) {
-				const auto filepath = uploadingData.file
-					? uploadingData.file->filepath
-					: uploadingData.media.file;
-				uploadingData.docFile = std::make_unique<QFile>(filepath);
-				if (!uploadingData.docFile->open(QIODevice::ReadOnly)) {
-					currentFailed();
-					return;
-				}
-				uploadingData.md5Hash.feed(
-					uploadingData.docFile->readAll().constData(), 
-					uploadingData.docFile->size());
-				uploadingData.docFile->seek(0);
-			}
-			toSend = uploadingData.docFile->read(uploadingData.docPartSize);			
-		} else {
-			const auto offset = uploadingData.docSentParts
-				* uploadingData.docPartSize;
-			toSend = content.mid(offset, uploadingData.docPartSize);
-		}
-		if ((toSend.size() > uploadingData.docPartSize)
-			|| ((toSend.size() < uploadingData.docPartSize
-				&& uploadingData.docSentParts + 1 != uploadingData.docPartsCount))) {
-			currentFailed();
-			return;
+bool webUploader::sendFileParts(
+		const FullMsgId &fullId,
+		File &file,
+		int &budget) {
+	const auto window = partsWindow();
+	const auto canSend = [&] {
+		return (budget > 0) && (file.requestsInFlight < window);
+	};
+	auto &parts = file.parts();
+	while (!parts.isEmpty()) {
+		if (!canSend()) {
+			return false;
 		}
-		QByteArray md5(32, Qt::Uninitialized);
-		if (uploadingData.type() == SendMediaType::Photo) {
-			md5 = uploadingData.file
-				? uploadingData.file->filemd5
-				: uploadingData.media.jpeg_md5;			
-		} else if (uploadingData.type() == SendMediaType::File
-			|| uploadingData.type() == SendMediaType::WallPaper
-			|| uploadingData.type() == SendMediaType::Audio) {			
-			hashMd5Hex(uploadingData.md5Hash.result(), md5.data());
-		} else if (uploadingData.type() == SendMediaType::Secure) {
-			md5 = uploadingData.file->filemd5;
-		}
-		const auto file_type = getFileType(uploadingData);
-		const auto file_name = uploadingData.filename();
-		QByteArray partMd5(32, Qt::Uninitialized);
-		HashMd5 partHashMd5;
-		partHashMd5.feed(toSend.data(), toSend.size());
-		hashMd5Hex(partHashMd5.result(), partMd5.data());
-		auto reply = post(md5, file_type, uploadingData.docPartsCount, uploadingData.docSentParts + 1, toSend, file_name, partMd5);
-		docRequestsSent.emplace(reply, uploadingData.docSentParts);
-		sentSize += uploadingData.docPartSize;
-		uploadingData.docSentParts++;
-	} else {
 		auto part = parts.begin();
-		const auto md5 = uploadingData.file
-			? uploadingData.file->filemd5
-			: uploadingData.media.jpeg_md5;
-		const auto file_type = getFileType(uploadingData);
-		const auto file_name = uploadingData.file
-			? ((uploadingData.type() == SendMediaType::Photo
-				|| uploadingData.type() == SendMediaType::Secure)
-				? uploadingData.file->filename
-				: uploadingData.file->thumbname)
-			: uploadingData.media.filename;
+		const auto md5 = file.file
+			? file.file->filemd5
+			: file.media.jpeg_md5;
+		const auto file_type = getFileType(file);
+		const auto file_name = file.file
+			? ((file.type() == SendMediaType::Photo
+				|| file.type() == SendMediaType::Secure)
+				? file.file->filename
+				: file.file->thumbname)
+			: file.media.filename;
 		QByteArray partMd5(32, Qt::Uninitialized);
 		HashMd5 partHashMd5;
 		partHashMd5.feed(part.value().data(), part.value().size());
 		hashMd5Hex(partHashMd5.result(), partMd5.data());
-		auto reply = post(md5, file_type, uploadingData.partsCount, part.key() + 1, part.value(), file_name, partMd5);
-		requestsSent.emplace(reply, part.value());
+		const auto bytes = UploadPartBytes::Slice(
+			part.value(),
+			0,
+			part.value().size());
+		auto reply = post(md5, file_type, file.partsCount, part.key() + 1, bytes, file_name, partMd5);
+		requestsSent.emplace(reply, SentPart{ part.key(), part.value() });
+		requestFiles.emplace(reply, fullId);
 		sentSize += part.value().size();
+		++file.requestsInFlight;
+		--budget;
 
 		parts.erase(part);
 	}
+	const auto docPartsLeft = [&] {
+		return (file.docSentParts < file.docPartsCount)
+			|| !file.docRetryParts.empty();
+	};
+	if (docPartsLeft()) {
+		if (!journalReady(fullId, file)) {
+			return false;
+		} else if (!file.docReader) {
+			startReading(fullId, file);
+			return false;
+		} else if (file.docMd5.isEmpty()) {
+			return false;
+		}
+		const auto file_type = getFileType(file);
+		const auto file_name = file.filename();
+		while (docPartsLeft()) {
+			if (!canSend()) {
+				return false;
+			}
+			const auto retry = !file.docRetryParts.empty();
+			const auto index = retry
+				? *file.docRetryParts.begin()
+				: file.docSentParts;
+			const auto j = file.docReadParts.find(index);
+			if (j == end(file.docReadParts)) {
+				return false;
+			}
+			auto part = std::move(j->second);
+			file.docReadParts.erase(j);
+			if (retry) {
+				file.docRetryParts.erase(index);
+			} else {
+				file.docSentParts++;
+				requestReadAhead(file);
+				if (file.journal.acknowledged(index, part.md5)) {
+					// This part was uploaded before the interruption.
+					++file.docLoadedParts;
+					continue;
+				}
+			}
+
+			auto reply = post(
+				file.docMd5,
+				file_type,
+				file.docPartsCount,
+				part.index + 1,
+				part.bytes,
+				file_name,
+				part.md5);
+			docRequestsSent.emplace(reply, part.index);
+			requestFiles.emplace(reply, fullId);
+			file.docPartMd5s[part.index] = part.md5;
+			sentSize += file.docPartSize;
+			++file.requestsInFlight;
+			--budget;
+		}
+	}
+	if (!file.requestsInFlight && !file.verifying) {
+		file.verifying = true;
+		if (file.type() == SendMediaType::Photo) {
+			const auto md5 = file.file
+				? file.file->filemd5
+				: file.media.jpeg_md5;
+			postVerify(fullId, md5, getFileType(file), file.partsCount);
+		} else if (file.type() == SendMediaType::File
+			|| file.type() == SendMediaType::WallPaper
+			|| file.type() == SendMediaType::Audio) {
+			postVerify(fullId, file.docMd5, getFileType(file), file.docPartsCount);
+		} else if (file.type() == SendMediaType::Secure) {
+			postVerify(fullId, file.file->filemd5, getFileType(file), file.partsCount);
+		}
+	}
+	return true;
+}
+
+void webUploader::startReading(const FullMsgId &fullId, File &file) {
+	const auto &content = file.file
+		? file.file->content
+		: file.media.data;
+	const auto &path = file.file
+		? file.file->filepath
+		: file.media.file;
+	file.docReader = std::make_unique<UploadReader>(
+		path,
+		content,
+		file.docPartSize,
+		file.docPartsCount,
+		UploadReader::Callbacks{
+			[=](QByteArray md5) { documentHashed(fullId, std::move(md5)); },
+			[=](UploadReaderPart &&part) {
+				documentPartRead(fullId, std::move(part));
+			},
+			[=] { fileFailed(fullId); }
+		});
+	requestReadAhead(file);
+}
+
+void webUploader::requestReadAhead(File &file) {
+	const auto ahead = std::max(web::kReadAheadParts, partsWindow());
+	const auto till = std::min(
+		file.docSentParts + ahead,
+		file.docPartsCount);
+	while (file.docRequestedParts < till) {
+		file.docReader->request(file.docRequestedParts++);
+	}
+}
+
+void webUploader::documentHashed(const FullMsgId &fullId, QByteArray md5) {
+	const auto i = queue.find(fullId);
+	if (i == end(queue)) {
+		return;
+	}
+	i->second->docMd5 = std::move(md5);
+	sendNext();
+}
+
+void webUploader::documentPartRead(
+		const FullMsgId &fullId,
+		UploadReaderPart &&part) {
+	const auto i = queue.find(fullId);
+	if (i == end(queue)) {
+		return;
+	}
+	i->second->docReadParts.emplace(part.index, std::move(part));
+	sendNext();
+}
+
+int webUploader::partsWindow() const {
+	const auto maxParts = std::max(Global::CdnUploadParallelParts(), 1);
+	return std::clamp(_partsWindow, 1, maxParts);
+}
+
+void webUploader::partsWindowSucceeded(int32 bytes) {
+	const auto now = crl::now();
+	if (!_windowSampleStart) {
+		_windowSampleStart = now;
+		_windowSampleBytes = 0;
+		return;
+	}
+	_windowSampleBytes += bytes;
+	const auto elapsed = now - _windowSampleStart;
+	if (elapsed < web::kWindowSampleDuration) {
+		return;
+	}
+	const auto throughput = _windowSampleBytes * 1000. / elapsed;
+	if (throughput > _windowThroughput * web::kWindowGrowThreshold) {
+		_partsWindow = std::min(
+			partsWindow() + 1,
+			std::max(Global::CdnUploadParallelParts(), 1));
+	}
+	_windowThroughput = throughput;
+	_windowSampleStart = now;
+	_windowSampleBytes = 0;
+}
+
+void webUploader::partsWindowFailed() {
+	_partsWindow = std::max(partsWindow() / 2, 1);
+	_windowThroughput = 0.;
+	_windowSampleStart = 0;
 }
 
 void webUploader::currentFailed() {
-	auto j = queue.find(uploadingId);
+	fileFailed(uploadingId);
+}
+
+void webUploader::fileFailed(const FullMsgId &fullId) {
+	auto replies = std::vector<QNetworkReply*>();
+	for (const auto &[reply, id] : requestFiles) {
+		if (id == fullId) {
+			replies.push_back(reply);
+		}
+	}
+	for (const auto reply : replies) {
+		forgetRequest(reply);
+		reply->abort();
+	}
+
+	auto j = queue.find(fullId);
 	if (j != queue.end()) {
 		if (j->second->type() == SendMediaType::Photo) {
 			_photoFailed.fire_copy(j->first);
@@ -884,23 +1220,49 @@ void webUploader::currentFailed() {
 		} else if (j->second->type() == SendMediaType::Secure) {
 			_secureFailed.fire_copy(j->first);
 		} else {
-			Unexpected("Type in webUploader::currentFailed.");
+			Unexpected("Type in webUploader::fileFailed.");
 		}
+		writeJournal(*j->second);
 		queue.erase(j);
 	}
-
-	requestsSent.clear();
-	docRequestsSent.clear();
-	uploadingId = FullMsgId();
-	sentSize = 0;
+	if (uploadingId == fullId) {
+		uploadingId = FullMsgId();
+	}
 
 	sendNext();
 }
 
+int32 webUploader::forgetRequest(QNetworkReply *reply) {
+	auto result = int32(0);
+	const auto i = requestsSent.find(reply);
+	if (i != requestsSent.cend()) {
+		result = i->second.bytes.size();
+		requestsSent.erase(i);
+	}
+	const auto j = docRequestsSent.find(reply);
+	const auto k = requestFiles.find(reply);
+	if (k != requestFiles.cend()) {
+		const auto l = queue.find(k->second);
+		if (l != queue.cend()) {
+			--l->second->requestsInFlight;
+			if (j != docRequestsSent.cend()) {
+				result = l->second->docPartSize;
+			}
+		}
+		requestFiles.erase(k);
+	}
+	if (j != docRequestsSent.cend()) {
+		docRequestsSent.erase(j);
+	}
+	sentSize -= result;
+	return result;
+}
+
 void webUploader::clear() {
 	queue.clear();
 	requestsSent.clear();
 	docRequestsSent.clear();
+	requestFiles.clear();
 	sentSize = 0;
 }
 
@@ -929,12 +1291,13 @@ void webUploader::addUserHash(QHttpMultiPart* multipart) {
 	addPostFilePart(qsl("user_id"), QString::number(user_id), multipart);
 }
 
+
 QNetworkReply* webUploader::post(
 	const QByteArray& md5, 
 	const QString& file_type, 
 	int file_count, 
 	int file_count_id, 
-	const QByteArray& file_form, 
+	const UploadPartBytes& file_form, 
 	const QString& file_name,
 	const QByteArray &partMd5) {
 	auto multipart = new QHttpMultiPart(QHttpMultiPart::FormDataType);
@@ -952,7 +1315,7 @@ QNetworkReply* webUploader::post(
 	contentPart.setHeader(QNetworkRequest::ContentDispositionHeader,
 		QVariant(qsl("form-data; name=\"file_form\"; filename=\"%1\"")
 			.arg(file_name)));
-	contentPart.setBody(file_form);
+	contentPart.setBodyDevice(file_form.device(multipart));
 	multipart->append(contentPart);
 
 	auto reply = _manager.post(
@@ -969,13 +1332,16 @@ QNetworkReply* webUploader::post(
 		handleResponse(reply);
 		reply->deleteLater();
 	});
-	connect(reply, QNetworkReply_error, [this](auto) {
-		currentFailed();
+	connect(reply, QNetworkReply_error, [=](auto) {
+		partFailed(reply);
 	});
 	return reply;
 }
 
 void webUploader::handleResponse(QNetworkReply *reply) {
+	if (requestFiles.find(reply) == requestFiles.cend()) {
+		return;
+	}
 	auto json = reply->readAll();
 
     auto error = QJsonParseError{ 0, QJsonParseError::NoError };
@@ -983,19 +1349,19 @@ void webUploader::handleResponse(QNetworkReply *reply) {
     if (error.error != QJsonParseError::NoError) {
         DEBUG_LOG(("webUploader Error: Fail to parse response JSON, error :%1.")
                     .arg(error.errorString()));
-		return currentFailed();
+		return partFailed(reply);
     } else if (!document.isObject()) {
 		DEBUG_LOG(("webUploader Error: Response not an object in json."));
-		return currentFailed();
+		return partFailed(reply);
     }
     auto content = document.object();
     auto it = content.constFind(qsl("error"));
     if (it == content.constEnd()) {
 		DEBUG_LOG(("webUploader Error: error value not found in response."));
-		return currentFailed();
+		return partFailed(reply);
     } else if(!it->isDouble()) {
 		DEBUG_LOG(("webUploader Error: error value not double type in response."));
-		return currentFailed();
+		return partFailed(reply);
     } else if((*it).toInt() != 0) {
 		DEBUG_LOG(("webUploader Error: error value not equal to 0."));
 		auto msg = qsl("message");
@@ -1003,31 +1369,33 @@ void webUploader::handleResponse(QNetworkReply *reply) {
 			DEBUG_LOG(("webUploader Error: error message: %1")
 				.arg(content.value(msg).toString()));
 		}
-		return currentFailed();
+		return partFailed(reply);
     }
 	DEBUG_LOG(("[%1] webUploader post succeed").arg(qintptr(reply)));
 	partLoaded(reply);
 }
 
 void webUploader::partLoaded(QNetworkReply* reply) {
-	auto j = docRequestsSent.end();
-	auto i = requestsSent.find(reply);
-	if (i == requestsSent.cend()) {
-		j = docRequestsSent.find(reply);
+	const auto i = requestFiles.find(reply);
+	if (i == requestFiles.cend()) {
+		return;
 	}
-	if (i != requestsSent.cend() || j != docRequestsSent.cend()) {
-		int32 sentPartSize = 0;
-		auto k = queue.find(uploadingId);
-		Assert(k != queue.cend());
-		auto& [fullId, file] = *k;
-		if (i != requestsSent.cend()) {
-			sentPartSize = i->second.size();
-			requestsSent.erase(i);
-		} else {
-			sentPartSize = file->docPartSize;
-			docRequestsSent.erase(j);
+	const auto fullId = i->second;
+	const auto j = docRequestsSent.find(reply);
+	const auto docPart = (j != docRequestsSent.cend())
+		? std::make_optional(j->second)
+		: std::nullopt;
+	const auto sentPartSize = forgetRequest(reply);
+	partsWindowSucceeded(sentPartSize);
+
+	const auto k = queue.find(fullId);
+	if (k != queue.cend()) {
+		auto &file = k->second;
+		file->failedAttempts = 0;
+		if (docPart) {
+			++file->docLoadedParts;
+			journalPartAcked(*file, *docPart);
 		}
-		sentSize -= sentPartSize;
 		if (file->type() == SendMediaType::Photo) {
 			file->fileSentSize += sentPartSize;
 			const auto photo = Auth().data().photo(file->id());
@@ -1041,11 +1409,9 @@ void webUploader::partLoaded(QNetworkReply* reply) {
 			|| file->type() == SendMediaType::Audio) {
 			const auto document = Auth().data().document(file->id());
 			if (document->uploading()) {
-				const auto doneParts = file->docSentParts
-					- int(docRequestsSent.size());
 				document->uploadingData->offset = std::min(
 					document->uploadingData->size,
-					doneParts * file->docPartSize);
+					file->docLoadedParts * file->docPartSize);
 			}
 			_documentProgress.fire_copy(fullId);
 		} else if (file->type() == SendMediaType::Secure) {
@@ -1060,7 +1426,41 @@ void webUploader::partLoaded(QNetworkReply* reply) {
 	sendNext();
 }
 
+void webUploader::partFailed(QNetworkReply *reply) {
+	const auto i = requestFiles.find(reply);
+	if (i == requestFiles.cend()) {
+		return;
+	}
+	const auto fullId = i->second;
+	const auto k = queue.find(fullId);
+	if (k == queue.cend()) {
+		forgetRequest(reply);
+		return;
+	}
+	auto &file = *k->second;
+	const auto j = requestsSent.find(reply);
+	const auto l = docRequestsSent.find(reply);
+	if (j != requestsSent.cend()) {
+		file.parts().insert(j->second.index, j->second.bytes);
+	} else if (l != docRequestsSent.cend()) {
+		file.docRetryParts.emplace(l->second);
+		file.docPartMd5s.erase(l->second);
+		if (file.docReader) {
+			file.docReader->request(l->second);
+		}
+	}
+	forgetRequest(reply);
+
+	partsWindowFailed();
+	if (!retryLater(file)) {
+		fileFailed(fullId);
+		return;
+	}
+	sendNext();
+}
+
 QNetworkReply* webUploader::postVerify(
+	const FullMsgId &fullId,
 	const QByteArray& md5, 
 	const QString& file_type, 
 	int file_count) {
@@ -1080,17 +1480,23 @@ QNetworkReply* webUploader::postVerify(
 		.arg(file_count));
 	multipart->setParent(reply);
 	connect(reply, &QNetworkReply::finished, [=] { 
-		handleVerifyResponse(reply);
+		handleVerifyResponse(fullId, reply);
 		reply->deleteLater();
 	});
-	connect(reply, QNetworkReply_error, [this] {
-		currentFailed();
+	connect(reply, QNetworkReply_error, [=] {
+		fileFailed(fullId);
 	});
 
 	return reply;
 }
 
-void webUploader::handleVerifyResponse(QNetworkReply *reply) {
+void webUploader::handleVerifyResponse(
+		const FullMsgId &fullId,
+		QNetworkReply *reply) {
+	if (reply->error() != QNetworkReply::NoError
+		|| queue.find(fullId) == queue.cend()) {
+		return;
+	}
 	auto response = reply->readAll();
 
 	auto error = QJsonParseError{ 0, QJsonParseError::NoError };
@@ -1098,19 +1504,19 @@ void webUploader::handleVerifyResponse(QNetworkReply *reply) {
 	if (error.error != QJsonParseError::NoError) {
 		DEBUG_LOG(("webUploader_verify Error: Fail to parse JSON, error :%1.")
 			.arg(error.errorString()));
-		return currentFailed();
+		return fileFailed(fullId);
 	} else if (!document.isObject()) {
 		DEBUG_LOG(("webUploader_verify Error: Response not an object in json."));
-		return currentFailed();
+		return fileFailed(fullId);
 	}
 	auto content = document.object();
 	const auto it = content.constFind(qsl("error"));
 	if (it == content.constEnd()) {
 		DEBUG_LOG(("webUploader_verify Error: error value not found in response."));
-		return currentFailed();
+		return fileFailed(fullId);
 	} else if (!it->isDouble()) {
 		DEBUG_LOG(("webUploader_verify Error: error type not double in response."));
-		return currentFailed();
+		return fileFailed(fullId);
 	} else if ((*it).toInt() != 0) {
 		DEBUG_LOG(("webUploader_verify Error: error value not equal to 0."));
 		auto msg = qsl("message");
@@ -1118,31 +1524,37 @@ void webUploader::handleVerifyResponse(QNetworkReply *reply) {
 			DEBUG_LOG(("webUploader_verify Error: error message: %1")
 				.arg(content.value(msg).toString()));
 		}
-		return currentFailed();
+		return fileFailed(fullId);
 	}
 	auto data_key = qsl("data");
 	if (!content.contains(data_key) || !content.value(data_key).isObject()) {
 		DEBUG_LOG(("webUploader_verify Error: data not found or data type not object"));
-		return currentFailed();
+		return fileFailed(fullId);
 	}
 	auto data = content.value(data_key).toObject();
 	auto file_name = qsl("file_name"), path = qsl("path");
 	if (!data.contains(file_name) || !data.value(file_name).isString() ||
 		!data.contains(path) || !data.value(path).isString()) {
 		DEBUG_LOG(("webUploader_verify Error: data in response not corrent."));
-		return currentFailed();
+		return fileFailed(fullId);
 	}
 	DEBUG_LOG(("[%1] webUploader post_verify succeed.")
 		.arg(qintptr(reply)));
-	currentReady(data.value(file_name).toString(), data.value(path).toString());
+	fileReady(
+		fullId,
+		data.value(file_name).toString(),
+		data.value(path).toString());
 }
 
-void webUploader::currentReady(
+void webUploader::fileReady(
+	const FullMsgId &fullId,
 	const QString &file_name, 
 	const QString &url) {
-	auto k = queue.find(uploadingId);
-	Assert(k != queue.cend());
-	auto& [fullId, uploadingData] = *k;
+	auto k = queue.find(fullId);
+	if (k == queue.cend()) {
+		return;
+	}
+	auto& uploadingData = k->second;
 
 	const auto silent = uploadingData->file
 		&& uploadingData->file->to.silent;
@@ -1155,7 +1567,7 @@ void webUploader::currentReady(
 			: uploadingData->media.filesize;
 		auto width = 0;
 		auto height = 0;
-		if (const auto item = App::histItemById(uploadingId)) {
+		if (const auto item = App::histItemById(fullId)) {
 			auto media = item->media();
 			if (auto photo = media ? media->photo() : nullptr) {
 				width = photo->width();
@@ -1171,7 +1583,7 @@ void webUploader::currentReady(
 			MTP_int(width),
 			MTP_int(height)
 		);
-		_photoReady.fire({ uploadingId, silent, file, edit });
+		_photoReady.fire({ fullId, silent, file, edit });
 	} else if (uploadingData->type() == SendMediaType::File
 		|| uploadingData->type() == SendMediaType::WallPaper
 		|| uploadingData->type() == SendMediaType::Audio) {
@@ -1200,27 +1612,30 @@ void webUploader::currentReady(
 				MTP_int(0)
 			);
 			_thumbDocumentReady.fire({
-				uploadingId,
+				fullId,
 				silent,
 				file,
 				thumb,
 				edit });
 		} else {
 			_documentReady.fire({
-				uploadingId,
+				fullId,
 				silent,
 				file,
 				edit });
 		}
 	} else if (uploadingData->type() == SendMediaType::Secure) {
 		_secureReady.fire({
-			uploadingId,
+			fullId,
 			uploadingData->id(),
 			uploadingData->partsCount });
 	}
-	queue.erase(uploadingId);
-	uploadingId = FullMsgId();
+	journalFinished(*uploadingData);
+	queue.erase(k);
+	if (uploadingId == fullId) {
+		uploadingId = FullMsgId();
+	}
 	sendNext();
 }
 
-} // namespace Storage
\ No newline at end of file
+} // namespace Storage
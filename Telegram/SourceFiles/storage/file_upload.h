@@ -1,6 +1,9 @@
 #pragma once
 
 #include "storage/localimageloader.h"
+#include "storage/file_upload_reader.h"
+#include "storage/file_upload_journal.h"
+#include "base/timer.h"
 
 namespace Storage {
 
@@ -53,11 +56,14 @@ public:
 		const FullMsgId &msgId,
 		const std::shared_ptr<FileLoadResult> &file) = 0;
 
-	void cancel(const FullMsgId &msgId);
+	virtual void cancel(const FullMsgId &msgId);
 	void pause(const FullMsgId &msgId);
 	void unpause();
 	void confirm(const FullMsgId &msgId);
 
+	// Saves the acknowledged parts right away, for example before quit.
+	void writeJournals();
+
 	rpl::producer<UploadedPhoto> photoReady() const {
 		return _photoReady.events();
 	}
@@ -92,6 +98,10 @@ public:
 protected:
 	virtual void sendNext() = 0;
 	virtual void currentFailed() = 0;
+struct SentPart {
+	int32 index = 0;
+	QByteArray bytes;
+};
 class File {
 public:
 	File(const SendMediaReady& media);
@@ -110,22 +120,57 @@ public:
 	SendMediaType type() const;
 	uint64 thumbId() const;
 	const QString& filename() const;
+	UploadFileParts &parts();
 
 	HashMd5 md5Hash;
 
 	std::unique_ptr<QFile> docFile;
+	std::unique_ptr<UploadReader> docReader;
+	base::flat_map<int, UploadReaderPart> docReadParts;
+	QByteArray docMd5;
+	int32 docRequestedParts = 0;
 	int32 docSentParts = 0;
+	int32 docLoadedParts = 0;
+	int32 requestsInFlight = 0;
+	bool verifying = false;
 	int32 docSize = 0;
 	int32 docPartSize = 0;
 	int32 docPartsCount = 0;
+
+	// Resumable upload state, see Uploader::journalReady().
+	enum class JournalState {
+		Unknown,
+		Loading,
+		Ready,
+	};
+	uint64 docFileId() const;
+	JournalState journalState = JournalState::Unknown;
+	std::optional<Cache::Key> journalKey;
+	UploadJournal journal;
+	bool journalChanged = false;
+	base::flat_map<int32, QByteArray> docPartMd5s;
+
+	// Failed parts are sent again after a growing delay.
+	base::flat_set<int32> docRetryParts;
+	int failedAttempts = 0;
+	crl::time retryAt = 0;
 };
 class mtpFile;
 class webFile;
 
+	bool journalReady(const FullMsgId &fullId, File &file);
+	void journalLoaded(const FullMsgId &fullId, const QByteArray &serialized);
+	void journalPartAcked(File &file, int32 index);
+	void journalFinished(File &file);
+	void writeJournal(File &file);
+	[[nodiscard]] bool retryLater(File &file);
+
 	FullMsgId uploadingId;
 	FullMsgId _pausedId;
 	std::map<FullMsgId, std::unique_ptr<File>> queue;
 	QTimer nextTimer;
+	base::Timer retryTimer;
+	base::Timer journalTimer;
 
 	rpl::event_stream<UploadedPhoto> _photoReady;
 	rpl::event_stream<UploadedDocument> _documentReady;
@@ -160,7 +205,9 @@ private:
 	void partLoaded(const MTPBool& result, mtpRequestId requestId);
 	bool partFailed(const RPCError& err, mtpRequestId requestId);
 
-	base::flat_map<mtpRequestId, QByteArray> requestsSent;
+	void partRetry(mtpRequestId requestId);
+
+	base::flat_map<mtpRequestId, SentPart> requestsSent;
 	base::flat_map<mtpRequestId, int32> docRequestsSent;
 	base::flat_map<mtpRequestId, int32> dcMap;
 	uint32 sentSize = 0;
@@ -178,6 +225,7 @@ public:
 	void upload(
 		const FullMsgId& msgId,
 		const std::shared_ptr<FileLoadResult>& file) override;
+	void cancel(const FullMsgId &msgId) override;
 
 protected:
 	void sendNext() override;
@@ -185,6 +233,18 @@ protected:
 
 private:
 	void clear();
+	bool sendFileParts(const FullMsgId &fullId, File &file, int &budget);
+	void startReading(const FullMsgId &fullId, File &file);
+	void requestReadAhead(File &file);
+	void documentHashed(const FullMsgId &fullId, QByteArray md5);
+	void documentPartRead(const FullMsgId &fullId, UploadReaderPart &&part);
+	void fileFailed(const FullMsgId &fullId);
+	int32 forgetRequest(QNetworkReply *reply);
+
+	int partsWindow() const;
+	void partsWindowSucceeded(int32 bytes);
+	void partsWindowFailed();
+
 	QString getFileType(Uploader::File& file) const;
 	void addPostFilePart(QString name, QString data, QHttpMultiPart* multipart);
 	void addUserHash(QHttpMultiPart* multipart);
@@ -193,24 +253,36 @@ private:
 		const QString& file_type,
 		int file_count,
 		int file_count_id,
-		const QByteArray& file_form,
+		const UploadPartBytes& file_form,
 		const QString& file_name,
 		const QByteArray& partMd5);
 
 	void handleResponse(QNetworkReply* reply);
 	void partLoaded(QNetworkReply* reply);
+	void partFailed(QNetworkReply* reply);
 
 	QNetworkReply* postVerify(
+		const FullMsgId &fullId,
 		const QByteArray& md5,
 		const QString& file_type,
 		int file_count);
-	void handleVerifyResponse(QNetworkReply* reply);
-	void currentReady(const QString& file_name, const QString& url);
+	void handleVerifyResponse(const FullMsgId &fullId, QNetworkReply* reply);
+	void fileReady(
+		const FullMsgId &fullId,
+		const QString& file_name,
+		const QString& url);
 
 	QNetworkAccessManager _manager;
 
-	base::flat_map<QNetworkReply*, QByteArray> requestsSent;
+	base::flat_map<QNetworkReply*, SentPart> requestsSent;
 	base::flat_map<QNetworkReply*, int32> docRequestsSent;
+	base::flat_map<QNetworkReply*, FullMsgId> requestFiles;
 	uint32 sentSize = 0;
+
+	// Adaptive count of parts in flight, see partsWindowSucceeded().
+	int _partsWindow = 0;
+	int64 _windowSampleBytes = 0;
+	crl::time _windowSampleStart = 0;
+	float64 _windowThroughput = 0.;
 };
 } // namesapce Storage
\ No newline at end of file
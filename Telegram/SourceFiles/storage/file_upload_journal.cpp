@@ -0,0 +1,102 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "storage/file_upload_journal.h"
+
+namespace Storage {
+namespace {
+
+constexpr auto kJournalVersion = qint32(1);
+
+// Server keeps uploaded parts for a limited time only.
+constexpr auto kJournalLifetime = TimeId(24 * 60 * 60);
+
+} // namespace
+
+bool UploadJournal::resumable(int32 partSize, int32 partsCount) const {
+	return fileId
+		&& (this->partSize == partSize)
+		&& (this->partsCount == partsCount)
+		&& (date + kJournalLifetime > unixtime());
+}
+
+bool UploadJournal::acknowledged(int32 index, const QByteArray &md5) const {
+	const auto i = acked.find(index);
+	return (i != end(acked)) && (i->second == md5);
+}
+
+QByteArray UploadJournal::serialize() const {
+	auto result = QByteArray();
+	{
+		QDataStream stream(&result, QIODevice::WriteOnly);
+		stream.setVersion(QDataStream::Qt_5_1);
+		stream
+			<< kJournalVersion
+			<< quint64(fileId)
+			<< qint32(date)
+			<< qint32(partSize)
+			<< qint32(partsCount)
+			<< qint32(acked.size());
+		for (const auto &[index, md5] : acked) {
+			stream << qint32(index) << md5;
+		}
+	}
+	return result;
+}
+
+std::optional<UploadJournal> UploadJournal::FromSerialized(
+		const QByteArray &serialized) {
+	if (serialized.isEmpty()) {
+		return std::nullopt;
+	}
+	QDataStream stream(serialized);
+	stream.setVersion(QDataStream::Qt_5_1);
+
+	auto version = qint32();
+	auto fileId = quint64();
+	auto date = qint32();
+	auto partSize = qint32();
+	auto partsCount = qint32();
+	auto count = qint32();
+	stream >> version >> fileId >> date >> partSize >> partsCount >> count;
+	if (stream.status() != QDataStream::Ok
+		|| version != kJournalVersion
+		|| count < 0
+		|| count > partsCount) {
+		return std::nullopt;
+	}
+	auto result = UploadJournal{
+		fileId,
+		date,
+		partSize,
+		partsCount
+	};
+	for (auto i = 0; i != count; ++i) {
+		auto index = qint32();
+		auto md5 = QByteArray();
+		stream >> index >> md5;
+		if (stream.status() != QDataStream::Ok
+			|| index < 0
+			|| index >= partsCount) {
+			return std::nullopt;
+		}
+		result.acked.emplace(index, md5);
+	}
+	return result;
+}
+
+std::optional<Cache::Key> UploadJournalKey(const QString &path) {
+	const auto info = QFileInfo(path);
+	if (path.isEmpty() || !info.isFile()) {
+		return std::nullopt;
+	}
+	return Data::UploadJournalCacheKey(info.absoluteFilePath()
+		+ '|' + QString::number(info.size())
+		+ '|' + QString::number(info.lastModified().toMSecsSinceEpoch()));
+}
+
+} // namespace Storage
@@ -0,0 +1,35 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "storage/cache/storage_cache_types.h"
+
+namespace Storage {
+
+// Persisted state of a document upload, so that an interrupted upload
+// of the same file continues from the acknowledged parts.
+struct UploadJournal {
+	uint64 fileId = 0;
+	TimeId date = 0;
+	int32 partSize = 0;
+	int32 partsCount = 0;
+	base::flat_map<int32, QByteArray> acked; // part index -> md5 hex
+
+	[[nodiscard]] bool resumable(int32 partSize, int32 partsCount) const;
+	[[nodiscard]] bool acknowledged(int32 index, const QByteArray &md5) const;
+
+	[[nodiscard]] QByteArray serialize() const;
+	[[nodiscard]] static std::optional<UploadJournal> FromSerialized(
+		const QByteArray &serialized);
+};
+
+// Depends on the file path, size and last modification time.
+[[nodiscard]] std::optional<Cache::Key> UploadJournalKey(
+	const QString &path);
+
+} // namespace Storage
@@ -0,0 +1,357 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "storage/file_upload_reader.h"
+
+namespace Storage {
+namespace {
+
+// First parts are kept in memory after the hashing pass,
+// so that the upload starts without reading them once again.
+constexpr auto kKeepHashedParts = 2;
+
+QByteArray Md5Hex(HashMd5 &hash) {
+	auto result = QByteArray(32, Qt::Uninitialized);
+	hashMd5Hex(hash.result(), result.data());
+	return result;
+}
+
+class UploadPartDevice final : public QIODevice {
+public:
+	UploadPartDevice(const UploadPartBytes &bytes, QObject *parent);
+
+	bool isSequential() const override;
+	qint64 size() const override;
+
+protected:
+	qint64 readData(char *data, qint64 maxSize) override;
+	qint64 writeData(const char *data, qint64 maxSize) override;
+
+private:
+	UploadPartBytes _bytes;
+
+};
+
+UploadPartDevice::UploadPartDevice(
+	const UploadPartBytes &bytes,
+	QObject *parent)
+: QIODevice(parent)
+, _bytes(bytes) {
+	open(QIODevice::ReadOnly);
+}
+
+bool UploadPartDevice::isSequential() const {
+	return false;
+}
+
+qint64 UploadPartDevice::size() const {
+	return _bytes.size();
+}
+
+qint64 UploadPartDevice::readData(char *data, qint64 maxSize) {
+	const auto available = std::max(_bytes.size() - pos(), qint64(0));
+	const auto result = std::min(available, maxSize);
+	if (result > 0) {
+		memcpy(data, _bytes.data() + pos(), result);
+	}
+	return result;
+}
+
+qint64 UploadPartDevice::writeData(const char *, qint64) {
+	return -1;
+}
+
+} // namespace
+
+struct UploadPartBytes::Mapping {
+	~Mapping();
+
+	QFile file;
+	uchar *data = nullptr;
+};
+
+UploadPartBytes::Mapping::~Mapping() {
+	if (data) {
+		file.unmap(data);
+	}
+}
+
+UploadPartBytes UploadPartBytes::Slice(
+		const QByteArray &content,
+		int64 offset,
+		int size) {
+	Expects(offset >= 0 && offset + size <= content.size());
+
+	auto result = UploadPartBytes();
+	result._content = content;
+	result._data = result._content.constData() + offset;
+	result._size = size;
+	return result;
+}
+
+UploadPartBytes UploadPartBytes::Map(
+		const QString &path,
+		int64 offset,
+		int size) {
+	auto mapping = std::make_shared<Mapping>();
+	mapping->file.setFileName(path);
+	if (!mapping->file.open(QIODevice::ReadOnly)
+		|| mapping->file.size() < offset + size) {
+		return UploadPartBytes();
+	}
+	mapping->data = mapping->file.map(offset, size);
+	if (!mapping->data) {
+		return UploadPartBytes();
+	}
+	auto result = UploadPartBytes();
+	result._data = reinterpret_cast<const char*>(mapping->data);
+	result._size = size;
+	result._mapping = std::move(mapping);
+	return result;
+}
+
+UploadPartBytes UploadPartBytes::Owned(QByteArray &&bytes) {
+	auto result = UploadPartBytes();
+	result._content = std::move(bytes);
+	result._data = result._content.constData();
+	result._size = result._content.size();
+	return result;
+}
+
+QByteArray UploadPartBytes::view() const {
+	return QByteArray::fromRawData(_data, _size);
+}
+
+QIODevice *UploadPartBytes::device(QObject *parent) const {
+	return new UploadPartDevice(*this, parent);
+}
+
+UploadPartBytes ReadUploadPart(QFile &file, int64 offset, int size) {
+	const auto length = int(std::min(int64(size), file.size() - offset));
+	if (length <= 0) {
+		return UploadPartBytes();
+	}
+	auto result = UploadPartBytes::Map(file.fileName(), offset, length);
+	if (result.empty() && file.seek(offset)) {
+		result = UploadPartBytes::Owned(file.read(length));
+	}
+	return result;
+}
+
+namespace details {
+
+class UploadReaderObject {
+public:
+	UploadReaderObject(
+		crl::weak_on_queue<UploadReaderObject> weak,
+		const QString &path,
+		const QByteArray &content,
+		int partSize,
+		int partsCount,
+		UploadReader::Callbacks &&callbacks);
+
+	void request(int index);
+
+private:
+	[[nodiscard]] bool open();
+	[[nodiscard]] std::optional<UploadPartBytes> read(int index);
+	void hashNext();
+	void hashFinished();
+	void send(int index, UploadPartBytes &&bytes);
+	void fail();
+
+	crl::weak_on_queue<UploadReaderObject> _weak;
+	UploadReader::Callbacks _callbacks;
+	QString _path;
+	QByteArray _content;
+	QFile _file;
+	int _partSize = 0;
+	int _partsCount = 0;
+
+	HashMd5 _md5;
+	std::vector<QByteArray> _partMd5s;
+	base::flat_map<int, UploadPartBytes> _kept;
+	base::flat_set<int> _requested;
+	bool _hashed = false;
+	bool _failed = false;
+
+};
+
+UploadReaderObject::UploadReaderObject(
+	crl::weak_on_queue<UploadReaderObject> weak,
+	const QString &path,
+	const QByteArray &content,
+	int partSize,
+	int partsCount,
+	UploadReader::Callbacks &&callbacks)
+: _weak(std::move(weak))
+, _callbacks(std::move(callbacks))
+, _path(path)
+, _content(content)
+, _partSize(partSize)
+, _partsCount(partsCount) {
+	Expects(_partSize > 0);
+
+	_partMd5s.reserve(_partsCount);
+	if (!open()) {
+		fail();
+	} else if (!_partsCount) {
+		hashFinished();
+	} else {
+		hashNext();
+	}
+}
+
+bool UploadReaderObject::open() {
+	if (!_content.isEmpty()) {
+		return true;
+	}
+	_file.setFileName(_path);
+	if (!_file.open(QIODevice::ReadOnly)) {
+		LOG(("Upload Error: Could not open '%1' for reading.").arg(_path));
+		return false;
+	}
+	return true;
+}
+
+std::optional<UploadPartBytes> UploadReaderObject::read(int index) {
+	Expects(index >= 0 && index < _partsCount);
+
+	const auto offset = int64(index) * _partSize;
+	auto result = UploadPartBytes();
+	if (!_content.isEmpty()) {
+		const auto size = int(std::min(
+			int64(_partSize),
+			std::max(_content.size() - offset, int64(0))));
+		if (size > 0) {
+			result = UploadPartBytes::Slice(_content, offset, size);
+		}
+	} else {
+		result = ReadUploadPart(_file, offset, _partSize);
+	}
+	const auto last = (index + 1 == _partsCount);
+	if (result.size() > _partSize
+		|| result.empty()
+		|| (result.size() < _partSize && !last)) {
+		LOG(("Upload Error: Bad part %1 of %2 read from '%3'."
+			).arg(index
+			).arg(_partsCount
+			).arg(_content.isEmpty() ? _path : qsl("memory")));
+		return std::nullopt;
+	}
+	return result;
+}
+
+void UploadReaderObject::hashNext() {
+	if (_failed) {
+		return;
+	}
+	const auto index = int(_partMd5s.size());
+	auto bytes = read(index);
+	if (!bytes) {
+		fail();
+		return;
+	}
+	_md5.feed(bytes->data(), bytes->size());
+	auto part = HashMd5(bytes->data(), bytes->size());
+	_partMd5s.push_back(Md5Hex(part));
+	if (index < kKeepHashedParts) {
+		_kept.emplace(index, std::move(*bytes));
+	}
+	if (index + 1 == _partsCount) {
+		hashFinished();
+	} else {
+		// Let the queue process requests and destruction between parts.
+		_weak.with([](UploadReaderObject &that) {
+			that.hashNext();
+		});
+	}
+}
+
+void UploadReaderObject::hashFinished() {
+	_hashed = true;
+	_callbacks.hashed(Md5Hex(_md5));
+	for (const auto index : base::take(_requested)) {
+		request(index);
+	}
+}
+
+void UploadReaderObject::request(int index) {
+	if (_failed) {
+		return;
+	} else if (!_hashed) {
+		_requested.emplace(index);
+		return;
+	}
+	const auto i = _kept.find(index);
+	if (i != end(_kept)) {
+		auto bytes = std::move(i->second);
+		_kept.erase(i);
+		send(index, std::move(bytes));
+	} else if (auto bytes = read(index)) {
+		send(index, std::move(*bytes));
+	} else {
+		fail();
+	}
+}
+
+void UploadReaderObject::send(int index, UploadPartBytes &&bytes) {
+	Expects(index < int(_partMd5s.size()));
+
+	_callbacks.ready({ index, std::move(bytes), _partMd5s[index] });
+}
+
+void UploadReaderObject::fail() {
+	_failed = true;
+	_kept.clear();
+	_requested.clear();
+	_file.close();
+	_callbacks.failed();
+}
+
+} // namespace details
+
+UploadReader::UploadReader(
+	const QString &path,
+	const QByteArray &content,
+	int partSize,
+	int partsCount,
+	Callbacks &&callbacks)
+: _callbacks(std::move(callbacks))
+, _wrapped(
+	path,
+	content,
+	partSize,
+	partsCount,
+	Callbacks{
+		[weak = base::make_weak(this)](QByteArray md5) {
+			crl::on_main(weak, [=] {
+				weak->_callbacks.hashed(md5);
+			});
+		},
+		[weak = base::make_weak(this)](UploadReaderPart &&part) {
+			crl::on_main(weak, [=, part = std::move(part)]() mutable {
+				weak->_callbacks.ready(std::move(part));
+			});
+		},
+		[weak = base::make_weak(this)] {
+			crl::on_main(weak, [=] {
+				weak->_callbacks.failed();
+			});
+		}
+	}) {
+}
+
+void UploadReader::request(int index) {
+	_wrapped.with([=](Implementation &unwrapped) {
+		unwrapped.request(index);
+	});
+}
+
+UploadReader::~UploadReader() = default;
+
+} // namespace Storage
@@ -0,0 +1,107 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "base/weak_ptr.h"
+
+#include <crl/crl_object_on_queue.h>
+
+namespace Storage {
+namespace details {
+class UploadReaderObject;
+} // namespace details
+
+// Read-only bytes of a document part that are not copied when passed
+// around: either a slice of the in-memory content or a mapped region
+// of the file. Copies share the storage and keep it alive.
+class UploadPartBytes {
+public:
+	UploadPartBytes() = default;
+
+	[[nodiscard]] static UploadPartBytes Slice(
+		const QByteArray &content,
+		int64 offset,
+		int size);
+	[[nodiscard]] static UploadPartBytes Map(
+		const QString &path,
+		int64 offset,
+		int size);
+	[[nodiscard]] static UploadPartBytes Owned(QByteArray &&bytes);
+
+	[[nodiscard]] const char *data() const {
+		return _data;
+	}
+	[[nodiscard]] int size() const {
+		return _size;
+	}
+	[[nodiscard]] bool empty() const {
+		return !_size;
+	}
+
+	// Doesn't own the bytes, valid while this object is alive.
+	[[nodiscard]] QByteArray view() const;
+
+	// Opened for reading, owns a copy of this object.
+	[[nodiscard]] QIODevice *device(QObject *parent) const;
+
+private:
+	struct Mapping;
+
+	std::shared_ptr<Mapping> _mapping;
+	QByteArray _content;
+	const char *_data = nullptr;
+	int _size = 0;
+
+};
+
+// Maps the part of an opened file if possible, reads it otherwise.
+[[nodiscard]] UploadPartBytes ReadUploadPart(
+	QFile &file,
+	int64 offset,
+	int size);
+
+struct UploadReaderPart {
+	int index = 0;
+	UploadPartBytes bytes;
+	QByteArray md5; // hex, 32 bytes
+};
+
+// Reads document parts for the uploader on a background queue.
+//
+// The source (a file on disk or an in-memory content) is first streamed
+// once in part-sized chunks to compute the whole md5 together with the
+// md5 of every part, after that parts are read only when requested.
+// All the callbacks are invoked on the main thread.
+class UploadReader final : public base::has_weak_ptr {
+public:
+	struct Callbacks {
+		Fn<void(QByteArray md5)> hashed;
+		Fn<void(UploadReaderPart &&part)> ready;
+		Fn<void()> failed;
+	};
+
+	UploadReader(
+		const QString &path,
+		const QByteArray &content,
+		int partSize,
+		int partsCount,
+		Callbacks &&callbacks);
+
+	void request(int index);
+
+	~UploadReader();
+
+private:
+	using Implementation = details::UploadReaderObject;
+
+	Callbacks _callbacks;
+	crl::object_on_queue<Implementation> _wrapped;
+
+};
+
+} // namespace Storage
@@ -3225,6 +3225,7 @@ Storage::Cache::Database::Settings cacheSettings() {
 	result.totalSizeLimit = _cacheTotalSizeLimit;
 	result.totalTimeLimit = _cacheTotalTimeLimit;
 	result.maxDataSize = Storage::kMaxFileInMemory;
+	result.mappedFilesLimit = 64;
 	return result;
 }
 
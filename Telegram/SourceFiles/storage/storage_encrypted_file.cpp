@@ -8,11 +8,16 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "storage/storage_encrypted_file.h"
 
 #include "base/openssl_help.h"
+#include "base/algorithm.h"
+#include <crl/crl_async.h>
+#include <crl/crl_semaphore.h>
+#include <thread>
 
 namespace Storage {
 namespace {
 
 constexpr auto kBlockSize = CtrState::kBlockSize;
+constexpr auto kParallelDecryptPart = size_type(1024 * 1024);
 
 enum class Format : uint32 {
 	Format_0,
@@ -171,15 +176,42 @@ File::Result File::readHeader(const EncryptionKey &key) {
 }
 
 size_type File::readPlain(bytes::span bytes) {
+	if (_mapped) {
+		const auto available = _mappedSize - _mappedPosition;
+		const auto count = size_type(std::min(
+			int64(bytes.size()),
+			std::max(available, int64(0))));
+		if (count > 0) {
+			memcpy(bytes.data(), _mapped + _mappedPosition, count);
+			_mappedPosition += count;
+		}
+		return count;
+	}
 	return _data.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
 }
 
 size_type File::writePlain(bytes::const_span bytes) {
+	Expects(!_mapped);
+
 	return _data.write(
 		reinterpret_cast<const char*>(bytes.data()),
 		bytes.size());
 }
 
+int64 File::positionPlain() const {
+	return _mapped ? _mappedPosition : _data.pos();
+}
+
+bool File::seekPlain(int64 position) {
+	if (!_mapped) {
+		return _data.seek(position);
+	} else if (position < 0 || position > _mappedSize) {
+		return false;
+	}
+	_mappedPosition = position;
+	return true;
+}
+
 void File::decrypt(bytes::span bytes) {
 	Expects(_state.has_value());
 
@@ -187,6 +219,42 @@ void File::decrypt(bytes::span bytes) {
 	_encryptionOffset += bytes.size();
 }
 
+void File::decryptInParallel(bytes::span bytes) {
+	Expects(_state.has_value());
+	Expects(bytes.size() % kBlockSize == 0);
+
+	const auto threads = std::max(
+		size_type(std::thread::hardware_concurrency()),
+		size_type(1));
+	const auto parts = std::min(
+		threads,
+		size_type(bytes.size() / kParallelDecryptPart));
+	if (parts < 2) {
+		decrypt(bytes);
+		return;
+	}
+	const auto even = bytes.size() / parts;
+	const auto part = even - (even % kBlockSize);
+	const auto state = &*_state;
+	const auto offset = _encryptionOffset;
+
+	crl::semaphore semaphore;
+	for (auto i = size_type(1); i != parts; ++i) {
+		const auto from = i * part;
+		const auto size = (i + 1 == parts) ? (bytes.size() - from) : part;
+		const auto data = bytes.subspan(from, size);
+		crl::async([=, &semaphore] {
+			state->decrypt(data, offset + from);
+			semaphore.release();
+		});
+	}
+	state->decrypt(bytes.subspan(0, part), offset);
+	for (auto i = size_type(1); i != parts; ++i) {
+		semaphore.acquire();
+	}
+	_encryptionOffset += bytes.size();
+}
+
 void File::encrypt(bytes::span bytes) {
 	Expects(_state.has_value());
 
@@ -195,16 +263,26 @@ void File::encrypt(bytes::span bytes) {
 }
 
 size_type File::read(bytes::span bytes) {
+	return read(bytes, false);
+}
+
+size_type File::readInParallel(bytes::span bytes) {
+	return read(bytes, true);
+}
+
+size_type File::read(bytes::span bytes, bool parallel) {
 	Expects(bytes.size() % kBlockSize == 0);
 
 	auto count = readPlain(bytes);
 	if (const auto back = -(count % kBlockSize)) {
-		if (!_data.seek(_data.pos() + back)) {
+		if (!seekPlain(positionPlain() + back)) {
 			return 0;
 		}
 		count += back;
 	}
-	if (count) {
+	if (count && parallel) {
+		decryptInParallel(bytes.subspan(0, count));
+	} else if (count) {
 		decrypt(bytes.subspan(0, count));
 	}
 	return count;
@@ -290,7 +368,33 @@ bool File::flush() {
 	return _data.flush();
 }
 
+bool File::map() {
+	Expects(isOpen());
+	Expects(_data.openMode() == QIODevice::ReadOnly);
+
+	if (_mapped) {
+		return true;
+	}
+	const auto size = _data.size();
+	const auto position = _data.pos();
+	_mapped = _data.map(0, size);
+	if (!_mapped) {
+		return false;
+	}
+	_mappedSize = size;
+	_mappedPosition = position;
+	return true;
+}
+
+bool File::isMapped() const {
+	return (_mapped != nullptr);
+}
+
 void File::close() {
+	if (_mapped) {
+		_data.unmap(base::take(_mapped));
+		_mappedSize = _mappedPosition = 0;
+	}
 	_lock.unlock();
 	_data.close();
 	_data.setFileName(QString());
@@ -316,7 +420,7 @@ bool File::seek(int64 offset) {
 	const auto realOffset = sizeof(BasicHeader) + offset;
 	if (offset < 0 || offset > _dataSize) {
 		return false;
-	} else if (!_data.seek(FileLock::kSkipBytes + realOffset)) {
+	} else if (!seekPlain(FileLock::kSkipBytes + realOffset)) {
 		return false;
 	}
 	_encryptionOffset = realOffset - kSaltSize;
@@ -32,11 +32,19 @@ public:
 	size_type read(bytes::span bytes);
 	bool write(bytes::span bytes);
 
+	// Large reads are decrypted in several parts on the crl thread pool.
+	size_type readInParallel(bytes::span bytes);
+
 	size_type readWithPadding(bytes::span bytes);
 	bool writeWithPadding(bytes::span bytes);
 
 	bool flush();
 
+	// For files opened in Mode::Read: further reads copy the data from
+	// the mapped memory instead of reading it from the descriptor.
+	bool map();
+	bool isMapped() const;
+
 	bool isOpen() const;
 	int64 size() const;
 	int64 offset() const;
@@ -57,7 +65,11 @@ private:
 
 	size_type readPlain(bytes::span bytes);
 	size_type writePlain(bytes::const_span bytes);
+	int64 positionPlain() const;
+	bool seekPlain(int64 position);
+	size_type read(bytes::span bytes, bool parallel);
 	void decrypt(bytes::span bytes);
+	void decryptInParallel(bytes::span bytes);
 	void encrypt(bytes::span bytes);
 	void decryptBack(bytes::span bytes);
 
@@ -66,6 +78,10 @@ private:
 	int64 _encryptionOffset = 0;
 	int64 _dataSize = 0;
 
+	uchar *_mapped = nullptr;
+	int64 _mappedSize = 0;
+	int64 _mappedPosition = 0;
+
 	std::optional<CtrState> _state;
 
 };
@@ -9,6 +9,7 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 
 #include "storage/storage_encrypted_file.h"
 
+#include <crl/crl_time.h>
 #include <QtCore/QThread>
 #include <QtCore/QCoreApplication>
 
@@ -37,6 +38,8 @@ abcdefgh01234567abcdefgh01234567abcdefgh01234567abcdefgh01234567\
 
 const auto Name = QString("test.file");
 
+const auto DisableBenchmarks = true;
+
 const auto Test1 = bytes::make_span("testbytetestbyte").subspan(0, 16);
 const auto Test2 = bytes::make_span("bytetestbytetest").subspan(0, 16);
 
@@ -245,3 +248,80 @@ TEST_CASE("two process encrypted file", "[storage_encrypted_file]") {
 	}
 
 }
+
+TEST_CASE("ctr state", "[storage_encrypted_file]") {
+	const auto key = bytes::make_span(
+		"abcdefgh01234567abcdefgh01234567"
+	).subspan(0, Storage::CtrState::kKeySize);
+	const auto random = [](size_type size) {
+		auto result = bytes::vector(size);
+		bytes::set_random(result);
+		return result;
+	};
+	const auto check = [&](bytes::const_span iv, int64 offset) {
+		for (const auto size : { 16, 4096, 64 * 1024 + 16 }) {
+			auto state = Storage::CtrState(key, iv);
+			const auto original = random(size);
+			auto accelerated = original;
+			auto plain = original;
+			state.encrypt(accelerated, offset);
+			state.processBlockByBlock(plain, offset);
+			REQUIRE(accelerated == plain);
+			REQUIRE(accelerated != original);
+			state.decrypt(accelerated, offset);
+			REQUIRE(accelerated == original);
+		}
+	};
+	SECTION("simple iv") {
+		const auto iv = bytes::make_span(
+			"0123456789abcdef"
+		).subspan(0, Storage::CtrState::kIvSize);
+		check(iv, 0);
+		check(iv, 16);
+		check(iv, 1024 * 1024 + 160);
+	}
+	SECTION("iv counter overflow") {
+		auto iv = bytes::vector(
+			Storage::CtrState::kIvSize,
+			bytes::type(0xFF));
+		iv[0] = bytes::type(0x12);
+		check(iv, 0);
+		check(iv, 16 * 7);
+		check(iv, int64(0xFFFFFFFFULL) * 16);
+	}
+}
+
+TEST_CASE("ctr state benchmark", "[storage_encrypted_file]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	const auto key = bytes::make_span(
+		"abcdefgh01234567abcdefgh01234567"
+	).subspan(0, Storage::CtrState::kKeySize);
+	const auto iv = bytes::make_span(
+		"0123456789abcdef"
+	).subspan(0, Storage::CtrState::kIvSize);
+	auto state = Storage::CtrState(key, iv);
+
+	const auto kTotal = int64(512 * 1024 * 1024);
+	for (const auto size : { 4 * 1024, 64 * 1024, 8 * 1024 * 1024 }) {
+		auto data = bytes::vector(size);
+		const auto measure = [&](auto &&method) {
+			const auto start = crl::now();
+			for (auto done = int64(); done < kTotal; done += size) {
+				method(data, done);
+			}
+			const auto ms = std::max(crl::now() - start, crl::time(1));
+			return (kTotal / (1024 * 1024)) * 1000 / ms;
+		};
+		const auto accelerated = measure([&](bytes::span data, int64 o) {
+			state.encrypt(data, o);
+		});
+		const auto plain = measure([&](bytes::span data, int64 o) {
+			state.processBlockByBlock(data, o);
+		});
+		WARN("CTR for " << size << " bytes: "
+			<< accelerated << " MB/s accelerated, "
+			<< plain << " MB/s block by block.");
+	}
+}
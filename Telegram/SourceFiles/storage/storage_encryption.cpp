@@ -19,8 +19,71 @@ CtrState::CtrState(bytes::const_span key, bytes::const_span iv) {
 	bytes::copy(_iv, iv);
 }
 
-template <typename Method>
-void CtrState::process(bytes::span data, int64 offset, Method method) {
+void CtrState::process(bytes::span data, int64 offset) {
+	if (!processEvp(data, offset)) {
+		processBlockByBlock(data, offset);
+	}
+}
+
+void CtrState::ContextDeleter::operator()(
+		evp_cipher_ctx_st *context) const {
+	EVP_CIPHER_CTX_free(context);
+}
+
+bool CtrState::processEvp(bytes::span data, int64 offset) {
+	Expects((data.size() % kBlockSize) == 0);
+	Expects((offset % kBlockSize) == 0);
+
+	// EVP uses AES-NI and processes several blocks at once if possible.
+	// It increments the whole 16 byte counter, just like incrementedIv.
+	if (data.size() > std::numeric_limits<int>::max()) {
+		return false;
+	} else if (!_context) {
+		auto context = std::unique_ptr<evp_cipher_ctx_st, ContextDeleter>(
+			EVP_CIPHER_CTX_new());
+		if (!context) {
+			return false;
+		}
+		const auto initialized = EVP_EncryptInit_ex(
+			context.get(),
+			EVP_aes_256_ctr(),
+			nullptr,
+			reinterpret_cast<const uchar*>(_key.data()),
+			nullptr);
+		if (initialized != 1) {
+			return false;
+		}
+		_context = std::move(context);
+	}
+
+	// Only the counter is reset here, the key schedule is kept.
+	const auto iv = incrementedIv(offset / kBlockSize);
+	const auto restarted = EVP_EncryptInit_ex(
+		_context.get(),
+		nullptr,
+		nullptr,
+		nullptr,
+		reinterpret_cast<const uchar*>(iv.data()));
+	if (restarted != 1) {
+		return false;
+	}
+
+	// The data may be partially processed after a failure, so there is
+	// no falling back to processBlockByBlock from here.
+	const auto buffer = reinterpret_cast<uchar*>(data.data());
+	auto written = 0;
+	const auto updated = EVP_EncryptUpdate(
+		_context.get(),
+		buffer,
+		&written,
+		buffer,
+		int(data.size()));
+	Assert(updated == 1);
+	Assert(written == int(data.size()));
+	return true;
+}
+
+void CtrState::processBlockByBlock(bytes::span data, int64 offset) {
 	Expects((data.size() % kBlockSize) == 0);
 	Expects((offset % kBlockSize) == 0);
 
@@ -43,7 +106,7 @@ void CtrState::process(bytes::span data, int64 offset, Method method) {
 		reinterpret_cast<unsigned char*>(iv.data()),
 		ecountBuf,
 		&offsetInBlock,
-		(block128_f)method);
+		(block128_f)AES_encrypt);
 }
 
 auto CtrState::incrementedIv(int64 blockIndex)
@@ -66,11 +129,11 @@ auto CtrState::incrementedIv(int64 blockIndex)
 }
 
 void CtrState::encrypt(bytes::span data, int64 offset) {
-	return process(data, offset, AES_encrypt);
+	return process(data, offset);
 }
 
 void CtrState::decrypt(bytes::span data, int64 offset) {
-	return process(data, offset, AES_encrypt);
+	return process(data, offset);
 }
 
 EncryptionKey::EncryptionKey(bytes::vector &&data)
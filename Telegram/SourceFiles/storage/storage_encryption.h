@@ -9,6 +9,8 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 
 #include "base/bytes.h"
 
+struct evp_cipher_ctx_st;
+
 namespace Storage {
 
 constexpr auto kSaltSize = size_type(64);
@@ -24,17 +26,27 @@ public:
 	void encrypt(bytes::span data, int64 offset);
 	void decrypt(bytes::span data, int64 offset);
 
+	// Always uses the block by block AES_encrypt implementation.
+	void processBlockByBlock(bytes::span data, int64 offset);
+
 private:
-	template <typename Method>
-	void process(bytes::span data, int64 offset, Method method);
+	void process(bytes::span data, int64 offset);
+	bool processEvp(bytes::span data, int64 offset);
 
 	bytes::array<kIvSize> incrementedIv(int64 blockIndex);
 
 	static constexpr auto EcountSize = kBlockSize;
 
+	struct ContextDeleter {
+		void operator()(evp_cipher_ctx_st *context) const;
+	};
+
 	bytes::array<kKeySize> _key;
 	bytes::array<kIvSize> _iv;
 
+	// Created on the first use with the key schedule already prepared.
+	std::unique_ptr<evp_cipher_ctx_st, ContextDeleter> _context;
+
 };
 
 class EncryptionKey {
@@ -432,7 +432,6 @@ public:
 private:
 	void clipCallback(
 		Media::Clip::Reader *reader,
-		qint32 threadIndex,
 		qint32 notification);
 
 };
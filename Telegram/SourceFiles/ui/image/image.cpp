@@ -8,6 +8,7 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "ui/image/image.h"
 
 #include "ui/image/image_source.h"
+#include "ui/image/image_decoder.h"
 #include "core/media_active_cache.h"
 #include "storage/cache/storage_cache_database.h"
 #include "data/data_session.h"
@@ -22,6 +23,9 @@ namespace {
 // After 128 MB of unpacked images we try to clear some memory.
 constexpr auto kMemoryForCache = 128 * 1024 * 1024;
 
+// Eviction passes may run many times a second while scrolling.
+constexpr auto kLogCacheStatsDelay = crl::time(60 * 1000);
+
 std::map<QString, std::unique_ptr<Image>> LocalFileImages;
 std::map<QString, std::unique_ptr<Image>> WebUrlImages;
 std::unordered_map<InMemoryKey, std::unique_ptr<Image>> StorageImages;
@@ -40,10 +44,47 @@ int64 ComputeUsage(const QImage &image) {
 	return ComputeUsage(image.size());
 }
 
-[[nodiscard]] Core::MediaActiveCache<const Image> &ActiveCache() {
-	static auto Instance = Core::MediaActiveCache<const Image>(
+// The decoded image entry key, no pixmap can have this key.
+constexpr auto kDataCacheKey = std::numeric_limits<uint64>::max();
+
+base::flat_map<Options::Type, PixmapStats> PixmapStatistics;
+crl::time LastCacheStatsLog = 0;
+
+void LogCacheStats() {
+	if (!Logs::DebugEnabled()) {
+		return;
+	}
+	const auto now = crl::now();
+	if (LastCacheStatsLog && now < LastCacheStatsLog + kLogCacheStatsDelay) {
+		return;
+	}
+	LastCacheStatsLog = now;
+	const auto stats = GetCacheStats();
+	auto pixmaps = QStringList();
+	for (const auto &[options, pixmap] : stats.pixmaps) {
+		pixmaps.push_back(QString("%1: %2 hits, %3 misses, %4 evicted (%5 bytes)"
+		).arg(options
+		).arg(pixmap.hits
+		).arg(pixmap.misses
+		).arg(pixmap.evicted
+		).arg(pixmap.evictedUsage));
+	}
+	DEBUG_LOG(("Images Info: evicted %1 (%2 bytes) in %3 us, "
+		"encoded %4 (to %5 bytes) in %6 ms, pixmaps by options: %7."
+		).arg(stats.evicted
+		).arg(stats.evictedUsage
+		).arg(stats.evictionDuration
+		).arg(stats.encoded
+		).arg(stats.encodedSize
+		).arg(stats.encodingDuration
+		).arg(pixmaps.join(", ")));
+}
+
+[[nodiscard]] Core::MediaActiveCache<const CacheEntry> &ActiveCache() {
+	static auto Instance = Core::MediaActiveCache<const CacheEntry>(
 		kMemoryForCache,
-		[](const Image *image) { image->unload(); });
+		[](const CacheEntry *entry) { entry->unload(); },
+		[] { LogCacheStats(); });
 	return Instance;
 }
 
@@ -57,6 +98,10 @@ uint64 SinglePixKey(Options options) {
 	return PixKey(0, 0, options);
 }
 
+PixmapStats &PixmapStatsByKey(uint64 key) {
+	return PixmapStatistics[Options::Type(key >> 48)];
+}
+
 } // namespace
 
 void ClearRemote() {
@@ -72,6 +117,33 @@ void ClearAll() {
 	ClearRemote();
 }
 
+CacheStats GetCacheStats() {
+	const auto active = ActiveCache().stats();
+	const auto encoding = GetEncodingStats();
+	auto result = CacheStats();
+	result.evicted = active.unloaded;
+	result.evictedUsage = active.unloadedUsage;
+	result.evictionDuration = active.unloadDuration;
+	result.encoded = encoding.count;
+	result.encodedSize = encoding.size;
+	result.encodingDuration = encoding.duration;
+	result.pixmaps = PixmapStatistics;
+	return result;
+}
+
+CacheEntry::CacheEntry(not_null<const Image*> image, uint64 key)
+: _image(image)
+, _key(key) {
+}
+
+void CacheEntry::unload() const {
+	if (_key == kDataCacheKey) {
+		_image->unload();
+	} else {
+		_image->unloadCached(_key);
+	}
+}
+
 ImagePtr Create(const QString &file, QByteArray format) {
 	if (file.startsWith(qstr("http://"), Qt::CaseInsensitive)
 		|| file.startsWith(qstr("https://"), Qt::CaseInsensitive)) {
@@ -272,7 +344,7 @@ ImagePtr CreateFromPhotoSize(
 			+ QByteArray::fromRawData(footer, sizeof(footer) - 1);
 		auto image = App::readImage(ready);
 		return !image.isNull()
-			? Images::Create(std::move(image), "JPG")
+			? Images::Create(ready, "JPG", std::move(image))
 			: ImagePtr();
 	}, [&](const MTPDphotoSizeEmpty &) {
 		return ImagePtr();
@@ -493,10 +565,21 @@ ImagePtr Create(const GeoPointLocation &location) {
 	return ImagePtr(image);
 }
 
+Decoded Source::takeDecoded(QSize prepare) {
+	auto result = Decoded();
+	result.original = takeLoaded();
+	return result;
+}
+
 } // namespace Images
 
+Image::CachedPixmap::CachedPixmap(not_null<const Image*> image, uint64 key)
+: entry(image, key) {
+}
+
 Image::Image(std::unique_ptr<Source> &&source)
-: _source(std::move(source)) {
+: _source(std::move(source))
+, _dataCacheEntry(this, kDataCacheKey) {
 }
 
 void Image::replaceSource(std::unique_ptr<Source> &&source) {
@@ -544,24 +627,20 @@ const QPixmap &Image::pix(
 		Data::FileOrigin origin,
 		int32 w,
 		int32 h) const {
-	checkSource();
-
 	if (w <= 0 || !width() || !height()) {
         w = width();
     } else {
         w *= cIntRetinaFactor();
         h *= cIntRetinaFactor();
     }
+	checkSource(QSize(w, h));
+
 	auto options = Option::Smooth | Option::None;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(origin, w, h, options);
-        p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = PixKey(w, h, options);
+	if (const auto cached = findCached(k)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixNoCache(origin, w, h, options));
 }
 
 const QPixmap &Image::pixRounded(
@@ -592,15 +671,11 @@ const QPixmap &Image::pixRounded(
 	} else if (radius == ImageRoundRadius::Ellipse) {
 		options |= Option::Circled | cornerOptions(corners);
 	}
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(origin, w, h, options);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = PixKey(w, h, options);
+	if (const auto cached = findCached(k)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixNoCache(origin, w, h, options));
 }
 
 const QPixmap &Image::pixCircled(
@@ -616,15 +691,11 @@ const QPixmap &Image::pixCircled(
 		h *= cIntRetinaFactor();
 	}
 	auto options = Option::Smooth | Option::Circled;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(origin, w, h, options);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = PixKey(w, h, options);
+	if (const auto cached = findCached(k)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixNoCache(origin, w, h, options));
 }
 
 const QPixmap &Image::pixBlurredCircled(
@@ -640,15 +711,11 @@ const QPixmap &Image::pixBlurredCircled(
 		h *= cIntRetinaFactor();
 	}
 	auto options = Option::Smooth | Option::Circled | Option::Blurred;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(origin, w, h, options);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = PixKey(w, h, options);
+	if (const auto cached = findCached(k)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixNoCache(origin, w, h, options));
 }
 
 const QPixmap &Image::pixBlurred(
@@ -664,15 +731,11 @@ const QPixmap &Image::pixBlurred(
 		h *= cIntRetinaFactor();
 	}
 	auto options = Option::Smooth | Option::Blurred;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixNoCache(origin, w, h, options);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = PixKey(w, h, options);
+	if (const auto cached = findCached(k)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixNoCache(origin, w, h, options));
 }
 
 const QPixmap &Image::pixColored(
@@ -689,15 +752,11 @@ const QPixmap &Image::pixColored(
 		h *= cIntRetinaFactor();
 	}
 	auto options = Option::Smooth | Option::Colored;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixColoredNoCache(origin, add, w, h, true);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = PixKey(w, h, options);
+	if (const auto cached = findCached(k)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixColoredNoCache(origin, add, w, h, true));
 }
 
 const QPixmap &Image::pixBlurredColored(
@@ -714,15 +773,11 @@ const QPixmap &Image::pixBlurredColored(
 		h *= cIntRetinaFactor();
 	}
 	auto options = Option::Blurred | Option::Smooth | Option::Colored;
-	auto k = PixKey(w, h, options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend()) {
-		auto p = pixBlurredColoredNoCache(origin, add, w, h);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = PixKey(w, h, options);
+	if (const auto cached = findCached(k)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixBlurredColoredNoCache(origin, add, w, h));
 }
 
 const QPixmap &Image::pixSingle(
@@ -761,18 +816,14 @@ const QPixmap &Image::pixSingle(
 		options |= Option::Colored;
 	}
 
-	auto k = SinglePixKey(options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend() || i->width() != (outerw * cIntRetinaFactor()) || i->height() != (outerh * cIntRetinaFactor())) {
-		if (i != _sizesCache.cend()) {
-			ActiveCache().decrement(ComputeUsage(*i));
-		}
-		auto p = pixNoCache(origin, w, h, options, outerw, outerh, colored);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = SinglePixKey(options);
+	const auto size = QSize(outerw, outerh) * cIntRetinaFactor();
+	if (const auto cached = findCached(k, size)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(
+		k,
+		pixNoCache(origin, w, h, options, outerw, outerh, colored));
 }
 
 const QPixmap &Image::pixBlurredSingle(
@@ -807,18 +858,12 @@ const QPixmap &Image::pixBlurredSingle(
 		options |= Option::Circled | cornerOptions(corners);
 	}
 
-	auto k = SinglePixKey(options);
-	auto i = _sizesCache.constFind(k);
-	if (i == _sizesCache.cend() || i->width() != (outerw * cIntRetinaFactor()) || i->height() != (outerh * cIntRetinaFactor())) {
-		if (i != _sizesCache.cend()) {
-			ActiveCache().decrement(ComputeUsage(*i));
-		}
-		auto p = pixNoCache(origin, w, h, options, outerw, outerh);
-		p.setDevicePixelRatio(cRetinaFactor());
-		i = _sizesCache.insert(k, p);
-		ActiveCache().increment(ComputeUsage(*i));
+	const auto k = SinglePixKey(options);
+	const auto size = QSize(outerw, outerh) * cIntRetinaFactor();
+	if (const auto cached = findCached(k, size)) {
+		return *cached;
 	}
-	return i.value();
+	return insertCached(k, pixNoCache(origin, w, h, options, outerw, outerh));
 }
 
 QPixmap Image::pixNoCache(
@@ -934,7 +979,7 @@ QPixmap Image::pixBlurredColoredNoCache(
 }
 
 QImage Image::original() const {
-	checkSource();
+	checkSourceNow();
 	return _data;
 }
 
@@ -970,7 +1015,29 @@ bool Image::loaded() const {
 	return !_data.isNull();
 }
 
-void Image::checkSource() const {
+void Image::checkSource(QSize prepare) const {
+	auto decoded = _source->takeDecoded(prepare);
+	if (_data.isNull() && !decoded.original.isNull()) {
+		invalidateSizeCache();
+		_data = std::move(decoded.original);
+		ActiveCache().increment(ComputeUsage(_data));
+
+		if (!decoded.prepared.isNull()) {
+			const auto size = decoded.preparedFor;
+			const auto key = PixKey(
+				size.width(),
+				size.height(),
+				Option::Smooth | Option::None);
+			insertCached(
+				key,
+				App::pixmapFromImageInPlace(std::move(decoded.prepared)));
+		}
+	}
+
+	ActiveCache().up(&_dataCacheEntry);
+}
+
+void Image::checkSourceNow() const {
 	auto data = _source->takeLoaded();
 	if (_data.isNull() && !data.isNull()) {
 		invalidateSizeCache();
@@ -978,7 +1045,7 @@ void Image::checkSource() const {
 		ActiveCache().increment(ComputeUsage(_data));
 	}
 
-	ActiveCache().up(this);
+	ActiveCache().up(&_dataCacheEntry);
 }
 
 void Image::unload() const {
@@ -999,20 +1066,71 @@ void Image::setDelayedStorageLocation(
 
 void Image::setImageBytes(const QByteArray &bytes) {
 	_source->setImageBytes(bytes);
-	checkSource();
+	checkSourceNow();
 }
 
 void Image::invalidateSizeCache() const {
 	auto &cache = ActiveCache();
-	for (const auto &image : std::as_const(_sizesCache)) {
-		cache.decrement(ComputeUsage(image));
+	for (const auto &[key, cached] : _sizesCache) {
+		cache.decrement(ComputeUsage(cached.pixmap));
+		cache.remove(&cached.entry);
 	}
 	_sizesCache.clear();
 }
 
+const QPixmap *Image::findCached(uint64 key, QSize size) const {
+	const auto i = _sizesCache.find(key);
+	if (i == end(_sizesCache)
+		|| (size.isValid() && i->second.pixmap.size() != size)) {
+		return nullptr;
+	}
+	++PixmapStatsByKey(key).hits;
+	ActiveCache().up(&i->second.entry);
+	return &i->second.pixmap;
+}
+
+const QPixmap &Image::insertCached(uint64 key, QPixmap &&pixmap) const {
+	++PixmapStatsByKey(key).misses;
+
+	auto &cache = ActiveCache();
+	auto i = _sizesCache.find(key);
+	if (i == end(_sizesCache)) {
+		i = _sizesCache.emplace(
+			std::piecewise_construct,
+			std::forward_as_tuple(key),
+			std::forward_as_tuple(this, key)).first;
+	} else {
+		cache.decrement(ComputeUsage(i->second.pixmap));
+	}
+	auto &cached = i->second;
+	cached.pixmap = std::move(pixmap);
+	cached.pixmap.setDevicePixelRatio(cRetinaFactor());
+	cache.increment(ComputeUsage(cached.pixmap));
+
+	// The memory limit is checked later, so the result stays alive.
+	cache.up(&cached.entry);
+	return cached.pixmap;
+}
+
+void Image::unloadCached(uint64 key) const {
+	const auto i = _sizesCache.find(key);
+	if (i == end(_sizesCache)) {
+		return;
+	}
+	const auto usage = ComputeUsage(i->second.pixmap);
+	auto &stats = PixmapStatsByKey(key);
+	++stats.evicted;
+	stats.evictedUsage += usage;
+
+	auto &cache = ActiveCache();
+	cache.decrement(usage);
+	cache.remove(&i->second.entry);
+	_sizesCache.erase(i);
+}
+
 Image::~Image() {
 	if (this != Empty() && this != BlankMedia()) {
 		unload();
-		ActiveCache().remove(this);
+		ActiveCache().remove(&_dataCacheEntry);
 	}
 }
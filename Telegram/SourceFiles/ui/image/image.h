@@ -10,12 +10,50 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "ui/image/image_prepare.h"
 
 class HistoryItem;
+class Image;
 
 namespace Images {
 
 void ClearRemote();
 void ClearAll();
 
+struct PixmapStats {
+	int64 hits = 0;
+	int64 misses = 0; // Prepared again, or first time.
+	int64 evicted = 0;
+	int64 evictedUsage = 0;
+};
+
+struct CacheStats {
+	// Decoded images and pixmaps unloaded when the memory limit was hit.
+	int64 evicted = 0;
+	int64 evictedUsage = 0; // Unpacked image memory freed by that.
+	int64 evictionDuration = 0; // Main thread microseconds spent on that.
+
+	int64 encoded = 0; // Evicted images without the original bytes.
+	int64 encodedSize = 0; // Size of the bytes they were encoded to.
+	crl::time encodingDuration = 0; // Background time spent encoding.
+
+	// Prepared pixmaps by the options they were prepared with.
+	base::flat_map<Options::Type, PixmapStats> pixmaps;
+};
+[[nodiscard]] CacheStats GetCacheStats();
+
+// An entry of the global cache of unpacked images. The decoded image
+// and each prepared pixmap of it are separate entries, so that sizes
+// and options no longer used are unloaded before the decoded image.
+class CacheEntry final {
+public:
+	CacheEntry(not_null<const Image*> image, uint64 key);
+
+	void unload() const;
+
+private:
+	not_null<const Image*> _image;
+	uint64 _key = 0;
+
+};
+
 ImagePtr Create(const QString &file, QByteArray format);
 ImagePtr Create(const QString &url, QSize box);
 ImagePtr Create(const QString &url, int width, int height);
@@ -47,6 +85,8 @@ ImagePtr Create(
 	int size = 0);
 ImagePtr Create(const GeoPointLocation &location);
 
+struct Decoded;
+
 class Source {
 public:
 	Source() = default;
@@ -67,6 +107,11 @@ public:
 	virtual QImage takeLoaded() = 0;
 	virtual void unload() = 0;
 
+	// Doesn't decode the image on the main thread, if it needs decoding
+	// this starts it in the background, prepares a copy of given size
+	// together with the original and returns nothing until it finishes.
+	virtual Decoded takeDecoded(QSize prepare);
+
 	virtual void automaticLoad(
 		Data::FileOrigin origin,
 		const HistoryItem *item) = 0;
@@ -245,11 +290,27 @@ public:
 	~Image();
 
 private:
-	void checkSource() const;
+	friend class Images::CacheEntry;
+
+	struct CachedPixmap {
+		CachedPixmap(not_null<const Image*> image, uint64 key);
+
+		QPixmap pixmap;
+		Images::CacheEntry entry;
+	};
+
+	void checkSource(QSize prepare = QSize()) const;
+	void checkSourceNow() const;
 	void invalidateSizeCache() const;
 
+	// Returns nullptr if there is no pixmap or it has a different size.
+	const QPixmap *findCached(uint64 key, QSize size = QSize()) const;
+	const QPixmap &insertCached(uint64 key, QPixmap &&pixmap) const;
+	void unloadCached(uint64 key) const;
+
 	std::unique_ptr<Images::Source> _source;
-	mutable QMap<uint64, QPixmap> _sizesCache;
+	mutable std::map<uint64, CachedPixmap> _sizesCache;
 	mutable QImage _data;
+	Images::CacheEntry _dataCacheEntry;
 
 };
@@ -0,0 +1,256 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "ui/image/image_decoder.h"
+
+#include "ui/image/image_prepare.h"
+#include "auth_session.h"
+
+#include <QtCore/QMutex>
+#include <QtCore/QThread>
+
+namespace Images {
+namespace {
+
+int MaxRunningDecodes() {
+	// Leave one core for the main thread.
+	static const auto result = std::max(QThread::idealThreadCount() - 1, 1);
+	return result;
+}
+
+Decoded Decode(DecodeTask::Request &&request) {
+	auto result = Decoded();
+	result.bytes = std::move(request.bytes);
+	if (result.bytes.isEmpty() && !request.path.isEmpty()) {
+		QFile f(request.path);
+		if (f.size() <= App::kImageSizeLimit && f.open(QIODevice::ReadOnly)) {
+			result.bytes = f.readAll();
+		}
+	}
+	if (result.bytes.isEmpty()) {
+		return result;
+	}
+	auto image = App::readImage(result.bytes, &result.format, false, nullptr);
+	if (image.isNull()) {
+		return result;
+	}
+	const auto box = request.shrinkBox;
+	if (!box.isEmpty()
+		&& (image.width() > box.width() || image.height() > box.height())) {
+		image = image.scaled(
+			box,
+			Qt::KeepAspectRatio,
+			Qt::SmoothTransformation);
+	}
+	const auto size = request.prepare;
+	if (size.width() > 0) {
+		result.prepared = prepare(
+			image,
+			size.width(),
+			size.height(),
+			Option::Smooth | Option::None,
+			-1,
+			-1);
+		result.preparedFor = size;
+	}
+	result.original = std::move(image);
+	return result;
+}
+
+} // namespace
+
+class DecodeQueue final {
+public:
+	static DecodeQueue &Instance();
+
+	uint64 enqueue(
+		not_null<DecodeTask*> task,
+		DecodeTask::Request &&request,
+		bool loadFirst,
+		bool prior);
+	void prioritize(uint64 id, bool loadFirst, bool prior);
+	void cancel(uint64 id);
+
+private:
+	struct Waiting {
+		uint64 id = 0;
+		DecodeTask::Request request;
+	};
+
+	void insert(Waiting &&waiting, bool loadFirst, bool prior);
+	std::optional<Waiting> takeWaiting(uint64 id);
+	std::optional<Waiting> takeNext();
+	void work();
+	void finished(uint64 id, Decoded &&result);
+
+	// Accessed from the worker threads.
+	QMutex _mutex;
+	std::deque<Waiting> _prior;
+	std::deque<Waiting> _regular;
+	int _running = 0;
+
+	// Accessed only from the main thread.
+	base::flat_map<uint64, not_null<DecodeTask*>> _tasks;
+	uint64 _autoincrement = 0;
+
+};
+
+DecodeQueue &DecodeQueue::Instance() {
+	static DecodeQueue Result;
+	return Result;
+}
+
+uint64 DecodeQueue::enqueue(
+		not_null<DecodeTask*> task,
+		DecodeTask::Request &&request,
+		bool loadFirst,
+		bool prior) {
+	const auto id = ++_autoincrement;
+	_tasks.emplace(id, task);
+
+	auto startWorker = false;
+	{
+		QMutexLocker lock(&_mutex);
+		insert({ id, std::move(request) }, loadFirst, prior);
+		if (_running < MaxRunningDecodes()) {
+			++_running;
+			startWorker = true;
+		}
+	}
+	if (startWorker) {
+		crl::async([=] { work(); });
+	}
+	return id;
+}
+
+void DecodeQueue::prioritize(uint64 id, bool loadFirst, bool prior) {
+	QMutexLocker lock(&_mutex);
+	if (auto waiting = takeWaiting(id)) {
+		insert(std::move(*waiting), loadFirst, prior);
+	}
+}
+
+void DecodeQueue::cancel(uint64 id) {
+	_tasks.remove(id);
+
+	QMutexLocker lock(&_mutex);
+	takeWaiting(id);
+}
+
+void DecodeQueue::insert(Waiting &&waiting, bool loadFirst, bool prior) {
+	if (loadFirst) {
+		_prior.push_front(std::move(waiting));
+	} else if (prior) {
+		_prior.push_back(std::move(waiting));
+	} else {
+		_regular.push_back(std::move(waiting));
+	}
+}
+
+auto DecodeQueue::takeWaiting(uint64 id) -> std::optional<Waiting> {
+	for (const auto queue : { &_prior, &_regular }) {
+		const auto i = ranges::find(*queue, id, &Waiting::id);
+		if (i != end(*queue)) {
+			auto result = std::move(*i);
+			queue->erase(i);
+			return std::move(result);
+		}
+	}
+	return std::nullopt;
+}
+
+auto DecodeQueue::takeNext() -> std::optional<Waiting> {
+	QMutexLocker lock(&_mutex);
+	for (const auto queue : { &_prior, &_regular }) {
+		if (!queue->empty()) {
+			auto result = std::move(queue->front());
+			queue->pop_front();
+			return std::move(result);
+		}
+	}
+	--_running;
+	return std::nullopt;
+}
+
+void DecodeQueue::work() {
+	while (auto waiting = takeNext()) {
+		auto result = Decode(std::move(waiting->request));
+		crl::on_main([=, id = waiting->id]() mutable {
+			finished(id, std::move(result));
+		});
+	}
+}
+
+void DecodeQueue::finished(uint64 id, Decoded &&result) {
+	const auto i = _tasks.find(id);
+	if (i == end(_tasks)) {
+		return;
+	}
+	const auto task = i->second;
+	_tasks.erase(i);
+	task->finish(std::move(result));
+}
+
+DecodeTask::~DecodeTask() {
+	cancel();
+}
+
+void DecodeTask::start(Request &&request, bool loadFirst, bool prior) {
+	if (_id) {
+		prioritize(loadFirst, prior);
+		return;
+	} else if (_failed) {
+		return;
+	}
+	_result = std::nullopt;
+	_id = DecodeQueue::Instance().enqueue(
+		this,
+		std::move(request),
+		loadFirst,
+		prior);
+}
+
+void DecodeTask::prioritize(bool loadFirst, bool prior) {
+	if (_id) {
+		DecodeQueue::Instance().prioritize(_id, loadFirst, prior);
+	}
+}
+
+void DecodeTask::cancel() {
+	if (const auto id = base::take(_id)) {
+		DecodeQueue::Instance().cancel(id);
+	}
+	_result = std::nullopt;
+	_failed = false;
+}
+
+bool DecodeTask::running() const {
+	return (_id != 0);
+}
+
+bool DecodeTask::finished() const {
+	return _result.has_value();
+}
+
+Decoded DecodeTask::take() {
+	Expects(_result.has_value());
+
+	auto result = std::move(*_result);
+	_result = std::nullopt;
+	_failed = result.original.isNull();
+	return result;
+}
+
+void DecodeTask::finish(Decoded &&result) {
+	_id = 0;
+	_result = std::move(result);
+	if (AuthSession::Exists()) {
+		Auth().downloaderTaskFinished().notify();
+	}
+}
+
+} // namespace Images
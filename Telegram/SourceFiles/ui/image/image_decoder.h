@@ -0,0 +1,63 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+namespace Images {
+
+struct Decoded {
+	QImage original;
+	QByteArray format;
+	QByteArray bytes; // Read from the file if only the path was given.
+	QImage prepared; // Scaled to the requested size, if it was given.
+	QSize preparedFor; // The requested size, height may be zero.
+};
+
+class DecodeQueue;
+
+// Decodes images on background threads, so that showing many new images
+// at once doesn't stall the main thread. Waiting requests are started in
+// the order of their priority, like FileLoader-s are. All methods should
+// be called on the main thread, the result is received on it as well.
+class DecodeTask final {
+public:
+	struct Request {
+		QByteArray bytes;
+		QString path; // Read the file if bytes are empty.
+		QSize shrinkBox; // Shrink the original to fit in it.
+		QSize prepare; // Prepare a smoothly scaled copy of this size.
+	};
+
+	DecodeTask() = default;
+	DecodeTask(const DecodeTask &other) = delete;
+	DecodeTask &operator=(const DecodeTask &other) = delete;
+	~DecodeTask();
+
+	// Only changes the priority if the request is already running.
+	// Does nothing after a failed decoding until cancel() is called.
+	void start(Request &&request, bool loadFirst, bool prior);
+	void prioritize(bool loadFirst, bool prior);
+
+	// Cancels the running request or forgets the received result.
+	void cancel();
+
+	[[nodiscard]] bool running() const;
+	[[nodiscard]] bool finished() const;
+	[[nodiscard]] Decoded take();
+
+private:
+	friend class DecodeQueue;
+
+	void finish(Decoded &&result);
+
+	uint64 _id = 0;
+	std::optional<Decoded> _result;
+	bool _failed = false;
+
+};
+
+} // namespace Images
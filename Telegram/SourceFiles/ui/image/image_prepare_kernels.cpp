@@ -0,0 +1,547 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "ui/image/image_prepare_kernels.h"
+
+#include "base/assertion.h"
+
+#include <vector>
+
+#if defined ARCH_CPU_X86_64 || defined __SSE2__ || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define KERNELS_USE_SSE2
+#include <emmintrin.h>
+#endif // ARCH_CPU_X86_64 || __SSE2__ || _M_IX86_FP >= 2
+
+namespace Images {
+namespace Kernels {
+namespace {
+
+// Every pixel is unpacked to four 16 bit components in an uint64.
+// Sums of them are kept in uint64 values as well, relying on wrapping.
+constexpr auto kBlurRadiusPlusOne = kBlurRadius + 1;
+constexpr auto kBlurDiv = kBlurRadius * 2 + 1;
+constexpr auto kBlurShift = 4;
+constexpr auto kBlurFirstMultiplier = (kBlurRadiusPlusOne * (kBlurRadiusPlusOne + 1)) >> 1;
+constexpr auto kBlurMask = 0x00FF00FF00FF00FFULL;
+static_assert(
+	(1 << kBlurShift) == kBlurRadiusPlusOne * kBlurRadiusPlusOne,
+	"Blur shift should divide by the sum of the weights.");
+
+TG_FORCE_INLINE uint64 BlurColors(const uchar *p) {
+	return (uint64)p[0] + ((uint64)p[1] << 16) + ((uint64)p[2] << 32) + ((uint64)p[3] << 48);
+}
+
+TG_FORCE_INLINE void BlurStore(uchar *p, uint64 sum) {
+	const auto res = sum >> kBlurShift;
+	p[0] = res & 0xFF;
+	p[1] = (res >> 16) & 0xFF;
+	p[2] = (res >> 32) & 0xFF;
+	p[3] = (res >> 48) & 0xFF;
+}
+
+template <typename Update>
+TG_FORCE_INLINE void BlurLine(int size, Update &&update) {
+	const auto r1 = kBlurRadiusPlusOne;
+	const auto end = size - r1;
+	auto i = 0;
+	for (; i < r1; ++i) {
+		update(i, 0, i, i + r1);
+	}
+	for (; i < end; ++i) {
+		update(i, i - r1, i, i + r1);
+	}
+	for (; i < size; ++i) {
+		update(i, i - r1, i, size - 1);
+	}
+}
+
+// Blurs the row of pixels horizontally to the row of unpacked values.
+void BlurRowScalar(const uchar *pix, uint64 *rgb, int w) {
+	const auto r1 = kBlurRadiusPlusOne;
+	auto cur = BlurColors(pix);
+	uint64 rgballsum = -kBlurRadius * cur;
+	uint64 rgbsum = cur * kBlurFirstMultiplier;
+	for (auto i = 1; i <= kBlurRadius; ++i) {
+		const auto cur = BlurColors(pix + i * 4);
+		rgbsum += cur * (r1 - i);
+		rgballsum += cur;
+	}
+	BlurLine(w, [&](int x, int start, int middle, int end) {
+		rgb[x] = (rgbsum >> kBlurShift) & kBlurMask;
+		rgballsum += BlurColors(pix + start * 4)
+			- 2 * BlurColors(pix + middle * 4)
+			+ BlurColors(pix + end * 4);
+		rgbsum += rgballsum;
+	});
+}
+
+// Blurs the column of unpacked values vertically to the pixels.
+void BlurColumnScalar(
+		const uint64 *rgb,
+		uchar *pix,
+		int x,
+		int w,
+		int h,
+		int stride) {
+	const auto r1 = kBlurRadiusPlusOne;
+	uint64 rgballsum = -kBlurRadius * rgb[x];
+	uint64 rgbsum = rgb[x] * kBlurFirstMultiplier;
+	for (auto i = 1; i <= kBlurRadius; ++i) {
+		rgbsum += rgb[i * w + x] * (r1 - i);
+		rgballsum += rgb[i * w + x];
+	}
+	auto yi = x * 4;
+	BlurLine(h, [&](int, int start, int middle, int end) {
+		BlurStore(pix + yi, rgbsum);
+		rgballsum += rgb[x + start * w]
+			- 2 * rgb[x + middle * w]
+			+ rgb[x + end * w];
+		rgbsum += rgballsum;
+		yi += stride;
+	});
+}
+
+void BlurScalar(Pixels image, uint64 *rgb) {
+	const auto pix = reinterpret_cast<uchar*>(image.ints);
+	const auto w = image.width;
+	const auto h = image.height;
+	const auto stride = image.intsPerLine * 4;
+	for (auto y = 0; y != h; ++y) {
+		BlurRowScalar(pix + y * stride, rgb + y * w, w);
+	}
+	for (auto x = 0; x != w; ++x) {
+		BlurColumnScalar(rgb, pix, x, w, h, stride);
+	}
+}
+
+void BlurGeneric(Pixels image, uint64 *rgb) {
+	const auto pix = reinterpret_cast<uchar*>(image.ints);
+	const auto w = image.width;
+	const auto h = image.height;
+	const auto stride = image.intsPerLine * 4;
+	for (auto y = 0; y != h; ++y) {
+		BlurRowScalar(pix + y * stride, rgb + y * w, w);
+	}
+
+	// Walk all the columns at once, so that the inner loops go over
+	// the contiguous rows of values instead of jumping between them.
+	const auto r1 = kBlurRadiusPlusOne;
+	auto sums = std::vector<uint64>(w * 2);
+	const auto rgbsum = sums.data();
+	const auto rgballsum = sums.data() + w;
+	for (auto x = 0; x != w; ++x) {
+		rgballsum[x] = -kBlurRadius * rgb[x];
+		rgbsum[x] = rgb[x] * kBlurFirstMultiplier;
+	}
+	for (auto i = 1; i <= kBlurRadius; ++i) {
+		const auto row = rgb + i * w;
+		for (auto x = 0; x != w; ++x) {
+			rgbsum[x] += row[x] * (r1 - i);
+			rgballsum[x] += row[x];
+		}
+	}
+	BlurLine(h, [&](int y, int start, int middle, int end) {
+		const auto out = pix + y * stride;
+		const auto first = rgb + start * w;
+		const auto second = rgb + middle * w;
+		const auto third = rgb + end * w;
+		for (auto x = 0; x != w; ++x) {
+			BlurStore(out + x * 4, rgbsum[x]);
+			rgballsum[x] += first[x] - 2 * second[x] + third[x];
+			rgbsum[x] += rgballsum[x];
+		}
+	});
+}
+
+TG_FORCE_INLINE uint32 MaskPixel(uint32 pixel, uint32 opacity) {
+	auto result = uint32(0);
+	for (auto shift = 0; shift != 32; shift += 8) {
+		const auto component = (pixel >> shift) & 0xFFU;
+		result |= ((component * opacity) >> 8) << shift;
+	}
+	return result;
+}
+
+void ApplyMaskScalar(Pixels image, const Mask &mask) {
+	for (auto y = 0; y != mask.height; ++y) {
+		auto ints = image.ints + y * image.intsPerLine;
+		auto bytes = mask.bytes + y * mask.bytesPerLine;
+		for (auto x = 0; x != mask.width; ++x) {
+			const auto opacity = uint32(*bytes) + 1;
+			*ints = MaskPixel(*ints, opacity);
+			bytes += mask.bytesPerPixel;
+			++ints;
+		}
+	}
+}
+
+TG_FORCE_INLINE uint32 ColorizePixel(
+		uint32 pixel,
+		int ca,
+		int cr,
+		int cg,
+		int cb) {
+	const auto b = int(pixel & 0xFFU);
+	const auto g = int((pixel >> 8) & 0xFFU);
+	const auto r = int((pixel >> 16) & 0xFFU);
+	const auto a = int(pixel >> 24);
+	const auto aca = a * ca;
+	return uint32(uchar(b + ((aca * (cb - b)) >> 16)))
+		| (uint32(uchar(g + ((aca * (cg - g)) >> 16))) << 8)
+		| (uint32(uchar(r + ((aca * (cr - r)) >> 16))) << 16)
+		| (uint32(uchar(a + ((aca * (0xFF - a)) >> 16))) << 24);
+}
+
+void ColorizeScalar(Pixels image, int ca, int cr, int cg, int cb) {
+	for (auto y = 0; y != image.height; ++y) {
+		auto ints = image.ints + y * image.intsPerLine;
+		for (const auto till = ints + image.width; ints != till; ++ints) {
+			*ints = ColorizePixel(*ints, ca, cr, cg, cb);
+		}
+	}
+}
+
+#ifdef KERNELS_USE_SSE2
+
+// Two unpacked pixels from the same place of two rows, in an __m128i.
+TG_FORCE_INLINE __m128i BlurColors2(
+		const uchar *first,
+		const uchar *second) {
+	const auto pixels = _mm_unpacklo_epi32(
+		_mm_cvtsi32_si128(*reinterpret_cast<const int*>(first)),
+		_mm_cvtsi32_si128(*reinterpret_cast<const int*>(second)));
+	return _mm_unpacklo_epi8(pixels, _mm_setzero_si128());
+}
+
+// The components are less than 256, so 16 bit multiplication is enough.
+TG_FORCE_INLINE __m128i BlurMultiply(__m128i value, int multiplier) {
+	return _mm_mullo_epi16(value, _mm_set1_epi16(short(multiplier)));
+}
+
+void BlurRowsSse2(
+		const uchar *first,
+		const uchar *second,
+		uint64 *firstRgb,
+		uint64 *secondRgb,
+		int w) {
+	const auto r1 = kBlurRadiusPlusOne;
+	const auto mask = _mm_set1_epi64x(kBlurMask);
+	const auto cur = BlurColors2(first, second);
+	auto rgballsum = _mm_sub_epi64(
+		_mm_setzero_si128(),
+		BlurMultiply(cur, kBlurRadius));
+	auto rgbsum = BlurMultiply(cur, kBlurFirstMultiplier);
+	for (auto i = 1; i <= kBlurRadius; ++i) {
+		const auto cur = BlurColors2(first + i * 4, second + i * 4);
+		rgbsum = _mm_add_epi64(rgbsum, BlurMultiply(cur, r1 - i));
+		rgballsum = _mm_add_epi64(rgballsum, cur);
+	}
+	BlurLine(w, [&](int x, int start, int middle, int end) {
+		const auto result = _mm_and_si128(
+			_mm_srli_epi64(rgbsum, kBlurShift),
+			mask);
+		_mm_storel_epi64(
+			reinterpret_cast<__m128i*>(firstRgb + x),
+			result);
+		_mm_storel_epi64(
+			reinterpret_cast<__m128i*>(secondRgb + x),
+			_mm_unpackhi_epi64(result, result));
+		const auto twice = _mm_slli_epi64(
+			BlurColors2(first + middle * 4, second + middle * 4),
+			1);
+		rgballsum = _mm_add_epi64(
+			rgballsum,
+			_mm_sub_epi64(
+				_mm_add_epi64(
+					BlurColors2(first + start * 4, second + start * 4),
+					BlurColors2(first + end * 4, second + end * 4)),
+				twice));
+		rgbsum = _mm_add_epi64(rgbsum, rgballsum);
+	});
+}
+
+// Walks the pairs of columns row by row, like BlurGeneric() does.
+void BlurColumnsSse2(
+		const uint64 *rgb,
+		uchar *pix,
+		int pairs,
+		int w,
+		int h,
+		int stride) {
+	const auto r1 = kBlurRadiusPlusOne;
+	const auto mask = _mm_set1_epi64x(kBlurMask);
+	const auto load = [&](const uint64 *row, int pair) {
+		return _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(row + pair * 2));
+	};
+	struct Sums {
+		__m128i rgbsum;
+		__m128i rgballsum;
+	};
+	auto sums = std::vector<Sums>(pairs);
+	for (auto p = 0; p != pairs; ++p) {
+		const auto cur = load(rgb, p);
+		auto &pair = sums[p];
+		pair.rgballsum = _mm_sub_epi64(
+			_mm_setzero_si128(),
+			BlurMultiply(cur, kBlurRadius));
+		pair.rgbsum = BlurMultiply(cur, kBlurFirstMultiplier);
+	}
+	for (auto i = 1; i <= kBlurRadius; ++i) {
+		const auto row = rgb + i * w;
+		for (auto p = 0; p != pairs; ++p) {
+			const auto cur = load(row, p);
+			auto &pair = sums[p];
+			pair.rgbsum = _mm_add_epi64(
+				pair.rgbsum,
+				BlurMultiply(cur, r1 - i));
+			pair.rgballsum = _mm_add_epi64(pair.rgballsum, cur);
+		}
+	}
+	BlurLine(h, [&](int y, int start, int middle, int end) {
+		const auto out = pix + y * stride;
+		const auto first = rgb + start * w;
+		const auto second = rgb + middle * w;
+		const auto third = rgb + end * w;
+		for (auto p = 0; p != pairs; ++p) {
+			auto &pair = sums[p];
+			const auto result = _mm_and_si128(
+				_mm_srli_epi64(pair.rgbsum, kBlurShift),
+				mask);
+			_mm_storel_epi64(
+				reinterpret_cast<__m128i*>(out + p * 8),
+				_mm_packus_epi16(result, result));
+			pair.rgballsum = _mm_add_epi64(
+				pair.rgballsum,
+				_mm_sub_epi64(
+					_mm_add_epi64(load(first, p), load(third, p)),
+					_mm_slli_epi64(load(second, p), 1)));
+			pair.rgbsum = _mm_add_epi64(pair.rgbsum, pair.rgballsum);
+		}
+	});
+}
+
+void BlurSse2(Pixels image, uint64 *rgb) {
+	const auto pix = reinterpret_cast<uchar*>(image.ints);
+	const auto w = image.width;
+	const auto h = image.height;
+	const auto stride = image.intsPerLine * 4;
+	auto y = 0;
+	for (; y + 1 < h; y += 2) {
+		BlurRowsSse2(
+			pix + y * stride,
+			pix + (y + 1) * stride,
+			rgb + y * w,
+			rgb + (y + 1) * w,
+			w);
+	}
+	if (y < h) {
+		BlurRowScalar(pix + y * stride, rgb + y * w, w);
+	}
+	const auto pairs = w / 2;
+	BlurColumnsSse2(rgb, pix, pairs, w, h, stride);
+	if (pairs * 2 < w) {
+		BlurColumnScalar(rgb, pix, w - 1, w, h, stride);
+	}
+}
+
+void ApplyMaskSse2(Pixels image, const Mask &mask) {
+	if (mask.bytesPerPixel != 4) {
+		ApplyMaskScalar(image, mask);
+		return;
+	}
+	const auto zero = _mm_setzero_si128();
+	const auto one = _mm_set1_epi16(1);
+	const auto first = _mm_set1_epi32(0xFF);
+	const auto multiply = [&](__m128i pixels, __m128i opacity) {
+		return _mm_srli_epi16(_mm_mullo_epi16(pixels, opacity), 8);
+	};
+	for (auto y = 0; y != mask.height; ++y) {
+		auto ints = image.ints + y * image.intsPerLine;
+		auto bytes = mask.bytes + y * mask.bytesPerLine;
+		auto x = 0;
+		for (; x + 4 <= mask.width; x += 4) {
+			const auto pixels = _mm_loadu_si128(
+				reinterpret_cast<const __m128i*>(ints));
+			const auto values = _mm_and_si128(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes)),
+				first);
+
+			// [m0 m1 m2 m3] -> [m0 m0 m1 m1 m2 m2 m3 m3] as 16 bit values.
+			const auto doubled = _mm_add_epi16(
+				_mm_unpacklo_epi16(
+					_mm_packs_epi32(values, values),
+					_mm_packs_epi32(values, values)),
+				one);
+			const auto low = multiply(
+				_mm_unpacklo_epi8(pixels, zero),
+				_mm_unpacklo_epi32(doubled, doubled));
+			const auto high = multiply(
+				_mm_unpackhi_epi8(pixels, zero),
+				_mm_unpackhi_epi32(doubled, doubled));
+			_mm_storeu_si128(
+				reinterpret_cast<__m128i*>(ints),
+				_mm_packus_epi16(low, high));
+			ints += 4;
+			bytes += 16;
+		}
+		for (; x != mask.width; ++x) {
+			*ints = MaskPixel(*ints, uint32(*bytes) + 1);
+			bytes += 4;
+			++ints;
+		}
+	}
+}
+
+void ColorizeSse2(Pixels image, int ca, int cr, int cg, int cb) {
+	const auto zero = _mm_setzero_si128();
+	const auto all = _mm_set1_epi16(-1);
+	const auto color = _mm_set_epi16(
+		0xFF, short(cr), short(cg), short(cb),
+		0xFF, short(cr), short(cg), short(cb));
+	const auto colorAlpha = _mm_set1_epi16(short(ca));
+
+	// c + floor(a * ca * (color - c) / 65536) for eight 16 bit values.
+	const auto colorize = [&](__m128i components) {
+		const auto alpha = _mm_shufflehi_epi16(
+			_mm_shufflelo_epi16(components, _MM_SHUFFLE(3, 3, 3, 3)),
+			_MM_SHUFFLE(3, 3, 3, 3));
+		const auto aca = _mm_mullo_epi16(alpha, colorAlpha);
+		const auto delta = _mm_sub_epi16(color, components);
+		const auto negative = _mm_cmplt_epi16(delta, zero);
+		const auto absolute = _mm_max_epi16(
+			delta,
+			_mm_sub_epi16(zero, delta));
+		const auto high = _mm_mulhi_epu16(aca, absolute);
+		const auto inexact = _mm_xor_si128(
+			_mm_cmpeq_epi16(_mm_mullo_epi16(aca, absolute), zero),
+			all);
+
+		// Rounding the negative products down adds one to the absolute.
+		const auto rounded = _mm_sub_epi16(
+			high,
+			_mm_and_si128(negative, inexact));
+		const auto product = _mm_sub_epi16(
+			_mm_xor_si128(rounded, negative),
+			negative);
+		return _mm_add_epi16(components, product);
+	};
+	for (auto y = 0; y != image.height; ++y) {
+		auto ints = image.ints + y * image.intsPerLine;
+		auto x = 0;
+		for (; x + 4 <= image.width; x += 4) {
+			const auto pixels = _mm_loadu_si128(
+				reinterpret_cast<const __m128i*>(ints));
+			const auto low = colorize(_mm_unpacklo_epi8(pixels, zero));
+			const auto high = colorize(_mm_unpackhi_epi8(pixels, zero));
+			_mm_storeu_si128(
+				reinterpret_cast<__m128i*>(ints),
+				_mm_packus_epi16(low, high));
+			ints += 4;
+		}
+		for (; x != image.width; ++x) {
+			*ints = ColorizePixel(*ints, ca, cr, cg, cb);
+			++ints;
+		}
+	}
+}
+
+#endif // KERNELS_USE_SSE2
+
+} // namespace
+
+bool Supported(Implementation implementation) {
+	switch (implementation) {
+	case Implementation::Scalar:
+	case Implementation::Generic: return true;
+#ifdef KERNELS_USE_SSE2
+	case Implementation::Sse2: return true;
+#else // KERNELS_USE_SSE2
+	case Implementation::Sse2: return false;
+#endif // KERNELS_USE_SSE2
+	}
+	return false;
+}
+
+Implementation Best() {
+#ifdef KERNELS_USE_SSE2
+	return Implementation::Sse2;
+#else // KERNELS_USE_SSE2
+	return Implementation::Generic;
+#endif // KERNELS_USE_SSE2
+}
+
+bool CanBlur(int width, int height) {
+	return (kBlurDiv < width) && (kBlurDiv < height);
+}
+
+void Blur(Pixels image, Implementation implementation) {
+	Expects(CanBlur(image.width, image.height));
+	Expects(image.intsPerLine >= image.width);
+	Expects(Supported(implementation));
+
+	auto rgb = std::vector<uint64>(image.width * image.height);
+	switch (implementation) {
+	case Implementation::Scalar: BlurScalar(image, rgb.data()); return;
+	case Implementation::Generic: BlurGeneric(image, rgb.data()); return;
+#ifdef KERNELS_USE_SSE2
+	case Implementation::Sse2: BlurSse2(image, rgb.data()); return;
+#else // KERNELS_USE_SSE2
+	case Implementation::Sse2: break;
+#endif // KERNELS_USE_SSE2
+	}
+	Unexpected("Implementation in Images::Kernels::Blur.");
+}
+
+void ApplyMask(
+		Pixels image,
+		const Mask &mask,
+		Implementation implementation) {
+	Expects(mask.width <= image.width && mask.height <= image.height);
+	Expects(mask.bytesPerPixel > 0);
+	Expects(mask.bytesPerLine >= mask.width * mask.bytesPerPixel);
+	Expects(Supported(implementation));
+
+	switch (implementation) {
+	case Implementation::Scalar:
+	case Implementation::Generic: ApplyMaskScalar(image, mask); return;
+#ifdef KERNELS_USE_SSE2
+	case Implementation::Sse2: ApplyMaskSse2(image, mask); return;
+#else // KERNELS_USE_SSE2
+	case Implementation::Sse2: break;
+#endif // KERNELS_USE_SSE2
+	}
+	Unexpected("Implementation in Images::Kernels::ApplyMask.");
+}
+
+void Colorize(
+		Pixels image,
+		int alpha,
+		int red,
+		int green,
+		int blue,
+		Implementation implementation) {
+	Expects(Supported(implementation));
+
+	switch (implementation) {
+	case Implementation::Scalar:
+	case Implementation::Generic:
+		ColorizeScalar(image, alpha, red, green, blue);
+		return;
+#ifdef KERNELS_USE_SSE2
+	case Implementation::Sse2:
+		ColorizeSse2(image, alpha, red, green, blue);
+		return;
+#else // KERNELS_USE_SSE2
+	case Implementation::Sse2: break;
+#endif // KERNELS_USE_SSE2
+	}
+	Unexpected("Implementation in Images::Kernels::Colorize.");
+}
+
+} // namespace Kernels
+} // namespace Images
@@ -0,0 +1,66 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#pragma once
+
+#include "base/basic_types.h"
+
+// Pixel loops of Images::prepare() working on raw 32 bit premultiplied
+// ARGB pixels in place. Every kernel has the scalar implementation and
+// the vectorized ones, all of them give exactly the same results.
+namespace Images {
+namespace Kernels {
+
+enum class Implementation {
+	Scalar,
+	Generic, // Loops reordered so that the compiler can vectorize them.
+	Sse2,
+};
+
+[[nodiscard]] bool Supported(Implementation implementation);
+[[nodiscard]] Implementation Best();
+
+struct Pixels {
+	uint32 *ints = nullptr;
+	int width = 0;
+	int height = 0;
+	int intsPerLine = 0;
+};
+
+struct Mask {
+	const uchar *bytes = nullptr; // Only the first byte of a pixel is used.
+	int width = 0;
+	int height = 0;
+	int bytesPerPixel = 0;
+	int bytesPerLine = 0;
+};
+
+constexpr auto kBlurRadius = 3;
+
+[[nodiscard]] bool CanBlur(int width, int height);
+
+// Triangle blur with a fixed radius, used for the Blurred option.
+void Blur(Pixels image, Implementation implementation = Best());
+
+// Multiplies every component by (mask + 1) / 256, used for rounding.
+void ApplyMask(
+	Pixels image,
+	const Mask &mask,
+	Implementation implementation = Best());
+
+// Moves every pixel to the color proportionally to its alpha.
+// The color components are not premultiplied, each one is 0-255.
+void Colorize(
+	Pixels image,
+	int alpha,
+	int red,
+	int green,
+	int blue,
+	Implementation implementation = Best());
+
+} // namespace Kernels
+} // namespace Images
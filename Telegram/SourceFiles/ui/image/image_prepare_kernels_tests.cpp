@@ -0,0 +1,231 @@
+/*
+This file is part of Telegram Desktop,
+the official desktop application for the Telegram messaging service.
+
+For license and copyright information please follow this link:
+https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
+*/
+#include "catch.hpp"
+
+#include "ui/image/image_prepare_kernels.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+
+namespace {
+
+const auto DisableBenchmarks = true;
+
+using namespace Images::Kernels;
+using Clock = std::chrono::steady_clock;
+
+constexpr auto kPadding = 3;
+
+const auto kImplementations = {
+	Implementation::Scalar,
+	Implementation::Generic,
+	Implementation::Sse2,
+};
+
+// Premultiplied pixels with a few ints of padding at the end of each line.
+struct TestImage {
+	TestImage(int width, int height, uint32 seed);
+
+	Pixels pixels();
+
+	int width = 0;
+	int height = 0;
+	std::vector<uint32> ints;
+};
+
+TestImage::TestImage(int width, int height, uint32 seed)
+: width(width)
+, height(height)
+, ints((width + kPadding) * height) {
+	// std::mt19937 outputs are defined by the standard, unlike the
+	// outputs of the distributions, so the golden hashes are portable.
+	auto generator = std::mt19937(seed);
+	for (auto &value : ints) {
+		const auto random = uint32(generator());
+		const auto alpha = (random >> 24);
+		auto result = (alpha << 24);
+		for (auto shift = 0; shift != 24; shift += 8) {
+			const auto component = (random >> shift) & 0xFFU;
+			result |= ((component * alpha) / 0xFF) << shift;
+		}
+		value = result;
+	}
+}
+
+Pixels TestImage::pixels() {
+	auto result = Pixels();
+	result.ints = ints.data();
+	result.width = width;
+	result.height = height;
+	result.intsPerLine = width + kPadding;
+	return result;
+}
+
+std::vector<uchar> TestMask(int width, int height, int bytesPerPixel) {
+	auto generator = std::mt19937(width * height * bytesPerPixel);
+	auto result = std::vector<uchar>(width * height * bytesPerPixel);
+	for (auto &value : result) {
+		value = uchar(generator() & 0xFFU);
+	}
+	return result;
+}
+
+Mask MakeMask(const std::vector<uchar> &bytes, int width, int height) {
+	auto result = Mask();
+	result.bytes = bytes.data();
+	result.width = width;
+	result.height = height;
+	result.bytesPerPixel = int(bytes.size()) / (width * height);
+	result.bytesPerLine = width * result.bytesPerPixel;
+	return result;
+}
+
+uint64 Hash(const std::vector<uint32> &ints) {
+	auto result = uint64(0xCBF29CE484222325ULL);
+	for (const auto value : ints) {
+		result = (result ^ value) * 0x100000001B3ULL;
+	}
+	return result;
+}
+
+template <typename Method>
+std::vector<uint32> Apply(TestImage image, Method method) {
+	method(image.pixels());
+	return std::move(image.ints);
+}
+
+template <typename Method>
+void CheckAllImplementations(
+		int width,
+		int height,
+		uint64 golden,
+		Method method) {
+	const auto source = TestImage(width, height, width * height);
+	const auto scalar = Apply(source, [&](Pixels pixels) {
+		method(pixels, Implementation::Scalar);
+	});
+	REQUIRE(Hash(scalar) == golden);
+	for (const auto implementation : kImplementations) {
+		if (!Supported(implementation)) {
+			continue;
+		}
+		const auto result = Apply(source, [&](Pixels pixels) {
+			method(pixels, implementation);
+		});
+		REQUIRE(result == scalar);
+	}
+}
+
+template <typename Method>
+double MeasureMilliseconds(int width, int height, Method method) {
+	const auto count = std::max(2000 * 1000 / (width * height), 10);
+	auto image = TestImage(width, height, 42);
+	const auto start = Clock::now();
+	for (auto i = 0; i != count; ++i) {
+		method(image.pixels());
+	}
+	const auto microseconds = std::chrono::duration_cast<
+		std::chrono::microseconds>(Clock::now() - start).count();
+	return microseconds / (1000. * count);
+}
+
+} // namespace
+
+TEST_CASE("Image kernels give the same results", "[image_prepare]") {
+	SECTION("blur") {
+		const auto blur = [](Pixels pixels, Implementation implementation) {
+			Blur(pixels, implementation);
+		};
+		CheckAllImplementations(8, 8, 0x8852FFAD2E6C1F22ULL, blur);
+		CheckAllImplementations(9, 13, 0x7F78680A338D8127ULL, blur);
+		CheckAllImplementations(101, 57, 0xC5C373A3BD6DE9BAULL, blur);
+		CheckAllImplementations(320, 240, 0xE15F555F0CA9CFC7ULL, blur);
+	}
+	SECTION("mask") {
+		const auto check = [](
+				int width,
+				int height,
+				int bytesPerPixel,
+				uint64 golden) {
+			const auto bytes = TestMask(width, height, bytesPerPixel);
+			const auto mask = MakeMask(bytes, width, height);
+			CheckAllImplementations(
+				width + 5,
+				height + 2,
+				golden,
+				[&](Pixels pixels, Implementation implementation) {
+					ApplyMask(pixels, mask, implementation);
+				});
+		};
+		check(7, 7, 4, 0xB2C1835ED93E634AULL);
+		check(18, 18, 4, 0xA7D33965A13E671BULL);
+		check(101, 57, 4, 0x42620C89DF2D5AA1ULL);
+		check(18, 18, 1, 0x85B78024C64B2643ULL);
+	}
+	SECTION("colorize") {
+		const auto check = [](int a, int r, int g, int b, uint64 golden) {
+			CheckAllImplementations(
+				103,
+				61,
+				golden,
+				[&](Pixels pixels, Implementation implementation) {
+					Colorize(pixels, a, r, g, b, implementation);
+				});
+		};
+		check(0, 0, 0, 0, 0xECB7E1D524312839ULL);
+		check(255, 255, 255, 255, 0x5BDCC4700419F54FULL);
+		check(128, 0, 136, 204, 0xC8535825093BDC84ULL);
+		check(77, 255, 0, 31, 0xD0D285E5B536F6ECULL);
+	}
+}
+
+TEST_CASE("Image kernels benchmark", "[image_prepare]") {
+	if (DisableBenchmarks) {
+		return;
+	}
+	const auto sizes = {
+		std::make_pair(100, 100),
+		std::make_pair(320, 240),
+		std::make_pair(640, 480),
+		std::make_pair(1280, 720),
+		std::make_pair(1280, 1280),
+	};
+	const auto name = [](Implementation implementation) {
+		switch (implementation) {
+		case Implementation::Scalar: return "scalar";
+		case Implementation::Generic: return "generic";
+		case Implementation::Sse2: return "sse2";
+		}
+		return "unknown";
+	};
+	const auto mask = TestMask(32, 32, 4);
+	for (const auto &[width, height] : sizes) {
+		for (const auto implementation : kImplementations) {
+			if (!Supported(implementation)) {
+				continue;
+			}
+			const auto blur = MeasureMilliseconds(width, height, [&](Pixels pixels) {
+				Blur(pixels, implementation);
+			});
+			const auto round = MeasureMilliseconds(width, height, [&](Pixels pixels) {
+				const auto corner = MakeMask(mask, 32, 32);
+				ApplyMask(pixels, corner, implementation);
+				pixels.ints += (width - 32);
+				ApplyMask(pixels, corner, implementation);
+			});
+			const auto colorize = MeasureMilliseconds(width, height, [&](Pixels pixels) {
+				Colorize(pixels, 128, 0, 136, 204, implementation);
+			});
+			WARN(width << "x" << height << " " << name(implementation)
+				<< ", blur: " << blur << " ms"
+				<< ", round: " << round << " ms"
+				<< ", colorize: " << colorize << " ms.");
+		}
+	}
+}
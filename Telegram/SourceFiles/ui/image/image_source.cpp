@@ -16,6 +16,15 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #include "auth_session.h"
 
 namespace Images {
+namespace {
+
+EncodingStats Encoding;
+
+} // namespace
+
+EncodingStats GetEncodingStats() {
+	return Encoding;
+}
 
 ImageSource::ImageSource(QImage &&data, const QByteArray &format)
 : _data(std::move(data))
@@ -29,7 +38,7 @@ void ImageSource::load(
 		bool loadFirst,
 		bool prior) {
 	if (_data.isNull() && !_bytes.isEmpty()) {
-		_data = App::readImage(_bytes, &_format, false);
+		_decode.start({ _bytes }, loadFirst, prior);
 	}
 }
 
@@ -41,22 +50,98 @@ void ImageSource::loadEvenCancelled(
 }
 
 QImage ImageSource::takeLoaded() {
-	load({}, false, false);
+	restoreEncoding();
+	if (_decode.finished()) {
+		auto decoded = _decode.take();
+		applyDecoded(decoded);
+	}
+	if (_data.isNull() && !_bytes.isEmpty()) {
+		_decode.cancel();
+		_data = App::readImage(_bytes, &_format, false);
+	}
 	return _data;
 }
 
 void ImageSource::unload() {
+	_decode.cancel();
 	if (_bytes.isEmpty() && !_data.isNull()) {
-		if (_format != "JPG") {
-			_format = "PNG";
-		}
+		startEncoding();
+	}
+	_data = QImage();
+}
+
+void ImageSource::startEncoding() {
+	Expects(!_data.isNull());
+
+	if (_format != "JPG") {
+		_format = "PNG";
+	}
+	_encoding = _data;
+	crl::async([
+		=,
+		image = _data,
+		format = _format,
+		guard = _encodingGuard.make_guard()
+	]() mutable {
+		const auto started = crl::now();
+		auto bytes = QByteArray();
 		{
-			QBuffer buffer(&_bytes);
-			_data.save(&buffer, _format);
+			QBuffer buffer(&bytes);
+			image.save(&buffer, format);
+		}
+		const auto duration = crl::now() - started;
+		crl::on_main(std::move(guard), [
+			=,
+			bytes = std::move(bytes)
+		]() mutable {
+			finishEncoding(std::move(bytes), duration);
+		});
+	});
+}
+
+void ImageSource::finishEncoding(QByteArray &&bytes, crl::time duration) {
+	Expects(!_encoding.isNull());
+	Expects(!bytes.isEmpty());
+
+	++Encoding.count;
+	Encoding.size += bytes.size();
+	Encoding.duration += duration;
+
+	_bytes = std::move(bytes);
+	_encoding = QImage();
+	_encodingGuard = nullptr;
+}
+
+void ImageSource::restoreEncoding() {
+	if (!_encoding.isNull()) {
+		_encodingGuard = nullptr;
+		if (_data.isNull()) {
+			_data = std::move(_encoding);
 		}
-		Assert(!_bytes.isEmpty());
+		_encoding = QImage();
+	}
+}
+
+Decoded ImageSource::takeDecoded(QSize prepare) {
+	restoreEncoding();
+	auto result = Decoded();
+	if (_decode.finished()) {
+		result = _decode.take();
+		applyDecoded(result);
+	}
+	if (!_data.isNull()) {
+		result.original = _data;
+	} else if (!_bytes.isEmpty()) {
+		_decode.start({ _bytes, QString(), QSize(), prepare }, false, true);
+	}
+	return result;
+}
+
+void ImageSource::applyDecoded(Decoded &result) {
+	if (_data.isNull() && !result.original.isNull()) {
+		_data = result.original;
+		_format = result.format;
 	}
-	_data = QImage();
 }
 
 void ImageSource::automaticLoad(
@@ -76,6 +161,7 @@ bool ImageSource::displayLoading() {
 }
 
 void ImageSource::cancel() {
+	_decode.cancel();
 }
 
 float64 ImageSource::progress() {
@@ -131,6 +217,10 @@ void ImageSource::setInformation(int size, int width, int height) {
 }
 
 QByteArray ImageSource::bytesForCache() {
+	if (!_bytes.isEmpty()) {
+		return _bytes;
+	}
+	restoreEncoding();
 	auto result = QByteArray();
 	{
 		QBuffer buffer(&result);
@@ -160,6 +250,14 @@ void LocalFileSource::load(
 		Data::FileOrigin origin,
 		bool loadFirst,
 		bool prior) {
+	if (!_data.isNull() || _bytes == "(bad)") {
+		return;
+	}
+	_decode.start({ _bytes, _path }, loadFirst, prior);
+}
+
+void LocalFileSource::loadNow() {
+	_decode.cancel();
 	if (!_data.isNull()) {
 		return;
 	}
@@ -187,13 +285,46 @@ void LocalFileSource::loadEvenCancelled(
 }
 
 QImage LocalFileSource::takeLoaded() {
+	if (_decode.finished()) {
+		auto decoded = _decode.take();
+		applyDecoded(decoded);
+	} else if (_decode.running()) {
+		loadNow();
+	}
 	return std::move(_data);
 }
 
 void LocalFileSource::unload() {
+	_decode.cancel();
 	_data = QImage();
 }
 
+Decoded LocalFileSource::takeDecoded(QSize prepare) {
+	auto result = Decoded();
+	if (_decode.finished()) {
+		result = _decode.take();
+		applyDecoded(result);
+	}
+	if (!_data.isNull()) {
+		result.original = std::move(_data);
+	} else if (_bytes != "(bad)") {
+		_decode.start({ _bytes, _path, QSize(), prepare }, false, true);
+	}
+	return result;
+}
+
+void LocalFileSource::applyDecoded(Decoded &result) {
+	if (_bytes.isEmpty()) {
+		_bytes = result.bytes.isEmpty() ? QByteArray("(bad)") : result.bytes;
+	}
+	if (_data.isNull() && !result.original.isNull()) {
+		_data = std::move(result.original);
+		_format = result.format;
+		_width = std::max(_data.width(), 1);
+		_height = std::max(_data.height(), 1);
+	}
+}
+
 void LocalFileSource::automaticLoad(
 	Data::FileOrigin origin,
 	const HistoryItem *item) {
@@ -211,6 +342,7 @@ bool LocalFileSource::displayLoading() {
 }
 
 void LocalFileSource::cancel() {
+	_decode.cancel();
 }
 
 float64 LocalFileSource::progress() {
@@ -244,8 +376,9 @@ bool LocalFileSource::isDelayedStorageImage() const {
 }
 
 void LocalFileSource::setImageBytes(const QByteArray &bytes) {
+	_decode.cancel();
 	_bytes = bytes;
-	load({}, false, true);
+	loadNow();
 }
 
 int LocalFileSource::width() {
@@ -273,7 +406,7 @@ void LocalFileSource::setInformation(int size, int width, int height) {
 
 void LocalFileSource::ensureDimensionsKnown() {
 	if (!_width || !_height) {
-		load({}, false, false);
+		loadNow();
 	}
 }
 
@@ -283,6 +416,10 @@ QByteArray LocalFileSource::bytesForCache() {
 }
 
 QImage RemoteSource::takeLoaded() {
+	if (_decode.finished()) {
+		return takeDecoded(QSize()).original;
+	}
+	_decode.cancel();
 	if (!loaderValid() || !_loader->finished()) {
 		return QImage();
 	}
@@ -300,6 +437,31 @@ QImage RemoteSource::takeLoaded() {
 	return data;
 }
 
+Decoded RemoteSource::takeDecoded(QSize prepare) {
+	if (_decode.finished()) {
+		auto result = _decode.take();
+		if (result.original.isNull()) {
+			destroyLoader(CancelledFileLoader);
+			return Decoded();
+		}
+		setInformation(
+			_loader->bytes().size(),
+			result.original.width(),
+			result.original.height());
+		destroyLoader();
+		return result;
+	} else if (!loaderValid() || !_loader->finished()) {
+		return Decoded();
+	} else if (!_loader->imageDataNeedsDecoding()) {
+		return Source::takeDecoded(prepare);
+	}
+	_decode.start(
+		{ _loader->bytes(), QString(), shrinkBox(), prepare },
+		false,
+		true);
+	return Decoded();
+}
+
 bool RemoteSource::loaderValid() const {
 	return _loader && !cancelled();
 }
@@ -391,6 +553,7 @@ void RemoteSource::load(
 	if (loaderValid()) {
 		_loader->start(loadFirst, prior);
 	}
+	_decode.prioritize(loadFirst, prior);
 }
 
 bool RemoteSource::cancelled() const {
@@ -413,12 +576,14 @@ bool RemoteSource::displayLoading() {
 }
 
 void RemoteSource::cancel() {
+	_decode.cancel();
 	if (!loaderValid()) return;
 
 	destroyLoader(CancelledFileLoader);
 }
 
 void RemoteSource::unload() {
+	_decode.cancel();
 	if (loaderValid()) {
 		delete base::take(_loader);
 	}
@@ -8,9 +8,18 @@ https://github.com/telegramdesktop/tdesktop/blob/master/LEGAL
 #pragma once
 
 #include "ui/image/image.h"
+#include "ui/image/image_decoder.h"
+#include "base/binary_guard.h"
 
 namespace Images {
 
+struct EncodingStats {
+	int64 count = 0; // Unloaded images that had no compressed bytes.
+	int64 size = 0; // Bytes that encoding them produced.
+	crl::time duration = 0; // Background time spent encoding them.
+};
+[[nodiscard]] EncodingStats GetEncodingStats();
+
 class ImageSource : public Source {
 public:
 	ImageSource(QImage &&data, const QByteArray &format);
@@ -25,6 +34,7 @@ public:
 		bool prior) override;
 	QImage takeLoaded() override;
 	void unload() override;
+	Decoded takeDecoded(QSize prepare) override;
 
 	void automaticLoad(
 		Data::FileOrigin origin,
@@ -54,11 +64,22 @@ public:
 	QByteArray bytesForCache() override;
 
 private:
+	void applyDecoded(Decoded &result);
+	void startEncoding();
+	void finishEncoding(QByteArray &&bytes, crl::time duration);
+	void restoreEncoding();
+
 	QImage _data;
 	QByteArray _format;
 	QByteArray _bytes;
 	int _width = 0;
 	int _height = 0;
+	DecodeTask _decode;
+
+	// While the unloaded image is encoded in the background it is kept
+	// here, so that it can be shown again without decoding the result.
+	QImage _encoding;
+	base::binary_guard _encodingGuard;
 
 };
 
@@ -80,6 +101,7 @@ public:
 		bool prior) override;
 	QImage takeLoaded() override;
 	void unload() override;
+	Decoded takeDecoded(QSize prepare) override;
 
 	void automaticLoad(
 		Data::FileOrigin origin,
@@ -110,6 +132,8 @@ public:
 
 private:
 	void ensureDimensionsKnown();
+	void loadNow();
+	void applyDecoded(Decoded &result);
 
 	QString _path;
 	QByteArray _bytes;
@@ -117,6 +141,7 @@ private:
 	QImage _data;
 	int _width = 0;
 	int _height = 0;
+	DecodeTask _decode;
 
 };
 
@@ -132,6 +157,7 @@ public:
 		bool prior) override;
 	QImage takeLoaded() override;
 	void unload() override;
+	Decoded takeDecoded(QSize prepare) override;
 
 	void automaticLoad(
 		Data::FileOrigin origin,
@@ -173,6 +199,7 @@ private:
 	void destroyLoader(FileLoader *newValue = nullptr);
 
 	FileLoader *_loader = nullptr;
+	DecodeTask _decode;
 
 };
 
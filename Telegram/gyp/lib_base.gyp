@@ -59,6 +59,7 @@
       '<(src_loc)/base/index_based_iterator.h',
 	  '<(src_loc)/base/last_used_cache.h',
       '<(src_loc)/base/match_method.h',
+      '<(src_loc)/base/mpsc_queue.h',
       '<(src_loc)/base/observer.cpp',
       '<(src_loc)/base/observer.h',
       '<(src_loc)/base/ordered_set.h',
@@ -24,6 +24,7 @@
     'dependencies': [
       '<!@(<(list_tests_command))',
       'tests_storage',
+      'tests_mtproto',
     ],
     'sources': [
       '<!@(<(list_tests_command) --sources)',
@@ -52,6 +53,25 @@
       '<(src_loc)/base/algorithm.h',
       '<(src_loc)/base/algorithm_tests.cpp',
     ],
+  }, {
+    'target_name': 'tests_dialogs_list_tree',
+    'includes': [
+      'common_test.gypi',
+    ],
+    'sources': [
+      '<(src_loc)/dialogs/dialogs_list_tree.h',
+      '<(src_loc)/dialogs/dialogs_list_tree_tests.cpp',
+    ],
+  }, {
+    'target_name': 'tests_download_controller',
+    'includes': [
+      'common_test.gypi',
+    ],
+    'sources': [
+      '<(src_loc)/storage/file_download_controller.cpp',
+      '<(src_loc)/storage/file_download_controller.h',
+      '<(src_loc)/storage/file_download_controller_tests.cpp',
+    ],
   }, {
     'target_name': 'tests_flags',
     'includes': [
@@ -79,6 +99,35 @@
       '<(src_loc)/base/flat_set.h',
       '<(src_loc)/base/flat_set_tests.cpp',
     ],
+  }, {
+    'target_name': 'tests_image_prepare_kernels',
+    'includes': [
+      'common_test.gypi',
+    ],
+    'sources': [
+      '<(src_loc)/ui/image/image_prepare_kernels.cpp',
+      '<(src_loc)/ui/image/image_prepare_kernels.h',
+      '<(src_loc)/ui/image/image_prepare_kernels_tests.cpp',
+    ],
+  }, {
+    'target_name': 'tests_mpsc_queue',
+    'includes': [
+      'common_test.gypi',
+    ],
+    'sources': [
+      '<(src_loc)/base/mpsc_queue.h',
+      '<(src_loc)/base/mpsc_queue_tests.cpp',
+    ],
+  }, {
+    'target_name': 'tests_openssl_help',
+    'includes': [
+      'common_test.gypi',
+      '../openssl.gypi',
+    ],
+    'sources': [
+      '<(src_loc)/base/openssl_help.h',
+      '<(src_loc)/base/openssl_help_tests.cpp',
+    ],
   }, {
     'target_name': 'tests_rpl',
     'includes': [
@@ -117,6 +166,16 @@
       '<(src_loc)/rpl/variable.h',
       '<(src_loc)/rpl/variable_tests.cpp',
     ],
+  }, {
+    'target_name': 'tests_timer_wheel',
+    'includes': [
+      'common_test.gypi',
+    ],
+    'sources': [
+      '<(src_loc)/mtproto/timer_wheel.cpp',
+      '<(src_loc)/mtproto/timer_wheel.h',
+      '<(src_loc)/mtproto/timer_wheel_tests.cpp',
+    ],
   }, {
     'target_name': 'tests_storage',
     'includes': [
@@ -138,5 +197,40 @@
         '<(src_loc)/platform/win/windows_dlls.h',
       ],
     }]],
+  }, {
+    'target_name': 'tests_mtproto',
+    'includes': [
+      'common_test.gypi',
+      '../openssl.gypi',
+    ],
+    'dependencies': [
+      '../lib_scheme.gyp:lib_scheme',
+    ],
+    'include_dirs': [
+      '<(SHARED_INTERMEDIATE_DIR)',
+      '<(libs_loc)/zlib',
+    ],
+    'sources': [
+      '<(src_loc)/mtproto/core_types.cpp',
+      '<(src_loc)/mtproto/core_types.h',
+      '<(src_loc)/mtproto/mtproto_parse_tests.cpp',
+    ],
+    'conditions': [[ 'build_win', {
+      'libraries': [
+        'zlibstat',
+      ],
+      'configurations': {
+        'Debug': {
+          'library_dirs': [
+            '<(libs_loc)/zlib/contrib/vstudio/vc14/x86/ZlibStatDebug',
+          ],
+        },
+        'Release': {
+          'library_dirs': [
+            '<(libs_loc)/zlib/contrib/vstudio/vc14/x86/ZlibStatReleaseWithoutAsm',
+          ],
+        },
+      },
+    }]],
   }],
 }